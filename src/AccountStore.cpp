@@ -0,0 +1,432 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <algorithm>
+
+#include "AccountStore.h"
+
+namespace chat {
+
+static const char snapshotMagic[8] = {'C', 'H', 'A', 'T', 'A', 'C', 'C', '1'};
+static const size_t snapshotHeader = 32;
+
+// 顺序读取快照或日志记录，越界时valid()为false
+class RecordReader {
+public:
+    RecordReader(const char* data, size_t len) : p_(data), end_(data + len), valid_(true) {}
+
+    uint32_t u32() {
+        uint32_t value = 0;
+        if (check(4)) {
+            memcpy(&value, p_, 4);
+            p_ += 4;
+        }
+        return value;
+    }
+
+    bool string(std::string& out) {
+        uint16_t len = 0;
+        if (!check(2))
+            return false;
+        memcpy(&len, p_, 2);
+        p_ += 2;
+        if (!check(len))
+            return false;
+        out.assign(p_, len);
+        p_ += len;
+        return true;
+    }
+
+    bool valid() const { return valid_; }
+
+private:
+    bool check(size_t n) {
+        if ((size_t)(end_ - p_) < n)
+            valid_ = false;
+        return valid_;
+    }
+
+    const char* p_;
+    const char* end_;
+    bool valid_;
+};
+
+static inline void putU16(std::vector<char>& out, uint16_t value) {
+    out.insert(out.end(), (const char*)&value, (const char*)&value + 2);
+}
+
+static inline void putU32(std::vector<char>& out, uint32_t value) {
+    out.insert(out.end(), (const char*)&value, (const char*)&value + 4);
+}
+
+static inline void putString(std::vector<char>& out, const std::string& s) {
+    putU16(out, (uint16_t)s.size());
+    out.insert(out.end(), s.begin(), s.end());
+}
+
+/* 把一条日志记录应用到state上，下标不合法的记录忽略
+ */
+static void applyRecord(AccountState& state, const char* data, size_t len) {
+    RecordReader reader(data + 1, len - 1);
+
+    switch (data[0]) {
+    case ACCOUNT_SIGN_UP: {
+        StoredUser usr;
+        if (reader.string(usr.name) && reader.string(usr.password))
+            state.users.push_back(usr);
+        break;
+    }
+    case ACCOUNT_MAKE_ROOM: {
+        std::string name;
+        if (reader.string(name))
+            state.rooms.push_back(name);
+        break;
+    }
+    case ACCOUNT_JOIN:
+    case ACCOUNT_LEAVE: {
+        uint32_t user = reader.u32(), room = reader.u32();
+        if (!reader.valid() || user >= state.users.size() || room >= state.rooms.size())
+            break;
+
+        std::vector<int>& rooms = state.users[user].rooms;
+        std::vector<int>::iterator iter = std::find(rooms.begin(), rooms.end(), (int)room);
+        if (data[0] == ACCOUNT_JOIN && iter == rooms.end()) {
+            rooms.push_back(room);
+        } else if (data[0] == ACCOUNT_LEAVE && iter != rooms.end()) {
+            *iter = rooms.back();
+            rooms.pop_back();
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/* @param dir 存放快照和预写日志的目录，不存在时创建
+ * @param syncIntervalMs 预写日志组提交的间隔
+ * @param snapshotRecords 日志新增这么多条记录后由后台线程生成快照
+ */
+AccountStore::AccountStore(const std::string& dir, int syncIntervalMs, uint64_t snapshotRecords)
+    : dir_(dir),
+      wal_(dir + "/wal", ACCOUNT_WAL_SEGMENT_SIZE, syncIntervalMs),
+      snapshotRecords_(snapshotRecords),
+      snapshotSeq_(0),
+      stopping_(false),
+      running_(false)
+{
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&stopCond_, NULL);
+}
+
+AccountStore::~AccountStore()
+{
+    if (running_) {
+        pthread_mutex_lock(&mutex_);
+        stopping_ = true;
+        pthread_cond_signal(&stopCond_);
+        pthread_mutex_unlock(&mutex_);
+        pthread_join(snapshotTid_, NULL);
+    }
+
+    pthread_mutex_destroy(&mutex_);
+    pthread_cond_destroy(&stopCond_);
+}
+
+/* 读取最新的快照并重放其后的日志，启动生成快照的后台线程
+ *
+ * @param state 读取到的账号和房间
+ * @return true : 成功; false : 目录无法访问或快照损坏
+ */
+bool AccountStore::open(AccountState& state) {
+    uint64_t seq;
+
+    mkdir(dir_.c_str(), 0755);
+    if (!wal_.open())
+        return false;
+
+    if (!load(state, wal_.nextSeq(), seq))
+        return false;
+
+    // 快照之前的日志已经同步过，日志不应该比快照短
+    if (seq > wal_.nextSeq()) {
+        errno = EINVAL;
+        return false;
+    }
+    snapshotSeq_ = seq;
+
+    running_ = true;
+    pthread_create(&snapshotTid_, NULL, snapshotThreadFunc, (void*)this);
+    return true;
+}
+
+/* 读取快照，再重放快照之后、endSeq之前的日志
+ *
+ * @param state 结果
+ * @param endSeq 重放到的日志序号（不包含）
+ * @param seq 快照覆盖的日志序号
+ */
+bool AccountStore::load(AccountState& state, uint64_t endSeq, uint64_t& seq) {
+    state.users.clear();
+    state.rooms.clear();
+    if (!loadSnapshot(state, seq))
+        return false;
+
+    wal_.scan(seq, [&] (uint64_t s, const char* data, size_t len) {
+        if (s >= endSeq)
+            return false;
+        applyRecord(state, data, len);
+        return true;
+    });
+    return true;
+}
+
+/* 用mmap读取快照文件，文件不存在时得到空的状态
+ *
+ * @param state 结果
+ * @param seq 快照覆盖的日志序号
+ * @return true : 成功; false : 快照无法读取或已损坏
+ */
+bool AccountStore::loadSnapshot(AccountState& state, uint64_t& seq) {
+    struct stat st;
+    int fd;
+
+    seq = 0;
+    fd = ::open((dir_ + "/snapshot").c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return errno == ENOENT;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < snapshotHeader) {
+        close(fd);
+        errno = EINVAL;
+        return false;
+    }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    const char* data = (const char*)map;
+    uint32_t numUsers, numRooms, crc;
+    memcpy(&seq, data + 8, 8);
+    memcpy(&numUsers, data + 16, 4);
+    memcpy(&numRooms, data + 20, 4);
+    memcpy(&crc, data + 24, 4);
+
+    bool ok = memcmp(data, snapshotMagic, sizeof(snapshotMagic)) == 0
+              && crc32c(data + snapshotHeader, st.st_size - snapshotHeader) == crc;
+    RecordReader reader(data + snapshotHeader, st.st_size - snapshotHeader);
+
+    if (ok) {
+        state.rooms.resize(numRooms);
+        for (uint32_t i = 0; i < numRooms && reader.valid(); i++)
+            reader.string(state.rooms[i]);
+
+        state.users.resize(numUsers);
+        for (uint32_t i = 0; i < numUsers && reader.valid(); i++) {
+            StoredUser& usr = state.users[i];
+
+            reader.string(usr.name);
+            reader.string(usr.password);
+            usr.rooms.resize(reader.u32());
+            for (size_t j = 0; j < usr.rooms.size() && reader.valid(); j++)
+                usr.rooms[j] = reader.u32();
+        }
+        ok = reader.valid();
+    }
+
+    munmap(map, st.st_size);
+    if (!ok) {
+        state.users.clear();
+        state.rooms.clear();
+        errno = EINVAL;
+    }
+    return ok;
+}
+
+/* 写出快照 : 先写临时文件并同步，再改名覆盖旧的快照
+ *
+ * @param state 快照的内容
+ * @param seq 快照覆盖的日志序号
+ */
+bool AccountStore::writeSnapshot(const AccountState& state, uint64_t seq) {
+    std::vector<char> buf(snapshotHeader, 0);
+    uint32_t numUsers = state.users.size(), numRooms = state.rooms.size(), crc;
+
+    for (size_t i = 0; i < state.rooms.size(); i++)
+        putString(buf, state.rooms[i]);
+    for (size_t i = 0; i < state.users.size(); i++) {
+        const StoredUser& usr = state.users[i];
+
+        putString(buf, usr.name);
+        putString(buf, usr.password);
+        putU32(buf, usr.rooms.size());
+        for (size_t j = 0; j < usr.rooms.size(); j++)
+            putU32(buf, usr.rooms[j]);
+    }
+
+    crc = crc32c(buf.data() + snapshotHeader, buf.size() - snapshotHeader);
+    memcpy(&buf[0], snapshotMagic, sizeof(snapshotMagic));
+    memcpy(&buf[8], &seq, 8);
+    memcpy(&buf[16], &numUsers, 4);
+    memcpy(&buf[20], &numRooms, 4);
+    memcpy(&buf[24], &crc, 4);
+
+    std::string tmp = dir_ + "/snapshot.tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return false;
+
+    size_t written = 0;
+    while (written < buf.size()) {
+        ssize_t n = write(fd, buf.data() + written, buf.size() - written);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            close(fd);
+            unlink(tmp.c_str());
+            return false;
+        }
+        written += n;
+    }
+
+    if (fsync(fd) == -1 || close(fd) == -1 || rename(tmp.c_str(), (dir_ + "/snapshot").c_str()) == -1) {
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    // 改名本身也需要持久化
+    int dirFd = ::open(dir_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd != -1) {
+        fsync(dirFd);
+        close(dirFd);
+    }
+    return true;
+}
+
+/* 生成快照 : 等待当前日志全部持久化，读取上一个快照并重放之后的日志，
+ * 写出新的快照，删除已被覆盖的日志段
+ * 只读取快照文件和日志，不访问服务器的数据结构
+ *
+ * @return true : 成功或没有新的记录; false : 写快照失败，下次再试
+ */
+bool AccountStore::snapshot() {
+    AccountState state;
+    uint64_t endSeq, seq;
+    bool ok = true;
+
+    pthread_mutex_lock(&mutex_);
+    endSeq = wal_.nextSeq();
+    if (endSeq > snapshotSeq_) {
+        // 快照之后的记录必须从日志的这个位置开始，之前的记录不能在崩溃后丢失
+        wal_.waitDurable(endSeq - 1);
+        ok = load(state, endSeq, seq) && writeSnapshot(state, endSeq);
+        if (ok) {
+            snapshotSeq_ = endSeq;
+            wal_.dropBefore(endSeq);
+        }
+    }
+    pthread_mutex_unlock(&mutex_);
+    return ok;
+}
+
+uint64_t AccountStore::snapshotSeq() {
+    uint64_t seq;
+
+    pthread_mutex_lock(&mutex_);
+    seq = snapshotSeq_;
+    pthread_mutex_unlock(&mutex_);
+    return seq;
+}
+
+/* 后台线程 : 每隔ACCOUNT_SNAPSHOT_CHECK_MS检查一次，日志新增的记录足够多时生成快照
+ */
+void* AccountStore::snapshotThreadFunc(void* arg) {
+    AccountStore* store = (AccountStore*)arg;
+
+    pthread_mutex_lock(&store->mutex_);
+    while (!store->stopping_) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += ACCOUNT_SNAPSHOT_CHECK_MS / 1000;
+        deadline.tv_nsec += (long)(ACCOUNT_SNAPSHOT_CHECK_MS % 1000) * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&store->stopCond_, &store->mutex_, &deadline);
+
+        if (!store->stopping_ && store->wal_.nextSeq() - store->snapshotSeq_ >= store->snapshotRecords_) {
+            pthread_mutex_unlock(&store->mutex_);
+            store->snapshot();
+            pthread_mutex_lock(&store->mutex_);
+        }
+    }
+    pthread_mutex_unlock(&store->mutex_);
+    return (void*)0;
+}
+
+/* 编码并追加一条日志记录，只有一次内存拷贝，不等待磁盘
+ *
+ * @param type ACCOUNT_*
+ * @param a 第一个字符串字段，没有时为NULL
+ * @param b 第二个字符串字段，没有时为NULL
+ * @param x 没有字符串字段时的第一个整数
+ * @param y 没有字符串字段时的第二个整数
+ */
+void AccountStore::appendRecord(int type, const std::string* a, const std::string* b, int x, int y) {
+    char stack[512];
+    std::vector<char> heap;
+    size_t len = 1;
+
+    if (a != NULL)
+        len += 2 + a->size() + (b != NULL ? 2 + b->size() : 0);
+    else
+        len += 8;
+
+    char* record = stack;
+    if (len > sizeof(stack)) {
+        heap.resize(len);
+        record = heap.data();
+    }
+
+    char* p = record;
+    *p++ = (char)type;
+    if (a != NULL) {
+        const std::string* fields[2] = {a, b};
+        for (int i = 0; i < 2 && fields[i] != NULL; i++) {
+            uint16_t n = fields[i]->size();
+            memcpy(p, &n, 2);
+            memcpy(p + 2, fields[i]->data(), n);
+            p += 2 + n;
+        }
+    } else {
+        uint32_t ux = x, uy = y;
+        memcpy(p, &ux, 4);
+        memcpy(p + 4, &uy, 4);
+    }
+
+    wal_.append(record, len);
+}
+
+void AccountStore::signUp(const std::string& name, const std::string& password) {
+    appendRecord(ACCOUNT_SIGN_UP, &name, &password, 0, 0);
+}
+
+void AccountStore::makeRoom(const std::string& name) {
+    appendRecord(ACCOUNT_MAKE_ROOM, &name, NULL, 0, 0);
+}
+
+void AccountStore::join(int user, int room) {
+    appendRecord(ACCOUNT_JOIN, NULL, NULL, user, room);
+}
+
+void AccountStore::leave(int user, int room) {
+    appendRecord(ACCOUNT_LEAVE, NULL, NULL, user, room);
+}
+
+} // namespace chat
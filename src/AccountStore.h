@@ -0,0 +1,96 @@
+/* 账号和房间的持久化
+ *
+ * 注册、建房、加入和退出房间先修改内存中的UserRegistry/RoomRegistry，
+ * 再在同一把锁内追加一条记录到预写日志（MessageLog），因此日志的顺序与内存中的修改顺序一致，
+ * 记录直接使用用户和房间的下标;追加只是一次内存拷贝，持久化由日志的组提交完成
+ *
+ * 后台线程在日志新增的记录足够多时生成快照 : 读取上一个快照，重放其后的日志，
+ * 写出新的快照后删除已被覆盖的日志段，整个过程不访问服务器的数据结构，也不加服务器的锁
+ *
+ * 启动时用mmap读取最新的快照，只重放快照之后的日志
+ *
+ * 目录结构 : dir/snapshot 最新的快照; dir/wal/ 预写日志的段文件
+ *
+ * 快照格式 : [magic 8字节][日志序号 u64][用户数 u32][房间数 u32][CRC32C u32][保留 u32]，之后是
+ *           房间 : [名字长度 u16][名字]...
+ *           用户 : [名字长度 u16][名字][密码长度 u16][密码][房间数 u32][房间下标 u32]...
+ * 日志序号是快照之后第一条需要重放的记录
+ */
+
+#ifndef _CHATROOM_SRC_ACCOUNTSTORE_H_
+#define _CHATROOM_SRC_ACCOUNTSTORE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "MessageLog.h"
+
+namespace chat {
+
+#define ACCOUNT_WAL_SEGMENT_SIZE    (16 << 20) // 预写日志每个段文件的大小
+#define ACCOUNT_SNAPSHOT_RECORDS    100000     // 日志新增这么多条记录后生成快照
+#define ACCOUNT_SNAPSHOT_CHECK_MS   1000       // 后台线程检查的间隔
+
+// 预写日志的记录类型，记录的第一个字节
+#define ACCOUNT_SIGN_UP     1 // [名字长度 u16][名字][密码长度 u16][密码]
+#define ACCOUNT_MAKE_ROOM   2 // [名字长度 u16][名字]
+#define ACCOUNT_JOIN        3 // [用户下标 u32][房间下标 u32]
+#define ACCOUNT_LEAVE       4 // [用户下标 u32][房间下标 u32]
+
+typedef struct {
+    std::string name;
+    std::string password;
+    std::vector<int> rooms; // 加入的房间的下标
+} StoredUser;
+
+// 持久化的全部状态，用户和房间按创建顺序存放，下标与UserRegistry/RoomRegistry一致
+typedef struct {
+    std::vector<StoredUser> users;
+    std::vector<std::string> rooms;
+} AccountState;
+
+class AccountStore {
+public:
+    AccountStore(const std::string& dir, int syncIntervalMs = LOG_SYNC_INTERVAL_MS,
+                 uint64_t snapshotRecords = ACCOUNT_SNAPSHOT_RECORDS);
+    ~AccountStore();
+
+    bool open(AccountState& state);
+
+    // 以下在修改内存中的数据的同一把锁内调用
+    void signUp(const std::string& name, const std::string& password);
+    void makeRoom(const std::string& name);
+    void join(int user, int room);
+    void leave(int user, int room);
+
+    bool snapshot();
+
+    uint64_t snapshotSeq();
+    uint64_t walSeq() { return wal_.nextSeq(); }
+
+private:
+    bool load(AccountState& state, uint64_t endSeq, uint64_t& seq);
+    bool loadSnapshot(AccountState& state, uint64_t& seq);
+    bool writeSnapshot(const AccountState& state, uint64_t seq);
+    void appendRecord(int type, const std::string* a, const std::string* b, int x, int y);
+    static void* snapshotThreadFunc(void* arg);
+
+private:
+    std::string dir_;
+    MessageLog wal_;
+    uint64_t snapshotRecords_;
+
+    pthread_mutex_t mutex_;    // 保护以下成员，同时保证同一时刻只生成一个快照
+    uint64_t snapshotSeq_;     // 当前快照覆盖的日志序号
+    bool stopping_;
+    pthread_cond_t stopCond_;
+
+    pthread_t snapshotTid_;
+    bool running_;
+};
+
+} // namespace chat
+
+#endif // _CHATROOM_SRC_ACCOUNTSTORE_H_
@@ -0,0 +1,580 @@
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "AsyncClient.h"
+#include "Common.h"
+
+namespace chat {
+
+#define ASYNC_READ_SIZE 65536 // 每次recv读取的最大字节数
+
+AsyncClient::AsyncClient()
+    : socketFd_(-1), connecting_(false), negotiated_(false), sent_(0), consumed_(0),
+      gateway_(NULL), sid_(0)
+{
+}
+
+AsyncClient::AsyncClient(AsyncClient* gateway, uint32_t sid)
+    : socketFd_(-1), connecting_(false), negotiated_(false), sent_(0), consumed_(0),
+      gateway_(gateway), sid_(sid)
+{
+    gateway_->sessions_[sid_] = this;
+}
+
+AsyncClient::~AsyncClient() {
+    close();
+
+    if (gateway_ != NULL) {
+        gateway_->sessions_.erase(sid_);
+    } else {
+        for (std::unordered_map<uint32_t, AsyncClient*>::iterator it = sessions_.begin();
+             it != sessions_.end(); ++it)
+            it->second->gateway_ = NULL;
+    }
+}
+
+/* 发起非阻塞的连接，立即返回
+ * 协商请求放在发送缓冲区的最前面，之后的请求不必等待连接完成或协商的回复
+ *
+ * @param serverIp 服务器IP
+ * @param serverPort 服务器端口
+ * @return true : 已开始连接; false : 失败
+ */
+bool AsyncClient::connectServer(std::string serverIp, int serverPort) {
+    struct sockaddr_in serverAddr;
+    unsigned char hello[2] = {PROTO_MAGIC, PROTO_VERSION};
+
+    if (gateway_ != NULL)
+        return false;
+    close();
+
+    socketFd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (socketFd_ == -1)
+        return false;
+
+    memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(serverPort);
+    inet_pton(AF_INET, serverIp.c_str(), &serverAddr.sin_addr);
+
+    if (connect(socketFd_, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1) {
+        if (errno != EINPROGRESS) {
+            close();
+            return false;
+        }
+        connecting_ = true;
+    }
+
+    output_.insert(output_.end(), hello, hello + sizeof(hello));
+    return true;
+}
+
+/* 关闭连接，等待中的请求以失败结束
+ * 网关 : 其上所有会话的等待中的请求也以失败结束
+ * 会话 : 通知服务器结束该会话，会话上登录的用户下线;之后再发起请求时建立新的会话
+ */
+void AsyncClient::close() {
+    if (gateway_ != NULL) {
+        if (gateway_->connected()) {
+            std::vector<char>& out = gateway_->output_;
+            FrameWriter writer(out, OP_SESSION_CLOSE);
+            writer.putU32(sid_);
+            writer.finish();
+        }
+        fail();
+        return ;
+    }
+
+    if (socketFd_ != -1) {
+        ::close(socketFd_);
+        socketFd_ = -1;
+    }
+    connecting_ = false;
+    negotiated_ = false;
+    output_.clear();
+    sent_ = 0;
+    input_.clear();
+    consumed_ = 0;
+    fail();
+
+    for (std::unordered_map<uint32_t, AsyncClient*>::iterator it = sessions_.begin();
+         it != sessions_.end(); ++it)
+        it->second->fail();
+}
+
+/* 处理套接字上的事件
+ *
+ * @param events epoll的事件，EPOLLIN/EPOLLOUT/EPOLLERR/EPOLLHUP
+ * @return true : 连接正常; false : 连接已断开
+ */
+bool AsyncClient::handleEvent(uint32_t events) {
+    if (gateway_ != NULL)
+        return gateway_->handleEvent(events);
+    if (socketFd_ == -1)
+        return false;
+
+    if (connecting_ && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        getsockopt(socketFd_, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            close();
+            return false;
+        }
+        connecting_ = false;
+    }
+
+    if (!connecting_ && !flush()) {
+        close();
+        return false;
+    }
+
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        // 连接关闭之前收到的回复仍然交给回调函数
+        bool open = readInput();
+        if (!processInput() || !open || socketFd_ == -1) {
+            close();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* 内置的事件循环 : 先发送缓冲区中的请求，再等待一次事件并处理
+ *
+ * @param timeoutMs 最长等待时间，-1表示一直等待
+ * @return true : 连接正常; false : 连接已断开
+ */
+bool AsyncClient::poll(int timeoutMs) {
+    struct pollfd pfd;
+    uint32_t events = 0;
+
+    if (gateway_ != NULL)
+        return gateway_->poll(timeoutMs);
+    if (socketFd_ == -1)
+        return false;
+    if (!connecting_ && !flush()) {
+        close();
+        return false;
+    }
+
+    pfd.fd = socketFd_;
+    pfd.events = POLLIN | (wantWrite() ? POLLOUT : 0);
+    pfd.revents = 0;
+    if (::poll(&pfd, 1, timeoutMs) <= 0)
+        return true;
+
+    if (pfd.revents & POLLIN)
+        events |= EPOLLIN;
+    if (pfd.revents & POLLOUT)
+        events |= EPOLLOUT;
+    if (pfd.revents & POLLERR)
+        events |= EPOLLERR;
+    if (pfd.revents & POLLHUP)
+        events |= EPOLLHUP;
+    return handleEvent(events);
+}
+
+/* 把发送缓冲区中的数据尽量发送出去
+ *
+ * @return true : 成功或EAGAIN; false : 连接出错
+ */
+bool AsyncClient::flush() {
+    while (sent_ < output_.size()) {
+        ssize_t n = send(socketFd_, &output_[sent_], output_.size() - sent_, MSG_NOSIGNAL);
+
+        if (n > 0)
+            sent_ += n;
+        else if (n == -1 && errno == EINTR)
+            continue;
+        else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        else
+            return false;
+    }
+
+    output_.clear();
+    sent_ = 0;
+    return true;
+}
+
+/* 读取套接字上的所有数据，直到EAGAIN
+ *
+ * @return true : 成功; false : 连接已关闭或出错
+ */
+bool AsyncClient::readInput() {
+    while (true) {
+        size_t size = input_.size();
+
+        input_.resize(size + ASYNC_READ_SIZE);
+        ssize_t n = recv(socketFd_, &input_[size], ASYNC_READ_SIZE, 0);
+        input_.resize(size + (n > 0 ? n : 0));
+
+        if (n > 0)
+            continue;
+        if (n == -1 && errno == EINTR)
+            continue;
+        return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+}
+
+/* 处理接收缓冲区中所有完整的帧
+ * 推送的消息交给消息回调函数，其余的帧是最早的等待中的请求的回复
+ *
+ * @return true : 成功; false : 协议错误
+ */
+bool AsyncClient::processInput() {
+    while (true) {
+        const char* data = input_.data() + consumed_;
+        size_t len = input_.size() - consumed_;
+
+        if (!negotiated_) {
+            if (len < 2)
+                break;
+            if ((unsigned char)data[0] != PROTO_MAGIC || data[1] == 0)
+                return false;
+            consumed_ += 2;
+            negotiated_ = true;
+            continue;
+        }
+
+        ssize_t frameLen = frameLength(data, len);
+        if (frameLen == 0)
+            break;
+        if (frameLen < 0)
+            return false;
+
+        FrameReader reader(data, frameLen);
+        consumed_ += frameLen;
+
+        if (reader.opcode() == OP_SESSION || reader.opcode() == OP_SESSION_CLOSE)
+            processSession(reader);
+        else if (!processFrame(reader))
+            return false;
+
+        if (socketFd_ == -1) // 回调函数中关闭了连接
+            return true;
+    }
+
+    if (consumed_ == input_.size()) {
+        input_.clear();
+        consumed_ = 0;
+    } else if (consumed_ > ASYNC_READ_SIZE) {
+        input_.erase(input_.begin(), input_.begin() + consumed_);
+        consumed_ = 0;
+    }
+    return true;
+}
+
+/* 处理一个发给本客户端（或本会话）的帧
+ * 推送的消息交给消息回调函数，心跳放入发送缓冲区等待回复，其余的帧是最早的等待中的请求的回复
+ *
+ * @return true : 成功; false : 回复与等待中的请求不符
+ */
+bool AsyncClient::processFrame(FrameReader& reader) {
+    if (reader.opcode() == OP_DELIVER) {
+        std::string command, dst, content;
+        if (callback_ && reader.getField(command, MAX_FRAME_SIZE)
+            && reader.getField(dst, MAX_NAME_LEN) && reader.getField(content, MAX_CONTENT_LEN))
+            callback_(Client::formatMessage(command, dst, content));
+        return true;
+    }
+    if (reader.opcode() == OP_PING) { // 回复在下一次poll或可写时发送
+        request(OP_PONG, "", "");
+        return true;
+    }
+
+    if (pending_.empty() || pending_.front().opcode != reader.opcode())
+        return false;
+
+    // 先出队再调用，回调函数中可以发起新的请求
+    Pending pending = pending_.front();
+    pending_.pop_front();
+    pending.handler(&reader);
+    return true;
+}
+
+/* 网关收到的会话帧 : 把内层的帧交给对应的会话;
+ * 服务器结束了会话（会话数已满）或回复不符时，该会话的等待中的请求以失败结束
+ *
+ * @param reader OP_SESSION或OP_SESSION_CLOSE帧
+ */
+void AsyncClient::processSession(FrameReader& reader) {
+    std::unordered_map<uint32_t, AsyncClient*>::iterator it;
+    const char* inner;
+    size_t innerLen;
+    uint32_t sid;
+
+    if (!reader.getU32(sid) || (it = sessions_.find(sid)) == sessions_.end())
+        return ;
+
+    AsyncClient* session = it->second;
+    if (reader.opcode() == OP_SESSION_CLOSE) {
+        session->fail();
+        return ;
+    }
+
+    reader.getRest(inner, innerLen);
+    if (innerLen <= FRAME_HEADER_SIZE || frameLength(inner, innerLen) != (ssize_t)innerLen) {
+        session->fail();
+        return ;
+    }
+
+    FrameReader request(inner, innerLen);
+    if (!session->processFrame(request))
+        session->fail();
+}
+
+// 所有等待中的请求以失败结束
+void AsyncClient::fail() {
+    std::deque<Pending> pending;
+
+    pending.swap(pending_);
+    for (size_t i = 0; i < pending.size(); i++)
+        pending[i].handler(NULL);
+}
+
+/* 把一个请求追加到发送缓冲区
+ *
+ * @param opcode 请求的opcode
+ * @param dst 请求的dst字段
+ * @param message 请求的message字段
+ */
+void AsyncClient::request(int opcode, const std::string& dst, const std::string& message) {
+    // 会话的请求在前面留出会话帧的头部，追加到网关的发送缓冲区
+    std::vector<char>& out = gateway_ != NULL ? gateway_->output_ : output_;
+    size_t start = out.size();
+
+    if (gateway_ != NULL)
+        out.resize(start + SESSION_HEADER_SIZE);
+
+    FrameWriter writer(out, opcode);
+    if (!dst.empty() || !message.empty())
+        writer.putField(dst.data(), std::min(dst.size(), (size_t)MAX_NAME_LEN));
+    if (!message.empty())
+        writer.putField(message.data(), std::min(message.size(), (size_t)MAX_CONTENT_LEN));
+    writer.finish();
+
+    if (gateway_ != NULL)
+        putSessionHeader(&out[start], sid_, out.size() - start - SESSION_HEADER_SIZE);
+}
+
+/* 登记一个等待回复的请求，未连接时立即以失败结束
+ *
+ * @param opcode 期望的回复opcode
+ * @param handler 回复到达或连接断开时调用
+ */
+void AsyncClient::expect(int opcode, const std::function<void(FrameReader* reader)>& handler) {
+    Pending pending = {opcode, handler};
+
+    if (!connected()) {
+        handler(NULL);
+        return ;
+    }
+    pending_.push_back(pending);
+}
+
+void AsyncClient::requestResult(int opcode, const std::string& dst, ResultCallback done) {
+    if (connected())
+        request(opcode, dst, "");
+    expect(OP_RESULT, [done] (FrameReader* reader) {
+        uint32_t value;
+        if (reader == NULL || !reader->getU32(value))
+            done(false, -1);
+        else
+            done(true, (int)value);
+    });
+}
+
+/* 逐页读取完整的用户或房间列表，与Client::ls的结果相同
+ * 每收到一页就从它的游标发出下一页请求，游标为空时以全部名字调用done;
+ * 之后发出的请求可能先于列表读完而完成
+ *
+ * @param opcode OP_LSUSER_PAGE或OP_LSROOM_PAGE
+ * @param cursor 下一页的游标，空串表示从头开始
+ * @param names 已经读到的名字
+ */
+void AsyncClient::requestAll(int opcode, const std::string& cursor,
+                             std::shared_ptr<std::vector<std::string>> names, NamesCallback done) {
+    requestPage(opcode, "", cursor, 0, [this, opcode, names, done] (bool ok, const NamePage& page) {
+        if (!ok) {
+            done(false, *names);
+            return ;
+        }
+        names->insert(names->end(), page.names.begin(), page.names.end());
+        if (page.cursor.empty())
+            done(true, *names);
+        else
+            requestAll(opcode, page.cursor, names, done);
+    });
+}
+
+void AsyncClient::requestPage(int opcode, const std::string& prefix, const std::string& cursor,
+                              int limit, PageCallback done) {
+    std::string args = std::to_string(limit);
+
+    if (!cursor.empty())
+        args += " " + cursor;
+    if (connected())
+        request(opcode, prefix, args);
+    expect(OP_NAMES_PAGE, [done] (FrameReader* reader) {
+        NamePage page;
+        std::string name;
+        uint32_t count;
+
+        page.version = 0;
+        if (reader == NULL || !reader->getU32(page.version)
+            || !reader->getField(page.cursor, MAX_NAME_LEN) || !reader->getU32(count)) {
+            done(false, page);
+            return ;
+        }
+        for (uint32_t i = 0; i < count && reader->getField(name, MAX_NAME_LEN); i++)
+            page.names.push_back(name);
+        done(true, page);
+    });
+}
+
+void AsyncClient::requestDelta(int opcode, uint32_t version, DeltaCallback done) {
+    if (connected())
+        request(opcode, std::to_string(version), "");
+    expect(OP_NAMES_DELTA, [done] (FrameReader* reader) {
+        NameDelta delta;
+        std::string name;
+        uint32_t reset, count;
+        bool ok = reader != NULL && reader->getU32(delta.version) && reader->getU32(reset);
+
+        delta.reset = ok && reset != 0;
+        std::vector<std::string>* lists[2] = {&delta.added, &delta.removed};
+        for (int k = 0; ok && k < 2; k++) {
+            ok = reader->getU32(count);
+            for (uint32_t i = 0; ok && i < count; i++) {
+                ok = reader->getField(name, MAX_NAME_LEN);
+                if (ok)
+                    lists[k]->push_back(name);
+            }
+        }
+        done(ok, delta);
+    });
+}
+
+void AsyncClient::signUp(const std::string& name, const std::string& password, ResultCallback done) {
+    if (connected())
+        request(OP_SIGNUP, name, password);
+    expect(OP_RESULT, [done] (FrameReader* reader) {
+        uint32_t value;
+        if (reader == NULL || !reader->getU32(value))
+            done(false, SIGN_UP_FAIL);
+        else
+            done(true, (int)value);
+    });
+}
+
+void AsyncClient::signIn(const std::string& name, const std::string& password, ResultCallback done) {
+    if (connected())
+        request(OP_SIGNIN, name, password);
+    expect(OP_RESULT, [done] (FrameReader* reader) {
+        uint32_t value;
+        if (reader == NULL || !reader->getU32(value))
+            done(false, !SIGN_IN_SUCCESS);
+        else
+            done(true, (int)value);
+    });
+}
+
+void AsyncClient::lsUsers(NamesCallback done) {
+    requestAll(OP_LSUSER_PAGE, "", std::make_shared<std::vector<std::string>>(), done);
+}
+
+void AsyncClient::lsRooms(NamesCallback done) {
+    requestAll(OP_LSROOM_PAGE, "", std::make_shared<std::vector<std::string>>(), done);
+}
+
+void AsyncClient::lsUsersPage(const std::string& prefix, const std::string& cursor, int limit,
+                              PageCallback done) {
+    requestPage(OP_LSUSER_PAGE, prefix, cursor, limit, done);
+}
+
+void AsyncClient::lsRoomsPage(const std::string& prefix, const std::string& cursor, int limit,
+                              PageCallback done) {
+    requestPage(OP_LSROOM_PAGE, prefix, cursor, limit, done);
+}
+
+void AsyncClient::lsUsersSince(uint32_t version, DeltaCallback done) {
+    requestDelta(OP_LSUSER_DELTA, version, done);
+}
+
+void AsyncClient::lsRoomsSince(uint32_t version, DeltaCallback done) {
+    requestDelta(OP_LSROOM_DELTA, version, done);
+}
+
+void AsyncClient::singleChat(const std::string& dstName, const std::string& content) {
+    if (connected())
+        request(OP_SGCHAT, dstName, content);
+}
+
+void AsyncClient::groupChat(const std::string& dstGroupName, const std::string& content) {
+    if (connected())
+        request(OP_GPCHAT, dstGroupName, content);
+}
+
+void AsyncClient::mkRoom(const std::string& roomName, ResultCallback done) {
+    requestResult(OP_MKROOM, roomName, done);
+}
+
+void AsyncClient::cdRoom(const std::string& roomName, ResultCallback done) {
+    requestResult(OP_CDROOM, roomName, done);
+}
+
+void AsyncClient::qtRoom(const std::string& roomName, ResultCallback done) {
+    requestResult(OP_QTROOM, roomName, done);
+}
+
+/* 从服务器上的收件箱取走消息
+ *
+ * @param maxCount 最多取走的消息数，0表示由服务器决定
+ * @param done 回复到达时调用，消息已格式化
+ */
+void AsyncClient::getMessage(int maxCount, MessagesCallback done) {
+    if (connected())
+        request(OP_GETMSG, maxCount > 0 ? std::to_string(maxCount) : "", "");
+    expect(OP_MESSAGES, [done] (FrameReader* reader) {
+        std::vector<std::string> messages;
+        std::string command, dst, content;
+        uint32_t count;
+
+        if (reader == NULL || !reader->getU32(count)) {
+            done(false, messages);
+            return ;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            if (!reader->getField(command, MAX_FRAME_SIZE)
+                || !reader->getField(dst, MAX_NAME_LEN)
+                || !reader->getField(content, MAX_CONTENT_LEN))
+                break;
+            messages.push_back(Client::formatMessage(command, dst, content));
+        }
+        done(true, messages);
+    });
+}
+
+/* 认证为网关连接，成功时ret为GATEWAY_SUCCESS
+ */
+void AsyncClient::authenticate(const std::string& token, ResultCallback done) {
+    requestResult(OP_GATEWAY, token, done);
+}
+
+/* 开启服务器推送，推送的消息交给setMessageCallback设置的回调函数
+ */
+void AsyncClient::enablePush(ResultCallback done) {
+    requestResult(OP_PUSH, "on", done);
+}
+
+} // namespace chat
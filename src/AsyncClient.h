@@ -0,0 +1,136 @@
+/* 非阻塞的异步客户端，只使用紧凑协议
+ *
+ * 每个请求立即返回，回复到达时调用该请求的回调函数;
+ * 请求先追加到发送缓冲区，在下一次可写时一起发送，多个请求因此合并为一次write（流水线），
+ * 服务器按请求的顺序回复，回复按顺序与等待中的请求一一对应
+ *
+ * 套接字是非阻塞的，有两种驱动方式 :
+ * 1.调用poll，在内部等待一次事件并处理
+ * 2.把fd()加入调用者自己的epoll，关注EPOLLIN以及wantWrite()为true时的EPOLLOUT，
+ *   事件到达时调用handleEvent
+ *
+ * 网关 : 一个AsyncClient用authenticate认证为网关后，可以在它之上创建多个会话（同样是AsyncClient），
+ * 每个会话相当于一个独立的客户端（各自登录、各自的请求和推送），请求经网关的连接发送;
+ * 会话没有自己的套接字，由网关的poll/handleEvent驱动，会话应在网关之前销毁
+ *
+ * 不是线程安全的，所有调用（包括回调函数中发起的新请求）都应在同一个线程中
+ * 连接断开时，所有等待中的请求的回调函数以ok为false被调用
+ */
+
+#ifndef _CHATROOM_SRC_ASYNCCLIENT_H_
+#define _CHATROOM_SRC_ASYNCCLIENT_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <functional>
+#include <memory>
+
+#include "Client.h"
+#include "Protocol.h"
+
+namespace chat {
+
+// 各种请求的回调函数，ok为false表示连接已断开，其余参数无意义
+typedef std::function<void(bool ok, int ret)> ResultCallback;
+typedef std::function<void(bool ok, const std::vector<std::string>& names)> NamesCallback;
+typedef std::function<void(bool ok, const NamePage& page)> PageCallback;
+typedef std::function<void(bool ok, const NameDelta& delta)> DeltaCallback;
+typedef std::function<void(bool ok, const std::vector<std::string>& messages)> MessagesCallback;
+
+class AsyncClient {
+public:
+    AsyncClient();
+    AsyncClient(AsyncClient* gateway, uint32_t sid); // 在网关上创建会话号为sid的会话
+    ~AsyncClient();
+
+    bool connectServer(std::string serverIp = "127.0.0.1", int serverPort = 5000);
+    void close();
+
+    // 认证为网关连接，token为服务器配置的口令
+    void authenticate(const std::string& token, ResultCallback done);
+
+    int fd() const { return gateway_ != NULL ? gateway_->fd() : socketFd_; }
+    bool connected() const { return gateway_ != NULL ? gateway_->connected() : socketFd_ != -1; }
+    bool wantWrite() const {
+        return gateway_ != NULL ? gateway_->wantWrite() : connecting_ || sent_ < output_.size();
+    }
+    size_t pending() const { return pending_.size(); }
+
+    bool handleEvent(uint32_t events);
+    bool poll(int timeoutMs);
+
+    // 服务器推送的消息
+    void setMessageCallback(MessageCallback callback) { callback_ = callback; }
+
+public:
+    void signUp(const std::string& name, const std::string& password, ResultCallback done);
+    void signIn(const std::string& name, const std::string& password, ResultCallback done);
+
+    void lsUsers(NamesCallback done);
+    void lsRooms(NamesCallback done);
+    void lsUsersPage(const std::string& prefix, const std::string& cursor, int limit, PageCallback done);
+    void lsRoomsPage(const std::string& prefix, const std::string& cursor, int limit, PageCallback done);
+    void lsUsersSince(uint32_t version, DeltaCallback done);
+    void lsRoomsSince(uint32_t version, DeltaCallback done);
+
+    // 服务器不回复聊天请求
+    void singleChat(const std::string& dstName, const std::string& content);
+    void groupChat(const std::string& dstGroupName, const std::string& content);
+
+    void mkRoom(const std::string& roomName, ResultCallback done);
+    void cdRoom(const std::string& roomName, ResultCallback done);
+    void qtRoom(const std::string& roomName, ResultCallback done);
+
+    void getMessage(int maxCount, MessagesCallback done);
+    void enablePush(ResultCallback done);
+
+private:
+    // 等待回复的请求，reader为NULL表示连接已断开
+    typedef struct {
+        int opcode; // 期望的回复opcode
+        std::function<void(FrameReader* reader)> handler;
+    } Pending;
+
+    void request(int opcode, const std::string& dst, const std::string& message);
+    void expect(int opcode, const std::function<void(FrameReader* reader)>& handler);
+    void requestResult(int opcode, const std::string& dst, ResultCallback done);
+    void requestAll(int opcode, const std::string& cursor,
+                    std::shared_ptr<std::vector<std::string>> names, NamesCallback done);
+    void requestPage(int opcode, const std::string& prefix, const std::string& cursor, int limit,
+                     PageCallback done);
+    void requestDelta(int opcode, uint32_t version, DeltaCallback done);
+    bool flush();
+    bool readInput();
+    bool processInput();
+    bool processFrame(FrameReader& reader);
+    void processSession(FrameReader& reader);
+    void fail();
+
+private:
+    int socketFd_;
+    bool connecting_;        // 非阻塞connect还未完成
+    bool negotiated_;        // 已收到协商的回复
+
+    std::vector<char> output_;
+    size_t sent_;            // output_中已发送的字节数
+    std::vector<char> input_;
+    size_t consumed_;        // input_中已处理的字节数
+
+    std::deque<Pending> pending_;
+    MessageCallback callback_;
+
+    AsyncClient* gateway_;   // 会话所在的网关，NULL表示不是会话
+    uint32_t sid_;           // 会话号
+    std::unordered_map<uint32_t, AsyncClient*> sessions_; // 网关上的会话
+
+private:
+    AsyncClient(const AsyncClient&);
+    AsyncClient& operator=(const AsyncClient&);
+};
+
+} // namespace chat
+
+#endif // _CHATROOM_SRC_ASYNCCLIENT_H_
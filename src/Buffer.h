@@ -69,7 +69,6 @@ public:
 
     bool retrive(int fd, std::vector<char>& buf, size_t len) {
         bool ret; 
-        int i;
 
         pthread_mutex_lock(&mutex_);
         auto iter = buffer_.find(fd);
@@ -79,6 +78,7 @@ public:
             buf.insert(buf.end(), iter->second.begin(), iter->second.begin() + len);
             std::vector<char> tmp(iter->second.begin() + len, iter->second.end());
             std::swap(tmp, iter->second);
+            ret = true;
         }
         pthread_mutex_unlock(&mutex_);
         return ret;
@@ -8,21 +8,34 @@
 
 #include "Client.h"
 #include "Common.h"
+#include "Protocol.h"
 
 namespace chat {
 
+Client::Client()
+    : serverPort_(0), socketFd_(-1), protocol_(PROTOCOL_COMPACT), pushing_(false)
+{
+    pthread_mutex_init(&sendMutex_, NULL);
+}
+
+Client::~Client() {
+    pthread_mutex_destroy(&sendMutex_);
+}
+
 /* 客户端连接服务器
  *
  * @param serverIp 服务器IP
  * @param serverIp 服务器端口
+ * @param protocol 使用的协议，PROTOCOL_COMPACT或PROTOCOL_LEGACY
  * @return true : 连接成功; false : 连接失败
  */
-bool Client::connectServer(std::string serverIp, int serverPort) {
+bool Client::connectServer(std::string serverIp, int serverPort, int protocol) {
     struct sockaddr_in serverAddr;
     int ret;
 
     serverIp_ = serverIp;
     serverPort_ = serverPort;
+    protocol_ = protocol;
 
     socketFd_ = socket(AF_INET, SOCK_STREAM, 0);
 
@@ -35,86 +48,263 @@ bool Client::connectServer(std::string serverIp, int serverPort) {
     if (ret == -1)
         return false;
 
+    if (protocol_ == PROTOCOL_COMPACT) { // 协商紧凑协议的版本
+        unsigned char hello[2] = {PROTO_MAGIC, PROTO_VERSION};
+
+        if (Send(socketFd_, hello, sizeof(hello)) != sizeof(hello))
+            return false;
+        if (Recv(socketFd_, hello, sizeof(hello)) != sizeof(hello) 
+            || hello[0] != PROTO_MAGIC || hello[1] == 0)
+            return false;
+    }
+
     return true;
 }
 
-/* 客户端注册
+/* 按当前协议发送一个请求
  *
- * @param name 用户名
- * @param password 密码
+ * @param opcode 请求的opcode
+ * @param dst 请求的dst字段
+ * @param message 请求的message字段
+ * @return true : 发送成功; false : 发送失败
  */
-int Client::signUp(std::string name, std::string password) {
+bool Client::request(int opcode, const std::string& dst, const std::string& message) {
+    if (protocol_ == PROTOCOL_COMPACT) {
+        std::vector<char> out;
+
+        if (dst.size() > MAX_NAME_LEN || message.size() > MAX_CONTENT_LEN)
+            return false;
+
+        FrameWriter writer(out, opcode);
+        if (!dst.empty() || !message.empty())
+            writer.putField(dst);
+        if (!message.empty())
+            writer.putField(message);
+        writer.finish();
+
+        return Send(socketFd_, &out[0], out.size()) == (ssize_t)out.size();
+    }
+
     Message msg;
+    memset(&msg, 0, sizeof(msg));
+    strncpy(msg.command, opcodeToCommand(opcode), sizeof(msg.command) - 1);
+    strncpy(msg.dst, dst.c_str(), sizeof(msg.dst) - 1);
+    strncpy(msg.message, message.c_str(), sizeof(msg.message) - 1);
+
+    return Send(socketFd_, (void*)&msg, sizeof(msg)) == sizeof(msg);
+}
+
+/* 接收服务器返回的返回值
+ *
+ * @param failValue 接收失败时的返回值
+ * @return 服务器的返回值
+ */
+int Client::recvResult(int failValue) {
     int ret, bytes;
 
-    strcpy(msg.command, "signup");
-    strcpy(msg.dst, name.c_str());
-    strcpy(msg.message, password.c_str());
+    if (protocol_ == PROTOCOL_COMPACT) {
+        std::vector<char> frame;
+        uint32_t value;
 
+        if (!recvFrame(frame, OP_RESULT))
+            return failValue;
 
-    bytes = Send(socketFd_, &msg, sizeof(msg));
-    if (bytes != sizeof(msg))
-        return SIGN_UP_FAIL;
+        FrameReader reader(&frame[0], frame.size());
+        if (!reader.getU32(value))
+            return failValue;
+        return value;
+    }
 
     bytes = Recv(socketFd_, (void*)&ret, sizeof(ret));
     if (bytes != sizeof(ret))
-        return SIGN_UP_FAIL;
+        return failValue;
 
     return ret;
 }
 
+/* 接收一个期望的回复帧
+ * 非推送模式下，在回复之前到达的推送消息就地处理，心跳就地回复
+ *
+ * @param frame 存放完整的帧
+ * @param opcode 期望的opcode
+ * @return true : 成功; false : 连接出错或opcode不符
+ */
+bool Client::recvFrame(std::vector<char>& frame, int opcode) {
+    while (true) {
+        if (pushing_) {
+            replies_.get(frame);
+            if (frame.empty()) // 接收线程已退出
+                return false;
+        } else if (!readFrame(frame)) {
+            return false;
+        }
+
+        if ((unsigned char)frame[FRAME_HEADER_SIZE] == OP_DELIVER) {
+            handleDelivery(frame);
+            continue;
+        }
+        if ((unsigned char)frame[FRAME_HEADER_SIZE] == OP_PING) {
+            request(OP_PONG, "", "");
+            continue;
+        }
+
+        return (unsigned char)frame[FRAME_HEADER_SIZE] == opcode;
+    }
+}
+
+/* 从套接字读取一个完整的帧
+ *
+ * @param frame 存放完整的帧
+ * @return true : 成功; false : 连接出错或帧非法
+ */
+bool Client::readFrame(std::vector<char>& frame) {
+    uint32_t bodyLen;
+
+    frame.resize(FRAME_HEADER_SIZE);
+    if (Recv(socketFd_, &frame[0], FRAME_HEADER_SIZE) != FRAME_HEADER_SIZE)
+        return false;
+
+    memcpy(&bodyLen, &frame[0], sizeof(bodyLen));
+    bodyLen = ntohl(bodyLen);
+    if (bodyLen == 0 || bodyLen > MAX_FRAME_SIZE)
+        return false;
+
+    frame.resize(FRAME_HEADER_SIZE + bodyLen);
+    return Recv(socketFd_, &frame[FRAME_HEADER_SIZE], bodyLen) == (ssize_t)bodyLen;
+}
+
+/* 处理服务器推送的消息
+ * 设置了回调函数时交给回调函数，否则保存起来由getMessage返回
+ *
+ * @param frame OP_DELIVER帧
+ */
+void Client::handleDelivery(const std::vector<char>& frame) {
+    FrameReader reader(&frame[0], frame.size());
+    std::string command, dst, content;
+
+    if (!reader.getField(command, MAX_FRAME_SIZE) 
+        || !reader.getField(dst, MAX_NAME_LEN)
+        || !reader.getField(content, MAX_CONTENT_LEN))
+        return ;
+
+    if (callback_)
+        callback_(formatMessage(command, dst, content));
+    else
+        message_.push_back(formatMessage(command, dst, content));
+}
+
+/* 开启服务器推送
+ * 开启后由后台接收线程读取连接上的所有帧，
+ * 推送的消息在接收线程中交给callback，其他请求的用法不变；
+ * getmsg仍然可用，用于取走开启推送之前存放在服务器上的消息
+ *
+ * @pre 已使用紧凑协议登录
+ * @param callback 消息到达时的回调函数
+ * @return true : 开启成功; false : 开启失败
+ */
+bool Client::enablePush(MessageCallback callback) {
+    if (pushing_ || protocol_ != PROTOCOL_COMPACT)
+        return false;
+
+    if (!request(OP_PUSH, "on", "") || recvResult(PUSH_FAIL) != PUSH_SUCCESS)
+        return false;
+
+    callback_ = callback;
+    pushing_ = true;
+    pthread_create(&recvTid_, NULL, recvThreadFunc, (void*)this);
+    return true;
+}
+
+/* 推送模式下的接收线程
+ * 推送的消息交给回调函数，心跳直接回复，其余的帧作为回复放入replies_
+ *
+ * @param arg Client对象
+ */
+void* Client::recvThreadFunc(void* arg) {
+    Client* client = (Client*)arg;
+
+    while (true) {
+        std::vector<char> frame;
+
+        if (!client->readFrame(frame)) {
+            client->replies_.push(std::vector<char>());
+            break;
+        }
+
+        if ((unsigned char)frame[FRAME_HEADER_SIZE] == OP_DELIVER)
+            client->handleDelivery(frame);
+        else if ((unsigned char)frame[FRAME_HEADER_SIZE] == OP_PING)
+            client->request(OP_PONG, "", "");
+        else
+            client->replies_.push(frame);
+    }
+
+    return (void*)0;
+}
+
+/* 客户端注册
+ *
+ * @param name 用户名
+ * @param password 密码
+ */
+int Client::signUp(std::string name, std::string password) {
+    if (!request(OP_SIGNUP, name, password))
+        return SIGN_UP_FAIL;
+
+    return recvResult(SIGN_UP_FAIL);
+}
+
 /* 客户端登录
  *
  * @param name 用户名
  * @param password 密码
  */
 int Client::signIn(std::string name, std::string password) {
-    Message msg;
-    int ret, bytes;
-
     name_ = name;
     password_ = password;
 
-    strcpy(msg.command, "signin");
-    strcpy(msg.dst, name_.c_str());
-    strcpy(msg.message, password_.c_str());
-
-    bytes = Send(socketFd_, (void*)&msg, sizeof(msg));
-    if (bytes != sizeof(msg))
-        return !SIGN_IN_SUCCESS;
-
-    bytes = Recv(socketFd_, (void*)&ret, sizeof(ret));
-    if (bytes != sizeof(ret))
+    if (!request(OP_SIGNIN, name_, password_))
         return !SIGN_IN_SUCCESS;
 
-    return ret;
+    return recvResult(!SIGN_IN_SUCCESS);
 }
 
 /* 列出服务器上在线的用户或房间
+ * 紧凑协议逐页读取完整的列表，旧协议最多返回1000个
  *
  * @param command : "lsuser"或"lsroom"
  */
 std::vector<std::string> Client::ls(std::string command) {
-    Message msg;
     std::vector<std::string> ret;
     int bytes, num;
-    Name buf[1000];
 
-    strcpy(msg.command, command.c_str());
+    if (protocol_ == PROTOCOL_COMPACT) {
+        int opcode = command == "lsuser" ? OP_LSUSER_PAGE : OP_LSROOM_PAGE;
+        NamePage page;
+
+        do {
+            if (!lsPage(opcode, "", page.cursor, 0, page))
+                break;
+            ret.insert(ret.end(), page.names.begin(), page.names.end());
+        } while (!page.cursor.empty());
+
+        return ret;
+    }
 
-    bytes = Send(socketFd_, (void*)&msg, sizeof(msg));
-    if (bytes != sizeof(msg))
+    if (!request(commandToOpcode(command.c_str()), "", ""))
         return ret;
 
     bytes = Recv(socketFd_, (void*)&num, sizeof(num));
-    if (bytes != sizeof(num) || num == 0)
+    if (bytes != sizeof(num) || num <= 0 || num > 1000)
         return ret;
 
-    bytes = Recv(socketFd_, (void*)buf, num * sizeof(Name));
+    std::vector<Name> buf(num);
+    bytes = Recv(socketFd_, (void*)&buf[0], num * sizeof(Name));
     if (bytes > 0) {
         int numUsers = bytes / sizeof(Name);
 
         for (int i = 0; i < numUsers; i++) {
+            buf[i].name[sizeof(buf[i].name) - 1] = '\0';
             std::string name = buf[i].name; 
             ret.push_back(name); 
         }
@@ -123,6 +313,122 @@ std::vector<std::string> Client::ls(std::string command) {
     return ret;
 }
 
+/* 分页读取在线用户或房间
+ *
+ * @param opcode OP_LSUSER_PAGE或OP_LSROOM_PAGE
+ * @param prefix 只返回带有该前缀的名字，空串表示全部
+ * @param cursor 上一页回复中的游标，空串表示从头开始
+ * @param limit 这一页最多的名字数，0表示由服务器决定
+ * @param page 读取到的一页
+ * @return true : 成功; false : 失败
+ */
+bool Client::lsPage(int opcode, const std::string& prefix, const std::string& cursor, int limit,
+                    NamePage& page) {
+    std::vector<char> frame;
+    std::string args = std::to_string(limit);
+    std::string name;
+    uint32_t count;
+
+    if (protocol_ != PROTOCOL_COMPACT)
+        return false;
+
+    if (!cursor.empty())
+        args += " " + cursor;
+    if (!request(opcode, prefix, args) || !recvFrame(frame, OP_NAMES_PAGE))
+        return false;
+
+    FrameReader reader(&frame[0], frame.size());
+    page.names.clear();
+    if (!reader.getU32(page.version) || !reader.getField(page.cursor, MAX_NAME_LEN) 
+        || !reader.getU32(count))
+        return false;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!reader.getField(name, MAX_NAME_LEN))
+            return false;
+        page.names.push_back(name);
+    }
+
+    return true;
+}
+
+/* 读取某个版本之后在线用户或房间的变化
+ *
+ * @param opcode OP_LSUSER_DELTA或OP_LSROOM_DELTA
+ * @param version 已知的版本号，取自之前的分页或增量回复
+ * @param delta 读取到的变化
+ * @return true : 成功; false : 失败
+ */
+bool Client::lsSince(int opcode, uint32_t version, NameDelta& delta) {
+    std::vector<char> frame;
+    std::string name;
+    uint32_t reset, count;
+
+    if (protocol_ != PROTOCOL_COMPACT)
+        return false;
+
+    if (!request(opcode, std::to_string(version), "") || !recvFrame(frame, OP_NAMES_DELTA))
+        return false;
+
+    FrameReader reader(&frame[0], frame.size());
+    delta.added.clear();
+    delta.removed.clear();
+    if (!reader.getU32(delta.version) || !reader.getU32(reset))
+        return false;
+    delta.reset = reset != 0;
+
+    std::vector<std::string>* lists[2] = {&delta.added, &delta.removed};
+    for (int k = 0; k < 2; k++) {
+        if (!reader.getU32(count))
+            return false;
+        for (uint32_t i = 0; i < count; i++) {
+            if (!reader.getField(name, MAX_NAME_LEN))
+                return false;
+            lists[k]->push_back(name);
+        }
+    }
+
+    return true;
+}
+
+/* 读取一页历史消息
+ *
+ * @param opcode OP_SGHISTORY或OP_GPHISTORY
+ * @param name 对方的用户名或房间名
+ * @param cursor 上一页回复中的游标，空串表示从最近的消息开始，"0"表示从最早的消息开始
+ * @param limit 这一页最多的消息数，0表示由服务器决定
+ * @param page 读取到的一页，消息可能为空而游标不为空，此时应继续读取
+ * @return true : 成功; false : 失败
+ */
+bool Client::history(int opcode, const std::string& name, const std::string& cursor, int limit,
+                     MessagePage& page) {
+    std::vector<char> frame;
+    std::string args = std::to_string(limit);
+    std::string command, dst, content;
+    uint32_t count;
+
+    if (protocol_ != PROTOCOL_COMPACT)
+        return false;
+
+    if (!cursor.empty())
+        args += " " + cursor;
+    if (!request(opcode, name, args) || !recvFrame(frame, OP_HISTORY))
+        return false;
+
+    FrameReader reader(&frame[0], frame.size());
+    page.messages.clear();
+    if (!reader.getField(page.cursor, MAX_NAME_LEN) || !reader.getU32(count))
+        return false;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!reader.getField(command, MAX_NAME_LEN)
+            || !reader.getField(dst, MAX_NAME_LEN)
+            || !reader.getField(content, MAX_CONTENT_LEN))
+            return false;
+        page.messages.push_back(formatMessage(command, dst, content));
+    }
+
+    return true;
+}
+
 // 列出服务器上在线的用户或房间
 std::vector<std::string> Client::lsUsers() {
     return ls("lsuser");
@@ -135,12 +441,7 @@ std::vector<std::string> Client::lsUsers() {
  * @param content 聊天内容
  */
 void Client::chat(std::string chatType, std::string dstName, std::string content) {
-    Message msg;
-    strcpy(msg.command, chatType.c_str());
-    strcpy(msg.dst, dstName.c_str());
-    strcpy(msg.message, content.c_str());
-
-    Send(socketFd_, (void*)&msg, sizeof(msg));
+    request(commandToOpcode(chatType.c_str()), dstName, content);
 }
 
 /* 单聊
@@ -166,23 +467,46 @@ std::vector<std::string> Client::lsRooms() {
     return ls("lsroom");
 }
 
-// 群操作函数
-int Client::doRoom(std::string command, std::string roomName) {
-    Message msg;
-    int ret, bytes;
+// 分页读取在线用户
+bool Client::lsUsersPage(const std::string& prefix, const std::string& cursor, int limit,
+                         NamePage& page) {
+    return lsPage(OP_LSUSER_PAGE, prefix, cursor, limit, page);
+}
 
-    strcpy(msg.command, command.c_str());
-    strcpy(msg.dst, roomName.c_str());
+// 分页读取房间
+bool Client::lsRoomsPage(const std::string& prefix, const std::string& cursor, int limit,
+                         NamePage& page) {
+    return lsPage(OP_LSROOM_PAGE, prefix, cursor, limit, page);
+}
 
-    bytes = Send(socketFd_, (void*)&msg, sizeof(msg));
-    if (bytes != sizeof(msg))
-        return -1;
+// 读取某个版本之后上线和下线的用户
+bool Client::lsUsersSince(uint32_t version, NameDelta& delta) {
+    return lsSince(OP_LSUSER_DELTA, version, delta);
+}
 
-    bytes = Recv(socketFd_, (void*)&ret, sizeof(ret));
-    if (bytes != sizeof(ret))
+// 读取某个版本之后新建的房间
+bool Client::lsRoomsSince(uint32_t version, NameDelta& delta) {
+    return lsSince(OP_LSROOM_DELTA, version, delta);
+}
+
+// 读取与一个用户之间的单聊历史
+bool Client::userHistory(const std::string& userName, const std::string& cursor, int limit,
+                         MessagePage& page) {
+    return history(OP_SGHISTORY, userName, cursor, limit, page);
+}
+
+// 读取房间的群聊历史，需要是房间成员
+bool Client::roomHistory(const std::string& roomName, const std::string& cursor, int limit,
+                         MessagePage& page) {
+    return history(OP_GPHISTORY, roomName, cursor, limit, page);
+}
+
+// 群操作函数
+int Client::doRoom(std::string command, std::string roomName) {
+    if (!request(commandToOpcode(command.c_str()), roomName, ""))
         return -1;
 
-    return ret;
+    return recvResult(-1);
 }
 
 /* 创建群
@@ -212,52 +536,87 @@ int Client::qtRoom(std::string roomName) {
 /* 客户端退出
  */
 void Client::exit() {
+    if (pushing_) {
+        shutdown(socketFd_, SHUT_RDWR);
+        pthread_join(recvTid_, NULL);
+        pushing_ = false;
+    }
     close(socketFd_);
 }
 
 // 获取单聊或群聊发送过来的消息
 std::vector<std::string>& Client::getMessage() {
-    Message msg; 
-    ssize_t bytes;
-
-    strcpy(msg.command, "getmsg");
-
-    bytes = Send(socketFd_, (void*)&msg, sizeof(msg));
-    if (bytes != sizeof(msg))
+    if (!request(OP_GETMSG, "", ""))
         return message_;
 
-    bytes = Recv(socketFd_, (void*)&msg, sizeof(msg));
+    if (protocol_ == PROTOCOL_COMPACT) {
+        std::vector<char> frame;
+        uint32_t count;
+        std::string command, dst, content;
+
+        if (!recvFrame(frame, OP_MESSAGES))
+            return message_;
+
+        FrameReader reader(&frame[0], frame.size());
+        if (!reader.getU32(count))
+            return message_;
+        for (uint32_t i = 0; i < count; i++) {
+            if (!reader.getField(command, MAX_FRAME_SIZE) 
+                || !reader.getField(dst, MAX_NAME_LEN)
+                || !reader.getField(content, MAX_CONTENT_LEN))
+                break;
+            message_.push_back(formatMessage(command, dst, content));
+        }
 
-    if (bytes == sizeof(msg) && strcmp(msg.message, "none") != 0) {
-        std::string message;
+        return message_;
+    }
 
-        message += "(";
+    Message msg; 
+    ssize_t bytes = Recv(socketFd_, (void*)&msg, sizeof(msg));
+
+    if (bytes == sizeof(msg)) {
+        msg.command[sizeof(msg.command) - 1] = '\0';
+        msg.dst[sizeof(msg.dst) - 1] = '\0';
+        msg.message[sizeof(msg.message) - 1] = '\0';
+        if (strcmp(msg.message, "none") != 0)
+            message_.push_back(formatMessage(msg.command, msg.dst, msg.message));
+    }
 
-        // 群聊消息
-        if (strcmp(msg.command, "sgchat") != 0) {
-            for (int i = 0; i < sizeof(msg.command); i++) {
-                if (msg.command[i] == ' ') {
-                    for (int j = i + 1; msg.command[j] != '\0'; j++)
-                        message.push_back(msg.command[j]);
-                    break;
-                }
-            }
-            message += ", ";
-        }
+    return message_;
+}
 
-        // 单聊消息
-        message += msg.dst;
-        message += ")";
-        message += " : ";
-        message += msg.message;
-        message_.push_back(message);
+/* 将服务器转发的消息格式化为 "(发送者) : 内容" 或 "(发送者, 群名称) : 内容"
+ *
+ * @param command "sgchat"或"gpchat 发送者"
+ * @param dst 单聊时为发送者，群聊时为群名称
+ * @param content 消息内容
+ * @return 格式化后的消息
+ */
+std::string Client::formatMessage(const std::string& command, const std::string& dst, 
+                                  const std::string& content) {
+    std::string message;
+
+    message += "(";
+
+    // 群聊消息
+    if (command != "sgchat") {
+        size_t space = command.find(' ');
+        if (space != std::string::npos)
+            message += command.substr(space + 1);
+        message += ", ";
     }
 
-    return message_;
+    // 单聊消息
+    message += dst;
+    message += ")";
+    message += " : ";
+    message += content;
+    return message;
 }
 
 ssize_t Client::Recv(int fd, void* buf, size_t len) {
-    size_t bytes, hasRead;
+    ssize_t bytes;
+    size_t hasRead;
 
     hasRead = 0;
 
@@ -271,11 +630,16 @@ ssize_t Client::Recv(int fd, void* buf, size_t len) {
     return hasRead;
 }
 
+/* 发送buf中的整个帧
+ * 持有sendMutex_直到全部发出，部分写入时不会与接收线程回复的心跳交错
+ */
 ssize_t Client::Send(int fd, void* buf, size_t len) {
-    size_t bytes, hasWrite;
+    ssize_t bytes;
+    size_t hasWrite;
 
     hasWrite = 0;
 
+    pthread_mutex_lock(&sendMutex_);
     while (hasWrite != len) {
         bytes = send(fd, (void*)((char*)buf + hasWrite), len - hasWrite, 0); 
         if (bytes <= 0)
@@ -283,6 +647,7 @@ ssize_t Client::Send(int fd, void* buf, size_t len) {
 
         hasWrite += bytes;
     }
+    pthread_mutex_unlock(&sendMutex_);
     return hasWrite;
 }
 
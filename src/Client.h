@@ -4,14 +4,48 @@
 #ifndef _CHATROOM_SRC_CLIENT_H_
 #define _CHATROOM_SRC_CLIENT_H_
 
+#include <pthread.h>
+#include <stdint.h>
 #include <string>
 #include <vector>
+#include <functional>
+
+#include "Common.h"
+#include "Queue.h"
 
 namespace chat {
 
+// 服务器推送的消息到达时的回调函数，参数为格式化后的消息
+typedef std::function<void(const std::string&)> MessageCallback;
+
+// 分页读取的一页
+typedef struct {
+    uint32_t version;          // 读取时目录的版本号
+    std::string cursor;        // 传给下一次请求; 空串表示已读完
+    std::vector<std::string> names;
+} NamePage;
+
+// 某个版本之后目录的变化
+typedef struct {
+    uint32_t version;          // 当前版本号，下一次增量请求时使用
+    bool reset;                // 版本太旧，需要重新分页读取，此时added和removed为空
+    std::vector<std::string> added;
+    std::vector<std::string> removed;
+} NameDelta;
+
+// 读取的一页历史消息
+typedef struct {
+    std::string cursor;                // 传给下一次请求; 空串表示已读到日志末尾
+    std::vector<std::string> messages; // 格式化后的消息，与getMessage相同
+} MessagePage;
+
 class Client {
 public:
-    bool connectServer(std::string serverIp = "127.0.0.1", int serverPort = 5000);
+    Client();
+    ~Client();
+
+    bool connectServer(std::string serverIp = "127.0.0.1", int serverPort = 5000,
+                       int protocol = PROTOCOL_COMPACT);
 
 public:
     int signUp(std::string name, std::string password);
@@ -20,6 +54,16 @@ public:
     std::vector<std::string> lsUsers();
     std::vector<std::string> lsRooms();
 
+    // 以下只用于紧凑协议
+    bool lsUsersPage(const std::string& prefix, const std::string& cursor, int limit, NamePage& page);
+    bool lsRoomsPage(const std::string& prefix, const std::string& cursor, int limit, NamePage& page);
+    bool lsUsersSince(uint32_t version, NameDelta& delta);
+    bool lsRoomsSince(uint32_t version, NameDelta& delta);
+    bool userHistory(const std::string& userName, const std::string& cursor, int limit,
+                     MessagePage& page);
+    bool roomHistory(const std::string& roomName, const std::string& cursor, int limit,
+                     MessagePage& page);
+
     void singleChat(std::string dstName, std::string content);
     void groupChat(std::string dstGroupName, std::string content);
 
@@ -30,11 +74,26 @@ public:
     void exit();
 
     std::vector<std::string>& getMessage();
+    bool enablePush(MessageCallback callback);
+
+    static std::string formatMessage(const std::string& command, const std::string& dst, 
+                                     const std::string& content);
 
 private:
     std::vector<std::string> ls(std::string command);
+    bool lsPage(int opcode, const std::string& prefix, const std::string& cursor, int limit,
+                NamePage& page);
+    bool lsSince(int opcode, uint32_t version, NameDelta& delta);
+    bool history(int opcode, const std::string& name, const std::string& cursor, int limit,
+                 MessagePage& page);
     void chat(std::string chatType, std::string dstName, std::string content);
     int doRoom(std::string command, std::string roomName);
+    bool request(int opcode, const std::string& dst, const std::string& message);
+    int recvResult(int failValue);
+    bool recvFrame(std::vector<char>& frame, int opcode);
+    bool readFrame(std::vector<char>& frame);
+    void handleDelivery(const std::vector<char>& frame);
+    static void* recvThreadFunc(void* arg);
     ssize_t Recv(int fd, void* buf, size_t len);
     ssize_t Send(int fd, void* buf, size_t len);
 
@@ -42,11 +101,21 @@ private:
     std::string serverIp_;
     int serverPort_;
     int socketFd_;
+    int protocol_;
 
     std::string name_;
     std::string password_;
 
     std::vector<std::string> message_;
+
+    // 推送模式下由接收线程读取所有帧，回复经replies_交给发出请求的线程
+    bool pushing_;
+    pthread_t recvTid_;
+    Queue<std::vector<char>> replies_;
+    MessageCallback callback_;
+
+    // 推送模式下接收线程回复心跳，与发出请求的线程共用套接字，发送整个帧时持有
+    pthread_mutex_t sendMutex_;
 };
 
 } // namespace chat
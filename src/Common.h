@@ -18,13 +18,17 @@ namespace chat {
 #define GETINTO_ROOM_FAIL               0x00000100
 #define QUIT_ROOM_SUCCESS               0x00000200
 #define QUIT_ROOM_FAIL                  0x00000400
+#define PUSH_SUCCESS                    0x00000800
+#define PUSH_FAIL                       0x00001000
+#define GATEWAY_SUCCESS                 0x00002000
+#define GATEWAY_FAIL                    0x00004000
 
 // 用户名和房间名的类型
 typedef struct {
     char name[100];
 } Name;
 
-/* 客户端和服务器通信的协议格式
+/* 客户端和服务器通信的协议格式（旧的定长格式，PROTOCOL_LEGACY）
  *
  * command : 命令类型
  * dst : 消息接收方
@@ -36,6 +40,82 @@ typedef struct {
     char message[1024];
 } Message;
 
+// 通信协议
+#define PROTOCOL_UNKNOWN    0 // 连接刚建立，还未确定协议
+#define PROTOCOL_LEGACY     1 // 定长的Message结构体
+#define PROTOCOL_COMPACT    2 // 带长度头的变长二进制帧
+
+/* 紧凑协议（PROTOCOL_COMPACT）
+ *
+ * 协商 : 客户端连接后先发送2字节 [PROTO_MAGIC][版本号]，
+ *        服务器回复 [PROTO_MAGIC][双方都支持的最高版本号]；
+ *        旧客户端的第一个字节总是命令名的ASCII字符，据此识别为PROTOCOL_LEGACY
+ *
+ * 帧   : [长度 u32][opcode u8][载荷]，长度为网络字节序，不含长度字段本身
+ * 载荷 : 由整数（u32，网络字节序）和字段（[长度 u16][字节]）组成
+ */
+#define PROTO_MAGIC         0xC7
+#define PROTO_VERSION       1
+#define FRAME_HEADER_SIZE   4
+#define MAX_FRAME_SIZE      65536
+
+// 字段长度上限，与Message/Name中的字符数组保持一致（不含结尾的'\0'）
+#define MAX_NAME_LEN        99
+#define MAX_CONTENT_LEN     1023
+
+// 请求的opcode，载荷为字段 [dst][message]，缺省的字段视为空串
+#define OP_SIGNUP           0x01
+#define OP_SIGNIN           0x02
+#define OP_LSUSER           0x03
+#define OP_SGCHAT           0x04
+#define OP_GPCHAT           0x05
+#define OP_MKROOM           0x06
+#define OP_LSROOM           0x07
+#define OP_CDROOM           0x08
+#define OP_QTROOM           0x09
+#define OP_GETMSG           0x0a
+#define OP_PUSH             0x0b // dst为"on"时开启服务器推送，否则关闭
+
+// 分页和增量读取目录，只用于紧凑协议
+// 分页 : dst为名字前缀，message为"上限"或"上限 游标"，游标取自上一页的回复
+// 增量 : dst为客户端已知的版本号（十进制）
+#define OP_LSUSER_PAGE      0x0c
+#define OP_LSROOM_PAGE      0x0d
+#define OP_LSUSER_DELTA     0x0e
+#define OP_LSROOM_DELTA     0x0f
+
+/* 网关 : 一个连接上承载多个逻辑会话，只用于紧凑协议
+ * 连接先用OP_GATEWAY（dst为服务器配置的口令）认证为网关连接，之后每个会话的请求包装为
+ * [长度 u32][OP_SESSION][会话号 u32][一个完整的请求帧]，发给该会话的回复和推送以同样方式包装;
+ * 会话在第一次出现时建立，行为与一个独立的连接相同（需要各自登录），
+ * 用OP_SESSION_CLOSE（载荷为[会话号 u32]）结束，网关连接关闭时其所有会话一并结束
+ */
+#define OP_GATEWAY          0x10
+#define OP_SESSION          0x11
+#define OP_SESSION_CLOSE    0x12
+#define SESSION_HEADER_SIZE (FRAME_HEADER_SIZE + 1 + 4)
+
+// 心跳 : 连接空闲一段时间后服务器发送OP_PING，客户端回复OP_PONG（没有载荷，服务器不回复），
+// 只用于紧凑协议; 网关连接本身收发心跳，会话上没有心跳
+#define OP_PONG             0x13
+
+// 历史消息，只用于紧凑协议，从服务器的消息日志（-l）中读取，没有开启日志时总是为空
+// dst为对方用户名（单聊，双方发给对方的消息）或房间名（群聊，只有房间成员可以读取），
+// message为"上限"或"上限 游标" : 没有游标时从日志末尾最近的一段记录开始，
+// 游标为"0"时从最早的记录开始，之后用回复中的游标继续向后读取
+#define OP_SGHISTORY        0x14
+#define OP_GPHISTORY        0x15
+
+// 回复的opcode
+#define OP_RESULT           0x81 // [返回值 u32]
+#define OP_NAMES            0x82 // [个数 u32][名字]...[游标]，游标非空表示一帧放不下，从游标起用分页请求继续读取
+#define OP_MESSAGES         0x83 // [个数 u32]([command][dst][message])...
+#define OP_DELIVER          0x84 // 服务器主动推送的消息 [command][dst][message]
+#define OP_NAMES_PAGE       0x85 // [版本号 u32][游标][个数 u32][名字]...，游标为空表示已读完
+#define OP_NAMES_DELTA      0x86 // [版本号 u32][需要重新读取 u32][加入个数 u32][名字]...[移除个数 u32][名字]...
+#define OP_PING             0x87 // 服务器发送的心跳，没有载荷，客户端应回复OP_PONG
+#define OP_HISTORY          0x88 // [游标][个数 u32]([command][dst][message])...，游标为空表示已读到日志末尾
+
 } // namespace chat
 
 #endif // _CHATROOM_SRC_COMMON_H_
@@ -0,0 +1,123 @@
+/* 已连接套接字的状态
+ *
+ * 服务器用以描述符为下标的数组（连接表）保存所有Connection，
+ * 每个描述符对应的Connection在第一次使用时创建，之后随描述符复用，不再释放，
+ * 因此其他线程持有的Connection指针始终有效
+ */
+
+#ifndef _CHATROOM_SRC_CONNECTION_H_
+#define _CHATROOM_SRC_CONNECTION_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <unordered_map>
+
+#include "RingBuffer.h"
+#include "OutputQueue.h"
+#include "TimerWheel.h"
+#include "Common.h"
+
+namespace chat {
+
+class UringLoop;
+
+// io_uring后端下连接的接收操作的状态
+#define RECV_ACTIVE         0 // 已提交多次触发的接收
+#define RECV_CANCELLING     1 // 暂停读取时已提交取消，等待接收操作结束
+#define RECV_STOPPED        2 // 接收操作已结束，恢复读取时重新提交
+
+class Connection {
+public:
+    Connection()
+        : fd(-1), epollFd(-1), uring(NULL), protocol(PROTOCOL_UNKNOWN), gateway(false),
+          generation(0), loop(0), timerGeneration(0), lastActive(0), partialSince(0),
+          pingSent(false), inputCounted(0), readPaused(false), recvState(RECV_ACTIVE),
+          outputCounted(0), flushQueued(false),
+          sendInFlight(false), backlogged(false), pushDeferred(false), slowClosing(false)
+    {
+        timer.arg = this;
+        pthread_mutex_init(&inputMutex, NULL);
+        pthread_mutex_init(&outputMutex, NULL);
+    }
+
+    ~Connection() {
+        pthread_mutex_destroy(&inputMutex);
+        pthread_mutex_destroy(&outputMutex);
+    }
+
+    /* 新连接复用该对象时重置状态
+     *
+     * @param connFd 已连接套接字
+     * @param loopEpollFd 该连接所属的epoll实例
+     */
+    void reset(int connFd, int loopEpollFd) {
+        pthread_mutex_lock(&inputMutex);
+        pthread_mutex_lock(&outputMutex);
+        fd = connFd;
+        epollFd = loopEpollFd;
+        protocol = PROTOCOL_UNKNOWN;
+        gateway = false;
+        sessions.clear();
+        generation++;
+        input.clear();
+        readPaused = false;
+        recvState = RECV_ACTIVE;
+        output.clear();
+        sendInFlight = false;
+        backlogged = false;
+        pushDeferred = false;
+        slowClosing = false;
+        pthread_mutex_unlock(&outputMutex);
+        pthread_mutex_unlock(&inputMutex);
+    }
+
+public:
+    int fd;
+    int epollFd;      // 该连接所属的epoll实例
+    UringLoop* uring; // io_uring后端下该连接所属的事件循环
+    int protocol;     // PROTOCOL_*
+
+    // 网关连接 : 已通过OP_GATEWAY认证，sessions为会话号到会话键的映射，都由inputMutex保护
+    bool gateway;
+    std::unordered_map<uint32_t, int> sessions;
+
+    // 每次复用或释放时加一，用于识别属于上一个连接的异步操作（io_uring的完成事件）和投递;
+    // 同时持有inputMutex和outputMutex时修改，单聊和群聊在usersMutex_内不加锁读取
+    std::atomic<uint32_t> generation;
+
+    // 超时检查 : timer在所属事件循环（下标为loop）的时间轮中，到期时检查以下时间，见Server::checkConnection;
+    // timerGeneration是安排定时器时的generation，其余由inputMutex保护，时间单位为毫秒
+    TimerNode timer;
+    int loop;
+    uint32_t timerGeneration;
+    uint64_t lastActive;   // 最近一次收到数据的时间
+    uint64_t partialSince; // 接收缓冲区中的不完整请求开始的时间，0表示没有
+    bool pingSent;         // 空闲后已发送心跳，收到数据时清除
+
+    // 规定需要同时加锁时，先对inputMutex加锁，再对outputMutex加锁
+    RingBuffer input;  // 接收缓冲区，由inputMutex保护
+    size_t inputCounted; // 上一次计入运行指标时input的字节数，由inputMutex保护，见Server::countInput
+    bool readPaused;    // 因发送队列积压暂停处理该连接的请求，由inputMutex保护
+    int recvState;      // io_uring后端下接收操作的状态，RECV_*，由inputMutex保护
+    OutputQueue output; // 发送队列，由outputMutex保护
+    size_t outputCounted; // 上一次计入运行指标时output的字节数，由outputMutex保护
+    bool flushQueued;   // 已加入某个线程的待发送列表，由outputMutex保护
+    bool sendInFlight;  // io_uring后端下有一个发送操作尚未完成，由outputMutex保护
+
+    // 慢消费者 : 发送队列超过高水位时置位，降到低水位以下时清除，见Server::checkBacklog;
+    // 在outputMutex内修改，processInput不加锁读取
+    std::atomic<bool> backlogged;
+    bool pushDeferred;  // SLOW_COALESCE下有推送改存入了收件箱，还没有补发，由outputMutex保护
+    bool slowClosing;   // SLOW_DISCONNECT下已经关闭，由outputMutex保护
+    pthread_mutex_t inputMutex;
+    pthread_mutex_t outputMutex;
+
+private:
+    Connection(const Connection&);
+    Connection& operator=(const Connection&);
+};
+
+} // namespace chat
+
+#endif // _CHATROOM_SRC_CONNECTION_H_
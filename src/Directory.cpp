@@ -0,0 +1,155 @@
+#include "Directory.h"
+
+namespace chat {
+
+static bool hasPrefix(const std::string& name, const std::string& prefix) {
+    return name.compare(0, prefix.size(), prefix) == 0;
+}
+
+Directory::Directory()
+    : version_(0), oldest_(0), history_(DIRECTORY_HISTORY)
+{
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_mutex_init(&rebuildMutex_, NULL);
+    for (int i = 0; i <= PROTOCOL_COMPACT; i++) {
+        cachedVersion_[i] = 0;
+        replies_[i] = NULL;
+    }
+}
+
+Directory::~Directory() {
+    for (int i = 0; i <= PROTOCOL_COMPACT; i++) {
+        if (replies_[i] != NULL)
+            replies_[i]->release();
+    }
+    pthread_mutex_destroy(&mutex_);
+    pthread_mutex_destroy(&rebuildMutex_);
+}
+
+void Directory::add(const std::string& name) {
+    pthread_mutex_lock(&mutex_);
+    if (names_.insert(name).second)
+        record(name, true);
+    pthread_mutex_unlock(&mutex_);
+}
+
+void Directory::remove(const std::string& name) {
+    pthread_mutex_lock(&mutex_);
+    if (names_.erase(name) > 0)
+        record(name, false);
+    pthread_mutex_unlock(&mutex_);
+}
+
+// 记下一次变化，调用者已对mutex_加锁
+void Directory::record(const std::string& name, bool added) {
+    Change& change = history_[++version_ % DIRECTORY_HISTORY];
+
+    change.name = name;
+    change.added = added;
+    if (version_ - oldest_ > DIRECTORY_HISTORY)
+        oldest_ = version_ - DIRECTORY_HISTORY;
+}
+
+uint64_t Directory::version() {
+    uint64_t version;
+
+    pthread_mutex_lock(&mutex_);
+    version = version_;
+    pthread_mutex_unlock(&mutex_);
+    return version;
+}
+
+bool Directory::page(const std::string& prefix, const std::string& after, size_t limit,
+                     size_t maxBytes, std::vector<std::string>& names, uint64_t& version) {
+    std::set<std::string>::const_iterator it;
+    size_t bytes = 0;
+    bool more;
+
+    pthread_mutex_lock(&mutex_);
+
+    version = version_;
+    if (after < prefix)
+        it = names_.lower_bound(prefix);
+    else
+        it = names_.upper_bound(after);
+
+    for ( ; it != names_.end() && hasPrefix(*it, prefix); ++it) {
+        if (names.size() >= limit || bytes + 2 + it->size() > maxBytes)
+            break;
+        bytes += 2 + it->size();
+        names.push_back(*it);
+    }
+    more = it != names_.end() && hasPrefix(*it, prefix);
+
+    pthread_mutex_unlock(&mutex_);
+    return more;
+}
+
+bool Directory::changesSince(uint32_t since, size_t maxBytes, std::vector<std::string>& added,
+                             std::vector<std::string>& removed, uint64_t& version) {
+    std::set<std::string> seen;
+    size_t bytes = 0;
+    bool ok = true;
+
+    pthread_mutex_lock(&mutex_);
+
+    version = version_;
+    // 按32位回绕计算相差的变化数，since比当前版本新时结果很大，同样视为太旧
+    uint64_t count = (uint32_t)((uint32_t)version_ - since);
+    if (count > version_ - oldest_)
+        ok = false;
+
+    // 从新到旧，每个名字只取最后一次变化
+    for (uint64_t v = version_; ok && v > version_ - count; v--) {
+        const Change& change = history_[v % DIRECTORY_HISTORY];
+
+        if (!seen.insert(change.name).second)
+            continue;
+        bytes += 2 + change.name.size();
+        if (bytes > maxBytes)
+            ok = false;
+        else if (change.added)
+            added.push_back(change.name);
+        else
+            removed.push_back(change.name);
+    }
+
+    pthread_mutex_unlock(&mutex_);
+
+    if (!ok) {
+        added.clear();
+        removed.clear();
+    }
+    return ok;
+}
+
+Payload* Directory::acquire(int protocol) {
+    Payload* reply = NULL;
+
+    // 只保护指针的读取和引用计数加1
+    pthread_mutex_lock(&mutex_);
+    if (replies_[protocol] != NULL && cachedVersion_[protocol] == version_) {
+        reply = replies_[protocol];
+        reply->acquire();
+    }
+    pthread_mutex_unlock(&mutex_);
+    return reply;
+}
+
+void Directory::publish(int protocol, uint64_t version, Payload* reply) {
+    Payload* old = NULL;
+
+    pthread_mutex_lock(&mutex_);
+    if (replies_[protocol] == NULL || version > cachedVersion_[protocol]) {
+        old = replies_[protocol];
+        reply->acquire();
+        replies_[protocol] = reply;
+        cachedVersion_[protocol] = version;
+    }
+    pthread_mutex_unlock(&mutex_);
+
+    if (old != NULL)
+        old->release();
+}
+
+} // namespace chat
@@ -0,0 +1,107 @@
+/* 在线用户列表和房间列表
+ *
+ * 按名字排序保存目录中的所有名字，每次加入或移除使版本号加1，并在环形的历史中记下这次变化 :
+ * 1.分页 : 按名字顺序返回某个名字（游标）之后、带有指定前缀的若干个名字
+ * 2.增量 : 返回某个版本之后加入和移除的名字，版本太旧、历史已被覆盖时要求客户端重新分页读取
+ * 3.完整列表 : 缓存编码好的回复（每种协议一份Payload），版本号未变时直接取走发送
+ *
+ * 加入和移除在修改用户或房间的同一把锁（usersMutex_/roomsMutex_）内调用，
+ * 内部的mutex_只保护目录本身，读取时不需要服务器的锁;
+ * 需要同时加锁时总是先对服务器的锁加锁
+ */
+
+#ifndef _CHATROOM_SRC_DIRECTORY_H_
+#define _CHATROOM_SRC_DIRECTORY_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "Common.h"
+#include "Payload.h"
+
+namespace chat {
+
+#define DIRECTORY_HISTORY   4096 // 保留最近这么多次变化，用于增量读取
+#define DIRECTORY_PAGE_MAX  1000 // 每页最多的名字数
+
+class Directory {
+public:
+    Directory();
+    ~Directory();
+
+    // 在修改数据的锁内调用
+    void add(const std::string& name);
+    void remove(const std::string& name);
+
+    uint64_t version();
+
+    /* 按名字顺序读取一页
+     *
+     * @param prefix 只返回带有该前缀的名字，空串表示全部
+     * @param after 游标，只返回大于它的名字，空串表示从头开始
+     * @param limit 最多返回的名字数
+     * @param maxBytes 名字编码后（每个名字加2字节长度）的总字节数上限
+     * @param names 返回的名字
+     * @param version 读取时的版本号
+     * @return true : 之后还有符合条件的名字; false : 已读完
+     */
+    bool page(const std::string& prefix, const std::string& after, size_t limit, size_t maxBytes,
+              std::vector<std::string>& names, uint64_t& version);
+
+    /* 读取某个版本之后的变化，同一个名字多次变化时只保留最后一次
+     *
+     * @param since 客户端已知的版本号（低32位）
+     * @param maxBytes added和removed编码后的总字节数上限
+     * @param added 加入的名字
+     * @param removed 移除的名字
+     * @param version 当前版本号
+     * @return true : 成功; false : 版本太旧或变化太多，需要重新分页读取
+     */
+    bool changesSince(uint32_t since, size_t maxBytes, std::vector<std::string>& added,
+                      std::vector<std::string>& removed, uint64_t& version);
+
+    /* 取得当前版本的完整列表的回复
+     *
+     * @param protocol PROTOCOL_LEGACY或PROTOCOL_COMPACT
+     * @return Payload* 引用计数已加1，用完后release; NULL : 没有缓存或已过期
+     */
+    Payload* acquire(int protocol);
+
+    /* 发布重建好的回复，缓存持有一个引用，调用者仍持有自己的引用
+     *
+     * @param version 读取名字时的版本号
+     */
+    void publish(int protocol, uint64_t version, Payload* reply);
+
+    // 同一时刻只有一个线程重建完整列表的回复
+    pthread_mutex_t* rebuildMutex() { return &rebuildMutex_; }
+
+private:
+    typedef struct {
+        std::string name;
+        bool added;
+    } Change;
+
+    void record(const std::string& name, bool added);
+
+    Directory(const Directory&);
+    Directory& operator=(const Directory&);
+
+private:
+    pthread_mutex_t mutex_;           // 保护以下成员
+    std::set<std::string> names_;
+    uint64_t version_;                // 变化的次数
+    uint64_t oldest_;                 // history_中最早的变化之前的版本号
+    std::vector<Change> history_;     // 使版本号变为v的变化存放在history_[v % DIRECTORY_HISTORY]
+    uint64_t cachedVersion_[PROTOCOL_COMPACT + 1];
+    Payload* replies_[PROTOCOL_COMPACT + 1];
+
+    pthread_mutex_t rebuildMutex_;
+};
+
+} // namespace chat
+
+#endif // _CHATROOM_SRC_DIRECTORY_H_
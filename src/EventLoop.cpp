@@ -0,0 +1,96 @@
+#include <unistd.h>
+#include <errno.h>
+
+#include "EventLoop.h"
+
+namespace chat {
+
+/* 事件循环的构造函数
+ * 创建该循环独占的epoll实例
+ *
+ * @param callback 每个就绪事件的处理函数
+ * @param maxEvents 每次epoll_wait最多返回的事件数
+ * @param afterEvents 每轮事件处理完之后调用，可以为空
+ * @param timeoutMs 每次epoll_wait最多等待的毫秒数，-1表示一直等待
+ */
+EventLoop::EventLoop(EventCallback callback, int maxEvents, IterationCallback afterEvents,
+                     int timeoutMs)
+    : epollFd_(epoll_create1(EPOLL_CLOEXEC)),
+      callback_(callback),
+      afterEvents_(afterEvents),
+      timeoutMs_(timeoutMs),
+      events_(maxEvents)
+{
+}
+
+EventLoop::~EventLoop()
+{
+    close(epollFd_);
+}
+
+/* 创建线程，使该事件循环运行在新线程中
+ *
+ * @param void
+ * @return void
+ */
+void EventLoop::start()
+{
+    pthread_create(&tid_, NULL, threadFunc, (void*)this);
+}
+
+/* 事件循环主体
+ * 等待本epoll实例上的事件，并在当前线程中直接处理
+ *
+ * @param void
+ * @return void
+ */
+void EventLoop::loop()
+{
+    int numReadyEvents;
+
+    while (true) {
+        numReadyEvents = epoll_wait(epollFd_, &events_[0], events_.size(), timeoutMs_);
+        if (numReadyEvents == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (int i = 0; i < numReadyEvents; i++)
+            callback_(events_[i]);
+        if (afterEvents_)
+            afterEvents_();
+    }
+}
+
+/* 将描述符注册到该事件循环
+ * epoll_ctl是线程安全的，因此可以由接收连接的线程直接调用
+ *
+ * @param fd 描述符
+ * @param events 关注的事件
+ * @return true : 注册成功; false : 注册失败
+ */
+bool EventLoop::addFd(int fd, uint32_t events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+int EventLoop::getEpollFd()
+{
+    return epollFd_;
+}
+
+void* EventLoop::threadFunc(void* arg)
+{
+    EventLoop* loop = (EventLoop*)arg;
+
+    loop->loop();
+
+    return (void*)0;
+}
+
+} // namespace chat
@@ -0,0 +1,52 @@
+/* 事件循环（reactor）的实现
+ *
+ * 每个EventLoop对象拥有一个epoll实例和一个线程，
+ * 注册到该epoll上的描述符的所有读写事件都在这个线程内处理，
+ * 不再经过工作队列在线程间传递
+ */
+
+#ifndef _CHATROOM_SRC_EVENTLOOP_H_
+#define _CHATROOM_SRC_EVENTLOOP_H_
+
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <functional>
+#include <vector>
+
+namespace chat {
+
+// 事件回调函数，参数为epoll_wait返回的事件
+typedef std::function<void(struct epoll_event&)> EventCallback;
+
+// 每轮epoll_wait返回的事件都处理完之后调用，例如统一发送这一轮产生的回复;
+// 设置了等待超时时，超时返回（没有事件）之后也会调用，可用于推进定时器
+typedef std::function<void()> IterationCallback;
+
+class EventLoop {
+public:
+    EventLoop(EventCallback callback, int maxEvents,
+              IterationCallback afterEvents = IterationCallback(), int timeoutMs = -1);
+    ~EventLoop();
+
+    void start();
+    void loop();
+
+    bool addFd(int fd, uint32_t events);
+    int getEpollFd();
+
+private:
+    static void* threadFunc(void* arg);
+
+private:
+    pthread_t tid_;
+    int epollFd_;
+    EventCallback callback_;
+    IterationCallback afterEvents_;
+    int timeoutMs_; // epoll_wait的超时，-1表示一直等待
+    std::vector<struct epoll_event> events_;
+};
+
+} // namespace chat
+
+#endif // _CHATROOM_SRC_EVENTLOOP_H_
@@ -0,0 +1,184 @@
+/* 用户收件箱
+ *
+ * 每个用户有一个有界的先进先出收件箱，存放等待getmsg取走的消息，
+ * 所有收件箱的节点来自同一个预先分配的节点池，投递和取出消息时不分配内存
+ *
+ * 节点只保存指向消息（Payload中的一个Message）的指针并持有一个引用，
+ * 群聊投递给所有成员的是同一个Payload，不为每个成员拷贝消息
+ * 节点记下投递的时间，开启消息有效期时由expire丢弃过期的消息
+ *
+ * 本类不加锁，由调用者（Server::msgMutex_）保证互斥
+ */
+
+#ifndef _CHATROOM_SRC_INBOX_H_
+#define _CHATROOM_SRC_INBOX_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include "Common.h"
+#include "Payload.h"
+
+namespace chat {
+
+// 收件箱已满时的处理策略
+#define INBOX_DROP_OLDEST   0 // 丢弃最早的消息，保留新消息
+#define INBOX_DROP_NEWEST   1 // 丢弃新消息
+
+// 一个用户的收件箱，只记录节点池中链表的首尾
+typedef struct {
+    int head;
+    int tail;
+    int count;
+} Inbox;
+
+class InboxPool {
+public:
+    /* @param capacity 节点池的节点总数，即所有收件箱中消息数之和的上限
+     * @param depth 每个收件箱最多存放的消息数
+     * @param policy 收件箱或节点池满时的处理策略，INBOX_DROP_*
+     */
+    InboxPool(size_t capacity, size_t depth, int policy)
+        : nodes_(capacity), freeHead_(-1), depth_(depth), policy_(policy),
+          dropped_(0), expired_(0)
+    {
+        for (size_t i = 0; i < capacity; i++) {
+            nodes_[i].msg = NULL;
+            putNode(i);
+        }
+    }
+
+    ~InboxPool() {
+        for (size_t i = 0; i < nodes_.size(); i++) {
+            if (nodes_[i].msg != NULL)
+                nodes_[i].msg->release();
+        }
+    }
+
+    static Inbox emptyInbox() {
+        Inbox inbox = {-1, -1, 0};
+        return inbox;
+    }
+
+    /* 投递一条消息，投递成功时收件箱持有msg的一个引用
+     *
+     * @param inbox 接收方的收件箱
+     * @param msg 消息，数据是一个Message
+     * @param nowMs 投递的时间，单位毫秒，用于判断消息是否过期
+     * @return true : 投递成功; false : 按策略丢弃了新消息
+     */
+    bool push(Inbox& inbox, Payload* msg, uint64_t nowMs) {
+        int node;
+
+        if ((size_t)inbox.count >= depth_ || freeHead_ == -1) {
+            dropped_++;
+            if (policy_ == INBOX_DROP_NEWEST || inbox.count == 0)
+                return false;
+            node = takeHead(inbox); // 复用最早那条消息的节点
+            nodes_[node].msg->release();
+        } else {
+            node = freeHead_;
+            freeHead_ = nodes_[node].next;
+        }
+
+        msg->acquire();
+        nodes_[node].msg = msg;
+        nodes_[node].time = nowMs;
+        nodes_[node].next = -1;
+        if (inbox.tail == -1)
+            inbox.head = node;
+        else
+            nodes_[inbox.tail].next = node;
+        inbox.tail = node;
+        inbox.count++;
+        return true;
+    }
+
+    /* 取出最早的一条消息，收件箱持有的引用转交给调用者，用完后由调用者release
+     *
+     * @param inbox 收件箱
+     * @param msg 存放取出的消息
+     * @return true : 成功; false : 收件箱为空
+     */
+    bool pop(Inbox& inbox, Payload*& msg) {
+        if (inbox.count == 0)
+            return false;
+
+        int node = takeHead(inbox);
+        msg = nodes_[node].msg;
+        nodes_[node].msg = NULL;
+        putNode(node);
+        return true;
+    }
+
+    // 最早的一条消息，收件箱为空时返回NULL
+    const Message* front(const Inbox& inbox) const {
+        return inbox.count == 0 ? NULL : (const Message*)nodes_[inbox.head].msg->data();
+    }
+
+    void clear(Inbox& inbox) {
+        while (inbox.count > 0) {
+            int node = takeHead(inbox);
+            nodes_[node].msg->release();
+            nodes_[node].msg = NULL;
+            putNode(node);
+        }
+    }
+
+    /* 丢弃收件箱开头投递时间早于beforeMs的消息，消息按投递顺序排列，遇到未过期的即停止
+     *
+     * @param inbox 收件箱
+     * @param beforeMs 早于该时间投递的消息已过期
+     * @return 丢弃的消息数
+     */
+    size_t expire(Inbox& inbox, uint64_t beforeMs) {
+        size_t count = 0;
+
+        while (inbox.count > 0 && nodes_[inbox.head].time < beforeMs) {
+            int node = takeHead(inbox);
+            nodes_[node].msg->release();
+            nodes_[node].msg = NULL;
+            putNode(node);
+            count++;
+        }
+        expired_ += count;
+        return count;
+    }
+
+    uint64_t dropped() const { return dropped_; }
+    uint64_t expired() const { return expired_; }
+
+private:
+    typedef struct {
+        Payload* msg;
+        uint64_t time; // 投递的时间
+        int next;
+    } Node;
+
+    int takeHead(Inbox& inbox) {
+        int node = inbox.head;
+
+        inbox.head = nodes_[node].next;
+        if (inbox.head == -1)
+            inbox.tail = -1;
+        inbox.count--;
+        return node;
+    }
+
+    void putNode(int node) {
+        nodes_[node].next = freeHead_;
+        freeHead_ = node;
+    }
+
+private:
+    std::vector<Node> nodes_;
+    int freeHead_; // 空闲节点链表
+    size_t depth_;
+    int policy_;
+    uint64_t dropped_; // 因收件箱满而丢弃的消息数
+    uint64_t expired_; // 因过期而丢弃的消息数
+};
+
+} // namespace chat
+
+#endif // _CHATROOM_SRC_INBOX_H_
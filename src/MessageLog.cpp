@@ -0,0 +1,502 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <algorithm>
+
+#include "MessageLog.h"
+
+namespace chat {
+
+/********************************* CRC32C *********************************/
+
+static uint32_t crcTable[256];
+
+static bool initCrcTable() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+        crcTable[i] = crc;
+    }
+    return true;
+}
+
+static uint32_t crc32cTable(uint32_t crc, const unsigned char* p, size_t len) {
+    static bool ready = initCrcTable();
+
+    (void)ready;
+    while (len-- > 0)
+        crc = crcTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+// SSE4.2的crc32指令，每次处理8字节
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char* p, size_t len) {
+    uint64_t crc64 = crc;
+
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (len-- > 0)
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
+}
+#endif
+
+/* 计算CRC32C（Castagnoli），CPU支持时使用硬件指令
+ *
+ * @param data 数据
+ * @param len 数据长度
+ * @return 校验值
+ */
+uint32_t crc32c(const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+
+#if defined(__x86_64__)
+    static bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware)
+        return ~crc32cHardware(~0u, p, len);
+#endif
+    return ~crc32cTable(~0u, p, len);
+}
+
+/********************************* MessageLog *********************************/
+
+/* 消息日志的构造函数，之后需要调用open
+ *
+ * @param dir 存放段文件的目录，不存在时创建
+ * @param segmentSize 新建段文件的大小
+ * @param syncIntervalMs 组提交的间隔
+ */
+MessageLog::MessageLog(const std::string& dir, size_t segmentSize, int syncIntervalMs)
+    : dir_(dir),
+      segmentSize_(segmentSize),
+      syncIntervalMs_(syncIntervalMs > 0 ? syncIntervalMs : 1),
+      nextSeq_(0),
+      durableSeq_(0),
+      syncIndex_(0),
+      syncOffset_(0),
+      syncCount_(0),
+      syncRequested_(false),
+      stopping_(false),
+      running_(false)
+{
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&syncCond_, NULL);
+    pthread_cond_init(&durableCond_, NULL);
+}
+
+/* 停止后台线程，同步所有已写入的记录后关闭
+ */
+MessageLog::~MessageLog()
+{
+    if (running_) {
+        pthread_mutex_lock(&mutex_);
+        stopping_ = true;
+        pthread_cond_signal(&syncCond_);
+        pthread_mutex_unlock(&mutex_);
+        pthread_join(syncTid_, NULL);
+    }
+
+    for (size_t i = 0; i < segments_.size(); i++) {
+        munmap(segments_[i]->map, segments_[i]->size);
+        close(segments_[i]->fd);
+        delete segments_[i];
+    }
+
+    pthread_mutex_destroy(&mutex_);
+    pthread_cond_destroy(&syncCond_);
+    pthread_cond_destroy(&durableCond_);
+}
+
+/* 打开或新建日志 : 映射已有的段，恢复最后一个段的写入位置，启动组提交线程
+ *
+ * @return true : 成功; false : 目录或文件无法访问
+ */
+bool MessageLog::open() {
+    std::vector<uint64_t> bases;
+    DIR* dir;
+    struct dirent* entry;
+
+    mkdir(dir_.c_str(), 0755);
+    dir = opendir(dir_.c_str());
+    if (dir == NULL)
+        return false;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned long long base;
+        char suffix[8];
+
+        if (sscanf(entry->d_name, "%20llu.%7s", &base, suffix) == 2 && strcmp(suffix, "log") == 0)
+            bases.push_back(base);
+    }
+    closedir(dir);
+    std::sort(bases.begin(), bases.end());
+
+    for (size_t i = 0; i < bases.size(); i++) {
+        Segment* segment = openSegment(bases[i], false);
+        if (segment == NULL)
+            return false;
+        segments_.push_back(segment);
+    }
+
+    if (segments_.empty()) {
+        Segment* segment = openSegment(0, true);
+        if (segment == NULL)
+            return false;
+        segments_.push_back(segment);
+    }
+
+    uint64_t count;
+    Segment* last = segments_.back();
+    if (!recover(last, count))
+        return false;
+    nextSeq_ = last->baseSeq + count;
+    durableSeq_ = nextSeq_;
+    syncIndex_ = segments_.size() - 1;
+    syncOffset_ = last->used;
+
+    running_ = true;
+    pthread_create(&syncTid_, NULL, syncThreadFunc, (void*)this);
+    return true;
+}
+
+/* 映射一个段文件
+ *
+ * @param baseSeq 段中第一条记录的序号
+ * @param create true : 新建并预先分配segmentSize_字节; false : 打开已有的文件
+ * @return Segment* 新的段; NULL : 失败
+ */
+MessageLog::Segment* MessageLog::openSegment(uint64_t baseSeq, bool create) {
+    char name[64];
+    struct stat st;
+    int fd;
+
+    snprintf(name, sizeof(name), "/%020llu.log", (unsigned long long)baseSeq);
+    fd = ::open((dir_ + name).c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if (fd == -1)
+        return NULL;
+
+    if ((create && ftruncate(fd, segmentSize_) == -1) || fstat(fd, &st) == -1
+        || st.st_size < LOG_RECORD_HEADER) {
+        close(fd);
+        return NULL;
+    }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    Segment* segment = new Segment;
+    segment->baseSeq = baseSeq;
+    segment->fd = fd;
+    segment->map = (char*)map;
+    segment->size = st.st_size;
+    segment->used = create ? 0 : st.st_size;
+    return segment;
+}
+
+/* 找到段中最后一条完整的记录，之后的部分视为没有写完，清除其头部
+ *
+ * @param segment 最后一个段
+ * @param count 段中完整的记录数
+ */
+bool MessageLog::recover(Segment* segment, uint64_t& count) {
+    size_t offset = 0;
+
+    count = 0;
+    while (offset + LOG_RECORD_HEADER <= segment->size) {
+        uint32_t len, crc;
+
+        memcpy(&len, segment->map + offset, sizeof(len));
+        memcpy(&crc, segment->map + offset + 4, sizeof(crc));
+        if (len == 0)
+            break;
+
+        if (len > segment->size - offset - LOG_RECORD_HEADER
+            || crc32c(segment->map + offset + LOG_RECORD_HEADER, len) != crc) {
+            // 写到一半的记录，之后的追加会从这里开始覆盖
+            size_t end = len > segment->size - offset - LOG_RECORD_HEADER
+                         ? offset + LOG_RECORD_HEADER : offset + LOG_RECORD_HEADER + len;
+            memset(segment->map + offset, 0, end - offset);
+            msync(segment->map, segment->size, MS_SYNC);
+            break;
+        }
+
+        offset += LOG_RECORD_HEADER + len;
+        count++;
+    }
+
+    segment->used = offset;
+    return true;
+}
+
+/* 追加一条记录，只拷贝到映射的内存中，不等待磁盘
+ *
+ * @param data 记录的内容
+ * @param len 记录的长度，不能为0，加上头部不能超过段的大小
+ * @return 记录的序号; LOG_APPEND_FAILED : 记录太长或无法创建新的段
+ */
+uint64_t MessageLog::append(const void* data, size_t len) {
+    uint32_t len32 = (uint32_t)len;
+    uint32_t crc = crc32c(data, len);
+    uint64_t seq;
+
+    if (len == 0 || len + LOG_RECORD_HEADER > segmentSize_)
+        return LOG_APPEND_FAILED;
+
+    pthread_mutex_lock(&mutex_);
+
+    Segment* segment = segments_.back();
+    if (segment->used + LOG_RECORD_HEADER + len > segment->size) {
+        if (!roll()) {
+            pthread_mutex_unlock(&mutex_);
+            return LOG_APPEND_FAILED;
+        }
+        segment = segments_.back();
+    }
+
+    char* p = segment->map + segment->used;
+    memcpy(p + LOG_RECORD_HEADER, data, len);
+    memcpy(p + 4, &crc, sizeof(crc));
+    memcpy(p, &len32, sizeof(len32));
+    segment->used += LOG_RECORD_HEADER + len;
+    seq = nextSeq_++;
+
+    pthread_mutex_unlock(&mutex_);
+    return seq;
+}
+
+/* 当前段已满，新建下一个段
+ * 旧段剩余未同步的部分由后台线程在下一次同步时一起写入磁盘
+ * 调用者已对mutex_加锁
+ */
+bool MessageLog::roll() {
+    Segment* segment = openSegment(nextSeq_, true);
+
+    if (segment == NULL)
+        return false;
+    segments_.push_back(segment);
+    return true;
+}
+
+/* 等待序号为seq的记录持久化
+ * 立即唤醒后台线程，同时等待的调用者共用一次同步
+ *
+ * @param seq append返回的序号
+ */
+void MessageLog::waitDurable(uint64_t seq) {
+    pthread_mutex_lock(&mutex_);
+    while (durableSeq_ <= seq && seq < nextSeq_ && running_ && !stopping_) {
+        syncRequested_ = true;
+        pthread_cond_signal(&syncCond_);
+        pthread_cond_wait(&durableCond_, &mutex_);
+    }
+    pthread_mutex_unlock(&mutex_);
+}
+
+/* 把上次同步之后写入的部分写入磁盘，一次同步覆盖期间追加的所有记录
+ */
+void MessageLog::sync() {
+    std::vector<Segment*> pending;
+    size_t startOffset, lastUsed;
+    uint64_t target;
+
+    pthread_mutex_lock(&mutex_);
+    syncRequested_ = false;
+    target = nextSeq_;
+    startOffset = syncOffset_;
+    lastUsed = segments_.back()->used;
+    pending.assign(segments_.begin() + syncIndex_, segments_.end());
+    if (pending.size() == 1 && startOffset == lastUsed) { // 没有新的记录
+        durableSeq_ = target;
+        pthread_cond_broadcast(&durableCond_);
+        pthread_mutex_unlock(&mutex_);
+        return ;
+    }
+    pthread_mutex_unlock(&mutex_);
+
+    // 已经写满的段不再变化，最后一个段只同步到开始时的写入位置
+    size_t pageMask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+    for (size_t i = 0; i < pending.size(); i++) {
+        size_t from = (i == 0 ? startOffset : 0) & ~pageMask;
+        size_t to = i + 1 == pending.size() ? lastUsed : pending[i]->used;
+
+        if (to > from)
+            msync(pending[i]->map + from, to - from, MS_SYNC);
+    }
+
+    pthread_mutex_lock(&mutex_);
+    syncIndex_ += pending.size() - 1;
+    syncOffset_ = lastUsed;
+    durableSeq_ = target;
+    syncCount_++;
+    pthread_cond_broadcast(&durableCond_);
+    pthread_mutex_unlock(&mutex_);
+}
+
+/* 组提交线程 : 每隔syncIntervalMs_同步一次，有调用者等待时立即同步
+ */
+void* MessageLog::syncThreadFunc(void* arg) {
+    MessageLog* log = (MessageLog*)arg;
+
+    pthread_mutex_lock(&log->mutex_);
+    while (!log->stopping_) {
+        if (!log->syncRequested_) {
+            struct timespec deadline;
+
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long)log->syncIntervalMs_ * 1000000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            pthread_cond_timedwait(&log->syncCond_, &log->mutex_, &deadline);
+        }
+        pthread_mutex_unlock(&log->mutex_);
+        log->sync();
+        pthread_mutex_lock(&log->mutex_);
+    }
+    pthread_mutex_unlock(&log->mutex_);
+
+    log->sync();
+    return (void*)0;
+}
+
+/* 按序号顺序遍历从fromSeq开始的记录，直接读取映射的内存
+ * 遍历的是调用时已经追加的记录，之后追加的不包括在内;
+ * 崩溃时没有写完的记录会在序号中留下空缺，遍历时跳过
+ *
+ * @param fromSeq 第一条要读取的记录的序号
+ * @param visit 对每条记录调用
+ * @return 最后读取的记录之后的序号
+ */
+uint64_t MessageLog::scan(uint64_t fromSeq, LogVisitor visit) {
+    std::vector<Segment*> segments;
+    size_t lastUsed;
+    uint64_t endSeq, seq = fromSeq;
+
+    pthread_mutex_lock(&mutex_);
+    segments = segments_;
+    lastUsed = segments_.back()->used;
+    endSeq = nextSeq_;
+    pthread_mutex_unlock(&mutex_);
+
+    // 第一个可能包含fromSeq的段
+    size_t first = 0;
+    while (first + 1 < segments.size() && segments[first + 1]->baseSeq <= fromSeq)
+        first++;
+
+    for (size_t i = first; i < segments.size(); i++) {
+        Segment* segment = segments[i];
+        uint64_t segmentEnd = i + 1 < segments.size() ? segments[i + 1]->baseSeq : endSeq;
+        size_t limit = i + 1 < segments.size() ? segment->size : lastUsed;
+        size_t offset = 0;
+
+        for (uint64_t s = segment->baseSeq; s < segmentEnd; s++) {
+            uint32_t len, crc;
+
+            if (offset + LOG_RECORD_HEADER > limit)
+                break;
+            memcpy(&len, segment->map + offset, sizeof(len));
+            memcpy(&crc, segment->map + offset + 4, sizeof(crc));
+            if (len == 0 || len > limit - offset - LOG_RECORD_HEADER)
+                break;
+
+            const char* data = segment->map + offset + LOG_RECORD_HEADER;
+            offset += LOG_RECORD_HEADER + len;
+            if (s < fromSeq)
+                continue;
+            if (crc32c(data, len) != crc)
+                break;
+            seq = s + 1;
+            if (!visit(s, data, len))
+                return seq;
+        }
+    }
+
+    return seq;
+}
+
+/* 删除所有记录的序号都小于seq的段，用于已经由快照覆盖的日志
+ * 只删除已经写满且已经同步的段，当前写入的段总是保留;
+ * 不能与scan同时调用
+ *
+ * @param seq 需要保留的第一条记录的序号
+ * @return 删除的段数
+ */
+size_t MessageLog::dropBefore(uint64_t seq) {
+    std::vector<Segment*> dropped;
+
+    pthread_mutex_lock(&mutex_);
+    while (segments_.size() > 1 && syncIndex_ > 0 && segments_[1]->baseSeq <= seq) {
+        dropped.push_back(segments_.front());
+        segments_.erase(segments_.begin());
+        syncIndex_--;
+    }
+    pthread_mutex_unlock(&mutex_);
+
+    for (size_t i = 0; i < dropped.size(); i++) {
+        char name[64];
+
+        snprintf(name, sizeof(name), "/%020llu.log", (unsigned long long)dropped[i]->baseSeq);
+        unlink((dir_ + name).c_str());
+        munmap(dropped[i]->map, dropped[i]->size);
+        close(dropped[i]->fd);
+        delete dropped[i];
+    }
+    return dropped.size();
+}
+
+uint64_t MessageLog::nextSeq() {
+    uint64_t seq;
+
+    pthread_mutex_lock(&mutex_);
+    seq = nextSeq_;
+    pthread_mutex_unlock(&mutex_);
+    return seq;
+}
+
+uint64_t MessageLog::durableSeq() {
+    uint64_t seq;
+
+    pthread_mutex_lock(&mutex_);
+    seq = durableSeq_;
+    pthread_mutex_unlock(&mutex_);
+    return seq;
+}
+
+// 组提交线程实际写入磁盘的次数
+uint64_t MessageLog::syncCount() {
+    uint64_t count;
+
+    pthread_mutex_lock(&mutex_);
+    count = syncCount_;
+    pthread_mutex_unlock(&mutex_);
+    return count;
+}
+
+size_t MessageLog::numSegments() {
+    size_t n;
+
+    pthread_mutex_lock(&mutex_);
+    n = segments_.size();
+    pthread_mutex_unlock(&mutex_);
+    return n;
+}
+
+} // namespace chat
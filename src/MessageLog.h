@@ -0,0 +1,103 @@
+/* 只追加的消息日志
+ *
+ * 记录按顺序追加到日志中，每条记录有一个从0开始连续递增的序号
+ * 日志由若干个固定大小的段文件组成，文件名是段中第一条记录的序号;
+ * 段文件创建时预先分配好大小并用mmap映射，追加只是一次内存拷贝
+ *
+ * 记录格式 : [长度 u32][CRC32C u32][数据]，长度为0表示段中的记录到此为止
+ *
+ * 持久化使用组提交 : 后台线程每隔syncIntervalMs把新写入的部分msync到磁盘，
+ * 追加本身从不等待磁盘;需要确认持久化的调用者用waitDurable等待下一次同步，
+ * 同时等待的多个调用者共用一次同步
+ *
+ * 打开时只需要检查最后一个段 : 之前的段在创建下一个段之前已经写满，
+ * 每个段的记录数由相邻段的文件名得到;最后一个段中CRC不符的记录视为崩溃时没有写完，丢弃
+ *
+ * 读取（scan）直接访问映射的内存，不需要系统调用
+ *
+ * 服务器中的用法 : 单聊和群聊的消息在投递之前追加，之后追加每次收件箱的放入和移除;
+ * 启动时用scan重放收件箱的变化，恢复还没有被取走的消息，历史消息请求也用scan读取，见Server
+ */
+
+#ifndef _CHATROOM_SRC_MESSAGELOG_H_
+#define _CHATROOM_SRC_MESSAGELOG_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <functional>
+
+namespace chat {
+
+#define LOG_SEGMENT_SIZE        (64 << 20) // 每个段文件的大小
+#define LOG_SYNC_INTERVAL_MS    10         // 组提交的间隔
+#define LOG_RECORD_HEADER       8          // 每条记录的头部长度
+#define LOG_APPEND_FAILED       ((uint64_t)-1)
+
+/* 遍历日志时对每条记录调用
+ *
+ * @return true : 继续; false : 停止遍历
+ */
+typedef std::function<bool(uint64_t seq, const char* data, size_t len)> LogVisitor;
+
+uint32_t crc32c(const void* data, size_t len);
+
+class MessageLog {
+public:
+    MessageLog(const std::string& dir, size_t segmentSize = LOG_SEGMENT_SIZE,
+               int syncIntervalMs = LOG_SYNC_INTERVAL_MS);
+    ~MessageLog();
+
+    bool open();
+
+    uint64_t append(const void* data, size_t len);
+    void waitDurable(uint64_t seq);
+    uint64_t scan(uint64_t fromSeq, LogVisitor visit);
+    size_t dropBefore(uint64_t seq);
+
+    uint64_t nextSeq();
+    uint64_t durableSeq();
+    uint64_t syncCount();
+    size_t numSegments();
+
+private:
+    typedef struct {
+        uint64_t baseSeq; // 段中第一条记录的序号
+        int fd;
+        char* map;
+        size_t size;      // 文件大小
+        size_t used;      // 已写入的字节数
+    } Segment;
+
+    Segment* openSegment(uint64_t baseSeq, bool create);
+    bool recover(Segment* segment, uint64_t& count);
+    bool roll();
+    void sync();
+    static void* syncThreadFunc(void* arg);
+
+private:
+    std::string dir_;
+    size_t segmentSize_;
+    int syncIntervalMs_;
+
+    // 以下由mutex_保护
+    pthread_mutex_t mutex_;
+    std::vector<Segment*> segments_;
+    uint64_t nextSeq_;
+    uint64_t durableSeq_;  // 序号小于它的记录已经持久化
+    size_t syncIndex_;     // 尚未同步的部分从segments_[syncIndex_]的syncOffset_开始
+    size_t syncOffset_;
+    uint64_t syncCount_;
+    bool syncRequested_;   // 有调用者在waitDurable中等待
+    bool stopping_;
+    pthread_cond_t syncCond_;    // 唤醒后台线程
+    pthread_cond_t durableCond_; // 一次同步完成
+
+    pthread_t syncTid_;
+    bool running_;
+};
+
+} // namespace chat
+
+#endif // _CHATROOM_SRC_MESSAGELOG_H_
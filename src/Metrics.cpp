@@ -0,0 +1,287 @@
+#include <time.h>
+#include <stdio.h>
+#include <new>
+
+#include "Metrics.h"
+#include "Protocol.h"
+#include "Common.h"
+
+namespace chat {
+
+// 输出直方图时使用的桶上界，单位秒
+static const double bucketBounds[] = {
+    1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4,
+    1e-3, 2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+};
+
+static const char* lockNames[NUM_LOCKS] = {"users", "rooms", "msg"};
+
+// 当前线程的计数器及其所属的Metrics
+static thread_local Metrics* localOwner = NULL;
+static thread_local void* localSlot = NULL;
+
+// 只有一个线程写入，不需要原子的读改写
+static inline void bump(std::atomic<uint64_t>& counter, uint64_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+LatencyHistogram::LatencyHistogram()
+    : sum_(0)
+{
+    for (int i = 0; i < kBuckets; i++)
+        counts_[i].store(0, std::memory_order_relaxed);
+}
+
+int LatencyHistogram::bucketOf(uint64_t ns) {
+    if (ns < (uint64_t)kSubBuckets)
+        return (int)ns;
+
+    int msb = 63 - __builtin_clzll(ns);
+    if (msb >= kMaxBits)
+        return kBuckets - 1;
+
+    int shift = msb - kSubBits;
+    return ((shift + 1) << kSubBits) + (int)((ns >> shift) & (kSubBuckets - 1));
+}
+
+uint64_t LatencyHistogram::upperBound(int bucket) {
+    if (bucket < kSubBuckets)
+        return bucket;
+
+    int shift = (bucket >> kSubBits) - 1;
+    uint64_t sub = (uint64_t)(bucket & (kSubBuckets - 1)) | kSubBuckets;
+    return ((sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+    bump(counts_[bucketOf(ns)], 1);
+    bump(sum_, ns);
+}
+
+void LatencyHistogram::addTo(std::vector<uint64_t>& counts, uint64_t& sum) const {
+    for (int i = 0; i < kBuckets; i++)
+        counts[i] += counts_[i].load(std::memory_order_relaxed);
+    sum += sum_.load(std::memory_order_relaxed);
+}
+
+Metrics::Metrics()
+{
+    pthread_mutex_init(&slotsMutex_, NULL);
+}
+
+Metrics::~Metrics()
+{
+    for (size_t i = 0; i < slots_.size(); i++)
+        delete slots_[i];
+    pthread_mutex_destroy(&slotsMutex_);
+}
+
+uint64_t Metrics::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 当前线程的计数器，第一次调用时分配并登记
+Metrics::ThreadSlot* Metrics::local() {
+    if (localOwner == this)
+        return (ThreadSlot*)localSlot;
+
+    ThreadSlot* slot = new ThreadSlot();
+    for (int i = 0; i < NUM_LOCKS; i++) {
+        slot->locks[i].acquired.store(0, std::memory_order_relaxed);
+        slot->locks[i].contended.store(0, std::memory_order_relaxed);
+    }
+    for (int i = 0; i < NUM_GAUGES; i++)
+        slot->gauges[i].store(0, std::memory_order_relaxed);
+
+    pthread_mutex_lock(&slotsMutex_);
+    slots_.push_back(slot);
+    pthread_mutex_unlock(&slotsMutex_);
+
+    localOwner = this;
+    localSlot = slot;
+    return slot;
+}
+
+/* 记录一个命令的处理耗时
+ *
+ * @param opcode 命令的opcode
+ * @param ns 耗时，单位纳秒
+ */
+void Metrics::recordCommand(int opcode, uint64_t ns) {
+    if (opcode < 0 || opcode >= METRIC_COMMANDS)
+        opcode = 0;
+    local()->commands[opcode].record(ns);
+}
+
+/* 对互斥锁加锁，并记录是否需要等待以及等待的时间
+ * 没有争用时只多一次trylock，不读时钟
+ *
+ * @param mutex 互斥锁
+ * @param which LOCK_*
+ */
+void Metrics::lock(pthread_mutex_t* mutex, int which) {
+    LockStats& stats = local()->locks[which];
+
+    bump(stats.acquired, 1);
+    if (pthread_mutex_trylock(mutex) == 0)
+        return ;
+
+    uint64_t start = now();
+    pthread_mutex_lock(mutex);
+    bump(stats.contended, 1);
+    stats.wait.record(now() - start);
+}
+
+/* 累计一个瞬时值的增减量
+ * 增加和减少可以发生在不同的线程，各线程的和可能为负，相加之后才是当前值
+ *
+ * @param which GAUGE_*
+ * @param delta 增减量
+ */
+void Metrics::adjust(int which, int64_t delta) {
+    if (delta != 0)
+        bump(local()->gauges[which], (uint64_t)delta);
+}
+
+/* 读取一个瞬时值 : 所有线程的增减量之和
+ *
+ * @param which GAUGE_*
+ * @return 当前值，并发修改时是近似值
+ */
+int64_t Metrics::gauge(int which) {
+    uint64_t sum = 0;
+
+    pthread_mutex_lock(&slotsMutex_);
+    for (size_t i = 0; i < slots_.size(); i++)
+        sum += slots_[i]->gauges[which].load(std::memory_order_relaxed);
+    pthread_mutex_unlock(&slotsMutex_);
+
+    return (int64_t)sum;
+}
+
+/* 输出一个瞬时值
+ *
+ * @param out 追加到的缓冲区
+ * @param name 指标名
+ * @param help 说明
+ * @param value 当前值
+ */
+void Metrics::renderGauge(std::string& out, const char* name, const char* help, double value) {
+    char line[256];
+
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s gauge\n%s %.17g\n",
+             name, help, name, name, value);
+    out += line;
+}
+
+/* 输出一个只增不减的计数器，name应以_total结尾
+ */
+void Metrics::renderCounter(std::string& out, const char* name, const char* help, uint64_t value) {
+    char line[256];
+
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+             name, help, name, name, (unsigned long long)value);
+    out += line;
+}
+
+/* 输出一个直方图的所有行（不含HELP和TYPE）
+ * 细分的桶按上界归入不超过它的输出桶，因此每个输出桶的计数最多少算1/8个区间
+ *
+ * @param label 标签，例如 command="sgchat"
+ */
+void Metrics::renderHistogram(std::string& out, const char* name, const char* label,
+                              const std::vector<uint64_t>& counts, uint64_t sum) {
+    char line[256];
+    uint64_t cumulative = 0;
+    int bucket = 0;
+
+    for (size_t i = 0; i < sizeof(bucketBounds) / sizeof(bucketBounds[0]); i++) {
+        uint64_t boundNs = (uint64_t)(bucketBounds[i] * 1e9);
+
+        while (bucket < LatencyHistogram::kBuckets
+               && LatencyHistogram::upperBound(bucket) <= boundNs)
+            cumulative += counts[bucket++];
+        snprintf(line, sizeof(line), "%s_bucket{%s,le=\"%g\"} %llu\n",
+                 name, label, bucketBounds[i], (unsigned long long)cumulative);
+        out += line;
+    }
+    while (bucket < LatencyHistogram::kBuckets)
+        cumulative += counts[bucket++];
+
+    snprintf(line, sizeof(line), "%s_bucket{%s,le=\"+Inf\"} %llu\n%s_sum{%s} %.9f\n%s_count{%s} %llu\n",
+             name, label, (unsigned long long)cumulative,
+             name, label, sum / 1e9,
+             name, label, (unsigned long long)cumulative);
+    out += line;
+}
+
+/* 把所有线程的计数器相加后输出
+ *
+ * @param out 追加到的缓冲区
+ */
+void Metrics::render(std::string& out) {
+    std::vector<ThreadSlot*> slots;
+    char line[256];
+
+    pthread_mutex_lock(&slotsMutex_);
+    slots = slots_;
+    pthread_mutex_unlock(&slotsMutex_);
+
+    out += "# HELP chat_command_duration_seconds Time spent handling a request.\n"
+           "# TYPE chat_command_duration_seconds histogram\n";
+    for (int op = 0; op < METRIC_COMMANDS; op++) {
+        std::vector<uint64_t> counts(LatencyHistogram::kBuckets, 0);
+        uint64_t sum = 0, total = 0;
+
+        for (size_t i = 0; i < slots.size(); i++)
+            slots[i]->commands[op].addTo(counts, sum);
+        for (size_t i = 0; i < counts.size(); i++)
+            total += counts[i];
+        if (total == 0)
+            continue;
+
+        const char* command = opcodeName(op);
+        if (*command == '\0')
+            command = "unknown";
+        snprintf(line, sizeof(line), "command=\"%s\"", command);
+        renderHistogram(out, "chat_command_duration_seconds", line, counts, sum);
+    }
+
+    out += "# HELP chat_lock_acquisitions_total Acquisitions of a server mutex.\n"
+           "# TYPE chat_lock_acquisitions_total counter\n";
+    for (int l = 0; l < NUM_LOCKS; l++) {
+        uint64_t acquired = 0;
+        for (size_t i = 0; i < slots.size(); i++)
+            acquired += slots[i]->locks[l].acquired.load(std::memory_order_relaxed);
+        snprintf(line, sizeof(line), "chat_lock_acquisitions_total{lock=\"%s\"} %llu\n",
+                 lockNames[l], (unsigned long long)acquired);
+        out += line;
+    }
+
+    out += "# HELP chat_lock_contended_total Acquisitions that had to wait.\n"
+           "# TYPE chat_lock_contended_total counter\n";
+    for (int l = 0; l < NUM_LOCKS; l++) {
+        uint64_t contended = 0;
+        for (size_t i = 0; i < slots.size(); i++)
+            contended += slots[i]->locks[l].contended.load(std::memory_order_relaxed);
+        snprintf(line, sizeof(line), "chat_lock_contended_total{lock=\"%s\"} %llu\n",
+                 lockNames[l], (unsigned long long)contended);
+        out += line;
+    }
+
+    out += "# HELP chat_lock_wait_seconds Time spent waiting for a contended server mutex.\n"
+           "# TYPE chat_lock_wait_seconds histogram\n";
+    for (int l = 0; l < NUM_LOCKS; l++) {
+        std::vector<uint64_t> counts(LatencyHistogram::kBuckets, 0);
+        uint64_t sum = 0;
+
+        for (size_t i = 0; i < slots.size(); i++)
+            slots[i]->locks[l].wait.addTo(counts, sum);
+        snprintf(line, sizeof(line), "lock=\"%s\"", lockNames[l]);
+        renderHistogram(out, "chat_lock_wait_seconds", line, counts, sum);
+    }
+}
+
+} // namespace chat
@@ -0,0 +1,110 @@
+/* 服务器的运行指标
+ *
+ * 1.每种命令的处理次数和耗时分布（dispatch中统计）
+ * 2.usersMutex_/roomsMutex_/msgMutex_的加锁次数、争用次数和等待时间分布
+ * 3.所有连接的接收缓冲区和发送队列的字节数，由各线程在缓冲区变化时累计增减量，输出时不遍历连接
+ * 队列长度、在线用户数等其他瞬时值由Server在输出时读取，见Server::renderMetrics
+ *
+ * 每个线程第一次记录时分配自己的一组计数器，之后只有该线程写入，
+ * 写入是普通的relaxed读改写，不加锁也不使用原子的fetch_add;
+ * 输出时把所有线程的计数器相加，读到的是近似一致的快照
+ *
+ * 输出格式为Prometheus的文本格式（text/plain; version=0.0.4）
+ */
+
+#ifndef _CHATROOM_SRC_METRICS_H_
+#define _CHATROOM_SRC_METRICS_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace chat {
+
+#define METRIC_COMMANDS     32 // 按opcode统计，opcode不小于该值或未知的命令计入0号
+
+// 统计等待时间的互斥锁
+#define LOCK_USERS          0
+#define LOCK_ROOMS          1
+#define LOCK_MSG            2
+#define NUM_LOCKS           3
+
+// 由增减量累计的瞬时值
+#define GAUGE_INPUT_BYTES   0 // 接收缓冲区中未解析的字节数
+#define GAUGE_OUTPUT_BYTES  1 // 发送队列中未发送的字节数
+#define NUM_GAUGES          2
+
+/* 只有一个线程写入的耗时直方图，单位纳秒
+ * 对数分桶 : 每个2的幂区间等分为8个桶，相对误差不超过1/8，超过2^36纳秒的值计入最后一个桶
+ */
+class LatencyHistogram {
+public:
+    static const int kSubBits = 3;
+    static const int kSubBuckets = 1 << kSubBits;
+    static const int kMaxBits = 36;
+    static const int kBuckets = (kMaxBits - kSubBits + 1) * kSubBuckets;
+
+    LatencyHistogram();
+
+    void record(uint64_t ns);
+
+    // 把本直方图加到counts（长度kBuckets）和sum上
+    void addTo(std::vector<uint64_t>& counts, uint64_t& sum) const;
+
+    // 第bucket个桶的上界（包含），单位纳秒
+    static uint64_t upperBound(int bucket);
+
+private:
+    static int bucketOf(uint64_t ns);
+
+private:
+    std::atomic<uint64_t> counts_[kBuckets];
+    std::atomic<uint64_t> sum_;
+};
+
+class Metrics {
+public:
+    Metrics();
+    ~Metrics();
+
+    // 单调时钟，单位纳秒
+    static uint64_t now();
+
+    void recordCommand(int opcode, uint64_t ns);
+    void lock(pthread_mutex_t* mutex, int which);
+    void adjust(int which, int64_t delta);
+    int64_t gauge(int which);
+
+    void render(std::string& out);
+
+    static void renderGauge(std::string& out, const char* name, const char* help, double value);
+    static void renderCounter(std::string& out, const char* name, const char* help, uint64_t value);
+
+private:
+    typedef struct {
+        std::atomic<uint64_t> acquired;  // 加锁次数
+        std::atomic<uint64_t> contended; // 需要等待的次数
+        LatencyHistogram wait;           // 需要等待时的等待时间
+    } LockStats;
+
+    // 一个线程的所有计数器
+    typedef struct {
+        LatencyHistogram commands[METRIC_COMMANDS];
+        LockStats locks[NUM_LOCKS];
+        std::atomic<uint64_t> gauges[NUM_GAUGES]; // 本线程的增减量之和，按2^64取模
+    } ThreadSlot;
+
+    ThreadSlot* local();
+    static void renderHistogram(std::string& out, const char* name, const char* label,
+                                const std::vector<uint64_t>& counts, uint64_t sum);
+
+private:
+    pthread_mutex_t slotsMutex_;
+    std::vector<ThreadSlot*> slots_;
+};
+
+} // namespace chat
+
+#endif // _CHATROOM_SRC_METRICS_H_
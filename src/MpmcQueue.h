@@ -0,0 +1,261 @@
+/* 有界无锁多生产者多消费者队列
+ *
+ * 环形数组，每个槽位带一个序号（Dmitry Vyukov的算法）:
+ * 生产者和消费者各自用CAS推进写位置和读位置，槽位序号表示该槽位当前可写还是可读，
+ * 入队和出队都不加锁
+ *
+ * 队列为空时消费者先短暂自旋，再在futex上睡眠，每次入队最多唤醒一个睡眠的消费者，
+ * 没有消费者睡眠时不进入内核;队列满时生产者同样在另一个futex上睡眠
+ * 相比Queue每次push都pthread_cond_broadcast唤醒所有线程，避免了惊群
+ *
+ * createQueue按QUEUE_*创建BlockingQueue的某种实现，供线程池和服务器选择
+ */
+
+#ifndef _CHATROOM_SRC_MPMCQUEUE_H_
+#define _CHATROOM_SRC_MPMCQUEUE_H_
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+#include "Queue.h"
+
+namespace chat {
+
+// 阻塞队列的实现
+#define QUEUE_MUTEX         0 // Queue : 互斥锁 + 条件变量
+#define QUEUE_LOCKFREE      1 // MpmcQueue : 无锁环形数组 + futex
+#define QUEUE_WORK_STEALING 2 // WorkStealingQueue : 每个工作线程一个本地队列，只用于线程池
+
+#define MPMC_QUEUE_CAPACITY 65536 // 无锁队列的默认容量，必须是2的幂
+#define MPMC_SPIN_COUNT     256   // 睡眠之前自旋检查队列的次数
+
+#define CACHE_LINE_SIZE     64
+
+template <typename T>
+class MpmcQueue : public BlockingQueue<T> {
+public:
+    /* @param capacity 队列容量，向上取整为2的幂
+     */
+    explicit MpmcQueue(size_t capacity = MPMC_QUEUE_CAPACITY)
+        : mask_(roundUp(capacity) - 1),
+          cells_(mask_ + 1),
+          enqueuePos_(0),
+          dequeuePos_(0),
+          spinCount_(sysconf(_SC_NPROCESSORS_ONLN) > 1 ? MPMC_SPIN_COUNT : 0)
+    {
+        for (size_t i = 0; i <= mask_; i++)
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+        initWaiter(notEmpty_);
+        initWaiter(notFull_);
+    }
+
+    /* 入队，不阻塞
+     *
+     * @return true : 成功; false : 队列已满
+     */
+    bool tryPush(const T& w) {
+        uint64_t pos = enqueuePos_.load(std::memory_order_relaxed);
+        Cell* cell;
+
+        while (true) {
+            cell = &cells_[pos & mask_];
+            uint64_t seq = cell->seq.load(std::memory_order_acquire);
+            int64_t diff = (int64_t)seq - (int64_t)pos;
+
+            if (diff == 0) { // 槽位可写，抢占写位置
+                if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) { // 槽位上一轮的元素还没有被取走
+                return false;
+            } else { // 其他生产者已经抢占了该位置
+                pos = enqueuePos_.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->data = w;
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* 出队，不阻塞
+     *
+     * @return true : 成功; false : 队列为空
+     */
+    bool tryGet(T& w) {
+        uint64_t pos = dequeuePos_.load(std::memory_order_relaxed);
+        Cell* cell;
+
+        while (true) {
+            cell = &cells_[pos & mask_];
+            uint64_t seq = cell->seq.load(std::memory_order_acquire);
+            int64_t diff = (int64_t)seq - (int64_t)(pos + 1);
+
+            if (diff == 0) {
+                if (dequeuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeuePos_.load(std::memory_order_relaxed);
+            }
+        }
+
+        w = cell->data;
+        cell->data = T(); // 释放元素持有的资源，例如std::function捕获的对象
+        cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    // 入队，队列满时阻塞，之后唤醒一个等待的消费者
+    void push(const T& w) {
+        while (!tryPush(w))
+            wait(notFull_, false);
+        wake(notEmpty_);
+    }
+
+    // 出队，队列为空时阻塞，之后唤醒一个等待的生产者
+    void get(T& w) {
+        while (!tryGet(w))
+            wait(notEmpty_, true);
+        wake(notFull_);
+    }
+
+    // 已放入和已取出的位置之差，正在进行的push/get可能使其暂时偏大或偏小
+    size_t size() {
+        uint64_t enqueued = enqueuePos_.load(std::memory_order_relaxed);
+        uint64_t dequeued = dequeuePos_.load(std::memory_order_relaxed);
+        return enqueued > dequeued ? (size_t)(enqueued - dequeued) : 0;
+    }
+
+private:
+    typedef struct {
+        std::atomic<uint64_t> seq;
+        T data;
+    } Cell;
+
+    // 在同一个futex上等待的一组线程
+    typedef struct {
+        std::atomic<uint32_t> futex;    // 每次唤醒加一
+        std::atomic<int> sleepers;      // 登记等待、尚未被唤醒的线程数
+        std::atomic<int> signals;       // 已经发出、尚未被消耗的唤醒数
+    } Waiter;
+
+    static void initWaiter(Waiter& waiter) {
+        waiter.futex.store(0);
+        waiter.sleepers.store(0);
+        waiter.signals.store(0);
+    }
+
+    // 自旋等待时降低功耗，并让出流水线给同一核心上的另一个超线程
+    static void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+    static size_t roundUp(size_t n) {
+        size_t capacity = 2;
+        while (capacity < n)
+            capacity <<= 1;
+        return capacity;
+    }
+
+    /* 等待队列非空（或不满），返回后由调用者重试
+     * 多核时先自旋一小段时间，仍不满足条件才在futex上睡眠
+     *
+     * 登记为等待者之后再读出futex的值、检查队列 :
+     * wake先发布元素再检查等待者计数，两边之间都有全序的内存屏障，
+     * 因此要么这里能看到新元素，要么wake能看到等待者并改变futex的值，不会丢失唤醒
+     *
+     * @param waiter 等待队列非空（或不满）的一组线程
+     * @param forGet true : 等待队列非空; false : 等待队列不满
+     */
+    void wait(Waiter& waiter, bool forGet) {
+        for (int i = 0; i < spinCount_; i++) {
+            if (forGet ? !empty() : !full())
+                return;
+            cpuRelax();
+        }
+
+        waiter.sleepers.fetch_add(1, std::memory_order_seq_cst);
+        uint32_t value = waiter.futex.load(std::memory_order_seq_cst);
+        if (forGet ? empty() : full())
+            syscall(SYS_futex, (uint32_t*)&waiter.futex, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+
+        // 退出等待 : 消耗一个唤醒名额，没有名额说明自己没有被唤醒，注销登记
+        while (true) {
+            int n = waiter.signals.load(std::memory_order_seq_cst);
+            if (n > 0 && waiter.signals.compare_exchange_weak(n, n - 1))
+                break;
+            n = waiter.sleepers.load(std::memory_order_seq_cst);
+            if (n > 0 && waiter.sleepers.compare_exchange_weak(n, n - 1))
+                break;
+        }
+    }
+
+    /* 有等待者时唤醒其中一个，没有等待者时不做任何写操作
+     * 被唤醒的线程在唤醒时就不再计为等待者（转为一个唤醒名额），
+     * 在它真正运行之前，后续的入队不会再为它发起系统调用
+     */
+    void wake(Waiter& waiter) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int n = waiter.sleepers.load(std::memory_order_seq_cst);
+
+        while (n > 0) {
+            if (waiter.sleepers.compare_exchange_weak(n, n - 1)) {
+                waiter.signals.fetch_add(1, std::memory_order_seq_cst);
+                waiter.futex.fetch_add(1, std::memory_order_seq_cst);
+                syscall(SYS_futex, (uint32_t*)&waiter.futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+                break;
+            }
+        }
+    }
+
+    bool empty() const {
+        uint64_t pos = dequeuePos_.load(std::memory_order_seq_cst);
+        uint64_t seq = cells_[pos & mask_].seq.load(std::memory_order_seq_cst);
+        return (int64_t)seq - (int64_t)(pos + 1) < 0;
+    }
+
+    bool full() const {
+        uint64_t pos = enqueuePos_.load(std::memory_order_seq_cst);
+        uint64_t seq = cells_[pos & mask_].seq.load(std::memory_order_seq_cst);
+        return (int64_t)seq - (int64_t)pos < 0;
+    }
+
+private:
+    const size_t mask_;
+    std::vector<Cell> cells_;
+
+    // 读写位置分别放在不同的缓存行，避免生产者和消费者互相干扰
+    char pad0_[CACHE_LINE_SIZE];
+    std::atomic<uint64_t> enqueuePos_;
+    char pad1_[CACHE_LINE_SIZE];
+    std::atomic<uint64_t> dequeuePos_;
+    char pad2_[CACHE_LINE_SIZE];
+
+    Waiter notEmpty_; // 消费者等待队列非空
+    Waiter notFull_;  // 生产者等待队列不满
+    int spinCount_;   // 单核时自旋没有意义，为0
+};
+
+/* 创建指定实现的阻塞队列，由调用者delete
+ * QUEUE_WORK_STEALING需要知道工作线程，由线程池自己创建，这里返回Queue
+ *
+ * @param type QUEUE_*
+ * @return BlockingQueue<T>* 新建的队列
+ */
+template <typename T>
+BlockingQueue<T>* createQueue(int type) {
+    if (type == QUEUE_LOCKFREE)
+        return new MpmcQueue<T>();
+    return new Queue<T>();
+}
+
+} // namespace chat
+
+#endif // _CHATROOM_SRC_MPMCQUEUE_H_
@@ -0,0 +1,114 @@
+/* 名字 -> 下标的索引，用于UserRegistry和RoomRegistry
+ *
+ * 开放寻址（线性探测）的哈希表，每个槽只存名字哈希值的低32位和下标，
+ * 名字本身不另外保存，比较时直接读取items[下标].name;
+ * 插入不分配内存（扩容除外），启动时一次加载上百万个名字也很快;
+ * 查找接受StringView，可以直接用请求中指向接收缓冲区的字段查找，不需要先构造std::string
+ *
+ * 用户和房间注册后都不会删除，因此不支持删除
+ */
+
+#ifndef _CHATROOM_SRC_NAMEINDEX_H_
+#define _CHATROOM_SRC_NAMEINDEX_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "StringView.h"
+
+namespace chat {
+
+// T需要有std::string类型的成员name
+template <typename T>
+class NameIndex {
+public:
+    explicit NameIndex(const std::vector<T>* items) : items_(items), size_(0) {}
+
+    /* @return 名字对应的下标; -1 : 不存在
+     */
+    int find(StringView name) const {
+        if (slots_.empty())
+            return -1;
+
+        uint32_t hash = hashOf(name);
+        for (size_t i = hash & (slots_.size() - 1); ; i = (i + 1) & (slots_.size() - 1)) {
+            const Slot& slot = slots_[i];
+            if (slot.index == -1)
+                return -1;
+            if (slot.hash == hash && (*items_)[slot.index].name == name)
+                return slot.index;
+        }
+    }
+
+    /* 插入name -> index，查找和插入只计算一次哈希、探测一次
+     *
+     * @return -1 : 插入成功; 否则name已存在，返回其下标，不插入
+     */
+    int insert(StringView name, int index) {
+        if ((size_ + 1) * 2 > slots_.size())
+            rehash(slots_.empty() ? 16 : slots_.size() * 2);
+
+        uint32_t hash = hashOf(name);
+        size_t i = hash & (slots_.size() - 1);
+        for ( ; slots_[i].index != -1; i = (i + 1) & (slots_.size() - 1)) {
+            if (slots_[i].hash == hash && (*items_)[slots_[i].index].name == name)
+                return slots_[i].index;
+        }
+        slots_[i].hash = hash;
+        slots_[i].index = index;
+        size_++;
+        return -1;
+    }
+
+    void reserve(size_t n) {
+        size_t capacity = 16;
+        while (capacity < n * 2)
+            capacity *= 2;
+        if (capacity > slots_.size())
+            rehash(capacity);
+    }
+
+private:
+    typedef struct {
+        uint32_t hash;
+        int index; // -1表示空槽
+    } Slot;
+
+    static uint32_t hashOf(StringView name) {
+        return name.hash();
+    }
+
+    void place(uint32_t hash, int index) {
+        size_t i = hash & (slots_.size() - 1);
+        while (slots_[i].index != -1)
+            i = (i + 1) & (slots_.size() - 1);
+        slots_[i].hash = hash;
+        slots_[i].index = index;
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<Slot> old;
+        Slot empty = {0, -1};
+
+        old.swap(slots_);
+        slots_.assign(capacity, empty);
+        for (size_t i = 0; i < old.size(); i++) {
+            if (old[i].index != -1)
+                place(old[i].hash, old[i].index);
+        }
+    }
+
+    // 不允许拷贝，拷贝后items_仍指向原来的数组
+    NameIndex(const NameIndex&);
+    NameIndex& operator=(const NameIndex&);
+
+private:
+    const std::vector<T>* items_;
+    std::vector<Slot> slots_; // 大小是2的幂，最多一半被占用
+    size_t size_;
+};
+
+} // namespace chat
+
+#endif // _CHATROOM_SRC_NAMEINDEX_H_
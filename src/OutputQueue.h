@@ -0,0 +1,237 @@
+/* 连接的发送队列
+ *
+ * 待发送的数据由两种片段按顺序组成 :
+ * 1.拷贝进环形缓冲区的字节，用于回复等只发给一个连接的数据
+ * 2.共享的Payload，用于群聊等发给多个连接的数据，只保存指针和引用，不拷贝
+ * 片段列表记录两者的先后顺序，相邻的环形缓冲区片段合并为一个
+ *
+ * gather把队首的若干片段填入iovec数组，可以用一次sendmsg发送多个片段;
+ * take把队首的若干片段整个取走，用于io_uring等发送完成之前数据不能移动的异步发送;
+ * 放入时标记为可丢弃的数据块（推送帧）在接收方跟不上时可以由dropOldest丢弃
+ *
+ * 本类本身不加锁，由调用者（Connection::outputMutex）保证互斥
+ */
+
+#ifndef _CHATROOM_SRC_OUTPUTQUEUE_H_
+#define _CHATROOM_SRC_OUTPUTQUEUE_H_
+
+#include <sys/uio.h>
+#include <deque>
+
+#include "RingBuffer.h"
+#include "Payload.h"
+
+namespace chat {
+
+#define MAX_IOVECS 64 // 一次sendmsg最多发送的片段数
+
+class OutputQueue {
+public:
+    OutputQueue() : size_(0) {}
+
+    ~OutputQueue() { clear(); }
+
+    bool empty() const { return size_ == 0; }
+
+    // 待发送的总字节数
+    size_t size() const { return size_; }
+
+    // 拷贝数据放入队尾
+    void append(const char* data, size_t len) {
+        if (len == 0)
+            return;
+
+        ring_.append(data, len);
+        if (segments_.empty() || segments_.back().payload != NULL) {
+            Segment segment = {NULL, len, false};
+            segments_.push_back(segment);
+        } else {
+            segments_.back().len += len;
+        }
+        size_ += len;
+    }
+
+    /* 共享的数据块放入队尾，持有一个引用直到发送完
+     *
+     * @param payload 数据块
+     * @param droppable 是否可以由dropOldest丢弃，数据块本身必须是完整的帧
+     */
+    void append(Payload* payload, bool droppable = false) {
+        if (payload->size() == 0)
+            return;
+
+        Segment segment = {payload, payload->size(), droppable};
+        payload->acquire();
+        segments_.push_back(segment);
+        size_ += payload->size();
+    }
+
+    /* 队首的一段连续数据
+     *
+     * @param data 指向待发送数据的开头
+     * @return 连续可发送的字节数，队列为空时为0
+     */
+    size_t peek(const char** data) const {
+        if (segments_.empty())
+            return 0;
+
+        const Segment& front = segments_.front();
+        if (front.payload != NULL) {
+            *data = front.payload->data() + front.payload->size() - front.len;
+            return front.len;
+        }
+        return std::min(ring_.peek(data), front.len);
+    }
+
+    /* 按顺序把待发送的数据填入iovec数组，不拷贝数据
+     * 环形缓冲区中回绕的片段占两个iovec
+     *
+     * @param iov iovec数组
+     * @param maxIov 数组长度
+     * @return 填入的iovec个数，队列为空时为0
+     */
+    int gather(struct iovec* iov, int maxIov) const {
+        size_t ringOffset = 0;
+        int n = 0;
+
+        for (size_t i = 0; i < segments_.size() && n < maxIov; i++) {
+            const Segment& segment = segments_[i];
+
+            if (segment.payload != NULL) {
+                iov[n].iov_base = (void*)(segment.payload->data()
+                                          + segment.payload->size() - segment.len);
+                iov[n].iov_len = segment.len;
+                n++;
+                continue;
+            }
+
+            size_t remain = segment.len;
+            while (remain > 0 && n < maxIov) {
+                const char* p;
+                size_t len = std::min(ring_.peekAt(ringOffset, &p), remain);
+
+                iov[n].iov_base = (void*)p;
+                iov[n].iov_len = len;
+                n++;
+                ringOffset += len;
+                remain -= len;
+            }
+        }
+
+        return n;
+    }
+
+    // 移除队首len个字节，可以跨越多个片段，len不超过size()
+    void consume(size_t len) {
+        while (len > 0) {
+            Segment& front = segments_.front();
+            size_t n = std::min(len, front.len);
+
+            if (front.payload == NULL)
+                ring_.consume(n);
+            front.len -= n;
+            size_ -= n;
+            len -= n;
+            if (front.len == 0) {
+                if (front.payload != NULL)
+                    front.payload->release();
+                segments_.pop_front();
+            }
+        }
+    }
+
+    /* 从队首取走最多max个片段，每个片段作为一个数据块交给调用者，用完后由调用者release
+     * 共享数据块直接转移引用;环形缓冲区中的片段（以及已经发送了一部分的数据块）
+     * 拷贝到新的数据块，之后环形缓冲区扩容或复用都不影响取走的数据
+     *
+     * @param out 存放取走的数据块
+     * @param max out的长度
+     * @return 取走的数据块个数
+     */
+    int take(Payload** out, int max) {
+        int n = 0;
+
+        while (!segments_.empty() && n < max) {
+            Segment& front = segments_.front();
+
+            if (front.payload != NULL && front.len == front.payload->size()) {
+                out[n] = front.payload;
+            } else if (front.payload != NULL) {
+                out[n] = Payload::create(front.payload->data() + front.payload->size() - front.len,
+                                         front.len);
+                front.payload->release();
+            } else {
+                size_t copied = 0;
+
+                out[n] = Payload::create(front.len);
+                while (copied < front.len) {
+                    const char* p;
+                    size_t len = std::min(ring_.peekAt(copied, &p), front.len - copied);
+                    memcpy(out[n]->data() + copied, p, len);
+                    copied += len;
+                }
+                ring_.consume(front.len);
+            }
+
+            size_ -= front.len;
+            segments_.pop_front();
+            n++;
+        }
+
+        return n;
+    }
+
+    /* 从队首开始丢弃可丢弃的数据块，直到总字节数不超过target或没有可丢弃的数据块
+     * 已经发送了一部分的数据块不丢弃，丢弃后相邻的环形缓冲区片段重新合并
+     *
+     * @param target 丢弃到这么多字节为止
+     * @return 丢弃的数据块个数
+     */
+    size_t dropOldest(size_t target) {
+        std::deque<Segment> kept;
+        size_t dropped = 0;
+
+        for (size_t i = 0; i < segments_.size(); i++) {
+            const Segment& segment = segments_[i];
+
+            if (size_ > target && segment.droppable && segment.len == segment.payload->size()) {
+                segment.payload->release();
+                size_ -= segment.len;
+                dropped++;
+            } else if (segment.payload == NULL && !kept.empty() && kept.back().payload == NULL) {
+                kept.back().len += segment.len;
+            } else {
+                kept.push_back(segment);
+            }
+        }
+
+        if (dropped > 0)
+            segments_.swap(kept);
+        return dropped;
+    }
+
+    void clear() {
+        for (size_t i = 0; i < segments_.size(); i++) {
+            if (segments_[i].payload != NULL)
+                segments_[i].payload->release();
+        }
+        segments_.clear();
+        ring_.clear();
+        size_ = 0;
+    }
+
+private:
+    typedef struct {
+        Payload* payload; // NULL表示环形缓冲区中的数据
+        size_t len;       // 该片段剩余未发送的字节数
+        bool droppable;   // 可以由dropOldest丢弃
+    } Segment;
+
+    RingBuffer ring_;
+    std::deque<Segment> segments_;
+    size_t size_;
+};
+
+} // namespace chat
+
+#endif // _CHATROOM_SRC_OUTPUTQUEUE_H_
@@ -0,0 +1,70 @@
+/* 引用计数的不可变数据块
+ *
+ * 群聊时消息只编码一次，放入一个Payload，
+ * 每个接收方的发送队列（OutputQueue）或收件箱（InboxPool）只保存指针并持有一个引用，
+ * 发送完或取走后释放引用，最后一个引用释放时回收内存
+ *
+ * 头部和数据在同一块内存中，创建时只分配一次
+ * 数据只在create之后、交给其他线程之前写入，之后只读，因此不需要加锁
+ */
+
+#ifndef _CHATROOM_SRC_PAYLOAD_H_
+#define _CHATROOM_SRC_PAYLOAD_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <atomic>
+
+namespace chat {
+
+class Payload {
+public:
+    /* 创建一个长度为len的数据块，引用计数为1
+     *
+     * @param len 数据长度
+     * @return Payload* 新建的数据块，数据未初始化
+     */
+    static Payload* create(size_t len) {
+        void* mem = malloc(sizeof(Payload) + len);
+        return new (mem) Payload(len);
+    }
+
+    /* 创建一个数据块并拷贝数据，引用计数为1
+     */
+    static Payload* create(const void* data, size_t len) {
+        Payload* payload = create(len);
+        memcpy(payload->data(), data, len);
+        return payload;
+    }
+
+    void acquire() {
+        refs_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release() {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            this->~Payload();
+            free(this);
+        }
+    }
+
+    char* data() { return (char*)(this + 1); }
+    const char* data() const { return (const char*)(this + 1); }
+    size_t size() const { return size_; }
+
+private:
+    explicit Payload(size_t len) : refs_(1), size_(len) {}
+    ~Payload() {}
+
+    Payload(const Payload&);
+    Payload& operator=(const Payload&);
+
+private:
+    std::atomic<int> refs_;
+    size_t size_;
+};
+
+} // namespace chat
+
+#endif // _CHATROOM_SRC_PAYLOAD_H_
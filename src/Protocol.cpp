@@ -0,0 +1,253 @@
+#include <arpa/inet.h>
+#include <string.h>
+
+#include "Protocol.h"
+#include "Common.h"
+
+namespace chat {
+
+// 旧协议中的命令名与opcode的对应关系
+static const struct {
+    const char* command;
+    int opcode;
+} commandTable[] = {
+    {"signup", OP_SIGNUP},
+    {"signin", OP_SIGNIN},
+    {"lsuser", OP_LSUSER},
+    {"sgchat", OP_SGCHAT},
+    {"gpchat", OP_GPCHAT},
+    {"mkroom", OP_MKROOM},
+    {"lsroom", OP_LSROOM},
+    {"cdroom", OP_CDROOM},
+    {"qtroom", OP_QTROOM},
+    {"getmsg", OP_GETMSG},
+};
+
+// 只用于紧凑协议的请求，旧协议中没有对应的命令名
+static const struct {
+    const char* name;
+    int opcode;
+} compactTable[] = {
+    {"push", OP_PUSH},
+    {"lsuserpage", OP_LSUSER_PAGE},
+    {"lsroompage", OP_LSROOM_PAGE},
+    {"lsuserdelta", OP_LSUSER_DELTA},
+    {"lsroomdelta", OP_LSROOM_DELTA},
+    {"gateway", OP_GATEWAY},
+    {"session", OP_SESSION},
+    {"sessionclose", OP_SESSION_CLOSE},
+    {"pong", OP_PONG},
+    {"sghistory", OP_SGHISTORY},
+    {"gphistory", OP_GPHISTORY},
+};
+
+/* 帧编码器的构造函数
+ * 预留长度字段并写入opcode，长度在finish中回填
+ *
+ * @param out 帧追加到的缓冲区
+ * @param opcode 帧的opcode
+ */
+FrameWriter::FrameWriter(std::vector<char>& out, int opcode)
+    : out_(out), start_(out.size())
+{
+    out_.resize(start_ + FRAME_HEADER_SIZE);
+    out_.push_back((char)opcode);
+}
+
+void FrameWriter::putU32(uint32_t value) {
+    uint32_t netValue = htonl(value);
+    const char* p = (const char*)&netValue;
+
+    out_.insert(out_.end(), p, p + sizeof(netValue));
+}
+
+void FrameWriter::putU64(uint64_t value) {
+    putU32((uint32_t)(value >> 32));
+    putU32((uint32_t)value);
+}
+
+/* 写入一个字段
+ *
+ * @param data 字段内容
+ * @param len 字段长度，调用者保证不超过65535
+ */
+void FrameWriter::putField(const char* data, size_t len) {
+    uint16_t netLen = htons((uint16_t)len);
+    const char* p = (const char*)&netLen;
+
+    out_.insert(out_.end(), p, p + sizeof(netLen));
+    out_.insert(out_.end(), data, data + len);
+}
+
+void FrameWriter::putField(const std::string& field) {
+    putField(field.data(), field.size());
+}
+
+// 回填长度字段
+void FrameWriter::finish() {
+    uint32_t netLen = htonl((uint32_t)(out_.size() - start_ - FRAME_HEADER_SIZE));
+
+    memcpy(&out_[start_], &netLen, sizeof(netLen));
+}
+
+/* 帧解码器的构造函数
+ *
+ * @param frame 完整的帧，包括长度字段
+ * @param len 帧的总长度，由frameLength得到
+ */
+FrameReader::FrameReader(const char* frame, size_t len)
+    : data_(frame), len_(len), pos_(FRAME_HEADER_SIZE + 1)
+{
+    opcode_ = (unsigned char)frame[FRAME_HEADER_SIZE];
+}
+
+int FrameReader::opcode() {
+    return opcode_;
+}
+
+bool FrameReader::getU32(uint32_t& value) {
+    if (len_ - pos_ < sizeof(value))
+        return false;
+
+    memcpy(&value, data_ + pos_, sizeof(value));
+    value = ntohl(value);
+    pos_ += sizeof(value);
+    return true;
+}
+
+bool FrameReader::getU64(uint64_t& value) {
+    uint32_t high, low;
+
+    if (len_ - pos_ < sizeof(value) || !getU32(high) || !getU32(low))
+        return false;
+
+    value = (uint64_t)high << 32 | low;
+    return true;
+}
+
+/* 读出一个字段
+ *
+ * @param field 存放字段内容
+ * @param maxLen 字段允许的最大长度
+ * @return true : 成功; false : 帧已结束或字段非法
+ */
+bool FrameReader::getField(std::string& field, size_t maxLen) {
+    StringView view;
+
+    if (!getField(view, maxLen))
+        return false;
+    field.assign(view.data(), view.size());
+    return true;
+}
+
+/* 读出一个字段，不拷贝
+ *
+ * @param field 指向帧的缓冲区中的字段内容，只在帧的缓冲区不变时有效
+ * @param maxLen 字段允许的最大长度
+ * @return true : 成功; false : 帧已结束或字段非法
+ */
+bool FrameReader::getField(StringView& field, size_t maxLen) {
+    uint16_t fieldLen;
+
+    if (len_ - pos_ < sizeof(fieldLen))
+        return false;
+
+    memcpy(&fieldLen, data_ + pos_, sizeof(fieldLen));
+    fieldLen = ntohs(fieldLen);
+    if (fieldLen > maxLen || len_ - pos_ - sizeof(fieldLen) < fieldLen)
+        return false;
+
+    pos_ += sizeof(fieldLen);
+    field = StringView(data_ + pos_, fieldLen);
+    pos_ += fieldLen;
+    return true;
+}
+
+bool FrameReader::atEnd() {
+    return pos_ == len_;
+}
+
+/* 读出帧中剩余的所有字节
+ *
+ * @param data 指向剩余字节的开头，在帧的缓冲区中
+ * @param len 剩余的字节数
+ */
+void FrameReader::getRest(const char*& data, size_t& len) {
+    data = data_ + pos_;
+    len = len_ - pos_;
+    pos_ = len_;
+}
+
+/* 写出网关会话帧的头部 : [长度][OP_SESSION][会话号]，之后紧跟innerLen字节的内层帧
+ *
+ * @param out 至少SESSION_HEADER_SIZE字节
+ * @param sid 会话号
+ * @param innerLen 内层帧的总长度
+ */
+void putSessionHeader(char* out, uint32_t sid, size_t innerLen) {
+    uint32_t netLen = htonl((uint32_t)(SESSION_HEADER_SIZE - FRAME_HEADER_SIZE + innerLen));
+    uint32_t netSid = htonl(sid);
+
+    memcpy(out, &netLen, sizeof(netLen));
+    out[FRAME_HEADER_SIZE] = (char)OP_SESSION;
+    memcpy(out + FRAME_HEADER_SIZE + 1, &netSid, sizeof(netSid));
+}
+
+/* 判断缓冲区开头是否是一个完整的帧
+ *
+ * @param data 缓冲区
+ * @param len 缓冲区中的字节数
+ * @return 完整帧的总长度; 0 : 帧还未接收完整; -1 : 帧长度非法
+ */
+ssize_t frameLength(const char* data, size_t len) {
+    uint32_t bodyLen;
+
+    if (len < FRAME_HEADER_SIZE)
+        return 0;
+
+    memcpy(&bodyLen, data, sizeof(bodyLen));
+    bodyLen = ntohl(bodyLen);
+    if (bodyLen == 0 || bodyLen > MAX_FRAME_SIZE)
+        return -1;
+
+    if (len < FRAME_HEADER_SIZE + bodyLen)
+        return 0;
+
+    return FRAME_HEADER_SIZE + bodyLen;
+}
+
+/* 旧协议的命令名转换为opcode
+ *
+ * @param command 命令名，可以不以'\0'结尾
+ * @return opcode; -1 : 未知命令
+ */
+int commandToOpcode(StringView command) {
+    for (size_t i = 0; i < sizeof(commandTable) / sizeof(commandTable[0]); i++) {
+        if (command == commandTable[i].command)
+            return commandTable[i].opcode;
+    }
+    return -1;
+}
+
+const char* opcodeToCommand(int opcode) {
+    for (size_t i = 0; i < sizeof(commandTable) / sizeof(commandTable[0]); i++) {
+        if (opcode == commandTable[i].opcode)
+            return commandTable[i].command;
+    }
+    return "";
+}
+
+/* 请求的名字，用于输出运行指标
+ *
+ * @param opcode 请求的opcode
+ * @return 旧协议的命令名或紧凑协议专有请求的名字; "" : 未知opcode
+ */
+const char* opcodeName(int opcode) {
+    for (size_t i = 0; i < sizeof(compactTable) / sizeof(compactTable[0]); i++) {
+        if (opcode == compactTable[i].opcode)
+            return compactTable[i].name;
+    }
+    return opcodeToCommand(opcode);
+}
+
+} // namespace chat
@@ -0,0 +1,63 @@
+/* 紧凑协议（PROTOCOL_COMPACT）的编码和解码
+ *
+ * 服务器和客户端共用，帧格式见Common.h
+ */
+
+#ifndef _CHATROOM_SRC_PROTOCOL_H_
+#define _CHATROOM_SRC_PROTOCOL_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "StringView.h"
+
+namespace chat {
+
+// 往out末尾追加一个帧
+class FrameWriter {
+public:
+    FrameWriter(std::vector<char>& out, int opcode);
+
+    void putU32(uint32_t value);
+    void putU64(uint64_t value);
+    void putField(const char* data, size_t len);
+    void putField(const std::string& field);
+    void finish();
+
+private:
+    std::vector<char>& out_;
+    size_t start_;
+};
+
+// 解析一个完整的帧
+class FrameReader {
+public:
+    FrameReader(const char* frame, size_t len);
+
+    int opcode();
+    bool getU32(uint32_t& value);
+    bool getU64(uint64_t& value);
+    bool getField(std::string& field, size_t maxLen);
+    bool getField(StringView& field, size_t maxLen);
+    bool atEnd();
+    void getRest(const char*& data, size_t& len);
+
+private:
+    const char* data_;
+    size_t len_;
+    size_t pos_;
+    int opcode_;
+};
+
+ssize_t frameLength(const char* data, size_t len);
+void putSessionHeader(char* out, uint32_t sid, size_t innerLen);
+
+int commandToOpcode(StringView command);
+const char* opcodeToCommand(int opcode);
+const char* opcodeName(int opcode);
+
+} // namespace chat
+
+#endif // _CHATROOM_SRC_PROTOCOL_H_
@@ -2,6 +2,9 @@
  *
  * 1.用作线程池的工作队列
  * 2.用作epoll_wait返回时，存放每个活跃的描述符对应的struct epoll_event
+ *
+ * BlockingQueue是阻塞队列的公共接口，线程池和服务器只通过它访问队列，
+ * 实现有两种 : 本文件的Queue（互斥锁 + 条件变量），以及MpmcQueue.h中的无锁队列
  */
 
 #ifndef _CHATROOM_SRC_QUEUE_H_
@@ -13,7 +16,22 @@
 namespace chat {
 
 template <typename T>
-class Queue {
+class BlockingQueue {
+public:
+    virtual ~BlockingQueue() {}
+
+    // 放入一个元素
+    virtual void push(const T& w) = 0;
+
+    // 取出一个元素，队列为空时阻塞
+    virtual void get(T& w) = 0;
+
+    // 当前的元素个数，只用于统计，并发修改时是近似值
+    virtual size_t size() = 0;
+};
+
+template <typename T>
+class Queue : public BlockingQueue<T> {
 public:
     Queue() {
         pthread_mutex_init(&mutex_, NULL);         
@@ -48,6 +66,15 @@ public:
         pthread_mutex_unlock(&mutex_);
     }
 
+    size_t size() {
+        size_t n;
+
+        pthread_mutex_lock(&mutex_);
+        n = queue_.size();
+        pthread_mutex_unlock(&mutex_);
+        return n;
+    }
+
 private:
     pthread_mutex_t mutex_;
     pthread_cond_t notEmpty_;
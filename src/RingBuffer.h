@@ -0,0 +1,150 @@
+/* 可增长的环形缓冲区
+ *
+ * 每个连接拥有自己的接收和发送缓冲区（见Connection.h），
+ * 本类本身不加锁，由调用者保证同一时刻只有一个线程访问
+ *
+ * 1.peek/consume : 直接读取缓冲区中的数据，不拷贝
+ * 2.prepareWrite/commitWrite : 直接向缓冲区的空闲空间写入（如recv），不经过临时数组
+ */
+
+#ifndef _CHATROOM_SRC_RINGBUFFER_H_
+#define _CHATROOM_SRC_RINGBUFFER_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+
+namespace chat {
+
+class RingBuffer {
+public:
+    // initialSize必须是2的幂
+    explicit RingBuffer(size_t initialSize = 4096)
+        : buf_((char*)malloc(initialSize)), capacity_(initialSize),
+          readIndex_(0), writeIndex_(0) {}
+
+    ~RingBuffer() { free(buf_); }
+
+    size_t size() const { return writeIndex_ - readIndex_; }
+
+    bool empty() const { return writeIndex_ == readIndex_; }
+
+    size_t capacity() const { return capacity_; }
+
+    void clear() { readIndex_ = writeIndex_ = 0; }
+
+    void append(const char* data, size_t len) {
+        while (len > 0) {
+            char* space;
+            size_t n = std::min(prepareWrite(&space, len), len);
+
+            memcpy(space, data, n);
+            commitWrite(n);
+            data += n;
+            len -= n;
+        }
+    }
+
+    /* 第一段连续可读区域
+     *
+     * @param data 指向可读数据的开头
+     * @return 连续可读的字节数，数据发生回绕时小于size()
+     */
+    size_t peek(const char** data) const {
+        size_t offset = readIndex_ & (capacity_ - 1);
+
+        *data = buf_ + offset;
+        return std::min(size(), capacity_ - offset);
+    }
+
+    /* 从第offset个字节开始的一段连续可读区域
+     *
+     * @param offset 相对于开头的偏移，调用者保证不超过size()
+     * @param data 指向该位置的数据
+     * @return 从该位置起连续可读的字节数
+     */
+    size_t peekAt(size_t offset, const char** data) const {
+        size_t pos = (readIndex_ + offset) & (capacity_ - 1);
+
+        *data = buf_ + pos;
+        return std::min(size() - offset, capacity_ - pos);
+    }
+
+    /* 保证开头的len个字节在内存中连续，只在数据回绕时移动数据
+     *
+     * @param len 需要连续的字节数，调用者保证不超过size()
+     * @return 指向开头的len个字节
+     */
+    const char* linearize(size_t len) {
+        size_t offset = readIndex_ & (capacity_ - 1);
+
+        if (offset + len > capacity_) {
+            relayout(capacity_);
+            offset = 0;
+        }
+        return buf_ + offset;
+    }
+
+    void consume(size_t len) {
+        readIndex_ += std::min(len, size());
+        if (readIndex_ == writeIndex_)
+            readIndex_ = writeIndex_ = 0;
+    }
+
+    /* 得到一段连续的空闲空间，空闲空间不足minLen时先扩容
+     *
+     * @param data 指向空闲空间的开头
+     * @param minLen 至少需要的空闲字节数
+     * @return 连续的空闲字节数
+     */
+    size_t prepareWrite(char** data, size_t minLen) {
+        if (capacity_ - size() < minLen)
+            grow(size() + minLen);
+
+        size_t offset = writeIndex_ & (capacity_ - 1);
+        *data = buf_ + offset;
+        return std::min(capacity_ - size(), capacity_ - offset);
+    }
+
+    void commitWrite(size_t len) { writeIndex_ += len; }
+
+private:
+    void grow(size_t minCapacity) {
+        size_t newCapacity = capacity_;
+
+        while (newCapacity < minCapacity)
+            newCapacity *= 2;
+
+        relayout(newCapacity);
+    }
+
+    // 把数据按顺序拷贝到容量为newCapacity的新缓冲区的开头
+    void relayout(size_t newCapacity) {
+        size_t len = size();
+        char* newBuf = (char*)malloc(newCapacity);
+        size_t offset = readIndex_ & (capacity_ - 1);
+        size_t first = std::min(len, capacity_ - offset);
+        memcpy(newBuf, buf_ + offset, first);
+        memcpy(newBuf + first, buf_, len - first);
+
+        free(buf_);
+        buf_ = newBuf;
+        capacity_ = newCapacity;
+        readIndex_ = 0;
+        writeIndex_ = len;
+    }
+
+private:
+    RingBuffer(const RingBuffer&);
+    RingBuffer& operator=(const RingBuffer&);
+
+    char* buf_;
+    size_t capacity_;
+    uint64_t readIndex_;  // 只增不减，取模capacity_后为实际位置
+    uint64_t writeIndex_;
+};
+
+} // namespace chat
+
+#endif // _CHATROOM_SRC_RINGBUFFER_H_
@@ -0,0 +1,89 @@
+#include <algorithm>
+
+#include "RoomRegistry.h"
+
+namespace chat {
+
+/* 创建房间
+ *
+ * @param name 房间名
+ * @return 新房间的下标; -1 : 房间名已存在
+ */
+int RoomRegistry::add(StringView name) {
+    if (byName_.insert(name, rooms_.size()) != -1)
+        return -1;
+
+    rooms_.push_back(Room());
+    rooms_.back().name.assign(name.data(), name.size());
+    return rooms_.size() - 1;
+}
+
+// 预先分配n个房间的空间
+void RoomRegistry::reserve(size_t n) {
+    rooms_.reserve(n);
+    byName_.reserve(n);
+}
+
+/* 按房间名查找
+ *
+ * @param name 房间名
+ * @return 房间的下标; -1 : 房间不存在
+ */
+int RoomRegistry::findByName(StringView name) const {
+    return byName_.find(name);
+}
+
+/* 用户加入房间
+ *
+ * @param room 房间的下标
+ * @param user 用户的下标
+ * @param userRooms 该用户加入的房间列表，同时更新
+ * @param online 该用户当前是否在线
+ * @return true : 加入成功; false : 已经是成员
+ */
+bool RoomRegistry::join(int room, int user, std::vector<int>& userRooms, bool online) {
+    if (!rooms_[room].members.insert(user))
+        return false;
+
+    userRooms.push_back(room);
+    if (online)
+        rooms_[room].online.insert(user);
+    return true;
+}
+
+/* 用户退出房间
+ *
+ * @param room 房间的下标
+ * @param user 用户的下标
+ * @param userRooms 该用户加入的房间列表，同时更新
+ * @return true : 退出成功; false : 不是该房间的成员
+ */
+bool RoomRegistry::leave(int room, int user, std::vector<int>& userRooms) {
+    if (!rooms_[room].members.erase(user))
+        return false;
+
+    rooms_[room].online.erase(user);
+    std::vector<int>::iterator iter = std::find(userRooms.begin(), userRooms.end(), room);
+    if (iter != userRooms.end()) {
+        *iter = userRooms.back();
+        userRooms.pop_back();
+    }
+    return true;
+}
+
+/* 用户登录或下线时，更新其加入的每个房间的在线成员
+ *
+ * @param user 用户的下标
+ * @param userRooms 该用户加入的房间列表
+ * @param online true : 登录; false : 下线
+ */
+void RoomRegistry::setOnline(int user, const std::vector<int>& userRooms, bool online) {
+    for (size_t i = 0; i < userRooms.size(); i++) {
+        if (online)
+            rooms_[userRooms[i]].online.insert(user);
+        else
+            rooms_[userRooms[i]].online.erase(user);
+    }
+}
+
+} // namespace chat
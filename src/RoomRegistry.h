@@ -0,0 +1,140 @@
+/* 房间表
+ *
+ * 房间和用户都用整数下标标识（用户下标见UserRegistry），
+ * 每个房间保存两个成员集合 :
+ * 1.members : 所有成员，加入和退出房间时修改
+ * 2.online : 其中当前在线的成员，用户登录和下线时修改，群聊只遍历这个集合
+ * 用户一侧保存自己加入的房间（User::rooms），登录和下线时只需更新这些房间
+ *
+ * 本类不加锁，由调用者（Server::roomsMutex_）保证互斥
+ */
+
+#ifndef _CHATROOM_SRC_ROOMREGISTRY_H_
+#define _CHATROOM_SRC_ROOMREGISTRY_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "NameIndex.h"
+
+namespace chat {
+
+// 整数集合，插入、删除、查找都是O(1)，元素连续存放便于遍历
+// 元素到位置的索引是开放寻址（线性探测）的哈希表，只存元素在ids_中的位置，插入不分配内存（扩容除外）
+class IdSet {
+public:
+    bool insert(int id) {
+        if ((ids_.size() + 1) * 2 > table_.size())
+            rehash(table_.empty() ? 8 : table_.size() * 2);
+
+        size_t slot = slotOf(id);
+        if (table_[slot] != -1)
+            return false;
+        table_[slot] = ids_.size();
+        ids_.push_back(id);
+        return true;
+    }
+
+    bool erase(int id) {
+        if (table_.empty())
+            return false;
+
+        size_t slot = slotOf(id);
+        int pos = table_[slot];
+        if (pos == -1)
+            return false;
+
+        // 用最后一个元素填补被删除元素的位置
+        int last = ids_.back();
+        if (last != id) {
+            table_[slotOf(last)] = pos;
+            ids_[pos] = last;
+        }
+        ids_.pop_back();
+        removeSlot(slot);
+        return true;
+    }
+
+    bool contains(int id) const { return !table_.empty() && table_[slotOf(id)] != -1; }
+
+    // 预先分配n个元素的空间，之后插入n个元素不再扩容
+    void reserve(size_t n) {
+        size_t capacity = 8;
+        while (capacity < n * 2)
+            capacity *= 2;
+        ids_.reserve(n);
+        if (capacity > table_.size())
+            rehash(capacity);
+    }
+
+    size_t size() const { return ids_.size(); }
+
+    const std::vector<int>& ids() const { return ids_; }
+
+private:
+    size_t home(int id) const { return ((uint32_t)id * 2654435769u) & (table_.size() - 1); }
+
+    // id所在的槽，不存在时是探测到的第一个空槽
+    size_t slotOf(int id) const {
+        size_t i = home(id);
+        while (table_[i] != -1 && ids_[table_[i]] != id)
+            i = (i + 1) & (table_.size() - 1);
+        return i;
+    }
+
+    // 清空一个槽，把之后探测链上的元素往前移，保证查找不会提前遇到空槽
+    void removeSlot(size_t hole) {
+        size_t mask = table_.size() - 1;
+
+        for (size_t i = (hole + 1) & mask; table_[i] != -1; i = (i + 1) & mask) {
+            size_t want = home(ids_[table_[i]]);
+            // want不在(hole, i]之间时，该元素可以移到hole
+            if (((i - want) & mask) >= ((i - hole) & mask)) {
+                table_[hole] = table_[i];
+                hole = i;
+            }
+        }
+        table_[hole] = -1;
+    }
+
+    void rehash(size_t capacity) {
+        table_.assign(capacity, -1);
+        for (size_t pos = 0; pos < ids_.size(); pos++)
+            table_[slotOf(ids_[pos])] = pos;
+    }
+
+private:
+    std::vector<int> ids_;
+    std::vector<int> table_; // 元素在ids_中的位置，-1表示空槽;大小是2的幂，最多一半被占用
+};
+
+typedef struct {
+    std::string name;
+    IdSet members; // 所有成员的用户下标
+    IdSet online;  // 在线成员的用户下标
+} Room;
+
+class RoomRegistry {
+public:
+    RoomRegistry() : byName_(&rooms_) {}
+
+    int add(StringView name);
+    void reserve(size_t n);
+    int findByName(StringView name) const;
+
+    bool join(int room, int user, std::vector<int>& userRooms, bool online);
+    bool leave(int room, int user, std::vector<int>& userRooms);
+    void setOnline(int user, const std::vector<int>& userRooms, bool online);
+
+    Room& operator[](int index) { return rooms_[index]; }
+    size_t size() const { return rooms_.size(); }
+
+private:
+    std::vector<Room> rooms_;
+    NameIndex<Room> byName_;
+};
+
+} // namespace chat
+
+#endif // _CHATROOM_SRC_ROOMREGISTRY_H_
@@ -3,586 +3,2282 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
 #include <sstream>
+#include <algorithm>
+#include <deque>
 
 #include "Server.h"
 #include "Common.h"
+#include "Protocol.h"
 
 namespace chat {
 
-Server::Server() : threadPool_(NUM_THREADS) {
-    threadPool_.run();
+/* 服务器的默认配置
+ *
+ * @return ServerOptions 默认配置
+ */
+ServerOptions defaultServerOptions() {
+    ServerOptions options;
+
+    options.mode = MODE_THREAD_POOL;
+    options.backend = IO_BACKEND_EPOLL;
+    options.queueType = QUEUE_MUTEX;
+    options.inboxDepth = INBOX_DEPTH;
+    options.inboxPool = INBOX_POOL_SIZE;
+    options.inboxPolicy = INBOX_DROP_OLDEST;
+    options.adminPort = ADMIN_PORT;
+    options.logSyncMs = LOG_SYNC_INTERVAL_MS;
+    options.reusePort = false;
+    options.idleTimeoutMs = 0;
+    options.pingIntervalMs = 0;
+    options.frameTimeoutMs = 0;
+    options.messageTtlMs = 0;
+    options.outputHighWater = OUTPUT_HIGH_WATER;
+    options.outputLowWater = OUTPUT_LOW_WATER;
+    options.slowPolicy = SLOW_DROP_OLDEST;
+    return options;
+}
+
+/* 把字段拷贝进定长的字符数组，超出的部分截断，保证以'\0'结尾
+ *
+ * @param out 字符数组
+ * @param size 数组长度
+ * @param field 字段内容
+ */
+static void copyField(char* out, size_t size, StringView field) {
+    size_t len = std::min(field.size(), size - 1);
+
+    memcpy(out, field.data(), len);
+    out[len] = '\0';
+}
+
+/* 定长字符数组中的字符串，最多size - 1个字符，不要求以'\0'结尾
+ */
+static StringView fieldOf(const char* field, size_t size) {
+    return StringView(field, strnlen(field, size - 1));
+}
+
+/* 创建一条消息，数据是一个Message，多个接收方共享
+ *
+ * @param command Message的command字段
+ * @param dst Message的dst字段
+ * @param content 聊天内容
+ * @return Payload* 引用计数为1的数据块，用完后由调用者release
+ */
+static Payload* makeMessage(StringView command, StringView dst, StringView content) {
+    Payload* payload = Payload::create(sizeof(Message));
+    Message* msg = (Message*)payload->data();
+
+    memset(msg, 0, sizeof(Message));
+    copyField(msg->command, sizeof(msg->command), command);
+    copyField(msg->dst, sizeof(msg->dst), dst);
+    copyField(msg->message, sizeof(msg->message), content);
+    return payload;
+}
+
+/* 把消息编码为推送给紧凑协议客户端的OP_DELIVER帧
+ *
+ * @param msg makeMessage创建的消息
+ * @return Payload* 引用计数为1的数据块，用完后由调用者release
+ */
+static Payload* makeDeliverFrame(const Payload* msg) {
+    const Message* m = (const Message*)msg->data();
+    std::vector<char> out;
+    FrameWriter writer(out, OP_DELIVER);
+
+    writer.putField(m->command, strlen(m->command));
+    writer.putField(m->dst, strlen(m->dst));
+    writer.putField(m->message, strlen(m->message));
+    writer.finish();
+    return Payload::create(&out[0], out.size());
+}
+
+// 消息日志中的一条聊天记录，字段指向映射的段，不拷贝
+typedef struct {
+    int opcode;         // OP_SGCHAT或OP_GPCHAT
+    StringView src;     // 发送方
+    StringView dst;     // 接收方或群名
+    StringView content;
+} ChatRecord;
+
+/* 解析logMessage写入的聊天记录
+ *
+ * @param data 记录的内容
+ * @param len 记录的长度
+ * @param record 解析结果
+ * @return true : 成功; false : 不是聊天记录
+ */
+static bool parseChatRecord(const char* data, size_t len, ChatRecord& record) {
+    if (frameLength(data, len) != (ssize_t)len)
+        return false;
+
+    FrameReader reader(data, len);
+    record.opcode = reader.opcode();
+    if (record.opcode != OP_SGCHAT && record.opcode != OP_GPCHAT)
+        return false;
+    return reader.getField(record.src, MAX_NAME_LEN) && reader.getField(record.dst, MAX_NAME_LEN)
+           && reader.getField(record.content, MAX_CONTENT_LEN);
+}
+
+/* 把聊天记录还原为投递时的消息，与singleChat和groupChat创建的相同
+ *
+ * @param record 聊天记录
+ * @return Payload* 引用计数为1的数据块，用完后由调用者release
+ */
+static Payload* makeMessage(const ChatRecord& record) {
+    char command[sizeof(Message::command)];
+
+    if (record.opcode == OP_SGCHAT)
+        return makeMessage("sgchat", record.src, record.content);
+
+    snprintf(command, sizeof(command), "gpchat %.*s", (int)record.src.size(), record.src.data());
+    return makeMessage(command, record.dst, record.content);
+}
+
+/* 解析logInbox写入的收件箱记录
+ *
+ * @param data 记录的内容
+ * @param len 记录的长度
+ * @param opcode LOG_INBOX_PUSH或LOG_INBOX_POP
+ * @param index 用户下标
+ * @param value 聊天记录的序号或移除的消息数
+ * @return true : 成功; false : 不是收件箱记录
+ */
+static bool parseInboxRecord(const char* data, size_t len, int& opcode, uint32_t& index,
+                             uint64_t& value) {
+    if (frameLength(data, len) != (ssize_t)len)
+        return false;
+
+    FrameReader reader(data, len);
+    opcode = reader.opcode();
+    if (opcode != LOG_INBOX_PUSH && opcode != LOG_INBOX_POP)
+        return false;
+    return reader.getU32(index) && reader.getU64(value) && reader.atEnd();
+}
+
+/* 把紧凑协议的请求帧解析为 opcode, dst, message，字段指向帧的缓冲区，不拷贝
+ *
+ * @param reader 请求帧
+ * @param request 解析结果
+ * @return true : 成功; false : 帧非法
+ */
+static bool parseRequest(FrameReader& reader, Request& request) {
+    request.opcode = reader.opcode();
+    request.dst = StringView();
+    request.message = StringView();
+    if (reader.getField(request.dst, MAX_NAME_LEN))
+        reader.getField(request.message, MAX_CONTENT_LEN);
+    return reader.atEnd();
+}
+
+// 定时器使用的时间，单调时钟，单位毫秒
+static uint64_t nowMs() {
+    return Metrics::now() / 1000000;
+}
+
+// 消息有效期为ttlMs时，早于返回值投递的消息已过期
+static uint64_t expiredBefore(uint64_t now, int ttlMs) {
+    return now > (uint64_t)ttlMs ? now - ttlMs : 0;
+}
+
+Server::Server(const ServerOptions& options)
+    : threadPool_(NUM_THREADS, options.queueType),
+      threadPoolArg_(createQueue<struct epoll_event>(options.queueType)),
+      options_(options),
+      mode_(options.mode),
+      nextReactor_(0),
+      conns_(MAX_CONNECTIONS),
+      adminFd_(-1),
+      log_(NULL),
+      accounts_(NULL),
+      sessions_(NULL),
+      sessionGenerations_(NULL),
+      nextSession_(0),
+      sweepNext_(0),
+      idleEvictions_(0),
+      frameEvictions_(0),
+      pingsSent_(0),
+      backlogs_(0),
+      droppedPushes_(0),
+      deferredPushes_(0),
+      slowDisconnects_(0),
+      inboxPool_(options.inboxPool, options.inboxDepth, options.inboxPolicy)
+{
+    if (mode_ == MODE_THREAD_POOL)
+        threadPool_.run();
+    if (options_.outputLowWater >= options_.outputHighWater) // 没有回差时每放入一帧都会反复暂停、恢复
+        options_.outputLowWater = options_.outputHighWater / 2;
     pthread_mutex_init(&usersMutex_, NULL);
     pthread_mutex_init(&roomsMutex_, NULL);
     pthread_mutex_init(&msgMutex_, NULL);
+    pthread_mutex_init(&sessionsMutex_, NULL);
+    pthread_mutex_init(&backlogMutex_, NULL);
+    for (size_t i = 0; i < conns_.size(); i++)
+        conns_[i].store(NULL, std::memory_order_relaxed);
+
+    if (!options_.gatewayToken.empty()) {
+        sessions_ = new std::atomic<uint64_t>[MAX_SESSIONS];
+        sessionGenerations_ = new std::atomic<uint32_t>[MAX_SESSIONS];
+        for (int i = 0; i < MAX_SESSIONS; i++) {
+            sessions_[i].store(0, std::memory_order_relaxed);
+            sessionGenerations_[i].store(0, std::memory_order_relaxed);
+        }
+    }
 }
 
 Server::~Server() {
+    for (size_t i = 0; i < reactors_.size(); i++)
+        delete reactors_[i];
+    for (size_t i = 0; i < urings_.size(); i++)
+        delete urings_[i];
+    for (size_t i = 0; i < conns_.size(); i++)
+        delete conns_[i];
+    for (size_t i = 0; i < timers_.size(); i++) {
+        delete timers_[i]->wheel;
+        pthread_mutex_destroy(&timers_[i]->mutex);
+        delete timers_[i];
+    }
+    delete threadPoolArg_;
+    delete log_;
+    delete accounts_;
+    delete[] sessions_;
+    delete[] sessionGenerations_;
+    pthread_mutex_destroy(&sessionsMutex_);
+    pthread_mutex_destroy(&backlogMutex_);
     pthread_mutex_destroy(&usersMutex_);
     pthread_mutex_destroy(&roomsMutex_);
     pthread_mutex_destroy(&msgMutex_);
 }
 
 void Server::init() {
-    struct sockaddr_in servaddr;
+    listenFd_ = createListener(options_.reusePort);
+    listenFds_.push_back(listenFd_);
+
+    if (!options_.dataDir.empty()) {
+        AccountState state;
+
+        accounts_ = new AccountStore(options_.dataDir, options_.logSyncMs);
+        if (accounts_->open(state)) {
+            loadAccounts(state);
+        } else {
+            fprintf(stderr, "cannot open account store in %s: %s, accounts will not persist\n",
+                    options_.dataDir.c_str(), strerror(errno));
+            delete accounts_;
+            accounts_ = NULL;
+        }
+    }
+
+    if (!options_.logDir.empty()) {
+        log_ = new MessageLog(options_.logDir, LOG_SEGMENT_SIZE, options_.logSyncMs);
+        if (!log_->open()) {
+            fprintf(stderr, "cannot open message log in %s: %s, running without it\n",
+                    options_.logDir.c_str(), strerror(errno));
+            delete log_;
+            log_ = NULL;
+        } else if (accounts_ != NULL) {
+            replayInboxes();
+        }
+    }
+
+    if (options_.adminPort > 0)
+        startAdmin();
+}
 
-    listenFd_ = socket(AF_INET, SOCK_STREAM, 0);
+/* 创建非阻塞的监听套接字
+ * 开启SO_REUSEPORT时多个套接字可以绑定同一端口，由内核按四元组把新连接分给其中一个
+ *
+ * @param reusePort 是否开启SO_REUSEPORT
+ * @return 监听套接字; -1 : 失败
+ */
+int Server::createListener(bool reusePort) {
+    struct sockaddr_in servaddr;
+    int fd, on = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    // 重启时不必等待旧连接的TIME_WAIT结束
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (reusePort && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+        perror("SO_REUSEPORT");
+        close(fd);
+        return -1;
+    }
 
     memset(&servaddr, 0, sizeof(servaddr));
     servaddr.sin_family = AF_INET;
     servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
     servaddr.sin_port = htons(SERVER_PORT);
 
-    bind(listenFd_, (struct sockaddr*)&servaddr, sizeof(servaddr));
+    if (bind(fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) == -1
+        || listen(fd, BACKLOG) == -1) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-    listen(listenFd_, BACKLOG);
+bool Server::isListener(int fd) {
+    for (size_t i = 0; i < listenFds_.size(); i++) {
+        if (listenFds_[i] == fd)
+            return true;
+    }
+    return false;
 }
 
 /* 服务器的事件驱动函数
  *
- * 对epoll_wait返回的每一个事件，往工作队列中添加一个任务
- * 其中使用了另一个队列存放每个事件的信息
+ * MODE_THREAD_POOL : 对epoll_wait返回的每一个事件，往工作队列中添加一个任务，
+ *                    其中使用了另一个队列存放每个事件的信息
+ * MODE_MULTI_REACTOR : 启动NUM_THREADS个事件循环，当前线程只负责接收连接，
+ *                      新连接交给其中一个事件循环，之后该连接的读写都在那个线程内完成
+ * IO_BACKEND_URING : 与MODE_MULTI_REACTOR相同的结构，事件循环换成UringLoop，见runUring
+ * 开启了超时时，每个事件循环（MODE_THREAD_POOL下为当前线程）至少每TIMER_TICK_MS醒来一次推进自己的时间轮
  */
 void Server::eventLoop() {
-    int epollFd, numReadyEvents, flags;
-    struct epoll_event events[MAXEVENTS];
+    int epollFd, numReadyEvents;
+    struct epoll_event* events;
     struct epoll_event ev;
 
+    if (options_.backend == IO_BACKEND_URING) {
+        if (runUring()) {
+            // 各个UringLoop已经持有连接，不能再改用epoll，只能退出
+            fprintf(stderr, "io_uring accept loop failed: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        fprintf(stderr, "io_uring unavailable, falling back to epoll\n");
+        options_.backend = IO_BACKEND_EPOLL;
+    }
+
+    events = new struct epoll_event[MAXEVENTS];
+    initTimers(mode_ == MODE_MULTI_REACTOR ? NUM_THREADS : 1);
+    int timeoutMs = timers_.empty() ? -1 : TIMER_TICK_MS;
+
     epollFd_ = epoll_create1(EPOLL_CLOEXEC);
     ev.events = EPOLLIN | EPOLLET;
     ev.data.fd = listenFd_;
-    flags = fcntl(listenFd_, F_GETFL, 0);
-    flags |= O_NONBLOCK;
-    fcntl(listenFd_, F_SETFL, flags);
-    epoll_ctl(epollFd_, EPOLL_CTL_ADD, listenFd_, &ev);
 
-    Queue<WorkType>* workQueue = threadPool_.getWorkQueue();
+    if (mode_ == MODE_MULTI_REACTOR) {
+        for (int i = 0; i < NUM_THREADS; i++) {
+            EventLoop* loop = new EventLoop(
+                [this] (struct epoll_event& ev) {this->handleEvent(ev);}, 
+                MAXEVENTS / NUM_THREADS,
+                [this, i] {this->runTimers(i); this->flushPending();},
+                timeoutMs);
+            reactors_.push_back(loop);
+        }
+    }
+
+    if (mode_ == MODE_MULTI_REACTOR && options_.reusePort) {
+        // 每个事件循环在自己的监听套接字上接收连接，新连接留在该循环中，当前线程不再参与
+        for (int i = 1; i < NUM_THREADS; i++) {
+            int fd = createListener(true);
+            if (fd == -1)
+                break;
+            listenFds_.push_back(fd);
+        }
+        for (size_t i = 0; i < listenFds_.size(); i++)
+            reactors_[i]->addFd(listenFds_[i], EPOLLIN | EPOLLET);
+    } else {
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, listenFd_, &ev);
+    }
+
+    for (size_t i = 0; i < reactors_.size(); i++)
+        reactors_[i]->start();
+
+    BlockingQueue<WorkType>* workQueue = threadPool_.getWorkQueue();
 
     while (true) {
-        numReadyEvents = epoll_wait(epollFd_, events, MAXEVENTS, -1); 
+        numReadyEvents = epoll_wait(epollFd_, events, MAXEVENTS,
+                                    mode_ == MODE_THREAD_POOL ? timeoutMs : -1); 
         for (int i = 0; i < numReadyEvents; i++) {
-            threadPoolArg_.push(events[i]); // 往队列中添加事件信息
+            if (mode_ == MODE_MULTI_REACTOR) {
+                handleEvent(events[i]);
+                continue;
+            }
+            threadPoolArg_->push(events[i]); // 往队列中添加事件信息
             workQueue->push([this] {this->solve();}); // 往工作队列中添加任务
         }
+        if (mode_ == MODE_THREAD_POOL)
+            runTimers(0);
+        flushPending();
     }
 
+    delete[] events;
     close(epollFd);
 }
 
-/* 每个线程的实际执行函数
+/* io_uring后端的事件驱动函数
+ * 启动NUM_THREADS个UringLoop，当前线程用另一个UringLoop接收连接，
+ * 新连接轮流分配给各个事件循环
  *
- * 从队列中取出一个事件信息，根据事件类型调用不同函数
+ * @return false : 内核不支持io_uring，没有启动任何事件循环;
+ *         true : 事件循环已经启动，接收连接的循环因io_uring_enter出错而退出
  */
-void Server::solve()
-{
-    struct epoll_event ev;
-    threadPoolArg_.get(ev);
-    int fd = ev.data.fd;
-
-    if (fd == listenFd_ && (ev.events & EPOLLIN)) {
-        handleAccept(fd); 
-    } else if (ev.events & EPOLLIN) {
-        handleRead(fd);
-    } else if (ev.events & EPOLLOUT) {
-        handleWrite(fd);
-    } else {
+bool Server::runUring() {
+    UringLoop acceptor(nullptr, nullptr); // 只接收连接
+
+    if (!acceptor.init(false))
+        return false;
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        UringLoop* loop = new UringLoop(
+            [this] (int fd, uint32_t gen, int event, const char* data, size_t len) {
+                this->handleUringInput(fd, gen, event, data, len);
+            },
+            [this, i] {this->runTimers(i); this->flushPending();},
+            [this] (Connection* conn) {this->handleUringSent(conn);});
+        if (!loop->init(true)) {
+            delete loop;
+            for (size_t j = 0; j < urings_.size(); j++)
+                delete urings_[j];
+            urings_.clear();
+            return false;
+        }
+        urings_.push_back(loop);
     }
-}
 
-/* 处理新连接到来
- *
- * @param listenFd 服务器的监听套接字
- */
-void Server::handleAccept(int listenFd) {
-    struct sockaddr_in clientAddr;
-    socklen_t clientAddrLen;
-    int connectedFd, ret, flags;
-    struct epoll_event ev;
+    initTimers(urings_.size());
+    for (size_t i = 0; i < urings_.size() && !timers_.empty(); i++)
+        urings_[i]->setTick(TIMER_TICK_MS);
 
-    while (1) {
-        clientAddrLen = sizeof(clientAddr);
-        connectedFd = accept(listenFd, (struct sockaddr*)&clientAddr, 
-                             &clientAddrLen);
-        if (connectedFd == -1) {
-            if (errno == EINTR) 
-                continue;
-            else
-                return ;
+    if (options_.reusePort) {
+        // 每个事件循环在自己的监听套接字上接收连接，新连接留在该循环中
+        for (int i = 1; i < NUM_THREADS; i++) {
+            int fd = createListener(true);
+            if (fd == -1)
+                break;
+            listenFds_.push_back(fd);
         }
-        break;
+        for (size_t i = 0; i < listenFds_.size(); i++) {
+            UringLoop* loop = urings_[i];
+            loop->acceptMultishot(listenFds_[i], [this, loop] (int fd) {this->handleUringAccept(fd, loop);});
+        }
+    } else {
+        acceptor.acceptMultishot(listenFd_, [this] (int fd) {this->handleUringAccept(fd, NULL);});
     }
 
-    // 非阻塞
-    flags = fcntl(connectedFd, F_GETFL, 0);
-    flags |= O_NONBLOCK;
-    fcntl(connectedFd, F_SETFL, flags);
+    for (size_t i = 0; i < urings_.size(); i++)
+        urings_[i]->start();
 
-    ev.events = EPOLLIN | EPOLLET;
-    ev.data.fd = connectedFd;
-    ret = epoll_ctl(epollFd_, EPOLL_CTL_ADD, connectedFd, &ev);
+    acceptor.loop(); // reusePort时没有提交任何操作，当前线程一直等待
+    return true;
 }
 
-/* 处理已连接套接字可读
+/* io_uring后端接收到新连接
  *
- * @param fd 活跃的套接字
+ * @param fd 已连接套接字，已经是非阻塞的
+ * @param loop 接收该连接的事件循环，连接交给它处理; NULL : 轮流分配
  */
-void Server::handleRead(int fd) {
-    int flags, i, ret;
-    Message msg;
-    bool loop;
-    char buf[2048];
-    ssize_t bytesRead, bytesTotal;
-    size_t bufSize;
+void Server::handleUringAccept(int fd, UringLoop* loop) {
+    if (fd >= MAX_CONNECTIONS) {
+        close(fd);
+        return ;
+    }
 
-    if (!recvBuffer_.exist(fd))
-        recvBuffer_.add(fd, std::vector<char>());
+    Connection* conn = slotOf(fd);
+
+    size_t index = 0;
+    if (loop == NULL)
+        index = nextReactor_++ % urings_.size();
+    else
+        index = std::find(urings_.begin(), urings_.end(), loop) - urings_.begin();
+    conn->reset(fd, -1);
+    conn->uring = urings_[index];
+    armConnection(conn, index);
+    urings_[index]->addConnection(conn);
+}
 
-    loop = true;
+/* io_uring后端连接上的接收事件
+ * 数据放入接收缓冲区后解析，与handleRead相同
+ *
+ * @param fd 客户端套接字
+ * @param gen 提交接收时连接的代数
+ * @param event URING_INPUT_*
+ * @param data 收到的数据
+ * @param len 数据长度
+ */
+void Server::handleUringInput(int fd, uint32_t gen, int event, const char* data, size_t len) {
+    Connection* conn = conns_[fd];
+    bool closed = false;
 
-    while (loop) {
-        bufSize = recvBuffer_.size(fd);
+    pthread_mutex_lock(&conn->inputMutex);
 
-        if (bufSize != 0) // 该FD的接收缓冲区存有上次未完整接收的数据
-            bytesTotal = sizeof(Message) - bufSize;
-        else
-            bytesTotal = sizeof(Message);
-
-        bytesRead = recv(fd, (void*)buf, bytesTotal, 0); 
-
-        if (bytesRead == bytesTotal) {
-            std::vector<std::string> require;
-
-            if (bytesRead == sizeof(Message)) { // 读到一个完整的消息
-                strncpy(msg.command, buf, 100); 
-                strncpy(msg.dst, buf + 100, 100); 
-                strncpy(msg.message, buf + 200, 1024); 
-            } else { // 上次和这次的数据合并成一个完整的Message
-                std::vector<char> tmp;
-                bool ret = recvBuffer_.retrive(fd, tmp, bufSize);
-                tmp.insert(tmp.end(), buf, buf + bytesRead);
-                for (int i = 0; i < 100; i++)
-                    msg.command[i] = tmp[i];
-                for (int i = 0; i < 100; i++)
-                    msg.dst[i] = tmp[100 + i];
-                for (int i = 0; i < 1024; i++)
-                    msg.message[i] = tmp[200 + i];
-            }
+    if ((conn->generation & URING_GEN_MASK) != gen) { // 属于已经释放的连接
+        pthread_mutex_unlock(&conn->inputMutex);
+        return ;
+    }
 
-            require.push_back(std::string(msg.command));
-            require.push_back(std::string(msg.dst));
-            require.push_back(std::string(msg.message));
-            if (require[0] == "signup")
-                clientSignUp(fd, require);
-            else if (require[0] == "signin")
-                clientSignIn(fd, require);
-            else if (require[0] == "lsuser")
-                lsUsers(fd);
-            else if (require[0] == "sgchat")
-                singleChat(fd, require[1], require[2]);
-            else if (require[0] == "gpchat")
-                groupChat(fd, require[1], require[2]);
-            else if (require[0] == "mkroom")
-                mkRoom(fd, require[1]);
-            else if (require[0] == "lsroom")
-                lsRooms(fd);
-            else if (require[0] == "cdroom")
-                cdRoom(fd, require[1]);
-            else if (require[0] == "qtroom")
-                qtRoom(fd, require[1]);
-            else if (require[0] == "getmsg")
-                getMsg(fd);
-            else {
-            }
+    if (event == URING_INPUT_DATA) {
+        conn->input.append(data, len);
+        closed = !processInput(conn);
+        // 暂停处理请求后取消接收，之后的数据留在内核中，由resumeInput重新提交接收
+        if (!closed && conn->readPaused && conn->recvState == RECV_ACTIVE) {
+            conn->recvState = RECV_CANCELLING;
+            conn->uring->cancelRecv(conn);
+        }
+    } else if (event == URING_INPUT_REARM) {
+        if (conn->readPaused) {
+            conn->recvState = RECV_STOPPED;
         } else {
-            if (bytesRead == -1) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) { // 处理该FD直到EAGAIN
-                    loop = false;
-                } else if (errno == EINTR) {
-                    continue; 
-                } else {
-                    releaseClient(fd);    
-                    loop = false;
-                }
-            } else if (bytesRead == 0) { // 客户端端开
-                releaseClient(fd);
-                loop = false;
-            } else { // bytesRead < bytesTotal
-                std::vector<char> tmp;
-                tmp.insert(tmp.end(), buf, buf + bytesRead);
-                recvBuffer_.append(fd, tmp);
-            }
+            conn->recvState = RECV_ACTIVE;
+            conn->uring->addConnection(conn);
         }
+    } else {
+        closed = true;
     }
-}
 
-void Server::releaseClient(int fd) {
-    int ret;
-    handleClientClose(fd);
-    ret = epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, NULL);
-    recvBuffer_.del(fd);
-    sendBuffer_.del(fd);
-}
+    countInput(conn);
+    pthread_mutex_unlock(&conn->inputMutex);
 
-void Server::handleWrite(int fd) {
-    size_t bufSize;
-    bool flag;
-    ssize_t bytesSend;
-    int ret;
+    if (closed)
+        releaseClient(fd);
+}
 
-    if (sendBuffer_.empty(fd))
-        return ;
+/* io_uring后端连接上的一个发送操作结束
+ * 取走数据和出错时清空都发生在UringLoop中，在这里统计发送队列的变化，之后与epoll后端一样检查积压
+ *
+ * @param conn 客户端连接，调用时不持有任何锁
+ */
+void Server::handleUringSent(Connection* conn) {
+    pthread_mutex_lock(&conn->outputMutex);
+    countOutput(conn);
+    pthread_mutex_unlock(&conn->outputMutex);
 
-    flag = true;
-
-    while (flag) {
-        std::vector<char> tmp;
-        char buf[10000];
-
-        bufSize = sendBuffer_.size(fd);
-
-        sendBuffer_.retrive(fd, tmp, bufSize);
-        for (int i = 0; i < tmp.size(); i++)
-            buf[i] = tmp[i];
-
-        bytesSend = ::send(fd, buf, bufSize, 0);
-
-        if (bytesSend == bufSize) {
-            struct epoll_event ev;
-            ev.data.fd = fd;
-            ev.events = EPOLLIN | EPOLLET;
-            ret = epoll_ctl(epollFd_, EPOLL_CTL_MOD, fd, &ev);
-        } else if (0 < bytesSend && bytesSend < bufSize) {
-            tmp.clear();
-            tmp.insert(tmp.end(), buf + bytesSend, buf + bufSize);
-            sendBuffer_.append(fd, tmp);
-        } else if (bytesSend == -1) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) 
-                flag = false; 
-            else if (errno == EINTR)
-                continue;
-            else {
-                releaseClient(fd);
-                flag = false;
-            }
-        } else {
-        }
-    }
+    checkDrained(conn);
 }
 
-void Server::Send(int fd, void* buf, size_t len) {
-    bool flag;
-    ssize_t bytesSend;
-    int ret;
-
-    flag = true;
-    char* buffer = (char*)buf;
-    ssize_t hasSend = 0;
-
-    while (flag) {
-        if (!sendBuffer_.empty(fd))
-            handleWrite(fd); // 先将发送缓冲区数据发送到客户端
-
-        if (sendBuffer_.empty(fd)) {
-            bytesSend = ::send(fd, (void*)((char*)buf + hasSend), len - hasSend, 0); 
-            hasSend += bytesSend;
-
-            if (0 < bytesSend && bytesSend < len - hasSend) { // 将未发送完的数据放入发送缓冲区
-                std::vector<char> tmp;
-                tmp.insert(tmp.end(), buffer + hasSend, buffer + len - bytesSend);
-                sendBuffer_.append(fd, tmp);
-                hasSend = len;
-
-            } else if (bytesSend == -1) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    struct epoll_event ev; 
-                    ev.data.fd = fd;
-                    ev.events = EPOLLOUT | EPOLLET;
-                    ret = epoll_ctl(epollFd_, EPOLL_CTL_MOD, fd, &ev);
-                    break;
-                } else if (errno == EINTR) {
-                    continue;
-                } else {
-                    releaseClient(fd); 
-                    break;
-                }
-            } else if (bytesSend == 0)
-                break;
-            else {
-            }
-        } else { // 追加到发送缓冲区
-            std::vector<char> tmp;
-            tmp.insert(tmp.end(), buffer, buffer + len);
-            sendBuffer_.append(fd, tmp);
-            break;
-        }
-    }
+/* 每个线程的实际执行函数
+ *
+ * 从队列中取出一个事件信息，交给handleEvent处理，之后发送处理过程中产生的数据
+ */
+void Server::solve()
+{
+    struct epoll_event ev;
+    threadPoolArg_->get(ev);
+    handleEvent(ev);
+    flushPending();
 }
 
-/* 客户端关闭处理
+/* 根据事件类型调用不同函数
  *
- * @param fd 客户端套接字
+ * @param ev epoll_wait返回的事件
  */
-void Server::handleClientClose(int fd) {
-    close(fd);
-
-    pthread_mutex_lock(&usersMutex_);
+void Server::handleEvent(struct epoll_event& ev)
+{
+    int fd = ev.data.fd;
 
-    for (int i = 0; i < users_.size(); i++) {
-        if (users_[i].fd == fd) {
-            users_[i].online = false;
-            break;
-        }
+    if (isListener(fd) && (ev.events & EPOLLIN)) {
+        handleAccept(fd); 
+    } else {
+        if (ev.events & EPOLLOUT)
+            handleWrite(fd);
+        if (ev.events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            handleRead(fd);
     }
-
-    pthread_mutex_unlock(&usersMutex_);
 }
 
-/* 客户端注册
+/* 处理新连接到来
+ * 监听套接字是边缘触发的，一次可读事件之后要一直accept到EAGAIN，
+ * 否则同时到达的其他连接会滞留在监听队列中，直到下一个连接触发新的事件
+ * accept4直接得到非阻塞的套接字，不需要再调用fcntl
  *
- * @param fd 客户端套接字
- * @require 客户端发送过来的协议内容
+ * @param listenFd 就绪的监听套接字
  */
-void Server::clientSignUp(int fd, std::vector<std::string> require) {
-    std::string name = require[1];
-    std::string password = require[2];
-    int ret;
-
-    pthread_mutex_lock(&usersMutex_); 
+void Server::handleAccept(int listenFd) {
+    int owner = -1;
+    int connectedFd;
+    struct epoll_event ev;
 
-    for (int i = 0; i < users_.size(); i++) {
-        if (users_[i].name == name) {
-            ret = SIGN_UP_FAIL; 
-            break;
+    // reusePort时监听套接字属于某个事件循环，新连接留在该循环中
+    if (mode_ == MODE_MULTI_REACTOR && options_.reusePort) {
+        for (size_t i = 0; i < listenFds_.size(); i++) {
+            if (listenFds_[i] == listenFd)
+                owner = i;
         }
     }
 
-    if (ret != SIGN_UP_FAIL) {
-        User usr;
-        usr.name = name;
-        usr.password = password;
-        usr.online = false;
-        users_.push_back(usr);
+    while (true) {
+        connectedFd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connectedFd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept4");
+            return ;
+        }
 
-        ret = SIGN_UP_SUCCESS;
-    }
+        if (connectedFd >= MAX_CONNECTIONS) {
+            close(connectedFd);
+            continue;
+        }
 
-    pthread_mutex_unlock(&usersMutex_);
+        Connection* conn = slotOf(connectedFd);
 
-    Send(fd, (void*)&ret, sizeof(ret));
+        if (mode_ == MODE_MULTI_REACTOR) { // 没有所属的事件循环时轮流分配
+            int index = owner != -1 ? owner : nextReactor_++ % reactors_.size();
+            conn->reset(connectedFd, reactors_[index]->getEpollFd());
+            armConnection(conn, index);
+            reactors_[index]->addFd(connectedFd, EPOLLIN | EPOLLET);
+            continue;
+        }
+
+        conn->reset(connectedFd, epollFd_);
+        armConnection(conn, 0);
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = connectedFd;
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, connectedFd, &ev);
+    }
 }
 
-/* 客户端登录
+/* 处理已连接套接字可读
+ * 数据直接读入该连接的接收缓冲区，直到EAGAIN，
+ * 每次读到数据后解析出其中所有完整的请求;
+ * 因发送队列积压暂停处理请求时不再读取，剩下的数据留在内核中，由resumeInput继续
  *
- * @param fd 客户端套接字
- * @require 客户端发送过来的协议内容
+ * @param fd 活跃的套接字
  */
-void Server::clientSignIn(int fd, std::vector<std::string> require) {
-    std::string name = require[1];
-    std::string password = require[2];
-    int ret, i;
+void Server::handleRead(int fd) {
+    Connection* conn = conns_[fd];
+    ssize_t bytesRead;
+    bool closed = false;
 
-    pthread_mutex_lock(&usersMutex_); 
+    pthread_mutex_lock(&conn->inputMutex);
 
-    for (i = 0; i < users_.size(); i++) {
-        if (users_[i].name == name) {
-            if (users_[i].password == password) {
-                ret = SIGN_IN_SUCCESS;
-                users_[i].fd = fd;
-                users_[i].online = true;
+    while (!conn->readPaused) {
+        char* space;
+        size_t spaceLen = conn->input.prepareWrite(&space, 2048);
+
+        bytesRead = recv(fd, (void*)space, spaceLen, 0); 
+
+        if (bytesRead > 0) {
+            conn->input.commitWrite(bytesRead);
+            if (!processInput(conn)) { // 协议错误
+                closed = true;
+                break;
+            }
+        } else if (bytesRead == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { // 处理该FD直到EAGAIN
+                break;
+            } else if (errno == EINTR) {
+                continue; 
+            } else {
+                closed = true;
+                break;
             }
-            else
-                ret = SIGN_IN_PASSWORD_ERROR;
+        } else { // 客户端断开
+            closed = true;
             break;
         }
     }
-    if (i == users_.size())
-        ret = SIGN_IN_ACCOUNT_NOT_EXISTENT;
 
-    pthread_mutex_unlock(&usersMutex_);
+    countInput(conn);
+    pthread_mutex_unlock(&conn->inputMutex);
 
-    Send(fd, (void*)&ret, sizeof(ret));
+    if (closed)
+        releaseClient(fd);
 }
 
-/* 列出当前服务器上所有在线用户
+/* 不经过套接字，把一段数据当作从fd上收到的数据处理
+ * fd不需要是真实的描述符，第一次使用时建立连接;回复留在发送队列中，由discardOutput丢弃
+ * 只应在没有调用eventLoop的服务器上使用
  *
- * @param fd 客户端套接字
+ * @param fd 连接表中的下标
+ * @param data 收到的数据
+ * @param len 数据长度
+ * @return true : 成功; false : 数据违反协议
  */
-void Server::lsUsers(int fd) {
-    Name buf[1000];
-    int count = 0;
+bool Server::feedInput(int fd, const char* data, size_t len) {
+    bool ok;
 
-    pthread_mutex_lock(&usersMutex_);
-    for (int i = 0; i < users_.size(); i++) {
-        if (users_[i].online)
-            strcpy(buf[count++].name, users_[i].name.c_str());
+    Connection* conn = conns_[fd];
+    if (conn == NULL) {
+        conn = slotOf(fd);
+        conn->reset(fd, -1);
     }
-    pthread_mutex_unlock(&usersMutex_);
 
-    Send(fd, (void*)&count, sizeof(count));
-    Send(fd, (void*)buf, count * sizeof(Name));
+    pthread_mutex_lock(&conn->inputMutex);
+    conn->input.append(data, len);
+    ok = processInput(conn);
+    countInput(conn);
+    pthread_mutex_unlock(&conn->inputMutex);
+
+    return ok;
 }
 
-/* 单聊
+/* 丢弃feedInput产生的回复
  *
- * @param fd 客户端套接字
- * @param usrName 目的客户端用户名
- * @param content 聊天内容
+ * @param fd 连接表中的下标
+ * @return 丢弃的字节数
  */
-void Server::singleChat(int fd, std::string usrName, std::string content) {
-    int index = -1;
-    std::string srcName;
-
-    pthread_mutex_lock(&usersMutex_);
-    for (int i = 0; i < users_.size(); i++) {
-        if (fd == users_[i].fd)
-            srcName = users_[i].name;
-
-        if (users_[i].name == usrName && users_[i].online) {
-            index = i;
-        }
-    }
-    pthread_mutex_unlock(&usersMutex_);
+size_t Server::discardOutput(int fd) {
+    Connection* conn = conns_[fd];
+    size_t len;
 
-    if (index != -1) {
-        Message msg;
-        strcpy(msg.command, "sgchat");
-        strcpy(msg.dst, srcName.c_str());
-        strcpy(msg.message, content.c_str());
+    if (conn == NULL)
+        return 0;
 
-        pthread_mutex_lock(&msgMutex_);
-        auto iter = clientsMsg_.find(users_[index].fd);
-        clientsMsg_[users_[index].fd] = msg;
-        pthread_mutex_unlock(&msgMutex_);
-    }
+    pthread_mutex_lock(&conn->outputMutex);
+    len = conn->output.size();
+    conn->output.clear();
+    setBacklogged(conn, false);
+    countOutput(conn);
+    pthread_mutex_unlock(&conn->outputMutex);
 
+    return len;
 }
 
-/* 群聊
+/* 解析接收缓冲区中的请求
+ * 连接上的第一个字节决定该连接使用的协议，
+ * 不完整的请求留在接收缓冲区中，等待下次数据到来;
+ * 请求的字段直接指向接收缓冲区，处理完（dispatch返回）之后才从缓冲区中移除;
+ * 该连接的发送队列超过高水位时暂停，置readPaused，剩下的请求等发送队列降到低水位后由resumeInput处理
  *
- * @param fd 客户端套接字
- * @param grpName 群名字
- * @param content 聊天内容
+ * @param conn 客户端连接，调用者已对inputMutex加锁
+ * @return true : 成功; false : 客户端违反协议
  */
-void Server::groupChat(int fd, std::string grpName, std::string content) {
-    std::vector<int> fds;
-    std::string srcName;
+bool Server::processInput(Connection* conn) {
+    RingBuffer& input = conn->input;
+    size_t received = input.size();
+    int fd = conn->fd;
+    uint64_t now = 0;
+
+    // 开启了超时时记下收到数据的时间，超时的检查在checkConnection中
+    if (!timers_.empty()) {
+        now = nowMs();
+        conn->lastActive = now;
+        conn->pingSent = false;
+    }
 
-    pthread_mutex_lock(&usersMutex_);
-    pthread_mutex_lock(&roomsMutex_);
+    conn->readPaused = false;
+    while (!input.empty()) {
+        const char* p;
+        size_t len = input.size();
 
-    for (int i = 0; i < users_.size(); i++) {
-        if (users_[i].fd == fd) {
-            srcName = users_[i].name;
+        if (conn->backlogged.load(std::memory_order_relaxed)) {
+            conn->readPaused = true;
             break;
         }
-    }
 
-    std::vector<std::string> members = rooms_[grpName];
-    for (int i = 0; i < members.size(); i++) {
-        for (int j = 0; j < users_.size(); j++) {
-            if (users_[j].name == members[i] && users_[j].online) 
-                fds.push_back(users_[j].fd);
-        }
-    }
+        if (conn->protocol == PROTOCOL_UNKNOWN) {
+            input.peek(&p);
+            if ((unsigned char)p[0] != PROTO_MAGIC) {
+                conn->protocol = PROTOCOL_LEGACY;
+                continue;
+            }
+            if (len < 2)
+                break;
 
-    pthread_mutex_unlock(&roomsMutex_);
-    pthread_mutex_unlock(&usersMutex_);
+            p = input.linearize(2);
+            char hello[2] = {(char)PROTO_MAGIC, (char)PROTO_VERSION};
+            if ((unsigned char)p[1] < PROTO_VERSION)
+                hello[1] = p[1];
+            conn->protocol = PROTOCOL_COMPACT;
+            input.consume(2);
+            Send(fd, hello, sizeof(hello));
+        } else if (conn->protocol == PROTOCOL_LEGACY) {
+            if (len < sizeof(Message))
+                break;
+
+            const Message* msg = (const Message*)input.linearize(sizeof(Message));
+            Request request;
+            request.opcode = commandToOpcode(fieldOf(msg->command, sizeof(msg->command)));
+            request.dst = fieldOf(msg->dst, sizeof(msg->dst));
+            request.message = fieldOf(msg->message, sizeof(msg->message));
 
+            dispatch(fd, request);
+            input.consume(sizeof(Message));
+        } else {
+            ssize_t frameLen = frameLength(input.linearize(std::min(len, (size_t)FRAME_HEADER_SIZE)), len);
+            if (frameLen == 0)
+                break;
+            if (frameLen < 0)
+                return false;
+
+            FrameReader reader(input.linearize(frameLen), frameLen);
+            if (reader.opcode() == OP_SESSION || reader.opcode() == OP_SESSION_CLOSE) {
+                bool ok = processSession(conn, reader);
+                input.consume(frameLen);
+                if (!ok)
+                    return false;
+                continue;
+            }
 
-    pthread_mutex_lock(&msgMutex_);
-    for (int i = 0; i < fds.size(); i++) {
-        Message msg; 
-        strcpy(msg.command, "gpchat ");
-        strcat(msg.command, srcName.c_str());
-        strcpy(msg.dst, grpName.c_str());
-        strcpy(msg.message, content.c_str());
+            Request request;
+            if (!parseRequest(reader, request))
+                return false;
 
-        clientsMsg_[fds[i]] = msg;
+            dispatch(fd, request);
+            input.consume(frameLen);
+        }
     }
-    pthread_mutex_unlock(&msgMutex_);
+
+    // 剩下不完整的请求时，从它开始接收（处理完上一个请求）的时间算起;暂停时剩下的是完整的请求
+    if (now != 0) {
+        if (input.empty() || conn->readPaused)
+            conn->partialSince = 0;
+        else if (conn->partialSince == 0 || input.size() < received)
+            conn->partialSince = now;
+    }
+    return true;
 }
 
-/* 创建房间
+/* 处理网关连接上的一个会话帧
+ * OP_SESSION : 解出内层的请求帧，以会话键代替描述符交给dispatch，第一次出现的会话号建立新会话;
+ *              会话数已满时回复OP_SESSION_CLOSE，网关应使该会话的等待中的请求失败
+ * OP_SESSION_CLOSE : 结束该会话，会话上登录的用户下线
  *
- * @param fd 客户端套接字
- * @param roomName 要创建的房间名
+ * @param conn 网关连接，调用者已对inputMutex加锁
+ * @param reader 会话帧
+ * @return true : 成功; false : 不是网关连接或帧非法
  */
-void Server::mkRoom(int fd, std::string roomName) {
-    pthread_mutex_lock(&roomsMutex_);
-
-    int ret;
-    std::map<std::string, std::vector<std::string>>::iterator iter = rooms_.begin();
-
-    for (; iter != rooms_.end(); iter++) {
-        if (iter->first == roomName) {
-            ret = MAKE_ROOM_FAIL; 
-            break;
+bool Server::processSession(Connection* conn, FrameReader& reader) {
+    Request request;
+    const char* inner;
+    size_t innerLen;
+    uint32_t sid;
+    int key;
+
+    if (!conn->gateway || !reader.getU32(sid))
+        return false;
+
+    if (reader.opcode() == OP_SESSION_CLOSE) {
+        std::unordered_map<uint32_t, int>::iterator it = conn->sessions.find(sid);
+        if (!reader.atEnd())
+            return false;
+        if (it != conn->sessions.end()) {
+            key = it->second;
+            conn->sessions.erase(it);
+            closeSession(conn, key);
         }
+        return true;
     }
 
-    if (ret != MAKE_ROOM_FAIL) {
-        rooms_[roomName] = std::vector<std::string>();
-        ret = MAKE_ROOM_SUCCESS;
+    // 只有会话号时innerLen为0，frameLength也返回0，要先排除，否则内层帧的opcode读到帧外
+    reader.getRest(inner, innerLen);
+    if (innerLen <= FRAME_HEADER_SIZE || frameLength(inner, innerLen) != (ssize_t)innerLen)
+        return false;
+
+    FrameReader innerReader(inner, innerLen);
+    int opcode = innerReader.opcode();
+    if (opcode == OP_GATEWAY || opcode == OP_SESSION || opcode == OP_SESSION_CLOSE)
+        return false;
+    if (!parseRequest(innerReader, request))
+        return false;
+
+    key = openSession(conn, sid);
+    if (key == -1) {
+        std::vector<char> out;
+        FrameWriter writer(out, OP_SESSION_CLOSE);
+        writer.putU32(sid);
+        writer.finish();
+        Send(conn->fd, &out[0], out.size());
+        return true;
     }
 
-    pthread_mutex_unlock(&roomsMutex_);
-    Send(fd, (void*)&ret, sizeof(ret));
+    dispatch(key, request);
+    return true;
 }
 
-/* 列出服务器上的所有房间名
+/* 根据opcode调用对应的处理函数
  *
  * @param fd 客户端套接字
+ * @param request 请求，字段只在本函数返回之前有效
  */
-void Server::lsRooms(int fd) {
-    Name buf[1000];
-    int count = 0;
-
-    pthread_mutex_lock(&roomsMutex_);
-    std::map<std::string, std::vector<std::string>>::iterator iter = rooms_.begin();
-    for (; iter != rooms_.end(); iter++) {
-        strcpy(buf[count++].name, iter->first.c_str());
-    }
-    pthread_mutex_unlock(&roomsMutex_);
+void Server::dispatch(int fd, const Request& request) {
+    uint64_t start = Metrics::now();
+    int opcode = request.opcode;
 
-    Send(fd, (void*)&count, sizeof(count)); 
-    Send(fd, (void*)buf, count * sizeof(Name));
-}
+    switch (opcode) {
+    case OP_SIGNUP:
+        clientSignUp(fd, request.dst, request.message);
+        break;
+    case OP_SIGNIN:
+        clientSignIn(fd, request.dst, request.message);
+        break;
+    case OP_LSUSER:
+        lsUsers(fd);
+        break;
+    case OP_SGCHAT:
+        singleChat(fd, request.dst, request.message);
+        break;
+    case OP_GPCHAT:
+        groupChat(fd, request.dst, request.message);
+        break;
+    case OP_MKROOM:
+        mkRoom(fd, request.dst);
+        break;
+    case OP_LSROOM:
+        lsRooms(fd);
+        break;
+    case OP_CDROOM:
+        cdRoom(fd, request.dst);
+        break;
+    case OP_QTROOM:
+        qtRoom(fd, request.dst);
+        break;
+    case OP_GETMSG:
+        getMsg(fd, request.dst);
+        break;
+    case OP_PUSH:
+        setPush(fd, request.dst);
+        break;
+    case OP_LSUSER_PAGE:
+    case OP_LSROOM_PAGE:
+        replyPage(fd, opcode == OP_LSROOM_PAGE, request.dst, request.message);
+        break;
+    case OP_LSUSER_DELTA:
+    case OP_LSROOM_DELTA:
+        replyDelta(fd, opcode == OP_LSROOM_DELTA, request.dst);
+        break;
+    case OP_SGHISTORY:
+    case OP_GPHISTORY:
+        replyHistory(fd, opcode == OP_GPHISTORY, request.dst, request.message);
+        break;
+    case OP_GATEWAY:
+        gatewayAuth(fd, request.dst);
+        break;
+    default:
+        break;
+    }
+
+    metrics_.recordCommand(opcode, Metrics::now() - start);
+}
+
+void Server::releaseClient(int fd) {
+    Connection* conn = conns_[fd];
+
+    // io_uring后端 : 使该连接上未完成的接收操作结束，否则它会一直持有套接字
+    if (options_.backend == IO_BACKEND_URING)
+        shutdown(fd, SHUT_RDWR);
+    else
+        epoll_ctl(conn->epollFd, EPOLL_CTL_DEL, fd, NULL);
+
+    pthread_mutex_lock(&conn->inputMutex);
+    pthread_mutex_lock(&conn->outputMutex);
+    conn->generation++;
+    conn->input.clear();
+    conn->readPaused = false;
+    conn->output.clear();
+    setBacklogged(conn, false);
+    conn->pushDeferred = false;
+    countInput(conn);
+    countOutput(conn);
+    pthread_mutex_unlock(&conn->outputMutex);
+    pthread_mutex_unlock(&conn->inputMutex);
+
+    // 关闭描述符之前取消定时器，此后checkConnection不会再对该描述符调用shutdown
+    if (!timers_.empty()) {
+        LoopTimers* timers = timers_[conn->loop];
+        pthread_mutex_lock(&timers->mutex);
+        timers->wheel->cancel(&conn->timer);
+        pthread_mutex_unlock(&timers->mutex);
+    }
+
+    // 关闭描述符之前，把本线程积累的引用该描述符的操作交给内核，之后描述符可能被复用
+    if (options_.backend == IO_BACKEND_URING)
+        conn->uring->submit();
+
+    handleClientClose(fd);
+}
+
+/* 修改已连接套接字在epoll上关注的事件
+ * 发送缓冲区有数据时才关注EPOLLOUT
+ *
+ * @param conn 客户端连接
+ * @param wantWrite 是否关注EPOLLOUT
+ */
+void Server::updateEvents(Connection* conn, bool wantWrite) {
+    struct epoll_event ev;
+
+    ev.data.fd = conn->fd;
+    ev.events = EPOLLIN | EPOLLET;
+    if (wantWrite)
+        ev.events |= EPOLLOUT;
+    epoll_ctl(conn->epollFd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/* 将发送队列中的数据尽量发送出去
+ * 每次用sendmsg发送队列中的多个片段，直到队列清空或EAGAIN
+ *
+ * @param conn 客户端连接，调用者已对outputMutex加锁
+ * @return true : 发送队列已清空; false : 还有数据未发送
+ */
+bool Server::flushOutput(Connection* conn) {
+    OutputQueue& output = conn->output;
+    struct iovec iov[MAX_IOVECS];
+    struct msghdr msg;
+
+    while (!output.empty()) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = output.gather(iov, MAX_IOVECS);
+
+        ssize_t bytesSend = ::sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+
+        if (bytesSend > 0) {
+            output.consume(bytesSend);
+        } else if (bytesSend == -1 && errno == EINTR) {
+            continue;
+        } else if (bytesSend == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return false;
+        } else { // 连接出错，由读事件负责释放连接
+            output.clear();
+            shutdown(conn->fd, SHUT_RDWR);
+            return true;
+        }
+    }
+
+    return true;
+}
+
+// 当前线程本轮事件处理中产生了待发送数据的连接，见flushPending
+static thread_local std::vector<Connection*> pendingFlush;
+
+/* 把数据放入发送队列之后调用
+ * 发送队列原来为空时，把连接加入当前线程的待发送列表，
+ * 原来不为空时，说明已经在某个待发送列表中，或者正在等待EPOLLOUT
+ *
+ * @param conn 客户端连接，调用者已对outputMutex加锁
+ * @param wasEmpty 放入数据之前发送队列是否为空
+ */
+static void queueFlush(Connection* conn, bool wasEmpty) {
+    if (wasEmpty && !conn->flushQueued) {
+        conn->flushQueued = true;
+        pendingFlush.push_back(conn);
+    }
+}
+
+/* 发送当前线程待发送列表中所有连接的数据
+ * 在每轮事件处理完之后调用，这一轮中发给同一个连接的多个回复合并为一次sendmsg，
+ * 未发送完的连接关注EPOLLOUT，由handleWrite继续发送;
+ * 积压的连接发送之后可能降到低水位以下，由checkDrained恢复，恢复中产生的数据也在这里发送
+ */
+void Server::flushPending() {
+    for (size_t i = 0; i < pendingFlush.size(); i++) {
+        Connection* conn = pendingFlush[i];
+
+        pthread_mutex_lock(&conn->outputMutex);
+        conn->flushQueued = false;
+        if (options_.backend == IO_BACKEND_URING) {
+            if (!conn->output.empty() && !conn->sendInFlight)
+                conn->uring->send(conn);
+        } else if (!conn->output.empty() && !flushOutput(conn)) {
+            updateEvents(conn, true);
+        }
+        countOutput(conn);
+        pthread_mutex_unlock(&conn->outputMutex);
+
+        checkDrained(conn);
+    }
+    pendingFlush.clear();
+}
+
+void Server::handleWrite(int fd) {
+    Connection* conn = conns_[fd];
+
+    pthread_mutex_lock(&conn->outputMutex);
+    if (flushOutput(conn))
+        updateEvents(conn, false);
+    countOutput(conn);
+    pthread_mutex_unlock(&conn->outputMutex);
+
+    checkDrained(conn);
+}
+
+/* 取得描述符对应的连接对象，第一次使用该描述符时分配
+ * 对象一直保留到服务器析构，槽位是原子的，输出运行指标的线程不加锁读取
+ *
+ * @param fd 已连接套接字，小于MAX_CONNECTIONS
+ * @return 连接对象，由调用者reset
+ */
+Connection* Server::slotOf(int fd) {
+    Connection* conn = conns_[fd].load(std::memory_order_acquire);
+
+    if (conn == NULL) {
+        conn = new Connection();
+        conns_[fd].store(conn, std::memory_order_release);
+    }
+    return conn;
+}
+
+/* 找到发往fd的数据应放入的连接
+ * fd是网关会话的会话键时返回网关连接，并在sessionHeader中写好会话帧的头部
+ *
+ * @param fd 客户端套接字或会话键
+ * @param sessionHeader 至少SESSION_HEADER_SIZE字节
+ * @param len 要发送的内层帧的长度
+ * @return Connection* 目标连接; NULL : 会话已结束
+ */
+Connection* Server::connectionOf(int fd, char* sessionHeader, size_t len) {
+    if (fd < MAX_CONNECTIONS)
+        return conns_[fd];
+
+    uint64_t session = sessions_[fd - MAX_CONNECTIONS].load(std::memory_order_acquire);
+    if (session == 0)
+        return NULL;
+
+    putSessionHeader(sessionHeader, (uint32_t)session, len);
+    return conns_[(session >> 32) - 1];
+}
+
+/* 向客户端发送数据
+ * 数据放入发送队列，由本轮事件处理完之后的flushPending统一发送;
+ * 发给网关会话时加上会话帧的头部，同一个网关连接上发给各个会话的数据一起发送
+ *
+ * @param fd 客户端套接字或会话键
+ * @param buf 数据
+ * @param len 数据长度
+ */
+void Server::Send(int fd, void* buf, size_t len) {
+    char header[SESSION_HEADER_SIZE];
+    Connection* conn = connectionOf(fd, header, len);
+    bool wasEmpty;
+
+    if (conn == NULL)
+        return ;
+
+    pthread_mutex_lock(&conn->outputMutex);
+
+    wasEmpty = conn->output.empty();
+    if (fd >= MAX_CONNECTIONS)
+        conn->output.append(header, sizeof(header));
+    conn->output.append((const char*)buf, len);
+    queueFlush(conn, wasEmpty);
+    checkBacklog(conn);
+    countOutput(conn);
+
+    pthread_mutex_unlock(&conn->outputMutex);
+}
+
+/* 向客户端发送共享的数据块
+ * 发送队列只保存指针并持有一个引用，发送完后释放，不拷贝数据;
+ * 发给网关会话时只另外拷贝会话帧的头部
+ *
+ * @param fd 客户端套接字或会话键
+ * @param payload 数据块
+ */
+void Server::Send(int fd, Payload* payload) {
+    char header[SESSION_HEADER_SIZE];
+    Connection* conn = connectionOf(fd, header, payload->size());
+    bool wasEmpty;
+
+    if (conn == NULL)
+        return ;
+
+    pthread_mutex_lock(&conn->outputMutex);
+
+    wasEmpty = conn->output.empty();
+    if (fd >= MAX_CONNECTIONS)
+        conn->output.append(header, sizeof(header));
+    conn->output.append(payload);
+    queueFlush(conn, wasEmpty);
+    checkBacklog(conn);
+    countOutput(conn);
+
+    pthread_mutex_unlock(&conn->outputMutex);
+}
+
+// 放入数据之后检查发送队列是否超过高水位，调用者已对outputMutex加锁
+void Server::checkBacklog(Connection* conn) {
+    if (options_.outputHighWater > 0 && !conn->backlogged
+        && conn->output.size() > options_.outputHighWater) {
+        setBacklogged(conn, true);
+        backlogs_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+/* 修改连接的积压状态，同时维护积压连接的集合，运行指标只遍历该集合
+ *
+ * @param conn 客户端连接，调用者已对outputMutex加锁
+ * @param on 是否积压
+ */
+void Server::setBacklogged(Connection* conn, bool on) {
+    if (conn->backlogged == on)
+        return ;
+
+    conn->backlogged = on;
+    pthread_mutex_lock(&backlogMutex_);
+    if (on)
+        backlogged_.insert(conn->fd);
+    else
+        backlogged_.erase(conn->fd);
+    pthread_mutex_unlock(&backlogMutex_);
+}
+
+/* 把接收缓冲区自上次统计以来的变化计入运行指标
+ * 在修改接收缓冲区的临界区结束前调用一次，不必每次修改都调用
+ *
+ * @param conn 客户端连接，调用者已对inputMutex加锁
+ */
+void Server::countInput(Connection* conn) {
+    size_t size = conn->input.size();
+
+    metrics_.adjust(GAUGE_INPUT_BYTES, (int64_t)size - (int64_t)conn->inputCounted);
+    conn->inputCounted = size;
+}
+
+// 同countInput，统计发送队列，调用者已对outputMutex加锁
+void Server::countOutput(Connection* conn) {
+    size_t size = conn->output.size();
+
+    metrics_.adjust(GAUGE_OUTPUT_BYTES, (int64_t)size - (int64_t)conn->outputCounted);
+    conn->outputCounted = size;
+}
+
+/* 把推送帧放入发送队列，标记为可丢弃
+ * 发给网关会话时，会话帧的头部和推送帧拷贝为一个数据块，丢弃时一起丢弃
+ *
+ * @param conn 目标连接，调用者已对outputMutex加锁
+ * @param fd 客户端套接字或会话键
+ * @param header connectionOf写好的会话帧头部，fd不是会话键时不使用
+ * @param frame OP_DELIVER帧
+ */
+void Server::queuePush(Connection* conn, int fd, const char* header, Payload* frame) {
+    bool wasEmpty = conn->output.empty();
+
+    if (fd >= MAX_CONNECTIONS) {
+        Payload* whole = Payload::create(SESSION_HEADER_SIZE + frame->size());
+        memcpy(whole->data(), header, SESSION_HEADER_SIZE);
+        memcpy(whole->data() + SESSION_HEADER_SIZE, frame->data(), frame->size());
+        conn->output.append(whole, true);
+        whole->release();
+    } else {
+        conn->output.append(frame, true);
+    }
+    queueFlush(conn, wasEmpty);
+}
+
+/* 向开启了推送的接收方推送一条消息
+ * 接收方已经下线（isCurrent为false）时不推送，与下线后才发出的消息相同;
+ * 接收方的发送队列超过高水位（慢消费者）时按slowPolicy处理 :
+ * SLOW_DROP_OLDEST : 放入后丢弃队列中最早的推送帧，直到降到低水位，回复不会被丢弃
+ * SLOW_COALESCE : 存入收件箱，降到低水位后由resumePush补发，补发之前的推送也存入收件箱以保持顺序
+ * SLOW_DISCONNECT : 关闭连接，之后由读事件释放
+ *
+ * @param to 在usersMutex_内记下的接收方
+ * @param frame 编码好的OP_DELIVER帧
+ * @param msg 消息，数据是一个Message
+ * @param seq 消息在日志中的序号，存入收件箱时记下
+ */
+void Server::pushMessage(const Recipient& to, Payload* frame, Payload* msg, uint64_t seq) {
+    char header[SESSION_HEADER_SIZE];
+    Connection* conn;
+
+    conn = connectionOf(to.fd, header, frame->size());
+    if (conn == NULL)
+        return ;
+
+    uint64_t now = options_.messageTtlMs > 0 ? nowMs() : 0;
+
+    pthread_mutex_lock(&conn->outputMutex);
+
+    if (!isCurrent(conn, to)) {
+        pthread_mutex_unlock(&conn->outputMutex);
+        return ;
+    }
+
+    if (options_.outputHighWater == 0) {
+        bool wasEmpty = conn->output.empty();
+
+        if (to.fd >= MAX_CONNECTIONS)
+            conn->output.append(header, sizeof(header));
+        conn->output.append(frame);
+        queueFlush(conn, wasEmpty);
+    } else if (options_.slowPolicy == SLOW_COALESCE && (conn->backlogged || conn->pushDeferred)) {
+        conn->pushDeferred = true;
+        metrics_.lock(&msgMutex_, LOCK_MSG);
+        pushInbox(to.index, msg, seq, now);
+        pthread_mutex_unlock(&msgMutex_);
+        deferredPushes_.fetch_add(1, std::memory_order_relaxed);
+    } else if (options_.slowPolicy == SLOW_DISCONNECT && conn->backlogged) {
+        if (!conn->slowClosing) {
+            conn->slowClosing = true;
+            shutdown(conn->fd, SHUT_RDWR);
+            slowDisconnects_.fetch_add(1, std::memory_order_relaxed);
+        }
+    } else {
+        queuePush(conn, to.fd, header, frame);
+        checkBacklog(conn);
+        if (options_.slowPolicy == SLOW_DROP_OLDEST && conn->output.size() > options_.outputHighWater)
+            droppedPushes_.fetch_add(conn->output.dropOldest(options_.outputLowWater),
+                                     std::memory_order_relaxed);
+    }
+
+    countOutput(conn);
+    pthread_mutex_unlock(&conn->outputMutex);
+}
+
+/* 发送队列变短之后调用，调用者不持有任何锁
+ * 积压的连接降到低水位以下时清除积压状态，补发SLOW_COALESCE下存入收件箱的推送，继续处理暂停的请求
+ *
+ * @param conn 客户端连接
+ */
+void Server::checkDrained(Connection* conn) {
+    uint32_t generation;
+    bool deferred;
+
+    if (!conn->backlogged.load(std::memory_order_relaxed))
+        return ;
+
+    pthread_mutex_lock(&conn->outputMutex);
+    if (!conn->backlogged || conn->output.size() > options_.outputLowWater) {
+        pthread_mutex_unlock(&conn->outputMutex);
+        return ;
+    }
+    setBacklogged(conn, false);
+    deferred = conn->pushDeferred;
+    generation = conn->generation;
+    pthread_mutex_unlock(&conn->outputMutex);
+
+    if (deferred)
+        resumePush(conn, generation);
+    resumeInput(conn);
+}
+
+/* 补发SLOW_COALESCE下存入收件箱的推送
+ * 该连接（网关连接还包括其上的所有会话）上开启了推送的用户，收件箱中的消息都编码为推送帧，
+ * 在同一次outputMutex加锁期间放入发送队列，之后的推送排在它们后面
+ *
+ * @param conn 客户端连接
+ * @param generation 清除积压状态时连接的代数，连接已经释放时不补发
+ */
+void Server::resumePush(Connection* conn, uint32_t generation) {
+    std::vector<int> keys;
+    uint64_t before = 0;
+    Payload* msg;
+
+    pthread_mutex_lock(&conn->inputMutex);
+    keys.push_back(conn->fd);
+    for (std::unordered_map<uint32_t, int>::iterator it = conn->sessions.begin();
+         it != conn->sessions.end(); ++it)
+        keys.push_back(it->second);
+    pthread_mutex_unlock(&conn->inputMutex);
+
+    if (options_.messageTtlMs > 0)
+        before = expiredBefore(nowMs(), options_.messageTtlMs);
+
+    metrics_.lock(&usersMutex_, LOCK_USERS);
+    pthread_mutex_lock(&conn->outputMutex);
+
+    // 期间再次积压时留到下一次降到低水位
+    if (conn->generation == generation && conn->pushDeferred && !conn->backlogged) {
+        metrics_.lock(&msgMutex_, LOCK_MSG);
+        for (size_t i = 0; i < keys.size(); i++) {
+            int index = users_.findByFd(keys[i]);
+            if (index == -1 || !users_[index].push)
+                continue;
+
+            size_t removed = 0;
+            if (options_.messageTtlMs > 0)
+                removed = inboxPool_.expire(inboxes_[index], before);
+            while (inboxPool_.pop(inboxes_[index], msg)) {
+                char header[SESSION_HEADER_SIZE];
+                Payload* frame = makeDeliverFrame(msg);
+
+                if (connectionOf(keys[i], header, frame->size()) == conn)
+                    queuePush(conn, keys[i], header, frame);
+                frame->release();
+                msg->release();
+                removed++;
+            }
+            if (removed > 0)
+                logInbox(LOG_INBOX_POP, index, removed);
+        }
+        pthread_mutex_unlock(&msgMutex_);
+
+        conn->pushDeferred = false;
+        checkBacklog(conn);
+        countOutput(conn);
+    }
+
+    pthread_mutex_unlock(&conn->outputMutex);
+    pthread_mutex_unlock(&usersMutex_);
+}
+
+/* 发送队列降到低水位以下之后，继续处理暂停时留在接收缓冲区中的请求，
+ * 之后epoll后端继续读取（暂停期间到达的数据不会再产生边缘触发的事件），io_uring后端重新提交接收
+ *
+ * @param conn 客户端连接
+ */
+void Server::resumeInput(Connection* conn) {
+    int fd = conn->fd;
+    bool closed, paused;
+
+    pthread_mutex_lock(&conn->inputMutex);
+    if (!conn->readPaused) {
+        pthread_mutex_unlock(&conn->inputMutex);
+        return ;
+    }
+
+    closed = !processInput(conn);
+    countInput(conn);
+    paused = conn->readPaused;
+    if (!closed && !paused && conn->recvState == RECV_STOPPED) {
+        conn->recvState = RECV_ACTIVE;
+        conn->uring->addConnection(conn);
+    }
+    pthread_mutex_unlock(&conn->inputMutex);
+
+    if (closed)
+        releaseClient(fd);
+    else if (!paused && options_.backend == IO_BACKEND_EPOLL)
+        handleRead(fd);
+}
+
+/* @param fd 客户端套接字或会话键
+ * @return 该客户端使用的协议，网关会话总是PROTOCOL_COMPACT
+ */
+int Server::protocolOf(int fd) {
+    return fd < MAX_CONNECTIONS ? conns_[fd].load()->protocol : PROTOCOL_COMPACT;
+}
+
+/* 把连接认证为网关连接
+ * 只有服务器配置了口令、使用紧凑协议的普通连接才能认证
+ *
+ * @param fd 客户端套接字
+ * @param token 口令
+ */
+void Server::gatewayAuth(int fd, StringView token) {
+    int ret = GATEWAY_FAIL;
+
+    if (fd < MAX_CONNECTIONS && sessions_ != NULL && conns_[fd].load()->protocol == PROTOCOL_COMPACT
+        && token == options_.gatewayToken) {
+        conns_[fd].load()->gateway = true;
+        ret = GATEWAY_SUCCESS;
+    }
+
+    replyResult(fd, ret);
+}
+
+/* 取得网关连接上某个会话的会话键，第一次出现时分配
+ *
+ * @param conn 网关连接，调用者已对inputMutex加锁
+ * @param sid 会话号
+ * @return 会话键; -1 : 会话数已满
+ */
+int Server::openSession(Connection* conn, uint32_t sid) {
+    std::unordered_map<uint32_t, int>::iterator it = conn->sessions.find(sid);
+    int slot;
+
+    if (it != conn->sessions.end())
+        return it->second;
+
+    pthread_mutex_lock(&sessionsMutex_);
+    if (!freeSessions_.empty()) {
+        slot = freeSessions_.back();
+        freeSessions_.pop_back();
+    } else if (nextSession_ < MAX_SESSIONS) {
+        slot = nextSession_++;
+    } else {
+        slot = -1;
+    }
+    pthread_mutex_unlock(&sessionsMutex_);
+
+    if (slot == -1)
+        return -1;
+
+    sessions_[slot].store((uint64_t)(conn->fd + 1) << 32 | sid, std::memory_order_release);
+    conn->sessions[sid] = MAX_CONNECTIONS + slot;
+    return MAX_CONNECTIONS + slot;
+}
+
+/* 结束一个会话 : 会话上登录的用户下线，槽位的代数加一，释放槽位
+ * 代数在下线之后、在网关连接的outputMutex内修改，之前记下的接收方不会再推送到复用该槽位的会话
+ * 调用者已把它从网关连接的sessions中移除，可以持有网关连接的inputMutex
+ *
+ * @param conn 网关连接
+ * @param key 会话键
+ */
+void Server::closeSession(Connection* conn, int key) {
+    int slot = key - MAX_CONNECTIONS;
+
+    signOut(key);
+
+    pthread_mutex_lock(&conn->outputMutex);
+    sessionGenerations_[slot].fetch_add(1, std::memory_order_relaxed);
+    pthread_mutex_unlock(&conn->outputMutex);
+    sessions_[slot].store(0, std::memory_order_release);
+
+    pthread_mutex_lock(&sessionsMutex_);
+    freeSessions_.push_back(slot);
+    pthread_mutex_unlock(&sessionsMutex_);
+}
+
+/* 回复一个返回值
+ *
+ * @param fd 客户端套接字
+ * @param ret 返回值，如SIGN_UP_SUCCESS
+ */
+void Server::replyResult(int fd, int ret) {
+    if (protocolOf(fd) == PROTOCOL_COMPACT) {
+        std::vector<char> out;
+        FrameWriter writer(out, OP_RESULT);
+        writer.putU32(ret);
+        writer.finish();
+        Send(fd, &out[0], out.size());
+    } else {
+        Send(fd, (void*)&ret, sizeof(ret));
+    }
+}
+
+/* 把用户名或房间名列表编码为回复
+ * 旧协议的客户端最多只能接收1000个名字，格式中没有表示截断的办法
+ *
+ * @param protocol PROTOCOL_LEGACY或PROTOCOL_COMPACT
+ * @param names 名字列表
+ * @param cursor 紧凑协议的回复放不下全部名字时为最后一个名字，否则为空
+ * @return Payload* 编码后的回复，引用计数为1
+ */
+Payload* Server::encodeNames(int protocol, const std::vector<std::string>& names,
+                             const std::string& cursor) {
+    std::vector<char> out;
+
+    if (protocol == PROTOCOL_COMPACT) {
+        FrameWriter writer(out, OP_NAMES);
+        writer.putU32(names.size());
+        for (size_t i = 0; i < names.size(); i++)
+            writer.putField(names[i]);
+        writer.putField(cursor);
+        writer.finish();
+    } else {
+        int count = std::min(names.size(), (size_t)1000);
+
+        out.resize(sizeof(count) + count * sizeof(Name));
+        memcpy(&out[0], &count, sizeof(count));
+        for (int i = 0; i < count; i++) {
+            Name* name = (Name*)&out[sizeof(count) + i * sizeof(Name)];
+            strncpy(name->name, names[i].c_str(), sizeof(name->name) - 1);
+        }
+    }
+
+    return Payload::create(&out[0], out.size());
+}
+
+/* 回复在线用户列表或房间列表
+ * 列表未变化时直接发送缓存的回复;变化后第一次请求时重新编码，
+ * 同时请求的其他客户端等待并共用这一次的结果
+ * 紧凑协议的一帧放不下时只回复能放下的部分，并在回复中带上游标，客户端从游标起分页读取剩下的部分
+ *
+ * @param fd 客户端套接字
+ * @param rooms true : 房间列表; false : 在线用户列表
+ */
+void Server::replyDirectory(int fd, bool rooms) {
+    Directory& directory = rooms ? roomNames_ : onlineUsers_;
+    int protocol = protocolOf(fd);
+    Payload* reply = directory.acquire(protocol);
+
+    if (reply == NULL) {
+        pthread_mutex_lock(directory.rebuildMutex());
+
+        // 等待期间可能已经被其他线程重建
+        reply = directory.acquire(protocol);
+        if (reply == NULL) {
+            std::vector<std::string> names;
+            std::string cursor;
+            uint64_t version;
+
+            if (protocol == PROTOCOL_COMPACT) {
+                if (directory.page("", "", (size_t)-1, NAMES_FRAME_BUDGET, names, version)
+                    && !names.empty())
+                    cursor = names.back();
+            } else {
+                directory.page("", "", 1000, (size_t)-1, names, version);
+            }
+            reply = encodeNames(protocol, names, cursor);
+            directory.publish(protocol, version, reply);
+        }
+
+        pthread_mutex_unlock(directory.rebuildMutex());
+    }
+
+    Send(fd, reply);
+    reply->release();
+}
+
+/* 分页回复在线用户列表或房间列表，只用于紧凑协议
+ * 按名字顺序返回游标之后带有指定前缀的名字，
+ * 回复中的游标是这一页的最后一个名字，客户端用它请求下一页;目录在翻页期间变化不影响游标
+ *
+ * @param fd 客户端套接字
+ * @param rooms true : 房间列表; false : 在线用户列表
+ * @param prefix 名字前缀，空串表示全部
+ * @param args "上限"或"上限 游标"，上限为0或缺省时取DIRECTORY_PAGE_MAX
+ */
+void Server::replyPage(int fd, bool rooms, StringView prefix, StringView args) {
+    Directory& directory = rooms ? roomNames_ : onlineUsers_;
+    std::vector<std::string> names;
+    std::string after, cursor;
+    uint64_t version, limit;
+    size_t used;
+
+    limit = args.toU64(&used);
+    if (used < args.size() && args[used] == ' ')
+        after = args.substr(used + 1).str();
+    if (limit == 0 || limit > DIRECTORY_PAGE_MAX)
+        limit = DIRECTORY_PAGE_MAX;
+
+    if (directory.page(prefix.str(), after, limit, NAMES_FRAME_BUDGET, names, version)
+        && !names.empty())
+        cursor = names.back();
+
+    std::vector<char> out;
+    FrameWriter writer(out, OP_NAMES_PAGE);
+    writer.putU32(version);
+    writer.putField(cursor);
+    writer.putU32(names.size());
+    for (size_t i = 0; i < names.size(); i++)
+        writer.putField(names[i]);
+    writer.finish();
+    Send(fd, &out[0], out.size());
+}
+
+/* 回复某个版本之后在线用户或房间的变化，只用于紧凑协议
+ * 版本太旧或变化太多时回复需要重新读取，客户端应重新分页读取完整的列表
+ *
+ * @param fd 客户端套接字
+ * @param rooms true : 房间列表; false : 在线用户列表
+ * @param since 客户端已知的版本号，取自之前的分页或增量回复
+ */
+void Server::replyDelta(int fd, bool rooms, StringView since) {
+    Directory& directory = rooms ? roomNames_ : onlineUsers_;
+    std::vector<std::string> added, removed;
+    uint64_t version;
+    bool ok;
+
+    ok = directory.changesSince(since.toU64(), NAMES_FRAME_BUDGET,
+                                added, removed, version);
+
+    std::vector<char> out;
+    FrameWriter writer(out, OP_NAMES_DELTA);
+    writer.putU32(version);
+    writer.putU32(ok ? 0 : 1);
+    writer.putU32(added.size());
+    for (size_t i = 0; i < added.size(); i++)
+        writer.putField(added[i]);
+    writer.putU32(removed.size());
+    for (size_t i = 0; i < removed.size(); i++)
+        writer.putField(removed[i]);
+    writer.finish();
+    Send(fd, &out[0], out.size());
+}
+
+/* 回复历史消息，只用于紧凑协议
+ * 从游标开始向后读取消息日志中的聊天记录，直接访问映射的段，读取时不持有服务器的锁;
+ * 一次最多检查HISTORY_SCAN_LIMIT条记录，回复中的游标是下一条要检查的记录的序号
+ * 未登录、不是房间成员或没有开启日志时回复空的一页
+ *
+ * @param fd 客户端套接字
+ * @param room true : 房间的群聊; false : 与一个用户之间的单聊
+ * @param name 房间名或对方的用户名
+ * @param args "上限"或"上限 游标"，上限为0或缺省时取一帧能容纳的最多条数
+ */
+void Server::replyHistory(int fd, bool room, StringView name, StringView args) {
+    // 一个OP_HISTORY帧最多能容纳的消息数，游标最多20个字符
+    const size_t frameLimit = (MAX_FRAME_SIZE - 64) / (sizeof(Message) + 6);
+    std::vector<Payload*> msgs;
+    std::string cursor;
+    Name self = {""};
+    bool allowed = false;
+    uint64_t limit;
+    size_t used;
+    int index;
+
+    limit = args.toU64(&used);
+    if (limit == 0 || limit > frameLimit)
+        limit = frameLimit;
+
+    metrics_.lock(&usersMutex_, LOCK_USERS);
+    index = users_.findByFd(fd);
+    if (index != -1) {
+        copyField(self.name, sizeof(self.name), users_[index].name);
+        if (room) {
+            metrics_.lock(&roomsMutex_, LOCK_ROOMS);
+            int id = rooms_.findByName(name);
+            allowed = id != -1 && rooms_[id].members.contains(index);
+            pthread_mutex_unlock(&roomsMutex_);
+        } else {
+            allowed = true;
+        }
+    }
+    pthread_mutex_unlock(&usersMutex_);
+
+    if (allowed && log_ != NULL) {
+        StringView me(self.name);
+        uint64_t from, stop, next;
+
+        if (used < args.size() && args[used] == ' ') {
+            from = args.substr(used + 1).toU64();
+        } else {
+            uint64_t end = log_->nextSeq();
+            from = end > HISTORY_SCAN_LIMIT ? end - HISTORY_SCAN_LIMIT : 0;
+        }
+        stop = from + HISTORY_SCAN_LIMIT;
+
+        next = log_->scan(from, [&] (uint64_t seq, const char* data, size_t len) {
+            ChatRecord record;
+
+            if (parseChatRecord(data, len, record)
+                && (room ? record.opcode == OP_GPCHAT && record.dst == name
+                         : record.opcode == OP_SGCHAT && ((record.src == me && record.dst == name)
+                                                          || (record.src == name && record.dst == me))))
+                msgs.push_back(makeMessage(record));
+            return msgs.size() < limit && seq + 1 < stop;
+        });
+        if (next < log_->nextSeq())
+            cursor = std::to_string(next);
+    }
+
+    std::vector<char> out;
+    FrameWriter writer(out, OP_HISTORY);
+    writer.putField(cursor);
+    writer.putU32(msgs.size());
+    for (size_t i = 0; i < msgs.size(); i++) {
+        const Message* msg = (const Message*)msgs[i]->data();
+        writer.putField(msg->command, strlen(msg->command));
+        writer.putField(msg->dst, strlen(msg->dst));
+        writer.putField(msg->message, strlen(msg->message));
+        msgs[i]->release();
+    }
+    writer.finish();
+    Send(fd, &out[0], out.size());
+}
+
+/* 回复getmsg请求
+ * 旧协议一次只能回复一条消息，没有消息时回复message为"none"的Message
+ *
+ * @param fd 客户端套接字
+ * @param msgs 要发送的消息，每个数据块中是一个Message
+ */
+void Server::replyMessages(int fd, const std::vector<Payload*>& msgs) {
+    if (protocolOf(fd) == PROTOCOL_COMPACT) {
+        std::vector<char> out;
+        FrameWriter writer(out, OP_MESSAGES);
+        writer.putU32(msgs.size());
+        for (size_t i = 0; i < msgs.size(); i++) {
+            const Message* msg = (const Message*)msgs[i]->data();
+            writer.putField(msg->command, strlen(msg->command));
+            writer.putField(msg->dst, strlen(msg->dst));
+            writer.putField(msg->message, strlen(msg->message));
+        }
+        writer.finish();
+        Send(fd, &out[0], out.size());
+    } else if (msgs.empty()) {
+        Message none;
+        memset(&none, 0, sizeof(none));
+        strcpy(none.message, "none");
+        Send(fd, &none, sizeof(none));
+    } else {
+        Send(fd, msgs[0]);
+    }
+}
+
+/* 客户端关闭处理
+ * 网关连接关闭时，其上的所有会话一并结束
+ *
+ * @param fd 客户端套接字
+ */
+void Server::handleClientClose(int fd) {
+    Connection* conn = conns_[fd];
+    std::unordered_map<uint32_t, int> sessions;
+
+    pthread_mutex_lock(&conn->inputMutex);
+    sessions.swap(conn->sessions);
+    conn->gateway = false;
+    pthread_mutex_unlock(&conn->inputMutex);
+
+    for (std::unordered_map<uint32_t, int>::iterator it = sessions.begin(); it != sessions.end(); ++it)
+        closeSession(conn, it->second);
+
+    signOut(fd);
+
+    // 先使用户下线再关闭 : 之后的单聊和群聊不会再把该描述符记为接收方;
+    // 之前记下的接收方带有连接的代数，描述符被新连接复用时reset使代数加一，推送时由isCurrent丢弃
+    close(fd);
+}
+
+/* 使该连接或会话上登录的用户下线
+ *
+ * @param fd 客户端套接字或会话键
+ */
+void Server::signOut(int fd) {
+    int index;
+
+    metrics_.lock(&usersMutex_, LOCK_USERS);
+    index = users_.unbind(fd);
+    if (index != -1) {
+        onlineUsers_.remove(users_[index].name);
+        metrics_.lock(&roomsMutex_, LOCK_ROOMS);
+        rooms_.setOnline(index, users_[index].rooms, false);
+        pthread_mutex_unlock(&roomsMutex_);
+    }
+    pthread_mutex_unlock(&usersMutex_);
+}
+
+/* 客户端注册
+ *
+ * @param fd 客户端套接字
+ * @param name 用户名
+ * @param password 密码
+ */
+void Server::clientSignUp(int fd, StringView name, StringView password) {
+    int ret = 0, index;
+
+    metrics_.lock(&usersMutex_, LOCK_USERS); 
+
+    index = users_.add(name, password);
+    if (index == -1) {
+        ret = SIGN_UP_FAIL; 
+    } else {
+        metrics_.lock(&msgMutex_, LOCK_MSG);
+        inboxes_.push_back(InboxPool::emptyInbox());
+        pthread_mutex_unlock(&msgMutex_);
+
+        // 在usersMutex_内追加，日志中用户的顺序与下标一致
+        if (accounts_ != NULL)
+            accounts_->signUp(users_[index].name, users_[index].password);
+        ret = SIGN_UP_SUCCESS;
+    }
+
+    pthread_mutex_unlock(&usersMutex_);
+
+    replyResult(fd, ret);
+}
+
+/* 客户端登录
+ *
+ * @param fd 客户端套接字
+ * @param name 用户名
+ * @param password 密码
+ */
+void Server::clientSignIn(int fd, StringView name, StringView password) {
+    int ret, index;
+
+    metrics_.lock(&usersMutex_, LOCK_USERS); 
+
+    index = users_.findByName(name);
+    if (index == -1) {
+        ret = SIGN_IN_ACCOUNT_NOT_EXISTENT;
+    } else if (users_[index].password == password) {
+        bool wasOnline = users_[index].online;
+        int previous = users_.bind(index, fd);
+
+        if (previous != -1)
+            onlineUsers_.remove(users_[previous].name);
+        if (!wasOnline)
+            onlineUsers_.add(users_[index].name);
+
+        metrics_.lock(&roomsMutex_, LOCK_ROOMS);
+        if (previous != -1)
+            rooms_.setOnline(previous, users_[previous].rooms, false);
+        rooms_.setOnline(index, users_[index].rooms, true);
+        pthread_mutex_unlock(&roomsMutex_);
+
+        ret = SIGN_IN_SUCCESS;
+    } else {
+        ret = SIGN_IN_PASSWORD_ERROR;
+    }
+
+    pthread_mutex_unlock(&usersMutex_);
+
+    replyResult(fd, ret);
+}
+
+/* 列出当前服务器上所有在线用户
+ *
+ * @param fd 客户端套接字
+ */
+void Server::lsUsers(int fd) {
+    replyDirectory(fd, false);
+}
+
+/* 单聊
+ *
+ * @param fd 客户端套接字
+ * @param usrName 目的客户端用户名
+ * @param content 聊天内容
+ */
+void Server::singleChat(int fd, StringView usrName, StringView content) {
+    int srcIndex;
+    Recipient to;
+    Name srcName = {""}; // 拷贝到栈上，解锁后users_可能扩容
+
+    metrics_.lock(&usersMutex_, LOCK_USERS);
+    srcIndex = users_.findByFd(fd);
+    if (srcIndex != -1)
+        copyField(srcName.name, sizeof(srcName.name), users_[srcIndex].name);
+
+    to.fd = -1;
+    to.index = users_.findByName(usrName);
+    if (to.index != -1 && users_[to.index].online) {
+        to.fd = users_[to.index].fd;
+        to.generation = generationOf(to.fd);
+        to.push = users_[to.index].push;
+    }
+    pthread_mutex_unlock(&usersMutex_);
+
+    if (to.fd != -1) {
+        // 先追加聊天记录，存入收件箱时记下它的序号
+        uint64_t seq = logMessage(OP_SGCHAT, srcName.name, usrName, content);
+        Payload* msg = makeMessage("sgchat", srcName.name, content);
+        Payload* frame = to.push ? makeDeliverFrame(msg) : NULL;
+
+        deliver(to, frame, msg, seq);
+
+        msg->release();
+        if (frame != NULL)
+            frame->release();
+    }
+}
 
-/* 客户端进入房间
+/* 群聊
  *
  * @param fd 客户端套接字
- * @param roomName 房间名
+ * @param grpName 群名字
+ * @param content 聊天内容
  */
-void Server::cdRoom(int fd, std::string roomName) {
-    int ret;
-    std::string userName;
+void Server::groupChat(int fd, StringView grpName, StringView content) {
+    Name srcName = {""};
+    char command[sizeof(Message::command)];
+    std::vector<Recipient> recipients;
+    int srcIndex, room;
 
-    pthread_mutex_lock(&usersMutex_);
+    metrics_.lock(&usersMutex_, LOCK_USERS);
+    metrics_.lock(&roomsMutex_, LOCK_ROOMS);
 
-    for (int i = 0; i < users_.size(); i++) {
-        if (users_[i].fd == fd) {
-            userName = users_[i].name;
-            break;
+    srcIndex = users_.findByFd(fd);
+    if (srcIndex != -1)
+        copyField(srcName.name, sizeof(srcName.name), users_[srcIndex].name);
+
+    room = rooms_.findByName(grpName);
+    if (room == -1) {
+        pthread_mutex_unlock(&roomsMutex_);
+        pthread_mutex_unlock(&usersMutex_);
+        return ;
+    }
+
+    // 只遍历在线成员，锁内只记下接收方，投递在锁外进行，与单聊相同
+    const std::vector<int>& online = rooms_[room].online.ids();
+    recipients.resize(online.size());
+    for (size_t i = 0; i < online.size(); i++) {
+        recipients[i].index = online[i];
+        recipients[i].fd = users_[online[i]].fd;
+        recipients[i].generation = generationOf(recipients[i].fd);
+        recipients[i].push = users_[online[i]].push;
+    }
+
+    pthread_mutex_unlock(&roomsMutex_);
+    pthread_mutex_unlock(&usersMutex_);
+
+    // 聊天记录只追加一次，存入各成员收件箱的记录只引用它的序号
+    uint64_t seq = logMessage(OP_GPCHAT, srcName.name, grpName, content);
+
+    // 消息和推送帧都只编码一次，所有成员共享，每个成员只多一个指针
+    snprintf(command, sizeof(command), "gpchat %s", srcName.name);
+    Payload* msg = makeMessage(command, grpName, content);
+    Payload* frame = makeDeliverFrame(msg);
+
+    for (size_t i = 0; i < recipients.size(); i++)
+        deliver(recipients[i], frame, msg, seq);
+
+    msg->release();
+    frame->release();
+}
+
+/* 启动时用持久化的账号和房间重建users_、rooms_和收件箱，所有用户都不在线
+ * 在处理任何请求之前调用，不需要加锁
+ *
+ * @param state AccountStore::open读取到的状态
+ */
+void Server::loadAccounts(const AccountState& state) {
+    users_.reserve(state.users.size());
+    rooms_.reserve(state.rooms.size());
+    inboxes_.reserve(state.users.size());
+
+    // 先统计每个房间的成员数，成员集合一次分配好
+    std::vector<size_t> members(state.rooms.size(), 0);
+    for (size_t i = 0; i < state.users.size(); i++) {
+        for (size_t j = 0; j < state.users[i].rooms.size(); j++)
+            members[state.users[i].rooms[j]]++;
+    }
+    for (size_t i = 0; i < state.rooms.size(); i++) {
+        rooms_.add(state.rooms[i]);
+        rooms_[i].members.reserve(members[i]);
+        roomNames_.add(state.rooms[i]);
+    }
+
+    for (size_t i = 0; i < state.users.size(); i++) {
+        const StoredUser& stored = state.users[i];
+        int index = users_.add(stored.name, stored.password);
+
+        inboxes_.push_back(InboxPool::emptyInbox());
+        users_[index].rooms.reserve(stored.rooms.size());
+        for (size_t j = 0; j < stored.rooms.size(); j++)
+            rooms_.join(stored.rooms[j], index, users_[index].rooms, false);
+    }
+}
+
+/* 把一条聊天消息追加到消息日志，不等待磁盘，在投递之前调用
+ * 记录是一个紧凑协议的帧 : opcode为OP_SGCHAT或OP_GPCHAT，字段依次是发送方、接收方或群名、内容
+ * 在所有服务器的锁之外调用，日志只有自己的一个短临界区
+ *
+ * @param opcode OP_SGCHAT或OP_GPCHAT
+ * @param srcName 发送方用户名
+ * @param dst 接收方用户名或群名
+ * @param content 聊天内容
+ * @return 记录的序号; LOG_APPEND_FAILED : 未开启日志或追加失败
+ */
+uint64_t Server::logMessage(int opcode, StringView srcName, StringView dst, StringView content) {
+    if (log_ == NULL)
+        return LOG_APPEND_FAILED;
+
+    std::vector<char> record;
+    FrameWriter writer(record, opcode);
+    writer.putField(srcName.data(), srcName.size());
+    writer.putField(dst.data(), dst.size());
+    writer.putField(content.data(), content.size());
+    writer.finish();
+    return log_->append(record.data(), record.size());
+}
+
+/* 在消息日志中记下一次收件箱的变化，调用者持有msgMutex_（启动时重放除外），
+ * 所以日志中每个收件箱的变化与收件箱本身的顺序一致
+ * 记录同样不等待磁盘 : 崩溃时最后一个组提交间隔内的变化会丢失，已经取走的消息可能再次投递
+ *
+ * @param opcode LOG_INBOX_PUSH或LOG_INBOX_POP
+ * @param index 用户下标
+ * @param value 聊天记录的序号或移除的消息数
+ */
+void Server::logInbox(int opcode, int index, uint64_t value) {
+    if (log_ == NULL || accounts_ == NULL)
+        return ;
+
+    std::vector<char> record;
+    FrameWriter writer(record, opcode);
+    writer.putU32(index);
+    writer.putU64(value);
+    writer.finish();
+    log_->append(record.data(), record.size());
+}
+
+/* 把消息放入用户的收件箱并记入日志，调用者持有msgMutex_
+ * 按策略丢弃新消息时不记录，挤掉最早一条消息时先记下它的移除
+ *
+ * @param index 用户下标
+ * @param msg 消息，数据是一个Message
+ * @param seq 消息的聊天记录的序号，追加失败时为LOG_APPEND_FAILED，重放时跳过
+ * @param now 投递的时间，单位毫秒
+ */
+void Server::pushInbox(int index, Payload* msg, uint64_t seq, uint64_t now) {
+    int count = inboxes_[index].count;
+
+    if (!inboxPool_.push(inboxes_[index], msg, now))
+        return ;
+    if (inboxes_[index].count == count)
+        logInbox(LOG_INBOX_POP, index, 1);
+    logInbox(LOG_INBOX_PUSH, index, seq);
+}
+
+/* 启动时按消息日志恢复收件箱中还没有被取走的消息
+ * 在loadAccounts之后、处理任何请求之前调用，不需要加锁;两遍遍历都直接读取映射的段 :
+ * 第一遍按顺序重放收件箱的变化，得到每个收件箱中剩下的聊天记录的序号，
+ * 第二遍从其中最小的序号开始读取这些聊天记录，还原为消息
+ *
+ * 恢复的消息以启动的时间作为投递时间;收件箱容量比之前小时按策略丢弃，
+ * 所以每个收件箱先记下移除日志中剩下的全部消息，再逐条记下实际放入的消息，之后的取出与之对应
+ */
+void Server::replayInboxes() {
+    std::vector<std::deque<uint64_t> > pending(inboxes_.size());
+    std::unordered_map<uint64_t, Payload*> messages;
+    uint64_t first = LOG_APPEND_FAILED;
+    uint64_t now = options_.messageTtlMs > 0 ? nowMs() : 0;
+    size_t found = 0;
+
+    log_->scan(0, [&pending] (uint64_t, const char* data, size_t len) {
+        uint32_t index;
+        uint64_t value;
+        int opcode;
+
+        if (!parseInboxRecord(data, len, opcode, index, value) || index >= pending.size())
+            return true;
+
+        std::deque<uint64_t>& inbox = pending[index];
+        if (opcode == LOG_INBOX_PUSH)
+            inbox.push_back(value);
+        else
+            inbox.erase(inbox.begin(), inbox.begin() + std::min(value, (uint64_t)inbox.size()));
+        return true;
+    });
+
+    for (size_t i = 0; i < pending.size(); i++) {
+        for (size_t j = 0; j < pending[i].size(); j++) {
+            messages[pending[i][j]] = NULL;
+            first = std::min(first, pending[i][j]);
+        }
+    }
+
+    if (!messages.empty()) {
+        log_->scan(first, [&messages, &found] (uint64_t seq, const char* data, size_t len) {
+            std::unordered_map<uint64_t, Payload*>::iterator it = messages.find(seq);
+            ChatRecord record;
+
+            if (it != messages.end() && parseChatRecord(data, len, record)) {
+                it->second = makeMessage(record);
+                found++;
+            }
+            return found < messages.size();
+        });
+    }
+
+    for (size_t i = 0; i < pending.size(); i++) {
+        if (pending[i].empty())
+            continue;
+
+        logInbox(LOG_INBOX_POP, i, pending[i].size());
+        for (size_t j = 0; j < pending[i].size(); j++) {
+            Payload* msg = messages[pending[i][j]];
+            if (msg != NULL)
+                pushInbox(i, msg, pending[i][j], now);
         }
     }
 
-    if (userName.empty())
+    for (std::unordered_map<uint64_t, Payload*>::iterator it = messages.begin();
+         it != messages.end(); ++it) {
+        if (it->second != NULL)
+            it->second->release();
+    }
+}
+
+/* 把消息交给接收方
+ * 接收方开启了推送时由pushMessage把推送帧放入其发送队列，否则把消息放入其收件箱等待getmsg取走，
+ * 两种情况都只增加数据块的引用，不拷贝
+ *
+ * @param to 在usersMutex_内记下的接收方
+ * @param frame 编码好的OP_DELIVER帧，to.push为false时可以为NULL
+ * @param msg 消息，数据是一个Message
+ * @param seq 消息在日志中的序号，logMessage的返回值
+ */
+void Server::deliver(const Recipient& to, Payload* frame, Payload* msg, uint64_t seq) {
+    if (to.push) {
+        pushMessage(to, frame, msg, seq);
+        return ;
+    }
+
+    uint64_t now = options_.messageTtlMs > 0 ? nowMs() : 0;
+
+    metrics_.lock(&msgMutex_, LOCK_MSG);
+    pushInbox(to.index, msg, seq, now);
+    pthread_mutex_unlock(&msgMutex_);
+}
+
+/* 描述符或会话键当前的代数，在usersMutex_内记下接收方时调用
+ * 用户绑定在fd上时，fd不会被关闭、会话键不会被释放（都在下线之后），所以记下的代数属于该用户的连接或会话
+ *
+ * @param fd 客户端套接字或会话键
+ * @return 连接的generation或会话槽位的代数
+ */
+uint32_t Server::generationOf(int fd) {
+    if (fd < MAX_CONNECTIONS)
+        return conns_[fd].load()->generation.load(std::memory_order_relaxed);
+    return sessionGenerations_[fd - MAX_CONNECTIONS].load(std::memory_order_relaxed);
+}
+
+/* 记下的接收方是否仍是conn上的同一个连接或会话
+ *
+ * @param conn connectionOf(to.fd)得到的连接，调用者已对outputMutex加锁
+ * @param to 接收方
+ * @return true : 可以推送; false : 接收方已下线，描述符或会话键可能已被复用
+ */
+bool Server::isCurrent(Connection* conn, const Recipient& to) {
+    if (to.fd < MAX_CONNECTIONS)
+        return conn->generation == to.generation;
+    return sessionGenerations_[to.fd - MAX_CONNECTIONS].load(std::memory_order_relaxed) == to.generation;
+}
+
+/* 客户端开启或关闭服务器推送
+ * 只有登录后且使用紧凑协议的连接才能开启推送
+ *
+ * @param fd 客户端套接字
+ * @param on "on"为开启，其他为关闭
+ */
+void Server::setPush(int fd, StringView on) {
+    int ret = PUSH_FAIL, index;
+
+    metrics_.lock(&usersMutex_, LOCK_USERS);
+    index = users_.findByFd(fd);
+    if (index != -1 && protocolOf(fd) == PROTOCOL_COMPACT) {
+        users_[index].push = (on == "on");
+        ret = PUSH_SUCCESS;
+    }
+    pthread_mutex_unlock(&usersMutex_);
+
+    replyResult(fd, ret);
+}
+
+/* 创建房间
+ *
+ * @param fd 客户端套接字
+ * @param roomName 要创建的房间名
+ */
+void Server::mkRoom(int fd, StringView roomName) {
+    metrics_.lock(&roomsMutex_, LOCK_ROOMS);
+
+    int ret, room;
+
+    room = rooms_.add(roomName);
+    if (room == -1) {
+        ret = MAKE_ROOM_FAIL; 
+    } else {
+        if (accounts_ != NULL)
+            accounts_->makeRoom(rooms_[room].name);
+        roomNames_.add(rooms_[room].name);
+        ret = MAKE_ROOM_SUCCESS;
+    }
+
+    pthread_mutex_unlock(&roomsMutex_);
+    replyResult(fd, ret);
+}
+
+/* 列出服务器上的所有房间名
+ *
+ * @param fd 客户端套接字
+ */
+void Server::lsRooms(int fd) {
+    replyDirectory(fd, true);
+}
+
+/* 客户端进入房间
+ *
+ * @param fd 客户端套接字
+ * @param roomName 房间名
+ */
+void Server::cdRoom(int fd, StringView roomName) {
+    int ret, index, room;
+
+    metrics_.lock(&usersMutex_, LOCK_USERS);
+    metrics_.lock(&roomsMutex_, LOCK_ROOMS);
+
+    index = users_.findByFd(fd);
+    room = rooms_.findByName(roomName);
+    if (index == -1 || room == -1)
         ret = GETINTO_ROOM_FAIL;
     else {
-        pthread_mutex_lock(&roomsMutex_);
-        auto iter = rooms_.find(roomName); 
-        if (iter == rooms_.end())
-            ret = GETINTO_ROOM_FAIL; 
-        else {
-            iter->second.push_back(userName);
-            ret = GETINTO_ROOM_SUCCESS;
-        }
-        pthread_mutex_unlock(&roomsMutex_);
+        // 已经是成员时也视为成功
+        if (rooms_.join(room, index, users_[index].rooms, true) && accounts_ != NULL)
+            accounts_->join(index, room);
+        ret = GETINTO_ROOM_SUCCESS;
     }
 
+    pthread_mutex_unlock(&roomsMutex_);
     pthread_mutex_unlock(&usersMutex_);
 
-    Send(fd, (void*)&ret, sizeof(ret));
+    replyResult(fd, ret);
 }
 
 /* 客户端退出房间
@@ -590,66 +2286,502 @@ void Server::cdRoom(int fd, std::string roomName) {
  * @param fd 客户端套接字
  * @param roomName 房间名
  */
-void Server::qtRoom(int fd, std::string roomName) {
-    int ret;
-    std::string userName;
+void Server::qtRoom(int fd, StringView roomName) {
+    int ret, index, room;
+
+    metrics_.lock(&usersMutex_, LOCK_USERS);
+    metrics_.lock(&roomsMutex_, LOCK_ROOMS);
+
+    index = users_.findByFd(fd);
+    room = rooms_.findByName(roomName);
+    if (index != -1 && room != -1 && rooms_.leave(room, index, users_[index].rooms)) {
+        if (accounts_ != NULL)
+            accounts_->leave(index, room);
+        ret = QUIT_ROOM_SUCCESS;
+    } else {
+        ret = QUIT_ROOM_FAIL;
+    }
 
-    pthread_mutex_lock(&usersMutex_);
+    pthread_mutex_unlock(&roomsMutex_);
+    pthread_mutex_unlock(&usersMutex_);
 
-    for (int i = 0; i < users_.size(); i++) {
-        if (users_[i].fd == fd) {
-            userName = users_[i].name;
-            break;
-        }
+    replyResult(fd, ret);
+}
+
+/* 从收件箱中取走消息
+ * 旧协议每次取走一条，紧凑协议每次最多取走maxCount条
+ *
+ * @param fd 客户端套接字
+ * @param maxCount 最多取走的消息数，为空时取GETMSG_BATCH
+ */
+void Server::getMsg(int fd, StringView maxCount) {
+    // 一个OP_MESSAGES帧最多能容纳的消息数
+    const size_t frameLimit = (MAX_FRAME_SIZE - 16) / (sizeof(Message) + 6);
+    std::vector<Payload*> msgs;
+    size_t limit = 1;
+    int index;
+
+    if (protocolOf(fd) == PROTOCOL_COMPACT) {
+        limit = maxCount.empty() ? GETMSG_BATCH : maxCount.toU64();
+        limit = std::max(std::min(limit, frameLimit), (size_t)1);
     }
 
-    if (userName.empty())
-        ret = QUIT_ROOM_FAIL;
-    else {
-        pthread_mutex_lock(&roomsMutex_);
-        auto iter = rooms_.find(roomName); 
-        if (iter == rooms_.end()) {
-            ret = QUIT_ROOM_FAIL; 
+    metrics_.lock(&usersMutex_, LOCK_USERS);
+    index = users_.findByFd(fd);
+    if (index != -1) {
+        Payload* msg;
+
+        size_t expired = 0;
+
+        metrics_.lock(&msgMutex_, LOCK_MSG);
+        if (options_.messageTtlMs > 0) // 不返回已过期但还没被sweepInboxes丢弃的消息
+            expired = inboxPool_.expire(inboxes_[index],
+                                        expiredBefore(nowMs(), options_.messageTtlMs));
+        while (msgs.size() < limit && inboxPool_.pop(inboxes_[index], msg))
+            msgs.push_back(msg);
+        if (expired + msgs.size() > 0)
+            logInbox(LOG_INBOX_POP, index, expired + msgs.size());
+        pthread_mutex_unlock(&msgMutex_);
+    }
+    pthread_mutex_unlock(&usersMutex_);
+
+    replyMessages(fd, msgs);
+    for (size_t i = 0; i < msgs.size(); i++)
+        msgs[i]->release();
+}
+
+/* 开启了任何超时时，为每个事件循环创建一个时间轮
+ * 开启消息有效期时在第0个时间轮中安排检查收件箱的定时器
+ *
+ * @param loops 事件循环的个数
+ */
+void Server::initTimers(size_t loops) {
+    uint64_t now = nowMs();
+
+    if (options_.idleTimeoutMs <= 0 && options_.pingIntervalMs <= 0
+        && options_.frameTimeoutMs <= 0 && options_.messageTtlMs <= 0)
+        return ;
+
+    for (size_t i = 0; i < loops; i++) {
+        LoopTimers* timers = new LoopTimers;
+        timers->wheel = new TimerWheel(TIMER_TICK_MS, now);
+        pthread_mutex_init(&timers->mutex, NULL);
+        timers_.push_back(timers);
+    }
+
+    if (options_.messageTtlMs > 0)
+        timers_[0]->wheel->schedule(&sweepTimer_, now + TIMER_TICK_MS);
+}
+
+/* 推进一个事件循环的时间轮，处理所有到期的定时器
+ * 在该事件循环的线程中、每轮事件处理完之后调用
+ *
+ * @param loop 事件循环的下标
+ */
+void Server::runTimers(int loop) {
+    if (timers_.empty())
+        return ;
+
+    LoopTimers* timers = timers_[loop];
+    uint64_t now = nowMs();
+
+    pthread_mutex_lock(&timers->mutex);
+    timers->wheel->advance(now, [this, timers, now] (TimerNode* node) {
+        if (node == &sweepTimer_) {
+            sweepInboxes(now);
+            timers->wheel->schedule(node, now + TIMER_TICK_MS);
         } else {
-            int index = -1;
-            std::vector<std::string> members = iter->second;
-            for (int i = 0; i < members.size(); i++) {
-                if (userName == members[i]) {
-                    index = i;
-                    break;
-                }
-            }
+            checkConnection((Connection*)node->arg, timers->wheel, now);
+        }
+    });
+    pthread_mutex_unlock(&timers->mutex);
+}
 
-            if (index != -1) {
-                iter->second.erase(iter->second.begin() + index);
-                ret = QUIT_ROOM_SUCCESS;
-            } else {
-                ret = QUIT_ROOM_FAIL; 
-            }
+/* 新连接开始计时，在连接注册到事件循环之前调用
+ *
+ * @param conn 刚reset的连接
+ * @param loop 连接所属事件循环的下标
+ */
+void Server::armConnection(Connection* conn, int loop) {
+    int first = 0;
+
+    if (timers_.empty())
+        return ;
+
+    // 第一次检查 : 最早可能到达的超时
+    const int timeouts[] = {options_.idleTimeoutMs, options_.pingIntervalMs, options_.frameTimeoutMs};
+    for (size_t i = 0; i < sizeof(timeouts) / sizeof(timeouts[0]); i++) {
+        if (timeouts[i] > 0 && (first == 0 || timeouts[i] < first))
+            first = timeouts[i];
+    }
+    if (first == 0) // 只开启了消息有效期
+        return ;
+
+    uint64_t now = nowMs();
+    LoopTimers* timers = timers_[loop];
+
+    pthread_mutex_lock(&conn->inputMutex);
+    conn->loop = loop;
+    conn->timerGeneration = conn->generation;
+    conn->lastActive = now;
+    conn->partialSince = 0;
+    conn->pingSent = false;
+    pthread_mutex_unlock(&conn->inputMutex);
+
+    pthread_mutex_lock(&timers->mutex);
+    timers->wheel->schedule(&conn->timer, now + first);
+    pthread_mutex_unlock(&timers->mutex);
+}
+
+/* 连接的定时器到期 : 检查空闲超时、请求接收超时和心跳，并安排下一次检查
+ * 超时的连接用shutdown关闭，之后由所属事件循环按对端断开的流程释放;
+ * 调用者持有时间轮的锁，releaseClient取消定时器之后才关闭描述符，因此这里的描述符仍然有效
+ *
+ * @param conn 客户端连接
+ * @param wheel 连接所属的时间轮，调用者已加锁
+ * @param now 当前时间
+ */
+void Server::checkConnection(Connection* conn, TimerWheel* wheel, uint64_t now) {
+    uint64_t next = UINT64_MAX;
+    bool idle = false, stalled = false, ping = false;
+
+    // 正在处理该连接的数据，说明连接是活跃的，下一个tick再检查
+    if (pthread_mutex_trylock(&conn->inputMutex) != 0) {
+        wheel->schedule(&conn->timer, now + TIMER_TICK_MS);
+        return ;
+    }
+
+    if (conn->generation != conn->timerGeneration) { // 已经释放，releaseClient正在等待取消定时器
+        pthread_mutex_unlock(&conn->inputMutex);
+        return ;
+    }
+
+    if (options_.idleTimeoutMs > 0) {
+        next = conn->lastActive + options_.idleTimeoutMs;
+        idle = now >= next;
+    }
+    if (options_.frameTimeoutMs > 0) {
+        if (conn->partialSince != 0 && now >= conn->partialSince + options_.frameTimeoutMs)
+            stalled = true;
+        // 没有不完整的请求时也要定期检查，请求开始接收时不会重新安排定时器
+        next = std::min(next, (conn->partialSince != 0 ? conn->partialSince : now)
+                              + options_.frameTimeoutMs);
+    }
+    if (options_.pingIntervalMs > 0) {
+        bool canPing = conn->protocol == PROTOCOL_COMPACT && !conn->pingSent;
+        if (canPing && now >= conn->lastActive + options_.pingIntervalMs) {
+            conn->pingSent = true;
+            ping = true;
         }
-        pthread_mutex_unlock(&roomsMutex_);
+        next = std::min(next, (conn->pingSent || conn->protocol != PROTOCOL_COMPACT ? now : conn->lastActive)
+                              + options_.pingIntervalMs);
+    }
+
+    pthread_mutex_unlock(&conn->inputMutex);
+
+    if (idle || stalled) {
+        (idle ? idleEvictions_ : frameEvictions_).fetch_add(1, std::memory_order_relaxed);
+        shutdown(conn->fd, SHUT_RDWR);
+        return ;
+    }
+
+    if (ping) {
+        char frame[FRAME_HEADER_SIZE + 1] = {0, 0, 0, 1, (char)OP_PING};
+        Send(conn->fd, frame, sizeof(frame));
+        pingsSent_.fetch_add(1, std::memory_order_relaxed);
     }
+    wheel->schedule(&conn->timer, next);
+}
 
+/* 丢弃收件箱中过期的消息，每次从上次停下的位置开始检查INBOX_SWEEP_BATCH个收件箱
+ * getmsg取消息时也会先丢弃过期的消息，这里只是及时归还长期没有人取的消息占用的节点
+ *
+ * @param now 当前时间
+ */
+void Server::sweepInboxes(uint64_t now) {
+    uint64_t before = expiredBefore(now, options_.messageTtlMs);
+
+    metrics_.lock(&usersMutex_, LOCK_USERS);
+    metrics_.lock(&msgMutex_, LOCK_MSG);
+    for (size_t i = 0; i < INBOX_SWEEP_BATCH && i < inboxes_.size(); i++) {
+        if (sweepNext_ >= inboxes_.size())
+            sweepNext_ = 0;
+        size_t expired = inboxPool_.expire(inboxes_[sweepNext_], before);
+        if (expired > 0)
+            logInbox(LOG_INBOX_POP, sweepNext_, expired);
+        sweepNext_++;
+    }
+    pthread_mutex_unlock(&msgMutex_);
     pthread_mutex_unlock(&usersMutex_);
+}
+
+/* 输出发送队列最长的几个积压连接（超过高水位），标签为描述符和登录的用户名，用于找出慢消费者
+ *
+ * @param out 追加到的缓冲区
+ * @param longest 字节数, 描述符，从大到小
+ * @param names 对应的用户名，没有登录时为空
+ */
+static void renderLongestQueues(std::string& out, const std::vector<std::pair<size_t, int> >& longest,
+                                const std::vector<std::string>& names) {
+    char line[512];
+
+    out += "# HELP chat_connection_output_bytes Queued output bytes of the backlogged connections"
+           " with the longest queues.\n# TYPE chat_connection_output_bytes gauge\n";
+    for (size_t i = 0; i < longest.size(); i++) {
+        std::string user;
+
+        for (size_t j = 0; j < names[i].size(); j++) { // 标签值中的反斜杠、引号和换行需要转义
+            char c = names[i][j];
+            if (c == '\\' || c == '"')
+                user += '\\';
+            user += c == '\n' ? std::string("\\n") : std::string(1, c);
+        }
+        snprintf(line, sizeof(line), "chat_connection_output_bytes{fd=\"%d\",user=\"%s\"} %zu\n",
+                 longest[i].second, user.c_str(), longest[i].first);
+        out += line;
+    }
+}
+
+/* 输出线程池每个工作线程的计数器，标签为工作线程的编号
+ *
+ * @param out 追加到的缓冲区
+ * @param pool 已经启动的线程池
+ */
+static void renderWorkers(std::string& out, ThreadPool& pool) {
+    std::vector<WorkerStats> stats;
+    char line[256];
+
+    for (int i = 0; i < pool.numThreads(); i++)
+        stats.push_back(pool.getStats(i));
+
+    out += "# HELP chat_worker_tasks_total Tasks executed by a thread pool worker.\n"
+           "# TYPE chat_worker_tasks_total counter\n";
+    for (size_t i = 0; i < stats.size(); i++) {
+        snprintf(line, sizeof(line), "chat_worker_tasks_total{worker=\"%zu\"} %llu\n",
+                 i, (unsigned long long)stats[i].executed);
+        out += line;
+    }
+
+    out += "# HELP chat_worker_stolen_tasks_total Tasks a worker stole from another worker's queue.\n"
+           "# TYPE chat_worker_stolen_tasks_total counter\n";
+    for (size_t i = 0; i < stats.size(); i++) {
+        snprintf(line, sizeof(line), "chat_worker_stolen_tasks_total{worker=\"%zu\"} %llu\n",
+                 i, (unsigned long long)stats[i].stolen);
+        out += line;
+    }
 
-    Send(fd, (void*)&ret, sizeof(ret));
+    out += "# HELP chat_worker_idle_seconds_total Time a worker spent waiting for a task.\n"
+           "# TYPE chat_worker_idle_seconds_total counter\n";
+    for (size_t i = 0; i < stats.size(); i++) {
+        snprintf(line, sizeof(line), "chat_worker_idle_seconds_total{worker=\"%zu\"} %.9f\n",
+                 i, stats[i].idleNs / 1e9);
+        out += line;
+    }
 }
 
-void Server::getMsg(int fd) {
-    pthread_mutex_lock(&msgMutex_);
+/* 输出所有运行指标，Prometheus文本格式
+ * 计数器、耗时分布和缓冲区字节数来自metrics_，其余为此刻读取的瞬时值;
+ * 不遍历连接表，只逐个读取积压连接的发送队列
+ *
+ * @param out 追加到的缓冲区
+ */
+void Server::renderMetrics(std::string& out) {
+    size_t backlogged, online = 0, users, rooms;
+    int64_t inputBytes, outputBytes;
+    std::vector<std::pair<size_t, int> > longest; // 发送队列最长的积压连接 : 字节数, 描述符
+    std::vector<std::string> names;
+    std::vector<int> fds;
+
+    // 缓冲区字节数是累计的增减量，只有积压的连接需要逐个读取
+    inputBytes = metrics_.gauge(GAUGE_INPUT_BYTES);
+    outputBytes = metrics_.gauge(GAUGE_OUTPUT_BYTES);
+
+    pthread_mutex_lock(&backlogMutex_);
+    fds = backlogged_.ids();
+    pthread_mutex_unlock(&backlogMutex_);
+    backlogged = fds.size();
+
+    for (size_t i = 0; i < fds.size(); i++) {
+        Connection* conn = conns_[fds[i]].load(std::memory_order_acquire);
+        size_t queued;
+
+        pthread_mutex_lock(&conn->outputMutex);
+        queued = conn->output.size();
+        pthread_mutex_unlock(&conn->outputMutex);
+
+        if (queued > 0)
+            longest.push_back(std::make_pair(queued, fds[i]));
+    }
+    if (longest.size() > SLOW_REPORT_LIMIT) {
+        std::nth_element(longest.begin(), longest.begin() + SLOW_REPORT_LIMIT, longest.end(),
+                         std::greater<std::pair<size_t, int> >());
+        longest.resize(SLOW_REPORT_LIMIT);
+    }
+    std::sort(longest.begin(), longest.end(), std::greater<std::pair<size_t, int> >());
+
+    pthread_mutex_lock(&usersMutex_);
+    users = users_.size();
+    for (size_t i = 0; i < users; i++) {
+        if (users_[i].online)
+            online++;
+    }
+    for (size_t i = 0; i < longest.size(); i++) {
+        int index = users_.findByFd(longest[i].second);
+        names.push_back(index != -1 ? users_[index].name : std::string());
+    }
+    pthread_mutex_unlock(&usersMutex_);
+
+    pthread_mutex_lock(&roomsMutex_);
+    rooms = rooms_.size();
+    pthread_mutex_unlock(&roomsMutex_);
 
-    auto iter = clientsMsg_.find(fd);
-    if (iter == clientsMsg_.end()) {
-        Message msg;
-        strcpy(msg.message, "none");
-        Send(fd, &msg, sizeof(msg));
+    metrics_.render(out);
+    if (!threadPool_.getThreads()->empty())
+        renderWorkers(out, threadPool_);
+    Metrics::renderGauge(out, "chat_work_queue_depth",
+                         "Tasks waiting in the thread pool work queue.",
+                         threadPool_.getWorkQueue()->size());
+    Metrics::renderGauge(out, "chat_event_queue_depth",
+                         "Epoll events waiting for a worker in thread-pool mode.",
+                         threadPoolArg_->size());
+    Metrics::renderGauge(out, "chat_input_buffer_bytes",
+                         "Received bytes not yet parsed, over all connections.", inputBytes);
+    Metrics::renderGauge(out, "chat_output_buffer_bytes",
+                         "Queued bytes not yet sent, over all connections.", outputBytes);
+    renderLongestQueues(out, longest, names);
+    if (options_.outputHighWater > 0) {
+        Metrics::renderGauge(out, "chat_backlogged_connections",
+                             "Connections whose output queue is above the high watermark.", backlogged);
+        Metrics::renderCounter(out, "chat_output_backlogs_total",
+                               "Times a connection's output queue crossed the high watermark.",
+                               backlogs_.load());
+        Metrics::renderCounter(out, "chat_dropped_pushes_total",
+                               "Push frames dropped from backlogged connections.", droppedPushes_.load());
+        Metrics::renderCounter(out, "chat_deferred_pushes_total",
+                               "Pushes held in the inbox while the connection was backlogged.",
+                               deferredPushes_.load());
+        Metrics::renderCounter(out, "chat_slow_disconnects_total",
+                               "Connections closed for falling behind on pushes.",
+                               slowDisconnects_.load());
+    }
+    Metrics::renderGauge(out, "chat_users", "Registered users.", users);
+    Metrics::renderGauge(out, "chat_online_users", "Users currently signed in.", online);
+    if (log_ != NULL) {
+        Metrics::renderCounter(out, "chat_log_records_total", "Records appended to the message log.",
+                               log_->nextSeq());
+        Metrics::renderCounter(out, "chat_log_durable_records_total",
+                               "Message log records known to be on disk.", log_->durableSeq());
+        Metrics::renderCounter(out, "chat_log_syncs_total", "Group commits issued by the message log.",
+                               log_->syncCount());
+    }
+    Metrics::renderGauge(out, "chat_rooms", "Rooms.", rooms);
+    if (!timers_.empty()) {
+        size_t timers = 0;
+        uint64_t expired;
+
+        for (size_t i = 0; i < timers_.size(); i++) {
+            pthread_mutex_lock(&timers_[i]->mutex);
+            timers += timers_[i]->wheel->size();
+            pthread_mutex_unlock(&timers_[i]->mutex);
+        }
+        pthread_mutex_lock(&msgMutex_);
+        expired = inboxPool_.expired();
         pthread_mutex_unlock(&msgMutex_);
+
+        Metrics::renderGauge(out, "chat_timers", "Timers armed in all timer wheels.", timers);
+        Metrics::renderCounter(out, "chat_idle_evictions_total",
+                               "Connections closed after the idle timeout.", idleEvictions_.load());
+        Metrics::renderCounter(out, "chat_frame_evictions_total",
+                               "Connections closed because a request did not arrive in time.",
+                               frameEvictions_.load());
+        Metrics::renderCounter(out, "chat_pings_sent_total", "Heartbeats sent to idle connections.",
+                               pingsSent_.load());
+        Metrics::renderCounter(out, "chat_expired_messages_total",
+                               "Inbox messages dropped after the message TTL.", expired);
+    }
+    if (sessions_ != NULL) {
+        pthread_mutex_lock(&sessionsMutex_);
+        size_t sessions = nextSession_ - freeSessions_.size();
+        pthread_mutex_unlock(&sessionsMutex_);
+        Metrics::renderGauge(out, "chat_gateway_sessions",
+                             "Logical sessions open over gateway connections.", sessions);
+    }
+}
+
+/* 在127.0.0.1:adminPort上监听，由单独的线程逐个处理请求
+ * 任何请求都返回全部指标，可以直接作为Prometheus的抓取地址
+ */
+void Server::startAdmin() {
+    struct sockaddr_in addr;
+    pthread_t tid;
+    int on = 1;
+
+    adminFd_ = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(adminFd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(options_.adminPort);
+
+    if (bind(adminFd_, (struct sockaddr*)&addr, sizeof(addr)) == -1
+        || listen(adminFd_, 16) == -1) {
+        fprintf(stderr, "cannot listen on admin port %d\n", options_.adminPort);
+        close(adminFd_);
+        adminFd_ = -1;
         return ;
     }
 
-    Send(fd, &iter->second, sizeof(Message));
+    pthread_create(&tid, NULL, adminThreadFunc, (void*)this);
+    pthread_detach(tid);
+}
+
+void* Server::adminThreadFunc(void* arg) {
+    Server* server = (Server*)arg;
 
-    pthread_mutex_unlock(&msgMutex_);
+    while (true) {
+        int fd = accept(server->adminFd_, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        server->serveAdmin(fd);
+        close(fd);
+    }
+
+    return (void*)0;
+}
+
+/* 读取一个HTTP请求（内容忽略），返回全部指标
+ *
+ * @param fd 已连接的套接字
+ */
+void Server::serveAdmin(int fd) {
+    struct timeval timeout = {1, 0};
+    std::string request, response, body;
+    char buf[1024];
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0)
+            break;
+        request.append(buf, n);
+    }
+
+    renderMetrics(body);
+    response = "HTTP/1.0 200 OK\r\n"
+               "Content-Type: text/plain; version=0.0.4\r\n"
+               "Content-Length: " + std::to_string(body.size()) + "\r\n"
+               "Connection: close\r\n\r\n" + body;
+
+    for (size_t sent = 0; sent < response.size(); ) {
+        ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            break;
+        sent += n;
+    }
 }
 
 } // namespace chat
@@ -7,10 +7,23 @@
 
 #include <sys/epoll.h>
 #include <string>
-#include <map>
+#include <atomic>
 
 #include "ThreadPool.h"
-#include "Buffer.h"
+#include "EventLoop.h"
+#include "UringLoop.h"
+#include "Connection.h"
+#include "Inbox.h"
+#include "UserRegistry.h"
+#include "RoomRegistry.h"
+#include "Metrics.h"
+#include "MessageLog.h"
+#include "AccountStore.h"
+#include "Directory.h"
+#include "TimerWheel.h"
+#include "Protocol.h"
+#include "StringView.h"
+#include "Common.h"
 
 namespace chat {
 
@@ -18,66 +31,243 @@ namespace chat {
 #define SERVER_PORT 5000
 #define BACKLOG 1000
 #define MAXEVENTS 100000
+#define MAX_CONNECTIONS 100000
+#define MAX_SESSIONS 262144 // 所有网关连接上的会话总数上限
 
-// 存放客户端的信息
+// 服务器的并发模型
+#define MODE_THREAD_POOL    0 // 单个epoll线程，事件经工作队列交给线程池处理
+#define MODE_MULTI_REACTOR  1 // 每个工作线程拥有自己的epoll和一部分连接
+
+// I/O后端
+#define IO_BACKEND_EPOLL    0 // epoll + 非阻塞recv/send
+#define IO_BACKEND_URING    1 // io_uring，每个工作线程一个UringLoop，此时忽略mode
+
+#define INBOX_DEPTH         256   // 每个用户收件箱的默认容量
+#define INBOX_POOL_SIZE     16384 // 收件箱节点池的默认大小
+#define GETMSG_BATCH        32    // 一次getmsg默认最多取走的消息数
+#define ADMIN_PORT          5001  // 输出运行指标的默认端口，只监听127.0.0.1
+#define NAMES_FRAME_BUDGET  (MAX_FRAME_SIZE - 256) // 一个名字列表帧中名字最多占用的字节数
+#define TIMER_TICK_MS       100   // 时间轮的精度，开启任何超时时事件循环至少每隔这么久醒来一次
+#define INBOX_SWEEP_BATCH   1024  // 开启消息有效期时每个tick检查的收件箱数
+#define OUTPUT_HIGH_WATER   (4 << 20) // 连接发送队列的默认高水位，字节
+#define OUTPUT_LOW_WATER    (1 << 20) // 连接发送队列的默认低水位，字节
+#define SLOW_REPORT_LIMIT   16    // 运行指标中列出的发送队列最长的连接数
+#define HISTORY_SCAN_LIMIT  65536 // 一次历史消息请求最多检查的日志记录数
+
+// 消息日志中收件箱变化的记录，与聊天记录（OP_SGCHAT/OP_GPCHAT）一样编码为紧凑协议的帧，
+// 用户用下标表示，与账号日志中的顺序一致，所以只在同时开启了账号持久化时记录
+#define LOG_INBOX_PUSH      0x40 // [用户下标 u32][聊天记录的序号 u64]，消息放入收件箱
+#define LOG_INBOX_POP       0x41 // [用户下标 u32][个数 u64]，从收件箱开头移除（取走、过期或被新消息挤掉）
+
+// 慢消费者 : 连接的发送队列超过高水位后，对发给它的推送的处理策略
+#define SLOW_DROP_OLDEST    0 // 丢弃队列中最早的推送帧，直到降到低水位
+#define SLOW_COALESCE       1 // 之后的推送改存入收件箱（受收件箱容量限制），降到低水位后一起补发
+#define SLOW_DISCONNECT     2 // 关闭连接
+
+// 服务器的可配置项，默认值由defaultServerOptions给出
+typedef struct {
+    int mode;           // MODE_*
+    int backend;        // IO_BACKEND_*，内核不支持io_uring时退回epoll
+    int queueType;      // MODE_THREAD_POOL下工作队列和事件队列的实现，QUEUE_*
+                        // QUEUE_WORK_STEALING只用于工作队列，事件队列使用Queue
+    size_t inboxDepth;  // 每个用户收件箱最多存放的消息数
+    size_t inboxPool;   // 所有收件箱共用的节点数
+    int inboxPolicy;    // 收件箱满时的处理策略，INBOX_DROP_*
+    int adminPort;      // 输出运行指标的本地端口，0表示不开启
+    std::string logDir; // 消息日志的目录，为空表示不记录
+    int logSyncMs;      // 消息日志组提交的间隔
+    std::string dataDir; // 账号和房间的持久化目录，为空表示重启后不保留
+    bool reusePort;     // MODE_MULTI_REACTOR和IO_BACKEND_URING下每个事件循环一个SO_REUSEPORT监听套接字
+    std::string gatewayToken; // 网关连接认证用的口令，为空表示不接受网关连接
+
+    // 超时，单位毫秒，0表示不开启
+    int idleTimeoutMs;  // 这么久没有收到任何数据的连接被关闭
+    int pingIntervalMs; // 紧凑协议的连接空闲这么久后发送心跳OP_PING
+    int frameTimeoutMs; // 一个请求这么久还没有接收完整时关闭连接
+    int messageTtlMs;   // 收件箱中的消息这么久没有被取走时丢弃
+
+    // 慢消费者 : 连接的发送队列超过outputHighWater字节时按slowPolicy处理推送，
+    // 并暂停处理该连接的请求，降到outputLowWater字节以下时恢复;outputHighWater为0表示不限制
+    size_t outputHighWater;
+    size_t outputLowWater;
+    int slowPolicy;     // SLOW_*
+} ServerOptions;
+
+ServerOptions defaultServerOptions();
+
+// 解析后的请求，字段指向接收缓冲区中的数据，不拷贝，只在dispatch返回之前有效
 typedef struct {
-    std::string name;
-    std::string password;
-    int fd;
-    bool online;
-}User;
+    int opcode;
+    StringView dst;     // 旧协议Message的dst，紧凑协议的第一个字段
+    StringView message; // 旧协议Message的message，紧凑协议的第二个字段
+} Request;
 
 class Server {
 public:
-    Server();
+    Server(const ServerOptions& options = defaultServerOptions());
     ~Server();
 
     void init();
     void eventLoop();
 
+    // 不经过套接字直接处理请求数据，用于基准测试
+    bool feedInput(int fd, const char* data, size_t len);
+    size_t discardOutput(int fd);
+
+    void renderMetrics(std::string& out);
+
 private:
+    // 单聊或群聊的一个接收方，在usersMutex_内记下，解锁后投递;
+    // 期间接收方可能下线、描述符或会话键被复用，投递时generation与generationOf不一致则不推送
+    typedef struct {
+        int index;           // 在users_中的下标
+        int fd;              // 套接字或会话键
+        uint32_t generation; // 记下时generationOf(fd)的值
+        bool push;
+    } Recipient;
+
     void solve();
+    void handleEvent(struct epoll_event& ev);
+    int createListener(bool reusePort);
+    bool isListener(int fd);
     void handleAccept(int listenFd);
     void handleRead(int fd);
+    bool processInput(Connection* conn);
+    bool processSession(Connection* conn, FrameReader& reader);
+    void dispatch(int fd, const Request& request);
     void handleWrite(int fd);
     void handleClientClose(int fd);
+    void signOut(int fd);
 
 private:
     void Send(int fd, void* buf, size_t len);
-    void clientSignUp(int fd, std::vector<std::string> require);
-    void clientSignIn(int fd, std::vector<std::string> require);
+    void Send(int fd, Payload* payload);
+    Connection* slotOf(int fd);
+    Connection* connectionOf(int fd, char* sessionHeader, size_t len);
+    int protocolOf(int fd);
+    void gatewayAuth(int fd, StringView token);
+    int openSession(Connection* conn, uint32_t sid);
+    void closeSession(Connection* conn, int key);
+    void replyResult(int fd, int ret);
+    Payload* encodeNames(int protocol, const std::vector<std::string>& names, const std::string& cursor);
+    void replyDirectory(int fd, bool rooms);
+    void replyPage(int fd, bool rooms, StringView prefix, StringView args);
+    void replyDelta(int fd, bool rooms, StringView since);
+    void replyMessages(int fd, const std::vector<Payload*>& msgs);
+    void clientSignUp(int fd, StringView name, StringView password);
+    void clientSignIn(int fd, StringView name, StringView password);
 
     void lsUsers(int fd);
-    void singleChat(int fd, std::string usrName, std::string content);
+    void singleChat(int fd, StringView usrName, StringView content);
 
-    void mkRoom(int fd, std::string roomName);
+    void mkRoom(int fd, StringView roomName);
     void lsRooms(int fd);
-    void cdRoom(int fd, std::string roomName);
-    void qtRoom(int fd, std::string roomName);
-    void groupChat(int fd, std::string grpName, std::string content);
-    void getMsg(int fd);
+    void cdRoom(int fd, StringView roomName);
+    void qtRoom(int fd, StringView roomName);
+    void groupChat(int fd, StringView grpName, StringView content);
+    void getMsg(int fd, StringView maxCount);
+    void setPush(int fd, StringView on);
+    uint32_t generationOf(int fd);
+    bool isCurrent(Connection* conn, const Recipient& to);
+    void replyHistory(int fd, bool room, StringView name, StringView args);
+    void deliver(const Recipient& to, Payload* frame, Payload* msg, uint64_t seq);
+    void pushMessage(const Recipient& to, Payload* frame, Payload* msg, uint64_t seq);
+    void pushInbox(int index, Payload* msg, uint64_t seq, uint64_t now);
+    void logInbox(int opcode, int index, uint64_t value);
+    void queuePush(Connection* conn, int fd, const char* header, Payload* frame);
+    void checkBacklog(Connection* conn);
+    void setBacklogged(Connection* conn, bool on);
+    void countInput(Connection* conn);
+    void countOutput(Connection* conn);
+    void checkDrained(Connection* conn);
+    void resumePush(Connection* conn, uint32_t generation);
+    void resumeInput(Connection* conn);
+    void loadAccounts(const AccountState& state);
+    uint64_t logMessage(int opcode, StringView srcName, StringView dst, StringView content);
+    void replayInboxes();
     void releaseClient(int fd);
+    void updateEvents(Connection* conn, bool wantWrite);
+    bool runUring();
+    void handleUringAccept(int fd, UringLoop* loop);
+    void handleUringInput(int fd, uint32_t gen, int event, const char* data, size_t len);
+    void handleUringSent(Connection* conn);
+    bool flushOutput(Connection* conn);
+    void flushPending();
+    void initTimers(size_t loops);
+    void runTimers(int loop);
+    void armConnection(Connection* conn, int loop);
+    void checkConnection(Connection* conn, TimerWheel* wheel, uint64_t now);
+    void sweepInboxes(uint64_t now);
+    void startAdmin();
+    static void* adminThreadFunc(void* arg);
+    void serveAdmin(int fd);
 
 private:
     ThreadPool threadPool_;
     int listenFd_;
+    std::vector<int> listenFds_; // 所有监听套接字，reusePort时第i个属于第i个事件循环
     int epollFd_;
-    Queue<struct epoll_event> threadPoolArg_;
+    BlockingQueue<struct epoll_event>* threadPoolArg_;
+
+    ServerOptions options_;
+    int mode_;
+    std::vector<EventLoop*> reactors_; // MODE_MULTI_REACTOR下的各个事件循环
+    std::vector<UringLoop*> urings_;   // IO_BACKEND_URING下的各个事件循环
+    size_t nextReactor_;
+    std::vector<std::atomic<Connection*> > conns_; // 连接表，以描述符为下标，对象分配后一直保留
+
+    Metrics metrics_;
+    int adminFd_; // 输出运行指标的监听套接字，-1表示未开启
+    MessageLog* log_; // 单聊和群聊以及收件箱变化的日志，NULL表示未开启
+    AccountStore* accounts_; // 账号和房间的持久化，NULL表示未开启
+
+    // 网关会话 : 会话键为MAX_CONNECTIONS + 槽位，在请求处理和users_中代替描述符使用;
+    // 每个槽位保存((网关连接的描述符 + 1) << 32 | 会话号)，0表示空闲，发送时不加锁读取
+    std::atomic<uint64_t>* sessions_; // 未开启网关时为NULL
+    std::atomic<uint32_t>* sessionGenerations_; // 每个槽位结束会话时加一，持有网关连接的outputMutex修改
+    std::vector<int> freeSessions_;   // 已释放的槽位
+    int nextSession_;                 // 从未使用过的第一个槽位
+    pthread_mutex_t sessionsMutex_;   // 保护槽位的分配和释放
+
+    // 定时器 : 每个事件循环一个时间轮，下标与reactors_/urings_相同，MODE_THREAD_POOL下只有一个;
+    // 由该循环的线程在每轮事件之后推进，其他线程（接收连接、关闭连接）安排或取消定时器时加锁
+    typedef struct {
+        TimerWheel* wheel;
+        pthread_mutex_t mutex;
+    } LoopTimers;
+    std::vector<LoopTimers*> timers_; // 没有开启任何超时时为空
+    TimerNode sweepTimer_;            // 检查收件箱中过期消息的定时器，在第0个时间轮中
+    size_t sweepNext_;                // 下一次从这个收件箱开始检查
+    std::atomic<uint64_t> idleEvictions_;  // 因空闲超时关闭的连接数
+    std::atomic<uint64_t> frameEvictions_; // 因请求接收超时关闭的连接数
+    std::atomic<uint64_t> pingsSent_;
+
+    // 慢消费者的计数
+    std::atomic<uint64_t> backlogs_;         // 连接的发送队列超过高水位的次数
+    std::atomic<uint64_t> droppedPushes_;    // SLOW_DROP_OLDEST丢弃的推送帧数
+    std::atomic<uint64_t> deferredPushes_;   // SLOW_COALESCE改存入收件箱的推送数
+    std::atomic<uint64_t> slowDisconnects_;  // SLOW_DISCONNECT关闭的连接数
+    IdSet backlogged_;                       // 发送队列超过高水位的连接的描述符
+    pthread_mutex_t backlogMutex_;           // 保护backlogged_，在outputMutex之内加锁
 
 private:
     // 规定当需要同时对下面两个互斥锁加锁时，
     // 总是先对usersMutex_加锁，再对roomsMutex_加锁，以防止死锁发生
-    std::vector<User> users_;
+    UserRegistry users_;
     pthread_mutex_t usersMutex_;
 
-    std::map<std::string, std::vector<std::string>> rooms_;
+    RoomRegistry rooms_;
     pthread_mutex_t roomsMutex_;
 
-    std::map<int, Message> clientsMsg_; // 发送给客户端的消息
-    pthread_mutex_t msgMutex_;
+    // 在线用户和房间的名字列表，分别在usersMutex_/roomsMutex_内修改
+    Directory onlineUsers_;
+    Directory roomNames_;
 
-    Buffer recvBuffer_; // 接收缓冲区
-    Buffer sendBuffer_; // 发送缓冲区
+    // 每个用户的收件箱，下标与users_相同；需要同时加锁时先对usersMutex_加锁，
+    // 还需要对连接的outputMutex加锁时（SLOW_COALESCE）按usersMutex_、outputMutex、msgMutex_的顺序
+    std::vector<Inbox> inboxes_;
+    InboxPool inboxPool_;
+    pthread_mutex_t msgMutex_;
 };
 
 } // namespace chat
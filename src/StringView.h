@@ -0,0 +1,80 @@
+/* 字符串视图
+ *
+ * 只保存指针和长度，指向别处（接收缓冲区、帧、std::string）的字节，不拷贝也不分配内存;
+ * 所指的数据在视图使用期间必须保持不变，例如请求的字段只在dispatch返回之前有效
+ *
+ * 不要求以'\0'结尾，需要C字符串时用str()拷贝出来
+ */
+
+#ifndef _CHATROOM_SRC_STRINGVIEW_H_
+#define _CHATROOM_SRC_STRINGVIEW_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+namespace chat {
+
+class StringView {
+public:
+    StringView() : data_(""), size_(0) {}
+    StringView(const char* data, size_t size) : data_(data), size_(size) {}
+    StringView(const char* str) : data_(str), size_(strlen(str)) {}
+    StringView(const std::string& str) : data_(str.data()), size_(str.size()) {}
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    char operator[](size_t i) const { return data_[i]; }
+
+    // 从pos开始的剩余部分，pos超过长度时为空
+    StringView substr(size_t pos) const {
+        return pos < size_ ? StringView(data_ + pos, size_ - pos) : StringView();
+    }
+
+    std::string str() const { return std::string(data_, size_); }
+
+    /* 开头的十进制无符号整数，用于请求中的数字字段
+     *
+     * @param used 非NULL时存放数字占用的字节数，没有数字时为0
+     * @return 数字的值，没有数字时为0，溢出时截断
+     */
+    uint64_t toU64(size_t* used = NULL) const {
+        uint64_t value = 0;
+        size_t i = 0;
+
+        while (i < size_ && data_[i] >= '0' && data_[i] <= '9')
+            value = value * 10 + (data_[i++] - '0');
+        if (used != NULL)
+            *used = i;
+        return value;
+    }
+
+    // FNV-1a，用于NameIndex，与std::string的哈希无关
+    uint32_t hash() const {
+        uint32_t h = 2166136261u;
+
+        for (size_t i = 0; i < size_; i++) {
+            h ^= (unsigned char)data_[i];
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+private:
+    const char* data_;
+    size_t size_;
+};
+
+// 非成员函数，两边都可以是std::string或C字符串
+inline bool operator==(const StringView& a, const StringView& b) {
+    return a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0;
+}
+
+inline bool operator!=(const StringView& a, const StringView& b) {
+    return !(a == b);
+}
+
+} // namespace chat
+
+#endif // _CHATROOM_SRC_STRINGVIEW_H_
@@ -1,5 +1,6 @@
+#include <time.h>
+
 #include "ThreadPool.h"
-#include "Queue.h"
 
 namespace chat {
 
@@ -16,23 +17,44 @@ Thread::Thread(ThreadFunc func, ThreadPool* pool)
 }
 
 /* 线程池的构造函数
- * 设定线程池中线程的数目
+ * 设定线程池中线程的数目，以及工作队列的实现
  *
  * @param numThreads 线程池中线程数目
+ * @param queueType 工作队列的实现，QUEUE_*
  */
-ThreadPool::ThreadPool(int numThreads)
-    : numThreads_(numThreads)
+ThreadPool::ThreadPool(int numThreads, int queueType)
+    : stealingQueue_(NULL),
+      nextIndex_(0),
+      numThreads_(numThreads)
 {
     threads_.reserve(numThreads);
+
+    if (queueType == QUEUE_WORK_STEALING) {
+        stealingQueue_ = new WorkStealingQueue<WorkType>(numThreads);
+        workQueue_ = stealingQueue_;
+    } else {
+        workQueue_ = createQueue<WorkType>(queueType);
+    }
+
+    for (int i = 0; i < numThreads; i++) {
+        Counters* counters = new Counters;
+        counters->executed.store(0);
+        counters->idleNs.store(0);
+        counters_.push_back(counters);
+    }
 }
 
 /* 线程池的析构函数
  * 对线程池中每个线程所分配的内存进行释放
+ * 没有调用过run（例如MODE_MULTI_REACTOR下的服务器）时threads_为空
  */
 ThreadPool::~ThreadPool()
 {
-    for (int i = 0; i < numThreads_; i++)
+    for (size_t i = 0; i < threads_.size(); i++)
         delete threads_[i];
+    for (size_t i = 0; i < counters_.size(); i++)
+        delete counters_[i];
+    delete workQueue_;
 }
 
 /* 线程池的启动函数
@@ -58,16 +80,31 @@ void ThreadPool::run()
  */
 void* ThreadPool::threadFunc(void* arg)
 {
+    ThreadPool* pool = (ThreadPool*)arg; 
+    int index = pool->nextIndex_.fetch_add(1);
+    Counters* counters = pool->counters_[index];
+
+    // 工作窃取模式下登记本线程的编号，之后本线程提交的任务放入自己的本地队列
+    if (pool->stealingQueue_ != NULL)
+        pool->stealingQueue_->attach(index);
+
     while (true) {
-        ThreadPool* pool = (ThreadPool*)arg; 
+        struct timespec begin, end;
 
         // 线程通过线程池类提供的接口得到工作队列，
         // 进而从工作队列中取出任务
         WorkType work;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
         (pool->getWorkQueue())->get(work);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        counters->idleNs.fetch_add((end.tv_sec - begin.tv_sec) * 1000000000ll
+                                   + (end.tv_nsec - begin.tv_nsec),
+                                   std::memory_order_relaxed);
 
         // 执行从工作队列中取得的任务
         work();
+        counters->executed.fetch_add(1, std::memory_order_relaxed);
     }
 
     return (void*)0;
@@ -77,11 +114,11 @@ void* ThreadPool::threadFunc(void* arg)
  * 线程池中的线程可以通过该接口取任务
  *
  * @param void
- * @return Queue<WorkType>* 指向工作队列的指针
+ * @return BlockingQueue<WorkType>* 指向工作队列的指针
  */
-Queue<WorkType>* ThreadPool::getWorkQueue()
+BlockingQueue<WorkType>* ThreadPool::getWorkQueue()
 {
-    return &workQueue_;
+    return workQueue_;
 }
 
 /* 线程池对外提供的获取线程数组的接口
@@ -94,4 +131,19 @@ std::vector<Thread*>* ThreadPool::getThreads()
     return &threads_;
 }
 
+/* 获取某个工作线程的统计数据，可以在线程池运行时调用
+ *
+ * @param index 工作线程的编号，0 ~ numThreads-1
+ * @return WorkerStats 统计数据的快照
+ */
+WorkerStats ThreadPool::getStats(int index)
+{
+    WorkerStats stats;
+
+    stats.executed = counters_[index]->executed.load(std::memory_order_relaxed);
+    stats.idleNs = counters_[index]->idleNs.load(std::memory_order_relaxed);
+    stats.stolen = stealingQueue_ != NULL ? stealingQueue_->stolen(index) : 0;
+    return stats;
+}
+
 } // namespace chat
@@ -5,10 +5,13 @@
 #ifndef _CHATROOM_SRC_THREADPOOL_H_
 #define _CHATROOM_SRC_THREADPOOL_H_
 
+#include <stdint.h>
+#include <atomic>
 #include <vector>
 #include <functional>
 
-#include "Queue.h"
+#include "MpmcQueue.h"
+#include "WorkStealingQueue.h"
 
 namespace chat {
 
@@ -16,6 +19,13 @@ typedef void* (*ThreadFunc)(void*);
 
 typedef std::function<void()> WorkType;
 
+// 每个工作线程的统计数据
+typedef struct {
+    uint64_t executed; // 执行的任务数
+    uint64_t stolen;   // 从其他线程窃取的任务数，只有QUEUE_WORK_STEALING时非0
+    uint64_t idleNs;   // 等待任务的总时间，单位纳秒
+} WorkerStats;
+
 class ThreadPool;
 
 class Thread {
@@ -29,7 +39,7 @@ private:
 
 class ThreadPool {
 public:
-    ThreadPool(int numThreads);
+    ThreadPool(int numThreads, int queueType = QUEUE_MUTEX);
 
     ~ThreadPool();
 
@@ -40,13 +50,26 @@ public:
     // 所以设置成静态成员函数，以禁止类自动插入this指针参数
     static void* threadFunc(void* arg);
 
-    Queue<WorkType>* getWorkQueue();
+    BlockingQueue<WorkType>* getWorkQueue();
 
     std::vector<Thread*>* getThreads(); 
 
+    WorkerStats getStats(int index);
+
+    int numThreads() const { return numThreads_; }
+
 private:
+    // 工作线程自己更新、其他线程读取的计数器
+    typedef struct {
+        std::atomic<uint64_t> executed;
+        std::atomic<uint64_t> idleNs;
+    } Counters;
+
     std::vector<Thread*> threads_;
-    Queue<WorkType> workQueue_;
+    BlockingQueue<WorkType>* workQueue_; // QUEUE_*指定的实现
+    WorkStealingQueue<WorkType>* stealingQueue_; // QUEUE_WORK_STEALING时同workQueue_，否则为NULL
+    std::vector<Counters*> counters_;
+    std::atomic<int> nextIndex_; // 分配给下一个启动的工作线程的编号
     int numThreads_;
 };
 
@@ -0,0 +1,186 @@
+/* 分层时间轮
+ *
+ * 时间按固定的tick划分，共WHEEL_LEVELS层，每层WHEEL_SLOTS个槽，
+ * 第L层每个槽代表8^L个tick，定时器按到期时间与当前时间的距离放入能容纳它的最低一层 :
+ *   第0层 : 距离小于63个tick，精确到tick
+ *   第L层 : 距离小于63 * 8^L个tick，到期时间向上取整到8^L个tick
+ * 每推进一个tick处理第0层的一个槽，每推进8^L个tick处理第L层的一个槽
+ *
+ * 与逐层下移（cascade）的时间轮不同，定时器放入后不再移动，只在到期时被访问一次，
+ * 大量定时器同时从高层下移造成的停顿因此不会出现;
+ * 代价是放在高层的定时器最多推迟约1/8的时长到期（从不提前），
+ * 适合空闲超时、心跳这类通常在到期之前就被取消或重新安排、对精度要求不高的定时器
+ *
+ * 安排、取消都是O(1) : 定时器节点（TimerNode）由使用者嵌入自己的对象中，
+ * 每个槽是一个带哨兵的双向循环链表，不分配内存;
+ * 超出最高层范围的定时器先放在最高层最远的槽，到达时再按实际的到期时间重新放置
+ *
+ * 本类不加锁，由调用者保证互斥;到期时的回调函数中可以安排或取消任何定时器，包括正在到期的那个
+ */
+
+#ifndef _CHATROOM_SRC_TIMERWHEEL_H_
+#define _CHATROOM_SRC_TIMERWHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace chat {
+
+#define WHEEL_LEVELS        8
+#define WHEEL_SLOT_BITS     6
+#define WHEEL_SLOTS         (1 << WHEEL_SLOT_BITS)
+#define WHEEL_LEVEL_SHIFT   3 // 相邻两层每个槽代表的tick数相差8倍
+
+// 定时器节点，arg由使用者设置，到期时据此找到所属的对象
+struct TimerNode {
+    TimerNode() : prev(NULL), next(NULL), expire(0), arg(NULL) {}
+
+    TimerNode* prev;
+    TimerNode* next;  // NULL表示不在时间轮中
+    uint64_t expire;  // 到期的tick
+    void* arg;
+};
+
+class TimerWheel {
+public:
+    /* @param tickMs 每个tick的毫秒数
+     * @param nowMs 当前时间，之后的时间都应来自同一个单调时钟
+     */
+    TimerWheel(uint64_t tickMs, uint64_t nowMs)
+        : tickMs_(tickMs), current_(nowMs / tickMs), count_(0)
+    {
+        for (int i = 0; i < WHEEL_LEVELS * WHEEL_SLOTS; i++)
+            initList(&slots_[i]);
+    }
+
+    /* 安排定时器在expireMs之后到期（不会提前，可能按所在层的精度推迟），已在时间轮中时先取消
+     * 已经过去的时间在下一个tick到期
+     *
+     * @param node 定时器节点
+     * @param expireMs 到期时间
+     */
+    void schedule(TimerNode* node, uint64_t expireMs) {
+        if (node->next != NULL)
+            unlink(node);
+        else
+            count_++;
+        node->expire = (expireMs + tickMs_ - 1) / tickMs_;
+        insert(node);
+    }
+
+    void cancel(TimerNode* node) {
+        if (node->next == NULL)
+            return ;
+        unlink(node);
+        count_--;
+    }
+
+    static bool scheduled(const TimerNode* node) { return node->next != NULL; }
+
+    /* 推进到nowMs，对每个到期的定时器调用fire(TimerNode*)，调用前该定时器已移出时间轮
+     *
+     * @return 到期的定时器数
+     */
+    template <typename Fire>
+    size_t advance(uint64_t nowMs, Fire fire) {
+        uint64_t target = nowMs / tickMs_;
+        size_t fired = 0;
+
+        while (current_ < target) {
+            if (count_ == 0) { // 没有定时器时直接跳到目标时间
+                current_ = target;
+                break;
+            }
+            current_++;
+
+            // 先把这个tick要处理的槽移到局部链表，回调函数中安排的定时器不会在这一轮被处理
+            TimerNode expired;
+            initList(&expired);
+            for (int level = 0; level < WHEEL_LEVELS; level++) {
+                int shift = level * WHEEL_LEVEL_SHIFT;
+                if (level > 0 && (current_ & ((1ull << shift) - 1)) != 0)
+                    break;
+                spliceAll(&slots_[level * WHEEL_SLOTS + ((current_ >> shift) & (WHEEL_SLOTS - 1))],
+                          &expired);
+            }
+
+            while (expired.next != &expired) {
+                TimerNode* node = expired.next;
+                unlink(node);
+                if (node->expire > current_) { // 超出范围而被提前放置的定时器
+                    insert(node);
+                    continue;
+                }
+                count_--;
+                fired++;
+                fire(node);
+            }
+        }
+        return fired;
+    }
+
+    size_t size() const { return count_; }
+    uint64_t tickMs() const { return tickMs_; }
+
+private:
+    static void initList(TimerNode* head) {
+        head->prev = head;
+        head->next = head;
+    }
+
+    static void unlink(TimerNode* node) {
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = NULL;
+        node->next = NULL;
+    }
+
+    static void append(TimerNode* head, TimerNode* node) {
+        node->prev = head->prev;
+        node->next = head;
+        head->prev->next = node;
+        head->prev = node;
+    }
+
+    static void spliceAll(TimerNode* from, TimerNode* to) {
+        if (from->next == from)
+            return ;
+        from->next->prev = to->prev;
+        from->prev->next = to;
+        to->prev->next = from->next;
+        to->prev = from->prev;
+        initList(from);
+    }
+
+    /* 放入能容纳该定时器的最低一层，不改变count_
+     * 第L层的槽按到期时间向上取整到8^L个tick的倍数，距离小于63 * 8^L保证不会绕回已处理过的槽
+     */
+    void insert(TimerNode* node) {
+        uint64_t expire = node->expire > current_ ? node->expire : current_ + 1;
+        uint64_t delta = expire - current_;
+        int level = 0, shift = 0;
+
+        while (level < WHEEL_LEVELS - 1 && delta >= ((uint64_t)(WHEEL_SLOTS - 1) << shift)) {
+            level++;
+            shift += WHEEL_LEVEL_SHIFT;
+        }
+        if (delta >= ((uint64_t)(WHEEL_SLOTS - 1) << shift))
+            expire = current_ + ((uint64_t)(WHEEL_SLOTS - 1) << shift) - 1;
+
+        uint64_t slot = (expire + (1ull << shift) - 1) >> shift;
+        append(&slots_[level * WHEEL_SLOTS + (slot & (WHEEL_SLOTS - 1))], node);
+    }
+
+private:
+    uint64_t tickMs_;
+    uint64_t current_; // 已处理到的tick
+    size_t count_;     // 时间轮中的定时器数
+    TimerNode slots_[WHEEL_LEVELS * WHEEL_SLOTS];
+
+    TimerWheel(const TimerWheel&);
+    TimerWheel& operator=(const TimerWheel&);
+};
+
+} // namespace chat
+
+#endif // _CHATROOM_SRC_TIMERWHEEL_H_
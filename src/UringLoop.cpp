@@ -0,0 +1,536 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <algorithm>
+
+#include "UringLoop.h"
+
+namespace chat {
+
+// 完成事件user_data的低3位表示操作类型
+#define TAG_ACCEPT  1
+#define TAG_RECV    2 // 高32位为描述符，中间29位为连接的代数
+#define TAG_SEND    3 // 其余位为SendOp指针
+#define TAG_TICK    4 // 周期性的超时，见setTick
+#define TAG_CANCEL  5 // 取消接收操作，结果不需要处理
+#define TAG_MASK    7
+
+#define BUF_GROUP   0 // 缓冲区环的编号
+
+// 当前线程运行的事件循环，用于判断提交是否来自本循环的线程
+static thread_local UringLoop* currentLoop = NULL;
+
+/* 事件循环的构造函数，之后需要调用init创建io_uring实例
+ *
+ * @param input 连接上接收事件的处理函数
+ * @param afterEvents 每轮完成事件处理完之后调用，可以为空
+ * @param sent 每个发送操作结束之后调用，可以为空
+ */
+UringLoop::UringLoop(UringInputCallback input, UringIterationCallback afterEvents,
+                     UringSentCallback sent)
+    : ringFd_(-1),
+      input_(input),
+      afterEvents_(afterEvents),
+      sent_(sent),
+      listenFd_(-1),
+      sqRing_(MAP_FAILED),
+      sqRingSize_(0),
+      sqes_((struct io_uring_sqe*)MAP_FAILED),
+      sqesSize_(0),
+      sqTail_(0),
+      cqRing_(MAP_FAILED),
+      cqRingSize_(0),
+      bufRing_((struct io_uring_buf_ring*)MAP_FAILED),
+      bufs_(NULL),
+      bufTail_(0)
+{
+    pthread_mutex_init(&sqMutex_, NULL);
+}
+
+UringLoop::~UringLoop()
+{
+    if (bufRing_ != MAP_FAILED)
+        munmap(bufRing_, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+    free(bufs_);
+    if (sqes_ != MAP_FAILED)
+        munmap(sqes_, sqesSize_);
+    if (cqRing_ != MAP_FAILED && cqRing_ != sqRing_)
+        munmap(cqRing_, cqRingSize_);
+    if (sqRing_ != MAP_FAILED)
+        munmap(sqRing_, sqRingSize_);
+    if (ringFd_ != -1)
+        close(ringFd_);
+    pthread_mutex_destroy(&sqMutex_);
+}
+
+/* 创建io_uring实例，映射提交队列和完成队列
+ *
+ * @param withBuffers 是否注册接收数据用的缓冲区环，只接收连接的循环不需要
+ * @return true : 成功; false : 内核不支持io_uring或所需的功能
+ */
+bool UringLoop::init(bool withBuffers)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * 4;
+
+    ringFd_ = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ringFd_ < 0) {
+        ringFd_ = -1;
+        return false;
+    }
+
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+
+    sqRing_ = mmap(NULL, sqRingSize_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQ_RING);
+    if (sqRing_ == MAP_FAILED)
+        return false;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        cqRing_ = sqRing_;
+    else
+        cqRing_ = mmap(NULL, cqRingSize_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_CQ_RING);
+    if (cqRing_ == MAP_FAILED)
+        return false;
+
+    sqesSize_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = (struct io_uring_sqe*)mmap(NULL, sqesSize_, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED)
+        return false;
+
+    char* sq = (char*)sqRing_;
+    char* cq = (char*)cqRing_;
+    sqHead_ = (unsigned*)(sq + params.sq_off.head);
+    sqTailPtr_ = (unsigned*)(sq + params.sq_off.tail);
+    sqMask_ = *(unsigned*)(sq + params.sq_off.ring_mask);
+    sqEntries_ = *(unsigned*)(sq + params.sq_off.ring_entries);
+    sqTail_ = *sqTailPtr_;
+    cqHead_ = (unsigned*)(cq + params.cq_off.head);
+    cqTail_ = (unsigned*)(cq + params.cq_off.tail);
+    cqMask_ = *(unsigned*)(cq + params.cq_off.ring_mask);
+    cqes_ = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // 提交队列的第i项始终对应第i个sqe
+    unsigned* array = (unsigned*)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < sqEntries_; i++)
+        array[i] = i;
+
+    if (!withBuffers)
+        return true;
+
+    // 注册缓冲区环，多次触发的recv从中选择缓冲区
+    bufRing_ = (struct io_uring_buf_ring*)mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf),
+                                               PROT_READ | PROT_WRITE,
+                                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufRing_ == MAP_FAILED)
+        return false;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)bufRing_;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = BUF_GROUP;
+    if (syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return false;
+
+    bufs_ = (char*)malloc(URING_BUF_COUNT * URING_BUF_SIZE);
+    for (int i = 0; i < URING_BUF_COUNT; i++)
+        recycleBuffer(i);
+
+    return true;
+}
+
+/* 创建线程，使该事件循环运行在新线程中
+ */
+void UringLoop::start()
+{
+    pthread_create(&tid_, NULL, threadFunc, (void*)this);
+}
+
+void* UringLoop::threadFunc(void* arg)
+{
+    UringLoop* loop = (UringLoop*)arg;
+
+    loop->loop();
+
+    return (void*)0;
+}
+
+/* 事件循环
+ * 每轮用一次io_uring_enter提交本线程积累的所有操作并等待至少一个完成事件，
+ * 然后处理所有完成事件
+ */
+void UringLoop::loop()
+{
+    currentLoop = this;
+
+    while (true) {
+        unsigned toSubmit;
+
+        pthread_mutex_lock(&sqMutex_);
+        toSubmit = sqTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+        pthread_mutex_unlock(&sqMutex_);
+
+        if (enter(toSubmit, 1, IORING_ENTER_GETEVENTS) < 0
+            && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+            break;
+
+        unsigned head = *cqHead_;
+        unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+
+        while (head != tail) {
+            struct io_uring_cqe* cqe = &cqes_[head & cqMask_];
+            uint64_t userData = cqe->user_data;
+            int res = cqe->res;
+            uint32_t flags = cqe->flags;
+
+            // 先取出完成事件的内容再归还该项，处理过程中可能产生新的完成事件
+            head++;
+            __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+            handleCompletion(userData, res, flags);
+
+            if (head == tail)
+                tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+        }
+
+        if (afterEvents_)
+            afterEvents_();
+    }
+}
+
+/* 在监听套接字上提交多次触发的accept，每接收一个连接调用一次accept
+ * 只应在调用loop之前调用一次
+ *
+ * @param listenFd 监听套接字
+ * @param accept 新连接的处理函数
+ */
+void UringLoop::acceptMultishot(int listenFd, UringAcceptCallback accept)
+{
+    listenFd_ = listenFd;
+    accept_ = accept;
+    submitAccept();
+}
+
+/* 开始在连接上接收数据，可以由任意线程调用
+ * 提交多次触发的recv，之后每次收到数据产生一个完成事件，直到连接断开
+ *
+ * @param conn 客户端连接，调用者保证其描述符在提交完成之前不会被关闭
+ */
+void UringLoop::addConnection(Connection* conn)
+{
+    pthread_mutex_lock(&sqMutex_);
+
+    struct io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = ((uint64_t)conn->fd << 32)
+                     | ((uint64_t)(conn->generation & URING_GEN_MASK) << 3) | TAG_RECV;
+
+    publish(currentLoop != this);
+    pthread_mutex_unlock(&sqMutex_);
+}
+
+/* 取消连接上的多次触发的recv，可以由任意线程调用
+ * 接收操作随后以-ECANCELED结束，作为URING_INPUT_REARM交给处理函数;
+ * 接收操作已经结束时取消不起作用
+ *
+ * @param conn 客户端连接，代数与提交接收时相同
+ */
+void UringLoop::cancelRecv(Connection* conn)
+{
+    pthread_mutex_lock(&sqMutex_);
+
+    struct io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = ((uint64_t)conn->fd << 32)
+                | ((uint64_t)(conn->generation & URING_GEN_MASK) << 3) | TAG_RECV;
+    sqe->user_data = TAG_CANCEL;
+
+    publish(currentLoop != this);
+    pthread_mutex_unlock(&sqMutex_);
+}
+
+/* 取走连接发送队列中的数据，用一个sendmsg操作发送
+ * 同一个连接同一时刻只有一个发送操作，完成后再发送之后放入的数据
+ *
+ * @param conn 客户端连接，调用者已对outputMutex加锁，且没有未完成的发送操作
+ */
+void UringLoop::send(Connection* conn)
+{
+    SendOp* op = new SendOp;
+
+    op->conn = conn;
+    op->gen = conn->generation;
+    op->first = 0;
+    op->count = conn->output.take(op->payloads, MAX_IOVECS);
+    for (int i = 0; i < op->count; i++) {
+        op->iov[i].iov_base = op->payloads[i]->data();
+        op->iov[i].iov_len = op->payloads[i]->size();
+    }
+
+    conn->sendInFlight = true;
+    submitSend(op);
+}
+
+/* 立即提交所有已准备好的操作，不等待完成
+ * 关闭描述符之前调用，保证引用该描述符的操作已经交给内核
+ */
+void UringLoop::submit()
+{
+    pthread_mutex_lock(&sqMutex_);
+    publish(true);
+    pthread_mutex_unlock(&sqMutex_);
+}
+
+/* 取得一个空闲的sqe，提交队列满时先提交已有的操作
+ * 调用者已对sqMutex_加锁
+ */
+struct io_uring_sqe* UringLoop::getSqe()
+{
+    while (sqTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_)
+        publish(true);
+
+    struct io_uring_sqe* sqe = &sqes_[sqTail_ & sqMask_];
+    sqTail_++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/* 把准备好的sqe交给内核可见的队尾
+ * 调用者已对sqMutex_加锁
+ *
+ * @param now true : 立即调用io_uring_enter提交;
+ *            false : 留给本循环下一次等待完成事件时一起提交
+ */
+void UringLoop::publish(bool now)
+{
+    __atomic_store_n(sqTailPtr_, sqTail_, __ATOMIC_RELEASE);
+
+    if (now) {
+        unsigned toSubmit = sqTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+        if (toSubmit > 0)
+            enter(toSubmit, 0, 0);
+    }
+}
+
+int UringLoop::enter(unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ringFd_, toSubmit, minComplete, flags, NULL, 0);
+}
+
+void UringLoop::submitAccept()
+{
+    pthread_mutex_lock(&sqMutex_);
+
+    struct io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenFd_;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = TAG_ACCEPT;
+
+    publish(currentLoop != this);
+    pthread_mutex_unlock(&sqMutex_);
+}
+
+/* 使事件循环至少每tickMs毫秒醒来一次（之后调用afterEvents），用于推进定时器
+ * 用一个IORING_OP_TIMEOUT实现，到期后重新提交;只应在调用loop之前调用一次
+ *
+ * @param tickMs 间隔的毫秒数
+ */
+void UringLoop::setTick(int tickMs)
+{
+    tick_.tv_sec = tickMs / 1000;
+    tick_.tv_nsec = (long long)(tickMs % 1000) * 1000000;
+    submitTick();
+}
+
+void UringLoop::submitTick()
+{
+    pthread_mutex_lock(&sqMutex_);
+
+    struct io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)&tick_;
+    sqe->len = 1;
+    sqe->off = 0; // 只按时间到期，不计完成事件数
+    sqe->user_data = TAG_TICK;
+
+    publish(currentLoop != this);
+    pthread_mutex_unlock(&sqMutex_);
+}
+
+/* 提交发送操作，本循环的线程提交时与下一次等待一起批量提交，其他线程立即提交
+ * 调用者已对该连接的outputMutex加锁，保证提交之前连接不会被释放
+ */
+void UringLoop::submitSend(SendOp* op)
+{
+    memset(&op->msg, 0, sizeof(op->msg));
+    op->msg.msg_iov = &op->iov[op->first];
+    op->msg.msg_iovlen = op->count - op->first;
+
+    pthread_mutex_lock(&sqMutex_);
+
+    struct io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = op->conn->fd;
+    sqe->addr = (uint64_t)&op->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)op | TAG_SEND;
+
+    publish(currentLoop != this);
+    pthread_mutex_unlock(&sqMutex_);
+}
+
+/* 处理一个完成事件
+ *
+ * @param userData 提交时设置的user_data
+ * @param res 操作的结果，负数为-errno
+ * @param flags IORING_CQE_F_*
+ */
+void UringLoop::handleCompletion(uint64_t userData, int res, uint32_t flags)
+{
+    switch (userData & TAG_MASK) {
+    case TAG_ACCEPT:
+        if (res >= 0)
+            accept_(res);
+        if (!(flags & IORING_CQE_F_MORE))
+            submitAccept();
+        break;
+
+    case TAG_RECV: {
+        int fd = (int)(userData >> 32);
+        uint32_t gen = (uint32_t)(userData >> 3) & URING_GEN_MASK;
+
+        if (res > 0) {
+            int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            input_(fd, gen, URING_INPUT_DATA, bufs_ + bid * URING_BUF_SIZE, res);
+            recycleBuffer(bid);
+            if (!(flags & IORING_CQE_F_MORE))
+                input_(fd, gen, URING_INPUT_REARM, NULL, 0);
+        } else if (res == -ENOBUFS || res == -ECANCELED) { // 缓冲区暂时用完，或被cancelRecv取消
+            if (!(flags & IORING_CQE_F_MORE))
+                input_(fd, gen, URING_INPUT_REARM, NULL, 0);
+        } else if (!(flags & IORING_CQE_F_MORE)) { // 对端关闭或出错
+            input_(fd, gen, URING_INPUT_CLOSED, NULL, 0);
+        }
+        break;
+    }
+
+    case TAG_SEND:
+        handleSend((SendOp*)(userData & ~(uint64_t)TAG_MASK), res);
+        break;
+
+    case TAG_TICK:
+        submitTick();
+        break;
+
+    default:
+        break;
+    }
+}
+
+/* 发送操作完成
+ * 只发送了一部分时继续发送剩余部分，全部发送完后发送这期间新放入发送队列的数据
+ *
+ * @param op 发送操作
+ * @param res 发送的字节数，负数为-errno
+ */
+void UringLoop::handleSend(SendOp* op, int res)
+{
+    Connection* conn = op->conn;
+
+    pthread_mutex_lock(&conn->outputMutex);
+
+    if (op->gen != conn->generation) { // 连接已经释放
+        pthread_mutex_unlock(&conn->outputMutex);
+        freeSendOp(op);
+        return ;
+    }
+
+    if (res == -EINTR || res == -EAGAIN) {
+        submitSend(op);
+        pthread_mutex_unlock(&conn->outputMutex);
+        return ;
+    }
+
+    if (res < 0) { // 连接出错，由接收操作负责释放连接
+        conn->output.clear();
+        conn->sendInFlight = false;
+        shutdown(conn->fd, SHUT_RDWR);
+        pthread_mutex_unlock(&conn->outputMutex);
+        freeSendOp(op);
+        if (sent_)
+            sent_(conn);
+        return ;
+    }
+
+    size_t left = res;
+    while (left > 0 && op->first < op->count) {
+        struct iovec& iov = op->iov[op->first];
+
+        if (left >= iov.iov_len) {
+            left -= iov.iov_len;
+            op->payloads[op->first]->release();
+            op->first++;
+        } else {
+            iov.iov_base = (char*)iov.iov_base + left;
+            iov.iov_len -= left;
+            left = 0;
+        }
+    }
+
+    if (op->first < op->count) {
+        submitSend(op);
+        pthread_mutex_unlock(&conn->outputMutex);
+        return ;
+    }
+
+    conn->sendInFlight = false;
+    if (!conn->output.empty())
+        send(conn);
+
+    pthread_mutex_unlock(&conn->outputMutex);
+    freeSendOp(op);
+    if (sent_)
+        sent_(conn);
+}
+
+void UringLoop::freeSendOp(SendOp* op)
+{
+    for (int i = op->first; i < op->count; i++)
+        op->payloads[i]->release();
+    delete op;
+}
+
+// 把缓冲区归还给缓冲区环，只由本循环的线程调用
+void UringLoop::recycleBuffer(int bid)
+{
+    // 不使用bufRing_->bufs : C++下头文件中的柔性数组前多了一个空结构体，偏移不是0
+    struct io_uring_buf* buf = (struct io_uring_buf*)bufRing_ + (bufTail_ & (URING_BUF_COUNT - 1));
+
+    buf->addr = (uint64_t)(bufs_ + bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    bufTail_++;
+    __atomic_store_n(&bufRing_->tail, bufTail_, __ATOMIC_RELEASE);
+}
+
+} // namespace chat
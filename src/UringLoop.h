@@ -0,0 +1,138 @@
+/* 基于io_uring的事件循环
+ *
+ * 与EventLoop一样，每个UringLoop拥有一个io_uring实例和一个线程，
+ * 分配给它的连接的接收和发送都在这个io_uring上完成 :
+ * 1.接收连接 : 多次触发的accept（IORING_ACCEPT_MULTISHOT），一次提交持续返回新连接
+ * 2.接收数据 : 多次触发的recv，数据由内核直接写入预先注册的缓冲区环（provided buffers），
+ *             处理完后缓冲区归还给内核，不再需要epoll_wait + recv直到EAGAIN
+ * 3.发送数据 : 发送队列中的片段取走后用一个IORING_OP_SENDMSG发送，
+ *             本线程产生的提交在下一次等待完成事件时一起提交，一次io_uring_enter
+ *
+ * 直接使用io_uring_setup/io_uring_enter/io_uring_register系统调用，不依赖liburing
+ *
+ * 提交队列由sqMutex_保护，其他线程（例如群聊投递）也可以向该循环提交发送;
+ * 完成队列只由本循环的线程读取
+ */
+
+#ifndef _CHATROOM_SRC_URINGLOOP_H_
+#define _CHATROOM_SRC_URINGLOOP_H_
+
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <functional>
+
+#include "Connection.h"
+
+namespace chat {
+
+#define URING_ENTRIES       1024 // 提交队列的长度，完成队列为其4倍
+#define URING_BUF_COUNT     256  // 缓冲区环中的缓冲区个数，必须是2的幂
+#define URING_BUF_SIZE      4096 // 每个缓冲区的大小
+#define URING_GEN_MASK      0x1fffffff // 完成事件中能携带的连接代数的位数
+
+// 接收到新连接
+typedef std::function<void(int fd)> UringAcceptCallback;
+
+// 接收事件的类型
+#define URING_INPUT_DATA    0 // 收到数据
+#define URING_INPUT_REARM   1 // 接收操作结束但连接正常（例如缓冲区暂时用完），需要重新调用addConnection
+#define URING_INPUT_CLOSED  2 // 连接已断开或出错
+
+/* 连接上的接收事件
+ * 参数gen是提交接收时连接的代数（只保留URING_GEN_MASK位），
+ * 处理函数需要先确认连接没有被释放、描述符没有被复用，再处理数据或重新提交接收
+ */
+typedef std::function<void(int fd, uint32_t gen, int event,
+                           const char* data, size_t len)> UringInputCallback;
+
+// 每轮完成事件处理完之后调用
+typedef std::function<void()> UringIterationCallback;
+
+// 连接上的一个发送操作结束（全部发送完或出错）之后调用，调用时不持有任何锁
+typedef std::function<void(Connection* conn)> UringSentCallback;
+
+class UringLoop {
+public:
+    UringLoop(UringInputCallback input, UringIterationCallback afterEvents,
+              UringSentCallback sent = nullptr);
+    ~UringLoop();
+
+    bool init(bool withBuffers);
+    void start();
+    void loop();
+
+    void acceptMultishot(int listenFd, UringAcceptCallback accept);
+    void setTick(int tickMs);
+    void addConnection(Connection* conn);
+    void cancelRecv(Connection* conn);
+    void send(Connection* conn);
+    void submit();
+
+private:
+    // 一次发送操作，发送完成之前持有所有数据块的引用
+    typedef struct {
+        Connection* conn;
+        uint32_t gen;
+        int count;
+        int first; // 第一个尚未发送完的数据块
+        Payload* payloads[MAX_IOVECS];
+        struct iovec iov[MAX_IOVECS];
+        struct msghdr msg;
+    } SendOp;
+
+    static void* threadFunc(void* arg);
+
+    struct io_uring_sqe* getSqe();
+    void publish(bool now);
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags);
+    void submitAccept();
+    void submitTick();
+    void submitSend(SendOp* op);
+    void handleCompletion(uint64_t userData, int res, uint32_t flags);
+    void handleSend(SendOp* op, int res);
+    void freeSendOp(SendOp* op);
+    void recycleBuffer(int bid);
+
+private:
+    pthread_t tid_;
+    int ringFd_;
+    UringInputCallback input_;
+    UringIterationCallback afterEvents_;
+    UringSentCallback sent_;
+    UringAcceptCallback accept_;
+    int listenFd_;
+
+    // 提交队列，sqTail_是本地的队尾，提交时写回*sqTail
+    void* sqRing_;
+    size_t sqRingSize_;
+    struct io_uring_sqe* sqes_;
+    size_t sqesSize_;
+    unsigned* sqHead_;
+    unsigned* sqTailPtr_;
+    unsigned sqMask_;
+    unsigned sqEntries_;
+    unsigned sqTail_;
+    pthread_mutex_t sqMutex_;
+
+    // 完成队列，只由本循环的线程访问
+    void* cqRing_;
+    size_t cqRingSize_;
+    struct io_uring_cqe* cqes_;
+    unsigned* cqHead_;
+    unsigned* cqTail_;
+    unsigned cqMask_;
+
+    // 缓冲区环（provided buffers），只由本循环的线程归还缓冲区
+    struct io_uring_buf_ring* bufRing_;
+    char* bufs_;
+    unsigned short bufTail_;
+
+    // 周期性的超时的间隔，超时操作可能到下一次io_uring_enter才交给内核读取，因此保存在成员中
+    struct __kernel_timespec tick_;
+};
+
+} // namespace chat
+
+#endif // _CHATROOM_SRC_URINGLOOP_H_
@@ -0,0 +1,96 @@
+#include "UserRegistry.h"
+
+namespace chat {
+
+/* 注册新用户
+ *
+ * @param name 用户名
+ * @param password 密码
+ * @return 新用户的下标; -1 : 用户名已存在
+ */
+int UserRegistry::add(StringView name, StringView password) {
+    if (byName_.insert(name, users_.size()) != -1)
+        return -1;
+
+    users_.push_back(User());
+    User& usr = users_.back();
+    usr.name.assign(name.data(), name.size());
+    usr.password.assign(password.data(), password.size());
+    usr.fd = -1;
+    usr.online = false;
+    usr.push = false;
+
+    return users_.size() - 1;
+}
+
+/* 预先分配n个用户的空间，启动时一次加载大量用户前调用
+ */
+void UserRegistry::reserve(size_t n) {
+    users_.reserve(n);
+    byName_.reserve(n);
+}
+
+/* 按用户名查找
+ *
+ * @param name 用户名
+ * @return 用户的下标; -1 : 用户不存在
+ */
+int UserRegistry::findByName(StringView name) const {
+    return byName_.find(name);
+}
+
+/* 查找登录在某个连接上的用户
+ *
+ * @param fd 客户端套接字
+ * @return 用户的下标; -1 : 该连接上没有登录的用户
+ */
+int UserRegistry::findByFd(int fd) const {
+    if (fd < 0 || (size_t)fd >= byFd_.size())
+        return -1;
+    return byFd_[fd];
+}
+
+/* 用户在某个连接上登录
+ * 该用户之前登录的连接、以及该连接上之前登录的用户都解除绑定
+ *
+ * @param index 用户的下标
+ * @param fd 客户端套接字
+ * @return 该连接上之前登录的另一个用户，因此而下线; -1 : 没有
+ */
+int UserRegistry::bind(int index, int fd) {
+    User& usr = users_[index];
+    int previous;
+
+    if (usr.online)
+        unbind(usr.fd);
+    previous = unbind(fd);
+
+    if ((size_t)fd >= byFd_.size())
+        byFd_.resize(fd + 1, -1);
+    byFd_[fd] = index;
+
+    usr.fd = fd;
+    usr.online = true;
+    usr.push = false;
+    return previous;
+}
+
+/* 连接关闭时，使该连接上登录的用户下线
+ *
+ * @param fd 客户端套接字
+ * @return 下线的用户的下标; -1 : 该连接上没有登录的用户
+ */
+int UserRegistry::unbind(int fd) {
+    int index = findByFd(fd);
+
+    if (index == -1)
+        return -1;
+
+    byFd_[fd] = -1;
+    users_[index].fd = -1;
+    users_[index].online = false;
+    users_[index].push = false;
+    return index;
+}
+
+} // namespace chat
@@ -0,0 +1,55 @@
+/* 用户表
+ *
+ * 按注册顺序保存所有用户，并维护两个索引 :
+ * 1.用户名 -> 下标，用于注册、登录和查找聊天对象
+ * 2.描述符 -> 下标，用于查找某个连接上登录的用户
+ * 两种查找都是O(1)，与用户总数无关
+ *
+ * 用户注册后不会删除，下标可以长期作为用户的标识
+ * 本类不加锁，由调用者（Server::usersMutex_）保证互斥
+ */
+
+#ifndef _CHATROOM_SRC_USERREGISTRY_H_
+#define _CHATROOM_SRC_USERREGISTRY_H_
+
+#include <string>
+#include <vector>
+
+#include "NameIndex.h"
+
+namespace chat {
+
+// 存放客户端的信息
+typedef struct {
+    std::string name;
+    std::string password;
+    int fd;
+    bool online;
+    bool push; // 是否开启了服务器推送
+    std::vector<int> rooms; // 加入的房间的下标，见RoomRegistry
+}User;
+
+class UserRegistry {
+public:
+    UserRegistry() : byName_(&users_) {}
+
+    int add(StringView name, StringView password);
+    void reserve(size_t n);
+    int findByName(StringView name) const;
+    int findByFd(int fd) const;
+
+    int bind(int index, int fd);
+    int unbind(int fd);
+
+    User& operator[](int index) { return users_[index]; }
+    size_t size() const { return users_.size(); }
+
+private:
+    std::vector<User> users_;
+    NameIndex<User> byName_;
+    std::vector<int> byFd_; // 以描述符为下标，-1表示该连接上没有登录的用户
+};
+
+} // namespace chat
+
+#endif // _CHATROOM_SRC_USERREGISTRY_H_
@@ -0,0 +1,207 @@
+/* 工作窃取的任务队列
+ *
+ * 线程池中每个工作线程拥有一个本地双端队列 :
+ * 1.工作线程自己提交的任务放入本地队列尾部，自己从尾部取出（后进先出，数据还在缓存中）
+ * 2.其他线程提交的任务轮流放入各个工作线程的本地队列
+ * 3.本地队列为空时，从其他工作线程的队列头部窃取任务（先进先出，窃取最早的任务）
+ * 每个本地队列有自己的互斥锁，通常只有所有者访问，不再像Queue那样所有线程争用同一把锁
+ *
+ * 所有队列都为空时工作线程睡眠，提交任务时只在有睡眠的线程时唤醒其中一个
+ *
+ * 对外仍然是BlockingQueue接口，可以直接替换线程池的工作队列;
+ * 工作线程启动时调用attach登记自己的编号
+ */
+
+#ifndef _CHATROOM_SRC_WORKSTEALINGQUEUE_H_
+#define _CHATROOM_SRC_WORKSTEALINGQUEUE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <vector>
+
+#include "Queue.h"
+
+namespace chat {
+
+template <typename T>
+class WorkStealingQueue : public BlockingQueue<T> {
+public:
+    /* @param numWorkers 工作线程数，即本地队列数
+     */
+    explicit WorkStealingQueue(int numWorkers)
+        : numWorkers_(numWorkers),
+          nextWorker_(0),
+          pending_(0),
+          sleepers_(0)
+    {
+        for (int i = 0; i < numWorkers; i++) {
+            Worker* worker = new Worker;
+            pthread_mutex_init(&worker->mutex, NULL);
+            worker->stolen.store(0);
+            workers_.push_back(worker);
+        }
+        pthread_mutex_init(&idleMutex_, NULL);
+        pthread_cond_init(&idleCond_, NULL);
+    }
+
+    ~WorkStealingQueue() {
+        for (int i = 0; i < numWorkers_; i++) {
+            pthread_mutex_destroy(&workers_[i]->mutex);
+            delete workers_[i];
+        }
+        pthread_mutex_destroy(&idleMutex_);
+        pthread_cond_destroy(&idleCond_);
+    }
+
+    /* 登记当前线程为第index个工作线程，之后该线程的push和get使用自己的本地队列
+     *
+     * @param index 工作线程的编号，0 ~ numWorkers-1
+     */
+    void attach(int index) {
+        currentQueue_ = this;
+        currentIndex_ = index;
+    }
+
+    /* 提交任务 : 工作线程放入自己的本地队列，其他线程轮流放入各个本地队列
+     */
+    void push(const T& w) {
+        int self = currentWorker();
+        int index = self != -1 ? self : nextWorker_.fetch_add(1) % numWorkers_;
+        Worker* worker = workers_[index];
+
+        pthread_mutex_lock(&worker->mutex);
+        worker->tasks.push_back(w);
+        pthread_mutex_unlock(&worker->mutex);
+
+        // 与get中的睡眠检查配对 : 要么这里看到睡眠的线程，要么它看到pending_
+        pending_.fetch_add(1, std::memory_order_seq_cst);
+        if (sleepers_.load(std::memory_order_seq_cst) > 0) {
+            pthread_mutex_lock(&idleMutex_);
+            pthread_cond_signal(&idleCond_);
+            pthread_mutex_unlock(&idleMutex_);
+        }
+    }
+
+    /* 取出任务 : 先取本地队列尾部，再窃取其他队列头部，都没有则睡眠
+     */
+    void get(T& w) {
+        int self = currentWorker();
+
+        while (true) {
+            if (self != -1 && popBack(workers_[self], w))
+                return;
+            if (steal(self, w))
+                return;
+
+            pthread_mutex_lock(&idleMutex_);
+            sleepers_.fetch_add(1, std::memory_order_seq_cst);
+            if (pending_.load(std::memory_order_seq_cst) <= 0)
+                pthread_cond_wait(&idleCond_, &idleMutex_);
+            sleepers_.fetch_sub(1, std::memory_order_seq_cst);
+            pthread_mutex_unlock(&idleMutex_);
+        }
+    }
+
+    // 所有本地队列中的任务总数
+    size_t size() {
+        long n = pending_.load(std::memory_order_relaxed);
+        return n > 0 ? (size_t)n : 0;
+    }
+
+    /* @param index 工作线程的编号
+     * @return 该工作线程从其他线程窃取的任务数
+     */
+    uint64_t stolen(int index) const {
+        return workers_[index]->stolen.load(std::memory_order_relaxed);
+    }
+
+private:
+    typedef struct {
+        pthread_mutex_t mutex;
+        std::deque<T> tasks;
+        std::atomic<uint64_t> stolen;
+    } Worker;
+
+    // 当前线程在本队列中的编号，不是本队列的工作线程时为-1
+    int currentWorker() const {
+        return currentQueue_ == this ? currentIndex_ : -1;
+    }
+
+    bool popBack(Worker* worker, T& w) {
+        bool ok = false;
+
+        pthread_mutex_lock(&worker->mutex);
+        if (!worker->tasks.empty()) {
+            w = worker->tasks.back();
+            worker->tasks.pop_back();
+            ok = true;
+        }
+        pthread_mutex_unlock(&worker->mutex);
+
+        if (ok)
+            pending_.fetch_sub(1, std::memory_order_relaxed);
+        return ok;
+    }
+
+    bool popFront(Worker* worker, T& w) {
+        bool ok = false;
+
+        pthread_mutex_lock(&worker->mutex);
+        if (!worker->tasks.empty()) {
+            w = worker->tasks.front();
+            worker->tasks.pop_front();
+            ok = true;
+        }
+        pthread_mutex_unlock(&worker->mutex);
+
+        if (ok)
+            pending_.fetch_sub(1, std::memory_order_relaxed);
+        return ok;
+    }
+
+    /* 从自己之后的工作线程开始，依次尝试窃取一个任务
+     *
+     * @param self 当前工作线程的编号，-1表示不是工作线程
+     */
+    bool steal(int self, T& w) {
+        if (pending_.load(std::memory_order_relaxed) <= 0)
+            return false;
+
+        for (int i = 1; i <= numWorkers_; i++) {
+            int victim = (self + i + numWorkers_) % numWorkers_;
+            if (victim == self)
+                continue;
+            if (popFront(workers_[victim], w)) {
+                if (self != -1)
+                    workers_[self]->stolen.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    static thread_local const WorkStealingQueue* currentQueue_;
+    static thread_local int currentIndex_;
+
+    const int numWorkers_;
+    std::vector<Worker*> workers_;
+    std::atomic<unsigned> nextWorker_; // 外部线程提交任务时轮流选择的本地队列
+
+    std::atomic<long> pending_; // 所有本地队列中的任务总数
+    std::atomic<int> sleepers_; // 正在睡眠或准备睡眠的工作线程数
+    pthread_mutex_t idleMutex_;
+    pthread_cond_t idleCond_;
+};
+
+template <typename T>
+thread_local const WorkStealingQueue<T>* WorkStealingQueue<T>::currentQueue_ = NULL;
+
+template <typename T>
+thread_local int WorkStealingQueue<T>::currentIndex_ = -1;
+
+} // namespace chat
+
+#endif // _CHATROOM_SRC_WORKSTEALINGQUEUE_H_
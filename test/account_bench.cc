@@ -0,0 +1,265 @@
+/* 账号持久化的基准测试
+ *
+ * signup  : 逐个注册用户，比较只修改UserRegistry和同时追加预写日志时每次注册的耗时，
+ *           后台生成快照的线程照常运行
+ * startup : 在大量用户（默认100万）、房间和成员关系上生成快照，再追加一段日志，
+ *           丢弃页缓存后测量读取快照、重放日志以及重建UserRegistry/RoomRegistry的时间
+ *
+ * 用法: account_bench [-d 目录] [-u 用户数] [-r 房间数] [-m 每个用户加入的房间数] [-t 快照之后的日志记录数]
+ */
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "../src/AccountStore.h"
+#include "../src/UserRegistry.h"
+#include "../src/RoomRegistry.h"
+#include "bench.h"
+
+using chat::AccountStore;
+using chat::AccountState;
+using chat::UserRegistry;
+using chat::RoomRegistry;
+
+static std::string baseDir = "/tmp/account_bench";
+static int numUsers = 1000000;
+static int numRooms = 1000;
+static int roomsPerUser = 3;
+static int tailRecords = ACCOUNT_SNAPSHOT_RECORDS - 1; // 下一次快照之前日志最长的情况
+
+static std::string userName(int i) {
+    char name[32];
+    snprintf(name, sizeof(name), "user%08d", i);
+    return name;
+}
+
+static void removeDir(const std::string& dir) {
+    DIR* d = opendir(dir.c_str());
+    struct dirent* entry;
+
+    if (d == NULL)
+        return ;
+    while ((entry = readdir(d)) != NULL) {
+        std::string path = dir + "/" + entry->d_name;
+        if (entry->d_name[0] == '.')
+            continue;
+        if (entry->d_type == DT_DIR)
+            removeDir(path);
+        else
+            unlink(path.c_str());
+    }
+    closedir(d);
+    rmdir(dir.c_str());
+}
+
+// 把目录下的文件写回磁盘后从页缓存中丢弃
+static void dropCache(const std::string& dir) {
+    DIR* d = opendir(dir.c_str());
+    struct dirent* entry;
+
+    if (d == NULL)
+        return ;
+    while ((entry = readdir(d)) != NULL) {
+        std::string path = dir + "/" + entry->d_name;
+        if (entry->d_name[0] == '.')
+            continue;
+        if (entry->d_type == DT_DIR) {
+            dropCache(path);
+            continue;
+        }
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1)
+            continue;
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    closedir(d);
+}
+
+static void printLatency(const char* name, const bench::Histogram& h) {
+    printf("signup  %-9s mean=%6.0fns  p50=%6lluns  p99=%6lluns  p99.9=%7lluns  max=%8lluns\n", name,
+           h.mean(), (unsigned long long)h.percentile(0.5), (unsigned long long)h.percentile(0.99),
+           (unsigned long long)h.percentile(0.999), (unsigned long long)h.max());
+}
+
+/******************************** signup ********************************/
+
+static void benchSignUp(const std::string& dir) {
+    bench::Histogram memory, persisted;
+    std::vector<std::string> names(numUsers);
+    uint64_t start, snapshotNs;
+
+    for (int i = 0; i < numUsers; i++)
+        names[i] = userName(i);
+
+    {
+        UserRegistry users;
+        for (int i = 0; i < numUsers; i++) {
+            uint64_t t = bench::nowNs();
+            users.add(names[i], "password");
+            memory.record(bench::nowNs() - t);
+        }
+    }
+
+    AccountStore store(dir);
+    AccountState state;
+    UserRegistry users;
+    RoomRegistry rooms;
+
+    if (!store.open(state)) {
+        perror("open account store");
+        exit(1);
+    }
+
+    for (int i = 0; i < numUsers; i++) {
+        uint64_t t = bench::nowNs();
+        users.add(names[i], "password");
+        store.signUp(names[i], "password");
+        persisted.record(bench::nowNs() - t);
+    }
+
+    printLatency("memory", memory);
+    printLatency("+wal", persisted);
+
+    // 房间和成员关系，用户i加入房间i, i+1, ...（取模）
+    for (int r = 0; r < numRooms; r++) {
+        char name[32];
+        snprintf(name, sizeof(name), "room%06d", r);
+        rooms.add(name);
+        store.makeRoom(name);
+    }
+    for (int i = 0; i < numUsers; i++) {
+        for (int k = 0; k < roomsPerUser; k++) {
+            int r = (i + k) % numRooms;
+            if (rooms.join(r, i, users[i].rooms, false))
+                store.join(i, r);
+        }
+    }
+
+    start = bench::nowNs();
+    if (!store.snapshot()) {
+        perror("snapshot");
+        exit(1);
+    }
+    snapshotNs = bench::nowNs() - start;
+
+    struct stat st;
+    stat((dir + "/snapshot").c_str(), &st);
+    printf("snapshot %d users  %d rooms  %.1f MB  %.0f ms\n", numUsers, numRooms,
+           st.st_size / 1048576.0, snapshotNs / 1e6);
+    fflush(stdout);
+}
+
+/******************************** startup ********************************/
+
+static void benchStartup(const std::string& dir) {
+    uint64_t start, openNs, buildNs, snapshotSeq, walSeq;
+    AccountState state;
+
+    // 快照之后的日志 : 新用户注册并加入房间，不生成新的快照
+    {
+        AccountStore store(dir, LOG_SYNC_INTERVAL_MS, (uint64_t)-1);
+        if (!store.open(state)) {
+            perror("open account store");
+            exit(1);
+        }
+        for (int i = 0; i < tailRecords; i++) {
+            if (i % 2 == 0)
+                store.signUp(userName(numUsers + i / 2), "password");
+            else
+                store.join(numUsers + i / 2, i % numRooms);
+        }
+    }
+    dropCache(dir);
+
+    AccountStore store(dir, LOG_SYNC_INTERVAL_MS, (uint64_t)-1);
+    state.users.clear();
+    state.rooms.clear();
+
+    start = bench::nowNs();
+    if (!store.open(state)) {
+        perror("reopen account store");
+        exit(1);
+    }
+    openNs = bench::nowNs() - start;
+    snapshotSeq = store.snapshotSeq();
+    walSeq = store.walSeq();
+
+    // 与Server::loadAccounts相同
+    start = bench::nowNs();
+    UserRegistry users;
+    RoomRegistry rooms;
+    std::vector<size_t> members(state.rooms.size(), 0);
+    users.reserve(state.users.size());
+    rooms.reserve(state.rooms.size());
+    for (size_t i = 0; i < state.users.size(); i++) {
+        for (size_t j = 0; j < state.users[i].rooms.size(); j++)
+            members[state.users[i].rooms[j]]++;
+    }
+    for (size_t i = 0; i < state.rooms.size(); i++) {
+        rooms.add(state.rooms[i]);
+        rooms[i].members.reserve(members[i]);
+    }
+    for (size_t i = 0; i < state.users.size(); i++) {
+        int index = users.add(state.users[i].name, state.users[i].password);
+        users[index].rooms.reserve(state.users[i].rooms.size());
+        for (size_t j = 0; j < state.users[i].rooms.size(); j++)
+            rooms.join(state.users[i].rooms[j], index, users[index].rooms, false);
+    }
+    buildNs = bench::nowNs() - start;
+
+    size_t expected = numUsers + (tailRecords + 1) / 2;
+    printf("startup %zu users  %zu rooms  wal tail=%llu records (cold cache)\n", users.size(),
+           rooms.size(), (unsigned long long)(walSeq - snapshotSeq));
+    printf("startup load snapshot + replay %8.1f ms\n", openNs / 1e6);
+    printf("startup rebuild registries     %8.1f ms\n", buildNs / 1e6);
+    printf("startup total                  %8.1f ms%s\n", (openNs + buildNs) / 1e6,
+           users.size() == expected ? "" : "  MISMATCH");
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:u:r:m:t:")) != -1) {
+        switch (opt) {
+        case 'd':
+            baseDir = optarg;
+            break;
+        case 'u':
+            numUsers = atoi(optarg);
+            break;
+        case 'r':
+            numRooms = atoi(optarg);
+            break;
+        case 'm':
+            roomsPerUser = atoi(optarg);
+            break;
+        case 't':
+            tailRecords = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d dir] [-u users] [-r rooms] [-m rooms per user] [-t tail]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (numUsers <= 0 || numRooms <= 0) {
+        fprintf(stderr, "need at least one user and one room\n");
+        return 1;
+    }
+
+    removeDir(baseDir);
+    benchSignUp(baseDir);
+    benchStartup(baseDir);
+    removeDir(baseDir);
+    return 0;
+}
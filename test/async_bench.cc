@@ -0,0 +1,158 @@
+/* 同步客户端与异步流水线客户端的请求吞吐对比，需要先启动服务器
+ *
+ * 每个连接注册并登录一个用户后反复发送cdroom（进入同一个已存在的房间，结果总是成功）:
+ * sync  : chat::Client，每个请求等待回复后再发下一个
+ * async : chat::AsyncClient，每个连接保持最多depth个请求在途，回复到达时补发，
+ *         同一轮中发出的请求合并为一次write
+ * 统计每秒完成的请求数和每个请求从发出到回调的延迟
+ *
+ * 用法: async_bench [-h 地址] [-p 端口] [-c 连接数] [-n 每个连接的请求数] [-d 在途请求数]
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "../src/Client.h"
+#include "../src/AsyncClient.h"
+#include "bench.h"
+
+using chat::Client;
+using chat::AsyncClient;
+
+static std::string host = "127.0.0.1";
+static int port = 5000;
+static int connections = 4;
+static int requests = 20000;
+static int depth = 64;
+
+static const char* kRoom = "async_bench_room";
+
+static std::string userName(int i) {
+    char name[32];
+    snprintf(name, sizeof(name), "ab%d_%d", (int)getpid(), i);
+    return name;
+}
+
+static void printResult(const char* mode, uint64_t done, uint64_t ns, const bench::Histogram& h) {
+    printf("%-6s conns=%d  depth=%3d  %9.0f req/s  latency us p50=%.1f p99=%.1f max=%.1f\n", mode,
+           connections, mode[0] == 's' ? 1 : depth, done * 1e9 / ns, h.percentile(0.5) / 1e3,
+           h.percentile(0.99) / 1e3, h.max() / 1e3);
+    fflush(stdout);
+}
+
+// 每个连接一个线程，逐个请求
+static void benchSync() {
+    std::vector<bench::Histogram> latency(connections);
+    std::vector<uint64_t> done(connections, 0);
+    bench::Histogram all;
+    uint64_t total = 0, ns;
+
+    ns = bench::runThreads(connections, [&] (int t) {
+        Client client;
+        std::string name = userName(t);
+
+        if (!client.connectServer(host, port))
+            return ;
+        client.signUp(name, "password");
+        client.signIn(name, "password");
+        for (int i = 0; i < requests; i++) {
+            uint64_t start = bench::nowNs();
+            if (client.cdRoom(kRoom) != GETINTO_ROOM_SUCCESS)
+                break;
+            latency[t].record(bench::nowNs() - start);
+            done[t]++;
+        }
+        client.exit();
+    });
+
+    for (int t = 0; t < connections; t++) {
+        all.merge(latency[t]);
+        total += done[t];
+    }
+    printResult("sync", total, ns, all);
+}
+
+// 每个连接一个线程，用内置的事件循环驱动，保持depth个请求在途
+static void benchAsync() {
+    std::vector<bench::Histogram> latency(connections);
+    std::vector<uint64_t> done(connections, 0);
+    bench::Histogram all;
+    uint64_t total = 0, ns;
+
+    ns = bench::runThreads(connections, [&] (int t) {
+        AsyncClient client;
+        std::string name = userName(connections + t);
+        int sent = 0;
+        bool failed = false;
+
+        if (!client.connectServer(host, port))
+            return ;
+        client.signUp(name, "password", [] (bool, int) {});
+        client.signIn(name, "password", [] (bool, int) {});
+
+        std::function<void()> issue = [&] () {
+            uint64_t start = bench::nowNs();
+            sent++;
+            client.cdRoom(kRoom, [&, start] (bool ok, int ret) {
+                if (!ok || ret != GETINTO_ROOM_SUCCESS) {
+                    failed = true;
+                    return ;
+                }
+                latency[t].record(bench::nowNs() - start);
+                done[t]++;
+                if (sent < requests)
+                    issue();
+            });
+        };
+        for (int i = 0; i < depth && sent < requests; i++)
+            issue();
+
+        while (!failed && done[t] < (uint64_t)requests && client.poll(1000))
+            ;
+        client.close();
+    });
+
+    for (int t = 0; t < connections; t++) {
+        all.merge(latency[t]);
+        total += done[t];
+    }
+    printResult("async", total, ns, all);
+}
+
+int main(int argc, char* argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:c:n:d:")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': connections = atoi(optarg); break;
+        case 'n': requests = atoi(optarg); break;
+        case 'd': depth = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-h host] [-p port] [-c connections] [-n requests]"
+                            " [-d depth]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (connections < 1 || requests < 1 || depth < 1) {
+        fprintf(stderr, "invalid options\n");
+        return 1;
+    }
+
+    Client owner;
+    if (!owner.connectServer(host, port)) {
+        fprintf(stderr, "can't connect to %s:%d\n", host.c_str(), port);
+        return 1;
+    }
+    owner.mkRoom(kRoom);
+    owner.exit();
+
+    benchSync();
+    benchAsync();
+    return 0;
+}
@@ -0,0 +1,138 @@
+/* 基准测试程序共用的计时和多线程辅助函数
+ */
+
+#ifndef _CHATROOM_TEST_BENCH_H_
+#define _CHATROOM_TEST_BENCH_H_
+
+#include <time.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+namespace bench {
+
+// 单调时钟，单位纳秒
+inline uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+typedef std::function<void(int)> ThreadBody;
+
+inline void* threadEntry(void* arg) {
+    std::pair<ThreadBody*, int>* p = (std::pair<ThreadBody*, int>*)arg;
+    (*p->first)(p->second);
+    return (void*)0;
+}
+
+/* 启动numThreads个线程执行body(线程编号)，等待全部结束
+ *
+ * @return 从启动到全部结束经过的纳秒数
+ */
+inline uint64_t runThreads(int numThreads, ThreadBody body) {
+    std::vector<pthread_t> tids(numThreads);
+    std::vector<std::pair<ThreadBody*, int> > args(numThreads);
+    uint64_t start = nowNs();
+
+    for (int i = 0; i < numThreads; i++) {
+        args[i] = std::make_pair(&body, i);
+        pthread_create(&tids[i], NULL, threadEntry, &args[i]);
+    }
+    for (int i = 0; i < numThreads; i++)
+        pthread_join(tids[i], NULL);
+
+    return nowNs() - start;
+}
+
+// 每秒操作数，单位百万
+inline double mops(uint64_t ops, uint64_t ns) {
+    return ns == 0 ? 0.0 : (double)ops * 1000.0 / ns;
+}
+
+/* 延迟直方图
+ * 对数分桶 : 每个2的幂区间再等分为kSubBuckets个桶，相对误差不超过1/kSubBuckets，
+ * 记录一个值只是一次数组自增，不保存样本，可以长时间运行
+ *
+ * 不加锁，每个线程使用自己的直方图，结束后用merge合并
+ */
+class Histogram {
+public:
+    Histogram() : counts_(kBuckets, 0), count_(0), sum_(0), max_(0) {}
+
+    void record(uint64_t value) {
+        counts_[bucketOf(value)]++;
+        count_++;
+        sum_ += value;
+        if (value > max_)
+            max_ = value;
+    }
+
+    void merge(const Histogram& other) {
+        for (int i = 0; i < kBuckets; i++)
+            counts_[i] += other.counts_[i];
+        count_ += other.count_;
+        sum_ += other.sum_;
+        if (other.max_ > max_)
+            max_ = other.max_;
+    }
+
+    /* @param p 百分位，例如0.99
+     * @return 不小于总数p倍的样本所在桶的上界，没有样本时为0
+     */
+    uint64_t percentile(double p) const {
+        uint64_t target = (uint64_t)(p * count_ + 0.5), seen = 0;
+
+        if (count_ == 0)
+            return 0;
+        if (target == 0)
+            target = 1;
+        for (int i = 0; i < kBuckets; i++) {
+            seen += counts_[i];
+            if (seen >= target)
+                return std::min(upperBound(i), max_);
+        }
+        return max_;
+    }
+
+    uint64_t count() const { return count_; }
+    uint64_t max() const { return max_; }
+    double mean() const { return count_ == 0 ? 0.0 : (double)sum_ / count_; }
+
+private:
+    static const int kSubBits = 5;
+    static const int kSubBuckets = 1 << kSubBits;
+    static const int kBuckets = (64 - kSubBits + 1) * kSubBuckets;
+
+    // 小于kSubBuckets的值各占一个桶，之后每个2的幂区间kSubBuckets个桶
+    static int bucketOf(uint64_t value) {
+        if (value < (uint64_t)kSubBuckets)
+            return (int)value;
+
+        int msb = 63 - __builtin_clzll(value);
+        int shift = msb - kSubBits;
+        return ((shift + 1) << kSubBits) + (int)((value >> shift) & (kSubBuckets - 1));
+    }
+
+    static uint64_t upperBound(int bucket) {
+        if (bucket < kSubBuckets)
+            return bucket;
+
+        int shift = (bucket >> kSubBits) - 1;
+        uint64_t sub = (uint64_t)(bucket & (kSubBuckets - 1)) | kSubBuckets;
+        return ((sub + 1) << shift) - 1;
+    }
+
+private:
+    std::vector<uint64_t> counts_;
+    uint64_t count_;
+    uint64_t sum_;
+    uint64_t max_;
+};
+
+} // namespace bench
+
+#endif // _CHATROOM_TEST_BENCH_H_
@@ -0,0 +1,95 @@
+/* 连接缓冲区的基准测试
+ *
+ * 对比旧的全局Buffer（一个std::map加一把锁）和
+ * 以描述符为下标的连接表中每个连接各自的RingBuffer
+ *
+ * 每个线程负责自己的一组连接，循环执行 : 追加一段数据，
+ * 攒够一个Message后取出，模拟接收缓冲区的使用方式
+ *
+ * 用法: buffer_bench [每线程操作数]
+ */
+
+#include <stdlib.h>
+#include <vector>
+
+#include "../src/Buffer.h"
+#include "../src/Connection.h"
+#include "bench.h"
+
+using chat::Buffer;
+using chat::Connection;
+
+static const int kConnsPerThread = 64;
+static const size_t kChunk = 256;
+static const size_t kFrame = sizeof(chat::Message);
+
+static uint64_t benchBuffer(int numThreads, int opsPerThread) {
+    Buffer buffer;
+    std::vector<char> chunk(kChunk, 'x');
+
+    for (int fd = 0; fd < numThreads * kConnsPerThread; fd++)
+        buffer.add(fd, std::vector<char>());
+
+    return bench::runThreads(numThreads, [&] (int id) {
+        std::vector<char> frame;
+
+        for (int i = 0; i < opsPerThread; i++) {
+            int fd = id * kConnsPerThread + i % kConnsPerThread;
+
+            buffer.append(fd, chunk);
+            if (buffer.size(fd) >= kFrame) {
+                frame.clear();
+                buffer.retrive(fd, frame, kFrame);
+            }
+        }
+    });
+}
+
+static uint64_t benchConnection(int numThreads, int opsPerThread) {
+    std::vector<Connection*> conns(numThreads * kConnsPerThread);
+    std::vector<char> chunk(kChunk, 'x');
+    uint64_t ns;
+
+    for (size_t fd = 0; fd < conns.size(); fd++)
+        conns[fd] = new Connection();
+
+    ns = bench::runThreads(numThreads, [&] (int id) {
+        volatile char sink = 0;
+
+        for (int i = 0; i < opsPerThread; i++) {
+            Connection* conn = conns[id * kConnsPerThread + i % kConnsPerThread];
+
+            pthread_mutex_lock(&conn->inputMutex);
+            conn->input.append(&chunk[0], chunk.size());
+            if (conn->input.size() >= kFrame) {
+                sink = conn->input.linearize(kFrame)[0];
+                conn->input.consume(kFrame);
+            }
+            pthread_mutex_unlock(&conn->inputMutex);
+        }
+        (void)sink;
+    });
+
+    for (size_t fd = 0; fd < conns.size(); fd++)
+        delete conns[fd];
+    return ns;
+}
+
+int main(int argc, char* argv[]) {
+    int opsPerThread = argc > 1 ? atoi(argv[1]) : 1000000;
+    int threads[] = {1, 2, 4, 8};
+
+    printf("%-8s %-10s %14s %14s %8s\n",
+           "threads", "ops", "Buffer Mops/s", "Ring Mops/s", "speedup");
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        int n = threads[i];
+        uint64_t ops = (uint64_t)n * opsPerThread;
+        double oldRate = bench::mops(ops, benchBuffer(n, opsPerThread));
+        double newRate = bench::mops(ops, benchConnection(n, opsPerThread));
+
+        printf("%-8d %-10llu %14.2f %14.2f %7.1fx\n", n, (unsigned long long)ops,
+               oldRate, newRate, newRate / oldRate);
+    }
+
+    return 0;
+}
@@ -0,0 +1,523 @@
+/* 聊天服务器的负载生成器
+ *
+ * 模拟大量用户连接本地服务器 : 每个用户注册、登录、进入一个房间、开启推送，
+ * 然后按固定速率发送单聊或群聊消息（开环，不等待上一条消息送达），
+ * 统计发送和送达的吞吐量，以及从发送到对方收到推送之间的延迟分布
+ *
+ * 消息内容的开头是发送时刻（CLOCK_MONOTONIC，16位十六进制），
+ * 负载生成器和服务器在同一台机器上，收到推送时直接相减得到延迟
+ *
+ * 每个驱动线程用一个epoll管理自己的一部分用户，连接都是非阻塞的，
+ * 数千个用户只需要几个线程；房间由chat::Client创建
+ *
+ * 用法: chatbench [-h 地址] [-p 端口] [-u 用户数] [-t 线程数] [-r 房间数]
+ *                 [-m 每个用户每秒消息数] [-s 消息长度] [-g 群聊百分比]
+ *                 [-d 持续秒数] [-o text | csv | json]
+ */
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+#include "../src/Client.h"
+#include "../src/Common.h"
+#include "../src/Protocol.h"
+#include "bench.h"
+
+using chat::FrameWriter;
+using chat::FrameReader;
+
+static const int kStampLen = 16; // 消息开头的发送时刻
+static const int kDrainMs = 2000; // 停止发送后继续接收的最长时间
+
+typedef struct {
+    std::string host;
+    int port;
+    int users;
+    int threads;
+    int rooms;
+    double rate;
+    int size;
+    int groupPct;
+    int seconds;
+    std::string format;
+} Options;
+
+typedef struct {
+    int fd;
+    int room;
+    uint64_t nextSend;
+    std::vector<char> in;
+    std::vector<char> out;
+    size_t outPos;
+} User;
+
+// 每个驱动线程的统计，结束后合并
+typedef struct {
+    uint64_t sent;
+    uint64_t sentBytes;
+    uint64_t delivered;
+    uint64_t failed; // 建立会话失败或连接中途断开的用户数
+    bench::Histogram latency;
+} Stats;
+
+static Options options;
+static std::string prefix; // 用户名和房间名的前缀，避免与服务器上已有的用户重复
+static pthread_barrier_t ready;
+static uint64_t startNs, stopNs;
+
+static std::string userName(int i) {
+    return prefix + "u" + std::to_string(i);
+}
+
+static std::string roomName(int i) {
+    return prefix + "r" + std::to_string(i);
+}
+
+static bool sendAll(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool recvAll(int fd, char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = recv(fd, data, len, 0);
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* 阻塞地发送一个请求并等待OP_RESULT
+ *
+ * @return 服务器的返回值; -1 : 连接出错
+ */
+static int call(int fd, int opcode, const std::string& dst, const std::string& message) {
+    std::vector<char> frame;
+    uint32_t bodyLen, result;
+
+    FrameWriter writer(frame, opcode);
+    writer.putField(dst);
+    if (!message.empty())
+        writer.putField(message);
+    writer.finish();
+    if (!sendAll(fd, &frame[0], frame.size()))
+        return -1;
+
+    frame.resize(FRAME_HEADER_SIZE);
+    if (!recvAll(fd, &frame[0], FRAME_HEADER_SIZE))
+        return -1;
+    memcpy(&bodyLen, &frame[0], sizeof(bodyLen));
+    bodyLen = ntohl(bodyLen);
+    if (bodyLen == 0 || bodyLen > MAX_FRAME_SIZE)
+        return -1;
+    frame.resize(FRAME_HEADER_SIZE + bodyLen);
+    if (!recvAll(fd, &frame[FRAME_HEADER_SIZE], bodyLen))
+        return -1;
+
+    FrameReader reader(&frame[0], frame.size());
+    if (reader.opcode() != OP_RESULT || !reader.getU32(result))
+        return -1;
+    return result;
+}
+
+/* 建立一个用户的会话 : 连接、协商协议、注册、登录、进入房间、开启推送
+ * 全部用阻塞调用完成，之后把套接字改为非阻塞
+ *
+ * @return 套接字; -1 : 失败
+ */
+static int openSession(int index, int room) {
+    struct sockaddr_in addr;
+    unsigned char hello[2] = {PROTO_MAGIC, PROTO_VERSION};
+    int fd, one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(options.port);
+    inet_pton(AF_INET, options.host.c_str(), &addr.sin_addr);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+        || !sendAll(fd, (const char*)hello, sizeof(hello))
+        || !recvAll(fd, (char*)hello, sizeof(hello)) || hello[0] != PROTO_MAGIC
+        || call(fd, OP_SIGNUP, userName(index), "pw") == -1
+        || call(fd, OP_SIGNIN, userName(index), "pw") != SIGN_IN_SUCCESS
+        || call(fd, OP_CDROOM, roomName(room), "") != GETINTO_ROOM_SUCCESS
+        || call(fd, OP_PUSH, "on", "") != PUSH_SUCCESS) {
+        close(fd);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// 尽量发送用户的发送缓冲区，发不完时关注EPOLLOUT
+static bool flush(int epollFd, User& user) {
+    while (user.outPos < user.out.size()) {
+        ssize_t n = send(user.fd, &user.out[user.outPos], user.out.size() - user.outPos,
+                         MSG_NOSIGNAL);
+        if (n > 0) {
+            user.outPos += n;
+        } else if (n == -1 && errno == EAGAIN) {
+            break;
+        } else {
+            return false;
+        }
+    }
+
+    struct epoll_event ev;
+    ev.data.ptr = &user;
+    ev.events = EPOLLIN | (user.outPos < user.out.size() ? EPOLLOUT : 0);
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, user.fd, &ev);
+
+    if (user.outPos == user.out.size()) {
+        user.out.clear();
+        user.outPos = 0;
+    }
+    return true;
+}
+
+// 编码一条带发送时刻的消息放入发送缓冲区
+static void queueMessage(User& user, unsigned int* seed, Stats& stats) {
+    char stamp[kStampLen + 1];
+    std::string content, dst;
+    int opcode;
+
+    snprintf(stamp, sizeof(stamp), "%016llx", (unsigned long long)bench::nowNs());
+    content.assign(stamp, kStampLen);
+    content.resize(std::max(options.size, kStampLen), 'x');
+
+    if ((int)(rand_r(seed) % 100) < options.groupPct) {
+        opcode = OP_GPCHAT;
+        dst = roomName(user.room);
+    } else {
+        opcode = OP_SGCHAT;
+        dst = userName(rand_r(seed) % options.users);
+    }
+
+    FrameWriter writer(user.out, opcode);
+    writer.putField(dst);
+    writer.putField(content);
+    writer.finish();
+
+    stats.sent++;
+    stats.sentBytes += content.size();
+}
+
+// 解析接收缓冲区中的完整帧，推送的消息记录延迟
+static bool parseInput(User& user, Stats& stats) {
+    size_t pos = 0;
+
+    while (true) {
+        ssize_t len = chat::frameLength(user.in.data() + pos, user.in.size() - pos);
+        if (len < 0)
+            return false;
+        if (len == 0)
+            break;
+
+        FrameReader reader(&user.in[pos], len);
+        std::string command, dst, content;
+        if (reader.opcode() == OP_DELIVER
+            && reader.getField(command, MAX_FRAME_SIZE)
+            && reader.getField(dst, MAX_NAME_LEN)
+            && reader.getField(content, MAX_CONTENT_LEN)
+            && content.size() >= (size_t)kStampLen) {
+            uint64_t sentAt = strtoull(content.substr(0, kStampLen).c_str(), NULL, 16);
+            uint64_t now = bench::nowNs();
+
+            stats.delivered++;
+            stats.latency.record(now > sentAt ? now - sentAt : 0);
+        }
+        pos += len;
+    }
+
+    user.in.erase(user.in.begin(), user.in.begin() + pos);
+    return true;
+}
+
+static bool readInput(User& user, Stats& stats) {
+    char buf[65536];
+
+    while (true) {
+        ssize_t n = recv(user.fd, buf, sizeof(buf), 0);
+        if (n > 0) {
+            user.in.insert(user.in.end(), buf, buf + n);
+            continue;
+        }
+        if (n == -1 && errno == EAGAIN)
+            return parseInput(user, stats);
+        return false;
+    }
+}
+
+static void dropUser(int epollFd, User& user, Stats& stats) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, user.fd, NULL);
+    close(user.fd);
+    user.fd = -1;
+    stats.failed++;
+}
+
+/* 驱动线程 : 建立[first, last)号用户的会话，等所有线程就绪后开始发送
+ * 所有用户的发送间隔相同，按下一次发送时刻排成队列，只需检查队首
+ */
+static void drive(int id, Stats& stats) {
+    int first = (long)options.users * id / options.threads;
+    int last = (long)options.users * (id + 1) / options.threads;
+    int epollFd = epoll_create1(0);
+    uint64_t interval = (uint64_t)(1e9 / options.rate);
+    unsigned int seed = id * 7919 + 1;
+    std::vector<User> users(last - first);
+    std::deque<User*> schedule;
+    struct epoll_event events[256];
+
+    for (int i = first; i < last; i++) {
+        User& user = users[i - first];
+
+        user.room = i % options.rooms;
+        user.outPos = 0;
+        user.fd = openSession(i, user.room);
+        if (user.fd == -1) {
+            stats.failed++;
+            continue;
+        }
+
+        struct epoll_event ev;
+        ev.data.ptr = &user;
+        ev.events = EPOLLIN;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, user.fd, &ev);
+    }
+
+    pthread_barrier_wait(&ready); // 所有会话已建立
+    pthread_barrier_wait(&ready); // 开始时刻已确定
+
+    // 起始时刻在一个间隔内均匀错开
+    for (size_t i = 0; i < users.size(); i++) {
+        if (users[i].fd == -1)
+            continue;
+        users[i].nextSend = startNs + interval * i / users.size();
+        schedule.push_back(&users[i]);
+    }
+
+    uint64_t drainUntil = stopNs + (uint64_t)kDrainMs * 1000000;
+    uint64_t lastDelivery = stopNs;
+
+    while (true) {
+        uint64_t now = bench::nowNs();
+        int timeout;
+
+        while (now < stopNs && !schedule.empty() && schedule.front()->nextSend <= now) {
+            User* user = schedule.front();
+
+            schedule.pop_front();
+            if (user->fd == -1)
+                continue;
+            queueMessage(*user, &seed, stats);
+            if (!flush(epollFd, *user)) {
+                dropUser(epollFd, *user, stats);
+                continue;
+            }
+            user->nextSend += interval;
+            schedule.push_back(user);
+        }
+
+        // 停止发送后，直到一段时间内没有新的推送才结束
+        if (now >= stopNs && (now >= drainUntil || now - lastDelivery > 200000000ull))
+            break;
+
+        if (now >= stopNs)
+            timeout = 10;
+        else if (schedule.empty())
+            timeout = (int)((stopNs - now) / 1000000) + 1;
+        else
+            timeout = (int)((schedule.front()->nextSend - now) / 1000000);
+
+        int n = epoll_wait(epollFd, events, sizeof(events) / sizeof(events[0]), timeout);
+        for (int i = 0; i < n; i++) {
+            User* user = (User*)events[i].data.ptr;
+            uint64_t before = stats.delivered;
+
+            if (user->fd == -1)
+                continue;
+            if ((events[i].events & EPOLLOUT) && !flush(epollFd, *user)) {
+                dropUser(epollFd, *user, stats);
+                continue;
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                && !readInput(*user, stats)) {
+                dropUser(epollFd, *user, stats);
+                continue;
+            }
+            if (stats.delivered != before)
+                lastDelivery = bench::nowNs();
+        }
+    }
+
+    for (size_t i = 0; i < users.size(); i++) {
+        if (users[i].fd != -1)
+            close(users[i].fd);
+    }
+    close(epollFd);
+}
+
+// 由一个单独的用户创建所有房间
+static bool makeRooms() {
+    chat::Client owner;
+
+    if (!owner.connectServer(options.host, options.port, PROTOCOL_COMPACT))
+        return false;
+    owner.signUp(prefix + "owner", "pw");
+    if (owner.signIn(prefix + "owner", "pw") != SIGN_IN_SUCCESS)
+        return false;
+    for (int i = 0; i < options.rooms; i++)
+        owner.mkRoom(roomName(i));
+    owner.exit();
+    return true;
+}
+
+static void report(const Stats& total, uint64_t setupNs) {
+    double seconds = options.seconds;
+    double sendRate = total.sent / seconds;
+    double deliverRate = total.delivered / seconds;
+    double p50 = total.latency.percentile(0.50) / 1000.0;
+    double p99 = total.latency.percentile(0.99) / 1000.0;
+    double p999 = total.latency.percentile(0.999) / 1000.0;
+    double maxUs = total.latency.max() / 1000.0;
+    double meanUs = total.latency.mean() / 1000.0;
+
+    if (options.format == "csv") {
+        printf("users,threads,rooms,rate,size,group_pct,seconds,failed,sent,delivered,"
+               "send_per_s,deliver_per_s,send_mb_per_s,p50_us,p99_us,p999_us,max_us,mean_us\n");
+        printf("%d,%d,%d,%g,%d,%d,%d,%llu,%llu,%llu,%.0f,%.0f,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+               options.users, options.threads, options.rooms, options.rate, options.size,
+               options.groupPct, options.seconds, (unsigned long long)total.failed,
+               (unsigned long long)total.sent, (unsigned long long)total.delivered,
+               sendRate, deliverRate, total.sentBytes / seconds / 1e6,
+               p50, p99, p999, maxUs, meanUs);
+    } else if (options.format == "json") {
+        printf("{\"users\": %d, \"threads\": %d, \"rooms\": %d, \"rate\": %g, \"size\": %d, "
+               "\"group_pct\": %d, \"seconds\": %d, \"failed\": %llu, \"sent\": %llu, "
+               "\"delivered\": %llu, \"send_per_s\": %.0f, \"deliver_per_s\": %.0f, "
+               "\"send_mb_per_s\": %.3f, \"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, "
+               "\"p999\": %.1f, \"max\": %.1f, \"mean\": %.1f}}\n",
+               options.users, options.threads, options.rooms, options.rate, options.size,
+               options.groupPct, options.seconds, (unsigned long long)total.failed,
+               (unsigned long long)total.sent, (unsigned long long)total.delivered,
+               sendRate, deliverRate, total.sentBytes / seconds / 1e6,
+               p50, p99, p999, maxUs, meanUs);
+    } else {
+        printf("users %d (%llu failed), setup %.2f s\n", options.users,
+               (unsigned long long)total.failed, setupNs / 1e9);
+        printf("sent      %12llu  %10.0f msg/s  %8.3f MB/s\n",
+               (unsigned long long)total.sent, sendRate, total.sentBytes / seconds / 1e6);
+        printf("delivered %12llu  %10.0f msg/s\n",
+               (unsigned long long)total.delivered, deliverRate);
+        printf("latency us  p50 %.1f  p99 %.1f  p999 %.1f  max %.1f  mean %.1f\n",
+               p50, p99, p999, maxUs, meanUs);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    struct rlimit limit;
+    int opt;
+
+    options.host = "127.0.0.1";
+    options.port = 5000;
+    options.users = 1000;
+    options.threads = 4;
+    options.rooms = 10;
+    options.rate = 1.0;
+    options.size = 64;
+    options.groupPct = 20;
+    options.seconds = 10;
+    options.format = "text";
+
+    while ((opt = getopt(argc, argv, "h:p:u:t:r:m:s:g:d:o:")) != -1) {
+        switch (opt) {
+        case 'h': options.host = optarg; break;
+        case 'p': options.port = atoi(optarg); break;
+        case 'u': options.users = atoi(optarg); break;
+        case 't': options.threads = atoi(optarg); break;
+        case 'r': options.rooms = atoi(optarg); break;
+        case 'm': options.rate = atof(optarg); break;
+        case 's': options.size = atoi(optarg); break;
+        case 'g': options.groupPct = atoi(optarg); break;
+        case 'd': options.seconds = atoi(optarg); break;
+        case 'o': options.format = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-h host] [-p port] [-u users] [-t threads] [-r rooms]\n"
+                            "       [-m msgs/s per user] [-s size] [-g group%%] [-d seconds]"
+                            " [-o text | csv | json]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (options.users < 1 || options.threads < 1 || options.rooms < 1 || options.rate <= 0
+        || options.seconds < 1 || options.size > MAX_CONTENT_LEN) {
+        fprintf(stderr, "invalid options\n");
+        return 1;
+    }
+    if (options.threads > options.users)
+        options.threads = options.users;
+
+    // 每个用户一个连接
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    prefix = "b" + std::to_string(getpid()) + "_";
+    if (!makeRooms()) {
+        fprintf(stderr, "cannot connect to %s:%d\n", options.host.c_str(), options.port);
+        return 1;
+    }
+
+    std::vector<Stats> stats(options.threads);
+    uint64_t setupStart = bench::nowNs(), setupNs;
+
+    pthread_barrier_init(&ready, NULL, options.threads + 1);
+    bench::runThreads(options.threads + 1, [&] (int id) {
+        if (id < options.threads) {
+            drive(id, stats[id]);
+            return;
+        }
+        pthread_barrier_wait(&ready);
+        startNs = bench::nowNs();
+        stopNs = startNs + (uint64_t)options.seconds * 1000000000ull;
+        setupNs = startNs - setupStart;
+        pthread_barrier_wait(&ready);
+    });
+    pthread_barrier_destroy(&ready);
+
+    Stats total = Stats();
+    for (int i = 0; i < options.threads; i++) {
+        total.sent += stats[i].sent;
+        total.sentBytes += stats[i].sentBytes;
+        total.delivered += stats[i].delivered;
+        total.failed += stats[i].failed;
+        total.latency.merge(stats[i].latency);
+    }
+    report(total, setupNs);
+
+    return 0;
+}
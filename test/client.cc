@@ -21,6 +21,7 @@ void mkroom(Client& client, vector<string>& command);
 void cdroom(Client& client, vector<string>& command);
 void qtroom(Client& client, vector<string>& command);
 void getmsg(Client& client);
+void history(Client& client, vector<string>& command);
 void lsuser(Client& client);
 void lsroom(Client& client);
 void quit(Client& client);
@@ -40,6 +41,11 @@ int main() {
 
     getIntoService(client);
 
+    // 开启服务器推送，收到的消息直接打印；开启失败时仍可用getmsg获取消息
+    client.enablePush([] (const string& message) {
+        cout << endl << message << endl << "$" << std::flush;
+    });
+
     while (true) {
         cout << "$";
         getline(cin, userInput);
@@ -68,6 +74,8 @@ int main() {
             qtroom(client, command); 
         } else if (command[0] == "getmsg") {
             getmsg(client); 
+        } else if ((command[0] == "sghistory" || command[0] == "gphistory") && command.size() >= 2) {
+            history(client, command);
         } else if (userInput == "lsuser") {
             lsuser(client); 
         } else if (userInput == "lsroom") {
@@ -227,6 +235,28 @@ void getmsg(Client& client) {
     message.clear();
 }
 
+// 读取最近的历史消息，直到日志末尾
+void history(Client& client, vector<string>& command) {
+    chat::MessagePage page;
+    string name;
+    bool ok;
+
+    for (size_t i = 1; i < command.size(); i++) {
+        name += command[i];
+        name += " ";
+    }
+    name.pop_back();
+
+    do {
+        if (command[0] == "sghistory")
+            ok = client.userHistory(name, page.cursor, 0, page);
+        else
+            ok = client.roomHistory(name, page.cursor, 0, page);
+        for (size_t i = 0; ok && i < page.messages.size(); i++)
+            cout << page.messages[i] << endl;
+    } while (ok && !page.cursor.empty());
+}
+
 void lsuser(Client& client) {
     vector<string> ret;
     
@@ -267,7 +297,14 @@ void help() {
     cout << "User quit the chat room \"room name\"" << endl << endl;
 
     cout << "getmsg" << endl;
-    cout << "Get messages from other users or groups" << endl << endl;
+    cout << "Get messages from other users or groups" 
+         << " (pushed messages are printed as they arrive)" << endl << endl;
+
+    cout << "sghistory [user name]" << endl;
+    cout << "Show recent messages between you and \"user name\"" << endl << endl;
+
+    cout << "gphistory [room name]" << endl;
+    cout << "Show recent messages of the room \"room name\" you have joined" << endl << endl;
 
     cout << "lsuser" << endl;
     cout << "List all the online users on the chat server" << endl << endl;
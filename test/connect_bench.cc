@@ -0,0 +1,299 @@
+/* 建立连接速率的基准测试，需要先启动服务器
+ *
+ * 模拟部署之后大量客户端同时重连 : 所有客户端在同一时刻发起非阻塞connect，
+ * 连接建立后发送紧凑协议的协商请求，收到服务器的回复说明连接已被服务器接收并注册;
+ * 统计全部完成所需的时间、每秒建立的连接数，以及每个连接从connect到收到回复的延迟分布
+ *
+ * 每一轮所有连接同时保持打开，结束后用RST关闭（不留TIME_WAIT），下一轮再全部重连
+ *
+ * 单个进程的描述符数有限，客户端分到多个子进程中，每个子进程用一个epoll驱动自己的连接;
+ * 源地址在127.0.0.2开始的多个地址之间轮换，避免耗尽一个地址的临时端口
+ *
+ * 用法: connect_bench [-h 地址] [-p 端口] [-c 客户端数] [-n 每个进程的客户端数] [-r 轮数] [-t 超时秒数]
+ */
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "../src/Common.h"
+#include "bench.h"
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+static std::string host = "127.0.0.1";
+static int port = 5000;
+static int clients = 50000;
+static int perProcess = 10000;
+static int rounds = 3;
+static int timeoutSec = 30;
+
+static const int kPortsPerAddress = 20000; // 每个源地址最多使用的临时端口数
+
+typedef struct {
+    int fd;
+    int state;        // 0 : 正在连接; 1 : 已发送协商请求; 2 : 完成; -1 : 失败
+    uint64_t startNs;
+} Conn;
+
+// 子进程的结果
+typedef struct {
+    uint32_t established;
+    uint32_t failed;
+} Result;
+
+static bool writeAll(int fd, const void* data, size_t len) {
+    const char* p = (const char*)data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool readAll(int fd, void* data, size_t len) {
+    char* p = (char*)data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* 子进程 : 准备好first开始的count个套接字后等待开始信号，同时发起连接，
+ * 全部完成后把结果和每个连接的延迟（微秒）写入resultFd，等待关闭信号后关闭所有连接
+ */
+static void runClients(int first, int count, int goFd, int resultFd) {
+    std::vector<Conn> conns(count);
+    std::vector<uint32_t> latencies;
+    struct sockaddr_in server, local;
+    unsigned char hello[2] = {PROTO_MAGIC, PROTO_VERSION};
+    int epollFd = epoll_create1(EPOLL_CLOEXEC), one = 1, pending = count;
+    Result result = {0, 0};
+    char go;
+
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &server.sin_addr);
+
+    for (int i = 0; i < count; i++) {
+        int id = first + i;
+        Conn& conn = conns[i];
+
+        conn.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        conn.state = 0;
+        if (conn.fd == -1) {
+            conn.state = -1;
+            continue;
+        }
+
+        // 源地址127.0.0.2, 127.0.0.3, ...，端口在connect时按四元组选择
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = htonl(0x7f000002 + id / kPortsPerAddress);
+        setsockopt(conn.fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+        bind(conn.fd, (struct sockaddr*)&local, sizeof(local));
+    }
+
+    if (!readAll(goFd, &go, 1))
+        _exit(1);
+
+    for (int i = 0; i < count; i++) {
+        Conn& conn = conns[i];
+        struct epoll_event ev;
+
+        if (conn.state == -1)
+            continue;
+        conn.startNs = bench::nowNs();
+        if (connect(conn.fd, (struct sockaddr*)&server, sizeof(server)) == -1 && errno != EINPROGRESS) {
+            conn.state = -1;
+            continue;
+        }
+        ev.events = EPOLLOUT | EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, conn.fd, &ev);
+    }
+    for (int i = 0; i < count; i++) {
+        if (conns[i].state == -1)
+            pending--;
+    }
+
+    std::vector<struct epoll_event> events(1024);
+    uint64_t deadline = bench::nowNs() + (uint64_t)timeoutSec * 1000000000ull;
+    while (pending > 0 && bench::nowNs() < deadline) {
+        int n = epoll_wait(epollFd, &events[0], events.size(), 100);
+        for (int k = 0; k < n; k++) {
+            Conn& conn = conns[events[k].data.u32];
+            int err = 0;
+            socklen_t len = sizeof(err);
+
+            if (conn.state == 0 && (events[k].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0 || send(conn.fd, hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello)) {
+                    conn.state = -1;
+                    pending--;
+                    continue;
+                }
+                struct epoll_event ev;
+                ev.events = EPOLLIN;
+                ev.data.u32 = events[k].data.u32;
+                epoll_ctl(epollFd, EPOLL_CTL_MOD, conn.fd, &ev);
+                conn.state = 1;
+            } else if (conn.state == 1 && (events[k].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                unsigned char reply[2];
+                ssize_t got = recv(conn.fd, reply, sizeof(reply), MSG_WAITALL);
+                if (got == sizeof(reply) && reply[0] == PROTO_MAGIC) {
+                    conn.state = 2;
+                    latencies.push_back((bench::nowNs() - conn.startNs) / 1000);
+                } else {
+                    conn.state = -1;
+                }
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, conn.fd, NULL);
+                pending--;
+            }
+        }
+    }
+
+    result.established = latencies.size();
+    result.failed = count - latencies.size();
+    writeAll(resultFd, &result, sizeof(result));
+    if (!latencies.empty())
+        writeAll(resultFd, &latencies[0], latencies.size() * sizeof(uint32_t));
+
+    // 所有子进程都完成后才关闭，保证这一轮的连接同时存在
+    readAll(goFd, &go, 1);
+    struct linger rst = {1, 0};
+    for (int i = 0; i < count; i++) {
+        if (conns[i].fd != -1) {
+            setsockopt(conns[i].fd, SOL_SOCKET, SO_LINGER, &rst, sizeof(rst));
+            close(conns[i].fd);
+        }
+    }
+    close(epollFd);
+    _exit(0);
+}
+
+static void runRound(int round) {
+    int numProcs = (clients + perProcess - 1) / perProcess;
+    std::vector<int> goFds, resultFds;
+    std::vector<pid_t> pids;
+    bench::Histogram latency;
+    uint64_t established = 0, failed = 0, start, elapsed;
+
+    for (int p = 0; p < numProcs; p++) {
+        int go[2], res[2];
+        int first = p * perProcess;
+        int count = std::min(perProcess, clients - first);
+
+        if (pipe(go) == -1 || pipe(res) == -1) {
+            perror("pipe");
+            exit(1);
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(go[1]);
+            close(res[0]);
+            runClients(first, count, go[0], res[1]);
+        }
+        close(go[0]);
+        close(res[1]);
+        goFds.push_back(go[1]);
+        resultFds.push_back(res[0]);
+        pids.push_back(pid);
+    }
+
+    // 等所有子进程准备好套接字
+    usleep(200000 + clients * 10);
+
+    start = bench::nowNs();
+    for (size_t p = 0; p < goFds.size(); p++)
+        writeAll(goFds[p], "g", 1);
+
+    for (size_t p = 0; p < resultFds.size(); p++) {
+        Result result;
+        if (!readAll(resultFds[p], &result, sizeof(result)))
+            continue;
+
+        std::vector<uint32_t> samples(result.established);
+        if (!samples.empty())
+            readAll(resultFds[p], &samples[0], samples.size() * sizeof(uint32_t));
+        for (size_t i = 0; i < samples.size(); i++)
+            latency.record(samples[i]);
+        established += result.established;
+        failed += result.failed;
+    }
+    elapsed = bench::nowNs() - start;
+
+    for (size_t p = 0; p < goFds.size(); p++) {
+        writeAll(goFds[p], "c", 1);
+        close(goFds[p]);
+        close(resultFds[p]);
+    }
+    for (size_t p = 0; p < pids.size(); p++)
+        waitpid(pids[p], NULL, 0);
+
+    printf("round %d  clients=%d  established=%llu  failed=%llu  %8.1f ms  %9.0f conn/s"
+           "  latency ms p50=%.1f p99=%.1f max=%.1f\n",
+           round, clients, (unsigned long long)established, (unsigned long long)failed,
+           elapsed / 1e6, established * 1e9 / elapsed, latency.percentile(0.5) / 1e3,
+           latency.percentile(0.99) / 1e3, latency.max() / 1e3);
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+    struct rlimit limit;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:c:n:r:t:")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': clients = atoi(optarg); break;
+        case 'n': perProcess = atoi(optarg); break;
+        case 'r': rounds = atoi(optarg); break;
+        case 't': timeoutSec = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-h host] [-p port] [-c clients] [-n clients per process]"
+                            " [-r rounds] [-t timeout]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (clients < 1 || perProcess < 1 || rounds < 1) {
+        fprintf(stderr, "invalid options\n");
+        return 1;
+    }
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        if ((rlim_t)perProcess + 64 > limit.rlim_cur)
+            perProcess = limit.rlim_cur - 64;
+    }
+
+    for (int r = 1; r <= rounds; r++)
+        runRound(r);
+    return 0;
+}
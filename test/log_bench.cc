@@ -0,0 +1,231 @@
+/* 消息日志的基准测试
+ *
+ * append  : 1个和4个线程持续追加256字节的记录，组提交开启，分两种方式 :
+ *           async   只追加不等待，计时包括最后一次同步完成，即持久化后的吞吐量
+ *           durable 每条记录追加后用waitDurable等待持久化，同时报告等待时间的分布
+ *           每个配置报告记录数/秒、MB/秒，以及平均每次同步覆盖的记录数
+ * recover : 写入一个数GB的日志后关闭，丢弃页缓存，测量重新打开（只检查最后一个段）
+ *           和校验全部记录的完整遍历所需的时间
+ *
+ * 用法: log_bench [-d 目录] [-t 每个配置的秒数] [-s 恢复测试的日志大小MB] [-f 组提交间隔ms]
+ *                 [append | recover]...
+ */
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "../src/MessageLog.h"
+#include "bench.h"
+
+using chat::MessageLog;
+
+static std::string baseDir = "/tmp/log_bench";
+static double seconds = 2.0;
+static size_t recoverMB = 2048;
+static int syncMs = LOG_SYNC_INTERVAL_MS;
+
+static const size_t kRecord = 256;
+
+// 删除目录中的段文件
+static void removeLog(const std::string& dir) {
+    DIR* d = opendir(dir.c_str());
+    struct dirent* entry;
+
+    if (d == NULL)
+        return ;
+    while ((entry = readdir(d)) != NULL) {
+        if (strstr(entry->d_name, ".log") != NULL)
+            unlink((dir + "/" + entry->d_name).c_str());
+    }
+    closedir(d);
+    rmdir(dir.c_str());
+}
+
+// 把段文件写回磁盘后从页缓存中丢弃，之后的读取需要访问磁盘
+static void dropCache(const std::string& dir) {
+    DIR* d = opendir(dir.c_str());
+    struct dirent* entry;
+
+    if (d == NULL)
+        return ;
+    while ((entry = readdir(d)) != NULL) {
+        if (strstr(entry->d_name, ".log") == NULL)
+            continue;
+        int fd = open((dir + "/" + entry->d_name).c_str(), O_RDONLY);
+        if (fd == -1)
+            continue;
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    closedir(d);
+}
+
+/******************************** append ********************************/
+
+static void benchAppend(int numThreads, bool durable) {
+    std::string dir = baseDir + "/append";
+    std::vector<uint64_t> counts(numThreads, 0);
+    std::vector<bench::Histogram> waits(numThreads);
+    uint64_t ns, syncs, total = 0;
+
+    removeLog(dir);
+    mkdir(baseDir.c_str(), 0755);
+    MessageLog log(dir, LOG_SEGMENT_SIZE, syncMs);
+    if (!log.open()) {
+        fprintf(stderr, "cannot open %s\n", dir.c_str());
+        exit(1);
+    }
+
+    uint64_t syncsBefore = log.syncCount();
+    uint64_t deadline = bench::nowNs() + (uint64_t)(seconds * 1e9);
+    ns = bench::runThreads(numThreads, [&] (int id) {
+        std::vector<char> record(kRecord, 'a' + id);
+        uint64_t n = 0, seq = 0;
+
+        while ((n & 255) != 0 || bench::nowNs() < deadline) {
+            memcpy(record.data(), &n, sizeof(n));
+            seq = log.append(record.data(), record.size());
+            if (durable) {
+                uint64_t start = bench::nowNs();
+                log.waitDurable(seq);
+                waits[id].record(bench::nowNs() - start);
+            }
+            n++;
+        }
+        // 计时包括最后一条记录持久化
+        log.waitDurable(seq);
+        counts[id] = n;
+    });
+    syncs = log.syncCount() - syncsBefore;
+
+    bench::Histogram wait;
+    for (int i = 0; i < numThreads; i++) {
+        total += counts[i];
+        wait.merge(waits[i]);
+    }
+
+    printf("append  %-7s threads=%d  %10.0f rec/s  %7.1f MB/s  %8.1f rec/sync",
+           durable ? "durable" : "async", numThreads, total * 1e9 / ns,
+           total * kRecord * 1e3 / ns, syncs == 0 ? 0.0 : (double)total / syncs);
+    if (durable)
+        printf("  wait p50=%.0fus p99=%.0fus", wait.percentile(0.5) / 1e3, wait.percentile(0.99) / 1e3);
+    printf("\n");
+    fflush(stdout);
+}
+
+/******************************** recover ********************************/
+
+static void benchRecover() {
+    std::string dir = baseDir + "/recover";
+    uint64_t records = (uint64_t)recoverMB * (1 << 20) / (kRecord + LOG_RECORD_HEADER);
+    uint64_t start, openNs, scanNs, seen = 0, bytes = 0;
+    size_t segments;
+
+    removeLog(dir);
+    mkdir(baseDir.c_str(), 0755);
+    {
+        MessageLog log(dir, LOG_SEGMENT_SIZE, syncMs);
+        std::vector<char> record(kRecord, 'r');
+
+        if (!log.open()) {
+            fprintf(stderr, "cannot open %s\n", dir.c_str());
+            exit(1);
+        }
+        start = bench::nowNs();
+        for (uint64_t i = 0; i < records; i++) {
+            memcpy(record.data(), &i, sizeof(i));
+            log.append(record.data(), record.size());
+        }
+        log.waitDurable(records - 1);
+        printf("recover write   %llu records (%zu MB)  %.2f s\n",
+               (unsigned long long)records, recoverMB, (bench::nowNs() - start) / 1e9);
+    }
+    dropCache(dir);
+
+    MessageLog log(dir, LOG_SEGMENT_SIZE, syncMs);
+    start = bench::nowNs();
+    if (!log.open()) {
+        fprintf(stderr, "cannot reopen %s\n", dir.c_str());
+        exit(1);
+    }
+    openNs = bench::nowNs() - start;
+    segments = log.numSegments();
+
+    start = bench::nowNs();
+    log.scan(0, [&] (uint64_t seq, const char* data, size_t len) {
+        uint64_t value;
+        memcpy(&value, data, sizeof(value));
+        if (value != seq)
+            return false;
+        seen++;
+        bytes += len + LOG_RECORD_HEADER;
+        return true;
+    });
+    scanNs = bench::nowNs() - start;
+
+    printf("recover open    %zu segments  %8.2f ms  next=%llu%s\n", segments, openNs / 1e6,
+           (unsigned long long)log.nextSeq(), log.nextSeq() == records ? "" : "  MISMATCH");
+    printf("recover scan    %llu records  %8.2f s  %.2f GB/s (cold cache, CRC checked)%s\n",
+           (unsigned long long)seen, scanNs / 1e9, bytes / (double)scanNs,
+           seen == records ? "" : "  MISMATCH");
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> sections;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:t:s:f:")) != -1) {
+        switch (opt) {
+        case 'd':
+            baseDir = optarg;
+            break;
+        case 't':
+            seconds = atof(optarg);
+            break;
+        case 's':
+            recoverMB = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            syncMs = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d dir] [-t seconds] [-s MB] [-f ms] [append | recover]...\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    for (int i = optind; i < argc; i++)
+        sections.push_back(argv[i]);
+    if (sections.empty()) {
+        sections.push_back("append");
+        sections.push_back("recover");
+    }
+
+    printf("record=%zuB  segment=%dMB  sync interval=%dms\n", kRecord, LOG_SEGMENT_SIZE >> 20, syncMs);
+    for (size_t i = 0; i < sections.size(); i++) {
+        if (sections[i] == "append") {
+            benchAppend(1, false);
+            benchAppend(4, false);
+            benchAppend(1, true);
+            benchAppend(4, true);
+            removeLog(baseDir + "/append");
+        } else if (sections[i] == "recover") {
+            benchRecover();
+            removeLog(baseDir + "/recover");
+        } else {
+            fprintf(stderr, "unknown section %s\n", sections[i].c_str());
+            return 1;
+        }
+    }
+    rmdir(baseDir.c_str());
+    return 0;
+}
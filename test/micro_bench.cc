@@ -0,0 +1,377 @@
+/* 组件级基准测试套件
+ *
+ * 不需要启动服务器，分别测量 :
+ * buffer     : chat::Buffer在多个线程争用同一组描述符时的append/retrive/size
+ * queue      : Queue（互斥锁）和MpmcQueue（无锁）在不同生产者、消费者数下的吞吐量
+ * threadpool : ThreadPool从放入任务到开始执行的延迟，分为空闲时逐个提交和成批提交，
+ *              以及全部重复结束后每个工作线程执行、窃取的任务数和等待任务的时间
+ * dispatch   : 不经过套接字，把预先编码好的请求字节流交给Server::feedInput，
+ *              测量解析和分发每个请求的开销，旧协议和紧凑协议分别测量
+ *
+ * 每项重复若干次取中位数，数据规模和随机数种子固定，输出格式固定，便于前后对比
+ *
+ * 用法: micro_bench [-r 重复次数] [buffer | queue | threadpool | dispatch]...
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+#include "../src/Buffer.h"
+#include "../src/ThreadPool.h"
+#include "../src/Server.h"
+#include "../src/Protocol.h"
+#include "bench.h"
+
+using chat::Buffer;
+using chat::BlockingQueue;
+using chat::ThreadPool;
+using chat::WorkType;
+using chat::Server;
+using chat::Message;
+using chat::FrameWriter;
+
+static int reps = 5;
+
+static double middle(std::vector<double> results) {
+    std::sort(results.begin(), results.end());
+    return results[results.size() / 2];
+}
+
+// 重复执行body，返回结果的中位数
+static double median(std::function<double()> body) {
+    std::vector<double> results;
+
+    for (int i = 0; i < reps; i++)
+        results.push_back(body());
+    return middle(results);
+}
+
+/******************************** buffer ********************************/
+
+static const int kSharedFds = 4;        // 所有线程争用的描述符数
+static const int kBufferOps = 200000;   // 每个线程的操作数
+static const size_t kChunk = 256;
+
+static double benchBuffer(int numThreads) {
+    Buffer buffer;
+    std::vector<char> chunk(kChunk, 'x');
+    uint64_t ns;
+
+    for (int fd = 0; fd < kSharedFds; fd++)
+        buffer.add(fd, std::vector<char>());
+
+    ns = bench::runThreads(numThreads, [&] (int id) {
+        std::vector<char> frame;
+
+        for (int i = 0; i < kBufferOps; i++) {
+            int fd = (id + i) % kSharedFds;
+
+            buffer.append(fd, chunk);
+            if (buffer.size(fd) >= sizeof(Message)) {
+                frame.clear();
+                buffer.retrive(fd, frame, sizeof(Message));
+            }
+        }
+    });
+
+    return bench::mops((uint64_t)numThreads * kBufferOps, ns);
+}
+
+static void runBuffer() {
+    int threads[] = {1, 2, 4, 8};
+
+    printf("[buffer] %d shared fds, %d ops per thread\n", kSharedFds, kBufferOps);
+    printf("%-10s %12s\n", "threads", "Mops/s");
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        double rate = median([&] { return benchBuffer(threads[i]); });
+        printf("%-10d %12.2f\n", threads[i], rate);
+    }
+    printf("\n");
+}
+
+/******************************** queue ********************************/
+
+static const int kQueueItems = 200000; // 每个生产者放入的元素数
+
+static double benchQueue(int type, int producers, int consumers) {
+    BlockingQueue<int>* queue = chat::createQueue<int>(type);
+    std::atomic<int> running(producers);
+    uint64_t ns;
+
+    ns = bench::runThreads(producers + consumers, [&] (int id) {
+        if (id < producers) {
+            for (int i = 0; i < kQueueItems; i++)
+                queue->push(i);
+            if (running.fetch_sub(1) == 1) {
+                for (int i = 0; i < consumers; i++)
+                    queue->push(-1);
+            }
+            return;
+        }
+
+        int item;
+        do {
+            queue->get(item);
+        } while (item != -1);
+    });
+
+    delete queue;
+    return bench::mops((uint64_t)producers * kQueueItems, ns);
+}
+
+static void runQueue() {
+    int shapes[][2] = {{1, 1}, {1, 4}, {4, 1}, {2, 2}, {4, 4}};
+
+    printf("[queue] %d items per producer\n", kQueueItems);
+    printf("%-10s %-10s %14s %14s\n", "producers", "consumers", "mutex Mops/s", "lockfree Mops/s");
+    for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+        int p = shapes[i][0], c = shapes[i][1];
+        double mutex = median([&] { return benchQueue(QUEUE_MUTEX, p, c); });
+        double lockfree = median([&] { return benchQueue(QUEUE_LOCKFREE, p, c); });
+        printf("%-10d %-10d %14.2f %14.2f\n", p, c, mutex, lockfree);
+    }
+    printf("\n");
+}
+
+/******************************** threadpool ********************************/
+
+static const int kPoolThreads = 4;
+static const int kIdleTasks = 2000;   // 逐个提交 : 等上一个任务执行完再提交下一个
+static const int kBurstTasks = 100000; // 成批提交 : 一次放入所有任务
+
+/* 测量从push到任务开始执行的延迟
+ *
+ * @param burst false : 逐个提交，测量唤醒空闲线程的延迟; true : 成批提交，包含排队时间
+ * @param p50 延迟的中位数，单位纳秒
+ * @param p99 延迟的99百分位，单位纳秒
+ */
+static void benchPool(ThreadPool& pool, bool burst, double* p50, double* p99) {
+    int tasks = burst ? kBurstTasks : kIdleTasks;
+    std::vector<uint64_t> latency(tasks);
+    std::atomic<int> done(0);
+    bench::Histogram histogram;
+
+    for (int i = 0; i < tasks; i++) {
+        uint64_t submitted = bench::nowNs();
+
+        pool.getWorkQueue()->push([&latency, &done, i, submitted] {
+            latency[i] = bench::nowNs() - submitted;
+            done.fetch_add(1, std::memory_order_release);
+        });
+        if (!burst) {
+            while (done.load(std::memory_order_acquire) != i + 1)
+                sched_yield();
+        }
+    }
+    while (done.load(std::memory_order_acquire) != tasks)
+        sched_yield();
+
+    for (int i = 0; i < tasks; i++)
+        histogram.record(latency[i]);
+    *p50 = histogram.percentile(0.50);
+    *p99 = histogram.percentile(0.99);
+}
+
+static void runThreadPool() {
+    const char* names[] = {"mutex", "lockfree", "stealing"};
+    int types[] = {QUEUE_MUTEX, QUEUE_LOCKFREE, QUEUE_WORK_STEALING};
+
+    std::vector<ThreadPool*> pools;
+
+    printf("[threadpool] %d threads, submit-to-run latency in ns\n", kPoolThreads);
+    printf("%-10s %12s %12s %12s %12s\n", "queue", "idle p50", "idle p99", "burst p50", "burst p99");
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        // 线程池没有停止工作线程的接口，测试结束前不析构
+        ThreadPool* pool = new ThreadPool(kPoolThreads, types[i]);
+        std::vector<double> idle50, idle99, burst50, burst99;
+
+        pools.push_back(pool);
+
+        pool->run();
+        for (int r = 0; r < reps; r++) {
+            double p50, p99;
+
+            benchPool(*pool, false, &p50, &p99);
+            idle50.push_back(p50);
+            idle99.push_back(p99);
+            benchPool(*pool, true, &p50, &p99);
+            burst50.push_back(p50);
+            burst99.push_back(p99);
+        }
+        printf("%-10s %12.0f %12.0f %12.0f %12.0f\n", names[i], middle(idle50), middle(idle99),
+               middle(burst50), middle(burst99));
+    }
+
+    printf("\n[threadpool] per-worker counters over all runs\n");
+    printf("%-10s %8s %12s %12s %12s\n", "queue", "worker", "executed", "stolen", "idle ms");
+    for (size_t i = 0; i < pools.size(); i++) {
+        for (int w = 0; w < kPoolThreads; w++) {
+            chat::WorkerStats stats = pools[i]->getStats(w);
+            printf("%-10s %8d %12llu %12llu %12.1f\n", names[i], w,
+                   (unsigned long long)stats.executed, (unsigned long long)stats.stolen,
+                   stats.idleNs / 1e6);
+        }
+    }
+    printf("\n");
+}
+
+/******************************** dispatch ********************************/
+
+static const int kUsers = 64;         // 每种协议的用户数，全部在同一个房间
+static const int kRequests = 4096;    // 每个请求字节流中的请求数
+static const size_t kReadSize = 2048; // 每次交给服务器的字节数，与handleRead每次recv的大小相同
+static const int kLegacyBase = 1000;  // 旧协议用户使用的描述符
+static const int kCompactBase = 2000; // 紧凑协议用户使用的描述符
+
+static void encodeLegacy(std::vector<char>& out, const char* command,
+                         const std::string& dst, const std::string& message) {
+    Message msg;
+
+    memset(&msg, 0, sizeof(msg));
+    snprintf(msg.command, sizeof(msg.command), "%s", command);
+    snprintf(msg.dst, sizeof(msg.dst), "%s", dst.c_str());
+    snprintf(msg.message, sizeof(msg.message), "%s", message.c_str());
+    out.insert(out.end(), (char*)&msg, (char*)&msg + sizeof(msg));
+}
+
+static void encodeCompact(std::vector<char>& out, const char* command,
+                          const std::string& dst, const std::string& message) {
+    FrameWriter writer(out, chat::commandToOpcode(command));
+
+    writer.putField(dst);
+    writer.putField(message);
+    writer.finish();
+}
+
+typedef void (*Encoder)(std::vector<char>&, const char*, const std::string&, const std::string&);
+
+static std::string benchUser(bool compact, int i) {
+    return std::string(compact ? "c" : "l") + std::to_string(i);
+}
+
+// 注册、登录并进入同一个房间，丢弃回复
+static void setupUsers(Server& server, bool compact) {
+    Encoder encode = compact ? encodeCompact : encodeLegacy;
+    int base = compact ? kCompactBase : kLegacyBase;
+
+    for (int i = 0; i < kUsers; i++) {
+        std::vector<char> out;
+
+        if (compact) {
+            out.push_back((char)PROTO_MAGIC);
+            out.push_back((char)PROTO_VERSION);
+        }
+        encode(out, "signup", benchUser(compact, i), "pw");
+        encode(out, "signin", benchUser(compact, i), "pw");
+        if (i == 0)
+            encode(out, "mkroom", compact ? "croom" : "lroom", "");
+        encode(out, "cdroom", compact ? "croom" : "lroom", "");
+        server.feedInput(base + i, &out[0], out.size());
+        server.discardOutput(base + i);
+    }
+}
+
+/* @param command 请求的命令名
+ * @return 每个请求的纳秒数
+ */
+static double benchDispatch(Server& server, bool compact, const char* command) {
+    Encoder encode = compact ? encodeCompact : encodeLegacy;
+    int base = compact ? kCompactBase : kLegacyBase;
+    std::string content(64, 'x');
+    std::vector<char> stream;
+    uint64_t start, ns;
+
+    // 同一个用户发出的请求流，接收方轮流变化
+    for (int i = 0; i < kRequests; i++) {
+        std::string dst;
+
+        if (strcmp(command, "sgchat") == 0)
+            dst = benchUser(compact, 1 + i % (kUsers - 1));
+        else if (strcmp(command, "gpchat") == 0)
+            dst = compact ? "croom" : "lroom";
+        encode(stream, command, dst, strcmp(command, "getmsg") == 0 ? "" : content);
+    }
+
+    start = bench::nowNs();
+    for (size_t pos = 0; pos < stream.size(); pos += kReadSize) {
+        server.feedInput(base, &stream[pos], std::min(kReadSize, stream.size() - pos));
+        server.discardOutput(base);
+    }
+    ns = bench::nowNs() - start;
+
+    // 清空其他用户的收件箱，每次重复从相同的状态开始
+    std::vector<char> drain;
+    encode(drain, "getmsg", "", "");
+    for (int i = 0; i < kUsers; i++) {
+        for (int j = 0; j < INBOX_DEPTH / GETMSG_BATCH + 1; j++)
+            server.feedInput(base + i, &drain[0], drain.size());
+        server.discardOutput(base + i);
+    }
+
+    return (double)ns / kRequests;
+}
+
+static void runDispatch() {
+    const char* commands[] = {"sgchat", "gpchat", "lsuser", "getmsg"};
+    chat::ServerOptions options = chat::defaultServerOptions();
+
+    // 多reactor模式下构造服务器不会启动线程池，也不调用init，不监听端口
+    options.mode = MODE_MULTI_REACTOR;
+    Server* server = new Server(options);
+    setupUsers(*server, false);
+    setupUsers(*server, true);
+
+    printf("[dispatch] %d users in one room, %d requests, %zu-byte reads, ns per request\n",
+           kUsers, kRequests, kReadSize);
+    printf("%-10s %12s %12s\n", "command", "legacy", "compact");
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        double legacy = median([&] { return benchDispatch(*server, false, commands[i]); });
+        double compact = median([&] { return benchDispatch(*server, true, commands[i]); });
+        printf("%-10s %12.0f %12.0f\n", commands[i], legacy, compact);
+    }
+    printf("\n");
+
+    // 服务器没有停止的接口，与线程池一样不析构
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> sections;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        switch (opt) {
+        case 'r':
+            reps = std::max(1, atoi(optarg));
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r reps] [buffer | queue | threadpool | dispatch]...\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    for (int i = optind; i < argc; i++)
+        sections.push_back(argv[i]);
+    if (sections.empty())
+        sections = {"buffer", "queue", "threadpool", "dispatch"};
+
+    printf("median of %d runs\n\n", reps);
+    for (size_t i = 0; i < sections.size(); i++) {
+        if (sections[i] == "buffer")
+            runBuffer();
+        else if (sections[i] == "queue")
+            runQueue();
+        else if (sections[i] == "threadpool")
+            runThreadPool();
+        else if (sections[i] == "dispatch")
+            runDispatch();
+        else
+            fprintf(stderr, "unknown section %s\n", sections[i].c_str());
+    }
+
+    return 0;
+}
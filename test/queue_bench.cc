@@ -0,0 +1,76 @@
+/* 阻塞队列的争用基准测试
+ *
+ * 不同的生产者、消费者线程数下，对比Queue（互斥锁 + pthread_cond_broadcast）
+ * 和MpmcQueue（无锁环形数组 + futex定向唤醒）的吞吐量
+ *
+ * 每个生产者放入固定数目的元素，最后一个结束的生产者为每个消费者放入一个结束标记，
+ * 消费者取到结束标记后退出
+ *
+ * 用法: queue_bench [每个生产者放入的元素数]
+ */
+
+#include <stdlib.h>
+#include <atomic>
+
+#include "../src/MpmcQueue.h"
+#include "bench.h"
+
+using chat::BlockingQueue;
+
+static const int kStop = -1;
+
+/* @return 每秒传递的元素数，单位百万
+ */
+static double run(int type, int producers, int consumers, int perProducer) {
+    BlockingQueue<int>* queue = chat::createQueue<int>(type);
+    std::atomic<int> running(producers);
+    std::atomic<long> sum(0);
+    uint64_t ns;
+
+    ns = bench::runThreads(producers + consumers, [&] (int id) {
+        if (id < producers) {
+            for (int i = 0; i < perProducer; i++)
+                queue->push(i);
+            if (running.fetch_sub(1) == 1) {
+                for (int i = 0; i < consumers; i++)
+                    queue->push(kStop);
+            }
+            return;
+        }
+
+        long local = 0;
+        int w;
+        while (true) {
+            queue->get(w);
+            if (w == kStop)
+                break;
+            local += w;
+        }
+        sum += local;
+    });
+
+    // 检查没有丢失或重复的元素
+    if (sum != (long)producers * perProducer * (perProducer - 1) / 2)
+        fprintf(stderr, "queue type %d lost elements\n", type);
+
+    delete queue;
+    return bench::mops((uint64_t)producers * perProducer, ns);
+}
+
+int main(int argc, char* argv[]) {
+    int perProducer = argc > 1 ? atoi(argv[1]) : 200000;
+    int producers[] = {1, 2, 4};
+    int consumers[] = {1, 2, 4, 10};
+
+    printf("%-10s %-10s %16s %16s\n", "producers", "consumers", "mutex Mops", "lockfree Mops");
+    for (size_t i = 0; i < sizeof(producers) / sizeof(producers[0]); i++) {
+        for (size_t j = 0; j < sizeof(consumers) / sizeof(consumers[0]); j++) {
+            double mutex = run(QUEUE_MUTEX, producers[i], consumers[j], perProducer);
+            double lockfree = run(QUEUE_LOCKFREE, producers[i], consumers[j], perProducer);
+
+            printf("%-10d %-10d %16.2f %16.2f\n", producers[i], consumers[j], mutex, lockfree);
+        }
+    }
+
+    return 0;
+}
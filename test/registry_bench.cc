@@ -0,0 +1,124 @@
+/* 用户表的基准测试
+ *
+ * 在不同的用户总数下，测量一次命令中查找用户的开销 :
+ * signin 按用户名查找并绑定连接，sgchat 按连接查找发送者、按用户名查找接收者
+ * 对比UserRegistry的哈希索引和原来对std::vector<User>的线性扫描
+ *
+ * 线性扫描在一百万用户时太慢，只测量哈希索引
+ *
+ * 用法: registry_bench [每组操作数]
+ */
+
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "../src/UserRegistry.h"
+#include "bench.h"
+
+using chat::User;
+using chat::UserRegistry;
+
+static const int kOnline = 1000; // 在线用户数，即使用的连接数
+
+static std::string nameOf(int i) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "user%08d", i);
+    return buf;
+}
+
+// 原来的实现 : 每次查找都扫描整个数组
+static int linearByName(std::vector<User>& users, const std::string& name) {
+    for (size_t i = 0; i < users.size(); i++) {
+        if (users[i].name == name)
+            return i;
+    }
+    return -1;
+}
+
+static int linearByFd(std::vector<User>& users, int fd) {
+    for (size_t i = 0; i < users.size(); i++) {
+        if (users[i].fd == fd && users[i].online)
+            return i;
+    }
+    return -1;
+}
+
+static void benchLinear(int numUsers, int ops, double* signinNs, double* chatNs) {
+    std::vector<User> users(numUsers);
+    volatile int sink = 0;
+    uint64_t start;
+
+    for (int i = 0; i < numUsers; i++) {
+        users[i].name = nameOf(i);
+        users[i].fd = -1;
+        users[i].online = false;
+    }
+
+    srand(1);
+    start = bench::nowNs();
+    for (int i = 0; i < ops; i++) {
+        int index = linearByName(users, nameOf(rand() % numUsers));
+        int fd = i % kOnline;
+        int old = linearByFd(users, fd);
+        if (old != -1)
+            users[old].online = false;
+        users[index].fd = fd;
+        users[index].online = true;
+    }
+    *signinNs = (double)(bench::nowNs() - start) / ops;
+
+    start = bench::nowNs();
+    for (int i = 0; i < ops; i++) {
+        sink = linearByFd(users, i % kOnline);
+        sink = linearByName(users, nameOf(rand() % numUsers));
+    }
+    *chatNs = (double)(bench::nowNs() - start) / ops;
+    (void)sink;
+}
+
+static void benchRegistry(int numUsers, int ops, double* signinNs, double* chatNs) {
+    UserRegistry users;
+    volatile int sink = 0;
+    uint64_t start;
+
+    for (int i = 0; i < numUsers; i++)
+        users.add(nameOf(i), "password");
+
+    srand(1);
+    start = bench::nowNs();
+    for (int i = 0; i < ops; i++)
+        users.bind(users.findByName(nameOf(rand() % numUsers)), i % kOnline);
+    *signinNs = (double)(bench::nowNs() - start) / ops;
+
+    start = bench::nowNs();
+    for (int i = 0; i < ops; i++) {
+        sink = users.findByFd(i % kOnline);
+        sink = users.findByName(nameOf(rand() % numUsers));
+    }
+    *chatNs = (double)(bench::nowNs() - start) / ops;
+    (void)sink;
+}
+
+int main(int argc, char* argv[]) {
+    int ops = argc > 1 ? atoi(argv[1]) : 2000;
+    int sizes[] = {1000, 10000, 100000, 1000000};
+
+    printf("%-10s %16s %16s %16s %16s\n", "users",
+           "linear signin ns", "linear sgchat ns", "hash signin ns", "hash sgchat ns");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        double linearSignin, linearChat, hashSignin, hashChat;
+
+        printf("%-10d ", sizes[i]);
+        if (sizes[i] <= 100000) {
+            benchLinear(sizes[i], ops, &linearSignin, &linearChat);
+            printf("%16.0f %16.0f ", linearSignin, linearChat);
+        } else {
+            printf("%16s %16s ", "-", "-");
+        }
+        benchRegistry(sizes[i], ops, &hashSignin, &hashChat);
+        printf("%16.0f %16.0f\n", hashSignin, hashChat);
+    }
+
+    return 0;
+}
@@ -0,0 +1,131 @@
+/* 发送路径的基准测试
+ *
+ * 模拟一轮事件处理中发给同一个连接的多条消息（一半是回复，一半是共享的群聊帧），
+ * 通过socketpair发送，统计每条消息的系统调用次数和耗时 :
+ * 1.逐条发送 : 原来的Server::Send，每放入一条消息就用send发送队首的连续数据
+ * 2.合并发送 : 本轮结束时用sendmsg一次发送发送队列中的所有片段
+ *
+ * 用法: send_bench [轮数]
+ */
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/OutputQueue.h"
+#include "bench.h"
+
+using chat::OutputQueue;
+using chat::Payload;
+
+static const int kReplySize = 12;  // 一个OP_RESULT帧
+static const int kFrameSize = 120; // 一条群聊推送帧
+
+// 读走对端收到的所有数据，不计入统计
+static void drain(int fd) {
+    char buf[65536];
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+// 逐条发送 : 每条消息一次或多次send
+static uint64_t sendEach(int fd, OutputQueue& output) {
+    uint64_t calls = 0;
+
+    while (!output.empty()) {
+        const char* p = NULL;
+        size_t len = output.peek(&p);
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+
+        calls++;
+        if (n <= 0)
+            break;
+        output.consume(n);
+    }
+    return calls;
+}
+
+// 合并发送 : 每次sendmsg发送多个片段
+static uint64_t sendGather(int fd, OutputQueue& output) {
+    uint64_t calls = 0;
+    struct iovec iov[64];
+    struct msghdr msg;
+
+    while (!output.empty()) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = output.gather(iov, 64);
+
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+        calls++;
+        if (n <= 0)
+            break;
+        output.consume(n);
+    }
+    return calls;
+}
+
+/* @param batch 每轮发给同一个连接的消息数
+ * @param gather true : 合并发送; false : 逐条发送
+ * @param callsPerMsg 每条消息的系统调用次数
+ * @param nsPerMsg 每条消息的耗时
+ */
+static void run(int batch, bool gather, int rounds, double* callsPerMsg, double* nsPerMsg) {
+    int fds[2];
+    char reply[kReplySize];
+    Payload* frame = Payload::create(kFrameSize);
+    OutputQueue output;
+    uint64_t calls = 0, ns = 0;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    memset(reply, 'r', sizeof(reply));
+    memset(frame->data(), 'f', kFrameSize);
+
+    for (int r = 0; r < rounds; r++) {
+        uint64_t start = bench::nowNs();
+
+        for (int i = 0; i < batch; i++) {
+            if (i % 2 == 0)
+                output.append(reply, sizeof(reply));
+            else
+                output.append(frame);
+            if (!gather)
+                calls += sendEach(fds[0], output);
+        }
+        if (gather)
+            calls += sendGather(fds[0], output);
+
+        ns += bench::nowNs() - start;
+        drain(fds[1]);
+    }
+
+    *callsPerMsg = (double)calls / ((double)rounds * batch);
+    *nsPerMsg = (double)ns / ((double)rounds * batch);
+
+    frame->release();
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main(int argc, char* argv[]) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 20000;
+    int batches[] = {1, 2, 4, 16, 64};
+
+    printf("%-8s %16s %16s %16s %16s\n", "batch",
+           "each sys/msg", "each ns/msg", "gather sys/msg", "gather ns/msg");
+    for (size_t i = 0; i < sizeof(batches) / sizeof(batches[0]); i++) {
+        double eachCalls, eachNs, gatherCalls, gatherNs;
+
+        run(batches[i], false, rounds, &eachCalls, &eachNs);
+        run(batches[i], true, rounds, &gatherCalls, &gatherNs);
+        printf("%-8d %16.3f %16.0f %16.3f %16.0f\n", batches[i],
+               eachCalls, eachNs, gatherCalls, gatherNs);
+    }
+
+    return 0;
+}
@@ -1,12 +1,124 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
 #include "../src/Server.h"
 
 #if __cplusplus < 201103
     #error "use c++11 at least"
 #endif
 
-int main()
+/* 用法: server [-r | -u] [-p] [-q | -w] [-d depth] [-n] [-a port] [-l dir] [-s dir] [-f ms] [-g token]
+ *               [-i ms] [-k ms] [-t ms] [-e ms] [-o bytes] [-m bytes] [-c drop | coalesce | close]
+ *
+ * -r : 使用多reactor模型（每个工作线程一个epoll），默认使用线程池模型
+ * -u : 使用io_uring（每个工作线程一个io_uring），内核不支持时退回epoll
+ * -p : 与-r或-u一起使用，每个事件循环一个SO_REUSEPORT监听套接字，由内核分配新连接
+ * -q : 线程池模型下使用无锁队列，默认使用互斥锁队列
+ * -w : 线程池模型下使用工作窃取的任务队列
+ * -d : 每个用户收件箱最多存放的消息数
+ * -n : 收件箱满时丢弃新消息，默认丢弃最早的消息
+ * -a : 输出运行指标的本地端口，默认5001，0表示不开启 : curl http://127.0.0.1:5001/metrics
+ * -l : 把单聊和群聊消息记录到该目录下的消息日志，提供历史消息;与-s一起使用时还记录收件箱的变化，
+ *      重启后恢复还没有被取走的消息，默认不记录
+ * -s : 把账号和房间保存到该目录（快照和预写日志），重启后恢复，默认不保存
+ * -f : 消息日志和预写日志组提交的间隔，单位毫秒，默认10
+ * -g : 接受网关连接，参数为网关认证用的口令，默认不接受
+ * -i : 连接这么多毫秒没有收到任何数据时关闭，默认不关闭
+ * -k : 紧凑协议的连接空闲这么多毫秒后发送心跳，默认不发送
+ * -t : 一个请求这么多毫秒还没有接收完整时关闭连接，默认不限制
+ * -e : 收件箱中的消息这么多毫秒没有被取走时丢弃，默认不丢弃
+ * -o : 连接的发送队列的高水位，字节，默认4MB，0表示不限制;超过后暂停处理该连接的请求，并按-c处理推送
+ * -m : 发送队列的低水位，字节，默认1MB，降到它以下时恢复
+ * -c : 发送队列超过高水位后对推送的处理 : drop丢弃最早的推送（默认），coalesce改存入收件箱、恢复后补发，
+ *      close关闭连接
+ */
+int main(int argc, char* argv[])
 {
-    chat::Server server;
+    chat::ServerOptions options = chat::defaultServerOptions();
+    int opt;
+
+    while ((opt = getopt(argc, argv, "rupqwd:na:l:s:f:g:i:k:t:e:o:m:c:")) != -1) {
+        switch (opt) {
+        case 'r':
+            options.mode = MODE_MULTI_REACTOR;
+            break;
+        case 'u':
+            options.backend = IO_BACKEND_URING;
+            break;
+        case 'p':
+            options.reusePort = true;
+            break;
+        case 'q':
+            options.queueType = QUEUE_LOCKFREE;
+            break;
+        case 'w':
+            options.queueType = QUEUE_WORK_STEALING;
+            break;
+        case 'd':
+            options.inboxDepth = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            options.inboxPolicy = INBOX_DROP_NEWEST;
+            break;
+        case 'a':
+            options.adminPort = atoi(optarg);
+            break;
+        case 'l':
+            options.logDir = optarg;
+            break;
+        case 's':
+            options.dataDir = optarg;
+            break;
+        case 'f':
+            options.logSyncMs = atoi(optarg);
+            break;
+        case 'g':
+            options.gatewayToken = optarg;
+            break;
+        case 'i':
+            options.idleTimeoutMs = atoi(optarg);
+            break;
+        case 'k':
+            options.pingIntervalMs = atoi(optarg);
+            break;
+        case 't':
+            options.frameTimeoutMs = atoi(optarg);
+            break;
+        case 'e':
+            options.messageTtlMs = atoi(optarg);
+            break;
+        case 'o':
+            options.outputHighWater = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            options.outputLowWater = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            if (strcmp(optarg, "coalesce") == 0)
+                options.slowPolicy = SLOW_COALESCE;
+            else if (strcmp(optarg, "close") == 0)
+                options.slowPolicy = SLOW_DISCONNECT;
+            else
+                options.slowPolicy = SLOW_DROP_OLDEST;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r | -u] [-p] [-q | -w] [-d depth] [-n] [-a port] [-l dir] [-s dir] [-f ms] [-g token]"
+                            " [-i ms] [-k ms] [-t ms] [-e ms] [-o bytes] [-m bytes] [-c policy]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // 每个连接一个描述符
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < MAX_CONNECTIONS) {
+        limit.rlim_cur = limit.rlim_max < MAX_CONNECTIONS ? limit.rlim_max : MAX_CONNECTIONS;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    chat::Server server(options);
     server.init();
     server.eventLoop();
 }
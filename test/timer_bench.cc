@@ -0,0 +1,195 @@
+/* 定时器的基准测试
+ *
+ * 对比分层时间轮（TimerWheel）和按到期时间排序的std::multimap（每个定时器保存自己的迭代器），
+ * 模拟服务器为每个连接维护一个空闲超时的用法，时间是模拟的，单位毫秒 :
+ * arm        : 安排n个定时器，到期时间在[timeout/2, timeout)之间均匀分布
+ * reschedule : 在timeout/2的时间内均匀地进行n次重新安排，每次随机选一个定时器推迟到now + timeout
+ *              （连接收到数据），每个tick推进一次，包括推进的时间
+ * cancel     : 取消一半的定时器（连接关闭）
+ * expire     : 每次推进一个tick，直到剩下的定时器全部到期
+ * 另外统计所有推进中一次推进的最长耗时
+ *
+ * 用法: timer_bench [-n 定时器数] [-t 超时毫秒数] [-k tick毫秒数]
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <algorithm>
+#include <map>
+#include <random>
+#include <vector>
+
+#include "../src/TimerWheel.h"
+#include "bench.h"
+
+using chat::TimerNode;
+using chat::TimerWheel;
+
+static int count = 500000;
+static uint64_t timeout = 60000;
+static uint64_t tick = 100;
+
+typedef struct {
+    uint64_t arm;
+    uint64_t reschedule;
+    uint64_t cancel;
+    uint64_t expire;
+    uint64_t maxAdvance; // 一次推进的最长耗时
+    size_t fired;
+} Result;
+
+// 每个定时器的初始到期时间和重新安排的顺序，两种实现使用相同的序列
+static std::vector<uint64_t> deadlines;
+static std::vector<int> touches;
+
+// 重新安排分布在timeout/2的时间内，每个tick进行的次数
+static int touchesPerTick() {
+    uint64_t ticks = timeout / 2 / tick;
+    return ticks == 0 ? count : std::max((int)(count / ticks), 1);
+}
+
+static void makeWorkload() {
+    std::mt19937_64 rng(42);
+
+    deadlines.resize(count);
+    touches.resize(count);
+    for (int i = 0; i < count; i++) {
+        deadlines[i] = timeout / 2 + rng() % (timeout / 2);
+        touches[i] = rng() % count;
+    }
+}
+
+static Result benchWheel() {
+    std::vector<TimerNode> nodes(count);
+    TimerWheel wheel(tick, 0);
+    uint64_t now = 0, start;
+    Result r = {0, 0, 0, 0, 0, 0};
+
+    start = bench::nowNs();
+    for (int i = 0; i < count; i++)
+        wheel.schedule(&nodes[i], deadlines[i]);
+    r.arm = bench::nowNs() - start;
+
+    start = bench::nowNs();
+    for (int i = 0; i < count; i++) {
+        wheel.schedule(&nodes[touches[i]], now + timeout);
+        if ((i + 1) % touchesPerTick() == 0) {
+            uint64_t begin = bench::nowNs();
+            now += tick;
+            wheel.advance(now, [&] (TimerNode*) { r.fired++; });
+            r.maxAdvance = std::max(r.maxAdvance, bench::nowNs() - begin);
+        }
+    }
+    r.reschedule = bench::nowNs() - start;
+
+    start = bench::nowNs();
+    for (int i = 0; i < count; i += 2)
+        wheel.cancel(&nodes[i]);
+    r.cancel = bench::nowNs() - start;
+
+    start = bench::nowNs();
+    while (wheel.size() > 0) {
+        uint64_t begin = bench::nowNs();
+        now += tick;
+        wheel.advance(now, [&] (TimerNode*) { r.fired++; });
+        r.maxAdvance = std::max(r.maxAdvance, bench::nowNs() - begin);
+    }
+    r.expire = bench::nowNs() - start;
+    return r;
+}
+
+static Result benchMap() {
+    typedef std::multimap<uint64_t, int> TimerMap;
+    TimerMap timers;
+    std::vector<TimerMap::iterator> its(count);
+    std::vector<bool> armed(count, false);
+    uint64_t now = 0, start;
+    Result r = {0, 0, 0, 0, 0, 0};
+
+    // 与时间轮相同，按tick向上取整
+    auto expireTick = [] (uint64_t ms) { return (ms + tick - 1) / tick * tick; };
+    auto advance = [&] (uint64_t to) {
+        while (!timers.empty() && timers.begin()->first <= to) {
+            armed[timers.begin()->second] = false;
+            timers.erase(timers.begin());
+            r.fired++;
+        }
+    };
+
+    start = bench::nowNs();
+    for (int i = 0; i < count; i++) {
+        its[i] = timers.insert(std::make_pair(expireTick(deadlines[i]), i));
+        armed[i] = true;
+    }
+    r.arm = bench::nowNs() - start;
+
+    start = bench::nowNs();
+    for (int i = 0; i < count; i++) {
+        int t = touches[i];
+        if (armed[t])
+            timers.erase(its[t]);
+        its[t] = timers.insert(std::make_pair(expireTick(now + timeout), t));
+        armed[t] = true;
+        if ((i + 1) % touchesPerTick() == 0) {
+            uint64_t begin = bench::nowNs();
+            now += tick;
+            advance(now);
+            r.maxAdvance = std::max(r.maxAdvance, bench::nowNs() - begin);
+        }
+    }
+    r.reschedule = bench::nowNs() - start;
+
+    start = bench::nowNs();
+    for (int i = 0; i < count; i += 2) {
+        if (armed[i]) {
+            timers.erase(its[i]);
+            armed[i] = false;
+        }
+    }
+    r.cancel = bench::nowNs() - start;
+
+    start = bench::nowNs();
+    while (!timers.empty()) {
+        uint64_t begin = bench::nowNs();
+        now += tick;
+        advance(now);
+        r.maxAdvance = std::max(r.maxAdvance, bench::nowNs() - begin);
+    }
+    r.expire = bench::nowNs() - start;
+    return r;
+}
+
+static void printResult(const char* name, const Result& r) {
+    printf("%-10s %10.1f %12.1f %10.1f %10.1f %14.1f %10zu\n", name,
+           (double)r.arm / count, (double)r.reschedule / count, (double)r.cancel / (count / 2),
+           (double)r.expire / (r.fired > 0 ? r.fired : 1), r.maxAdvance / 1e3, r.fired);
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:t:k:")) != -1) {
+        switch (opt) {
+        case 'n': count = atoi(optarg); break;
+        case 't': timeout = strtoull(optarg, NULL, 10); break;
+        case 'k': tick = strtoull(optarg, NULL, 10); break;
+        default:
+            fprintf(stderr, "usage: %s [-n timers] [-t timeout ms] [-k tick ms]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (count < 2 || timeout < 4 || tick < 1) {
+        fprintf(stderr, "invalid options\n");
+        return 1;
+    }
+
+    makeWorkload();
+    printf("timers=%d timeout=%llums tick=%llums, ns per operation\n", count,
+           (unsigned long long)timeout, (unsigned long long)tick);
+    printf("%-10s %10s %12s %10s %10s %14s %10s\n",
+           "impl", "arm", "reschedule", "cancel", "expire", "max advance us", "fired");
+    printResult("wheel", benchWheel());
+    printResult("multimap", benchMap());
+    return 0;
+}